@@ -6,6 +6,12 @@
 #include 	<process.h>
 #define NOMINMAX
 #include <Windows.h>
+#else
+#include <limits.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#define MAX_PATH PATH_MAX
+#define strcat_s strcat
 #endif
 #include <algorithm>
 
@@ -21,9 +27,10 @@ enum class ParseMode
 std::unique_ptr<WasmContext> g_spctxtLast;
 ExpressionService::Variant g_variantLastExec;
 ExpressionService::Variant g_variantExpectedReturn;
+bool g_fTrapLastExec = false;	// the last invoke or module start function trapped instead of returning
+TrapKind g_trapkindLastExec = TrapKind::Unknown;
 
 const char *rgszUnsupported[] = {
-	"assert_trap",
 	"assert_invalid",
 	"assert_malformed",
 	"assert_unlinkable",
@@ -42,6 +49,7 @@ bool FUnsupportedCommand(const std::string &str)
 	return false;
 }
 
+#ifdef _MSC_VER
 int RunProgram(const char *szProgram, const char *szArgs)
 {
 	SHELLEXECUTEINFOA shellexeca = { 0 };
@@ -60,8 +68,60 @@ int RunProgram(const char *szProgram, const char *szArgs)
 	return (int)retV;
 }
 
+void GetTempDir(char *szPath)
+{
+	GetTempPathA(MAX_PATH, szPath);
+}
+#else
+extern char **environ;
+int RunProgram(const char *szProgram, const char *szArgs)
+{
+	// szArgs is a space delimited command line, split it back up for posix_spawn
+	std::vector<std::string> vecstrArgs;
+	vecstrArgs.push_back(szProgram);
+	for (const char *pch = szArgs; *pch != '\0'; ++pch)
+	{
+		if (isspace(*pch))
+			continue;
+		const char *pchEnd = pch;
+		while (*pchEnd != '\0' && !isspace(*pchEnd))
+			++pchEnd;
+		vecstrArgs.push_back(std::string(pch, pchEnd));
+		pch = pchEnd - 1;
+	}
+	std::vector<char*> vecszArgv;
+	for (auto &str : vecstrArgs)
+		vecszArgv.push_back(&str[0]);
+	vecszArgv.push_back(nullptr);
+
+	pid_t pid;
+	if (posix_spawnp(&pid, szProgram, nullptr, nullptr, vecszArgv.data(), environ) != 0)
+		return EXIT_FAILURE;
+	int status;
+	if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+		return EXIT_FAILURE;
+	return WEXITSTATUS(status);
+}
+
+void GetTempDir(char *szPath)
+{
+	const char *szTmp = getenv("TMPDIR");
+	if (szTmp == nullptr)
+		szTmp = "/tmp";
+	strcpy(szPath, szTmp);
+	strcat(szPath, "/");
+}
+#endif
+
+void RecordTrap(const TrapException &trap)
+{
+	printf("Trap: %s\n", trap.strErr.c_str());
+	g_fTrapLastExec = true;
+	g_trapkindLastExec = trap.kind;
+}
+
 // cch == 0 means no expression
-size_t CchTryParseExpression(const char *rgchExpr, size_t cchExpr, ExpressionService::Variant *pvarOut)
+size_t CchTryParseExpression(const char *rgchExpr, size_t cchExpr, ExpressionService::Variant * /*pvarOut*/)
 {
 	size_t ichCur = 0;
 	while (ichCur < cchExpr)
@@ -73,6 +133,7 @@ size_t CchTryParseExpression(const char *rgchExpr, size_t cchExpr, ExpressionSer
 		}
 		++ichCur;
 	}
+	return 0;
 }
 
 void ProcessInvoke(const char *rgch, size_t cch)
@@ -124,7 +185,16 @@ void ProcessInvoke(const char *rgch, size_t cch)
 	}
 
 	printf("Invoke: %s\n", strFnExec.c_str());
-	g_variantLastExec = g_spctxtLast->CallFunction(strFnExec.c_str(), vecargs.data(), numeric_cast<uint32_t>(vecargs.size()));
+	g_fTrapLastExec = false;
+	try
+	{
+		g_variantLastExec = g_spctxtLast->CallFunction(strFnExec.c_str(), vecargs.data(), numeric_cast<uint32_t>(vecargs.size()));
+	}
+	catch (const TrapException &trap)
+	{
+		RecordTrap(trap);
+		g_variantLastExec = ExpressionService::Variant();
+	}
 }
 
 void ProcessCommand(const std::string &str, FILE *pf, off_t offsetStart, off_t offsetEnd)
@@ -140,7 +210,7 @@ void ProcessCommand(const std::string &str, FILE *pf, off_t offsetStart, off_t o
 		char szPathWast[MAX_PATH];
 		char szPathWasm[MAX_PATH];
 		
-		GetTempPathA(MAX_PATH, szPathWast);
+		GetTempDir(szPathWast);
 		strcpy(szPathWasm, szPathWast);
 		strcat_s(szPathWast, "temp.wast");
 		strcat_s(szPathWasm, "temp.wasm");
@@ -157,8 +227,8 @@ void ProcessCommand(const std::string &str, FILE *pf, off_t offsetStart, off_t o
 			size_t cbT = fread(rgchT, 1, cb, pf);
 			if (cbT == 0)
 				throw "failed to read wast";
-			size_t cbWrote = fwrite(rgchT, 1, cbT, pfWast);
-			assert(cbWrote == cbT);
+			if (fwrite(rgchT, 1, cbT, pfWast) != cbT)
+				throw "failed to write wast";
 			cbWritten += cbT;
 		}
 		fclose(pfWast);
@@ -169,13 +239,20 @@ void ProcessCommand(const std::string &str, FILE *pf, off_t offsetStart, off_t o
 		strcat_s(szParams, " --no-check -o ");
 		strcat_s(szParams, szPathWasm);
 		int res = RunProgram("wat2wasm", szParams);
+		g_fTrapLastExec = false;
 		if (res == EXIT_SUCCESS)
 		{
-			g_spctxtLast = std::make_unique<WasmContext>();
+			auto spctxt = std::make_unique<WasmContext>();
 			FILE *pfWasm = fopen(szPathWasm, "rb");
 			try
 			{
-				g_spctxtLast->LoadModule(pfWasm);
+				spctxt->LoadModule(pfWasm);
+				g_spctxtLast = std::move(spctxt);
+			}
+			catch (const TrapException &trap)
+			{
+				// The start function trapped (assert_trap), the module never becomes the current one
+				RecordTrap(trap);
 			}
 			catch (Exception)
 			{
@@ -199,11 +276,12 @@ void ProcessCommand(const std::string &str, FILE *pf, off_t offsetStart, off_t o
 	}
 	else if (str == "assert_return")
 	{
+		Verify(!g_fTrapLastExec, "Unexpected trap");
 		Verify(g_variantExpectedReturn == g_variantLastExec);
 	}
 	else if (str == "assert_trap")
 	{
-		//assert(false);
+		Verify(g_fTrapLastExec, "Expected a trap");
 	}
 	else if (FUnsupportedCommand(str))
 	{
@@ -244,6 +322,7 @@ int main(int argc, char *argv[])
 	int cblock = 0;
 	std::stack<off_t> stackoffsetBlockStart;
 	bool fNestCmd = false;
+	int cblockModule = 0;	// depth of a module nested in a command (assert_trap), its own parens aren't commands
 
 	std::stack<std::string> stackstrCmd;
 	while ((cch = fread(rgch, 1, 1024, pf)) > 0)
@@ -266,6 +345,8 @@ int main(int argc, char *argv[])
 				else
 				{
 					fNestCmd = stackstrCmd.top() != "module" && !FUnsupportedCommand(stackstrCmd.top());
+					if (stackstrCmd.top() == "module" && cblock > 1)
+						cblockModule = cblock;
 					stackMode.pop();
 					mode = stackMode.top();
 				}
@@ -308,14 +389,22 @@ int main(int argc, char *argv[])
 					break;
 
 				case ')':
-					if (cblock == 1 || fNestCmd)
+					if (cblock == 1 || fNestCmd || cblock == cblockModule)
 					{
 						off_t offsetCur = ftell(pf) - (pchMax - (pch + 1));
 						ProcessCommand(stackstrCmd.top(), pf, stackoffsetBlockStart.top(), offsetCur);
 						stackstrCmd.pop();
 						stackoffsetBlockStart.pop();
 						if (cblock == 1)
+						{
 							fNestCmd = false;
+						}
+						else if (cblock == cblockModule)
+						{
+							// back in the command the module was nested in
+							cblockModule = 0;
+							fNestCmd = true;
+						}
 					}
 					--cblock;
 					break;
@@ -15,7 +15,27 @@ struct RuntimeException : public Exception
 	{}
 };
 
-static void Verify(bool fVerify, const char *sz = "Validation Failure")
+// Why wasm execution stopped, these values are also written by optemplates so don't renumber them
+enum class TrapKind
+{
+	Unknown = 0,
+	Unreachable = 1,
+	MemoryOutOfBounds = 2,
+	IntegerDivide = 3,		// divide by zero or INT_MIN / -1
+	StackOverflow = 4,
+	IndirectCall = 5,		// call_indirect out of bounds or with the wrong signature
+	CompileFailed = 6,		// a function called for the first time didn't compile, the compiler's error is thrown instead
+};
+
+struct TrapException : public RuntimeException
+{
+	TrapException(TrapKind kind, const std::string &strErr)
+		: RuntimeException(strErr), kind(kind)
+	{}
+	TrapKind kind;
+};
+
+inline void Verify(bool fVerify, const char *sz = "Validation Failure")
 {
 	if (!fVerify)
 		throw Exception(sz);
@@ -0,0 +1,15 @@
+#include "stdafx.h"
+#include "ExecutionContext.h"
+#include "Exceptions.h"
+#include "os_memory.h"
+
+static const size_t cbHostStackReserve = 256 * 1024;	// left for C code called from wasm (compiling, imports, traps)
+
+ExecutionContext::ExecutionContext(JitWriter *pjitWriter)
+{
+	memset(&m_ectl, 0, sizeof(m_ectl));
+	m_ectl.pjitWriter = pjitWriter;
+	uint8_t *pbStackLow = OsThreadStackLow();
+	Verify(reinterpret_cast<uint8_t*>(&pbStackLow) - pbStackLow > ptrdiff_t(cbHostStackReserve), "Thread stack too small to run wasm");
+	m_ectl.stackLimit = pbStackLow + cbHostStackReserve;
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include "ExecutionControlBlock.h"
+
+// Per thread state for running JIT code: a control block whose module level fields are filled in once.  Wasm frames
+//	live on the thread's own stack, the control block holds how far down they may go.
+class ExecutionContext
+{
+public:
+	ExecutionContext(class JitWriter *pjitWriter);
+
+	ExecutionControlBlock m_ectl;
+	bool m_fInUse = false;
+	std::exception_ptr m_excptPending;	// thrown by the runtime while called from JIT code, rethrown once back in ExternCallFn
+};
@@ -4,19 +4,18 @@ struct ExecutionControlBlock
 {
 	class JitWriter *pjitWriter;
 	void *pfnEntry;
-	void *operandStack;
-	void *localsStack;
-	uint64_t cbHeap;
+	const uint64_t *rgargs;	// pushed in order before pfnEntry is called
+	uint64_t cargs;
+	uint64_t rgargsReg[8];	// loaded into rax, r9, r10, r11 and xmm2-xmm5 (JitWriter::_RegArg)
 	void *memoryBase;
-
-	uint64_t cFnIndirect;
-	uint32_t *rgfnIndirect;
-	uint32_t *rgFnTypeIndicies;
-	uint64_t cFnTypeIndicies;
-	void *rgFnPtrs;
-	uint64_t cFnPtrs;
+	void *stackLimit;	// function entries trap when rsp is below this
 
 	// Values set by the executing code
 	void *stackrestore;
 	uint64_t retvalue;
+	uint64_t retvalueFloat;	// f32 and f64 results come back in xmm2
+	uint64_t dbgOpcode;	// last opcode started by the JIT code (CompileOptions::fDebugStamps)
+	void *trapAddress;	// address inside the instruction that trapped
+	uint64_t trapKind;	// TrapKind
+	void *faultAddress;	// data address of a faulting memory access
 };
\ No newline at end of file
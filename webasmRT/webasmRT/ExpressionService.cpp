@@ -19,15 +19,21 @@ size_t ExpressionService::CbEatExpression(const uint8_t *rgb, size_t cb, _Out_ V
 		break;
 
 	case opcode::f32_const:
+	{
 		pvariantOut->type = value_type::f32;
 		pvariantOut->val = 0;
-		*reinterpret_cast<float*>(&pvariantOut->val) = safe_read_buffer<float>(&rgb, &cb);
+		float valT = safe_read_buffer<float>(&rgb, &cb);
+		memcpy(&pvariantOut->val, &valT, sizeof(valT));
 		break;
+	}
 
 	case opcode::f64_const:
+	{
 		pvariantOut->type = value_type::f64;
-		*reinterpret_cast<double*>(&pvariantOut->val) = safe_read_buffer<double>(&rgb, &cb);
+		double valT = safe_read_buffer<double>(&rgb, &cb);
+		memcpy(&pvariantOut->val, &valT, sizeof(valT));
 		break;
+	}
 
 	default:
 		Verify(false);
@@ -133,13 +139,15 @@ size_t ExpressionService::CchEatExpression(const char *sz, size_t cch, _Out_ Var
 				case value_type::f32:
 				{
 					float valT = std::stof(strVal);
-					pvalOut->val = *reinterpret_cast<uint32_t*>(&valT);
+					uint32_t bits;
+					memcpy(&bits, &valT, sizeof(bits));
+					pvalOut->val = bits;
 					break;
 				}
 				case value_type::f64:
 				{
 					double valT = std::stod(strVal);
-					pvalOut->val = *reinterpret_cast<int64_t*>(&valT);
+					memcpy(&pvalOut->val, &valT, sizeof(valT));
 					break;
 				}
 				default:
@@ -3,814 +3,1640 @@
 #include "Exceptions.h"
 #include "safe_access.h"
 #include "JitWriter.h"
+#include "OptimizingCompiler.h"
 #include "WasmContext.h"
 #include "ExecutionControlBlock.h"
 #include "numeric_cast.h"
-#include <Windows.h>
+#include "os_memory.h"
+#include "ExecutionContext.h"
+#include "trap_handler.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
 
 extern "C" void WasmToC();
-extern "C" void CallIndirectShim();
-extern "C" void BranchTable();
+extern "C" void IndirectCallTrap();
+extern "C" void IndirectCacheShim();
 extern "C" void U64ToF32();
 extern "C" void U64ToF64();
 extern "C" void GrowMemoryOp();
 extern "C" void F32ToU64Trunc();
 extern "C" void F64ToU64Trunc();
+extern "C" void TierUpShim();
+extern "C" void OsrShim();
+extern "C" void LazyCallShim();
+extern "C" void StackOverflowTrap();
+extern "C" void CompileFailedTrap();
+
+static const size_t cbHeapReserve = 0x200000000;
+static const size_t cbExecPlaneCommitChunk = 0x100000;	// commit the execution plane 1MB at a time
+static const size_t crunBranchTreeMax = 4;	// br_table with more runs of equal targets than this uses a jump table
+static const uint32_t clocalsZeroUnroll = 8;	// prologues push more zeroed locals than this with a loop
+
+static std::atomic<uint64_t> g_idWriterNext(1);
+
+// roundss/roundsd are SSE4.1 while the rest of the float code only needs SSE2, checked once and cached
+static bool FCpuHasSse41()
+{
+	static const bool fSse41 = []()
+	{
+#ifdef _MSC_VER
+		int rgregs[4];
+		__cpuid(rgregs, 1);
+		return (rgregs[2] & (1 << 19)) != 0;
+#else
+		unsigned int eax, ebx, ecx, edx;
+		return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_1) != 0;
+#endif
+	}();
+	return fSse41;
+}
+
+struct ExecctxtCache
+{
+	uint64_t idWriter = 0;
+	ExecutionContext *pexecctxt = nullptr;
+};
+static thread_local ExecctxtCache g_execctxtcache;	// the context used by the last call on this thread
 
-JitWriter::JitWriter(WasmContext *pctxt, uint8_t *pexecPlane, size_t cbExec, size_t cfn, size_t cglbls)
-	: m_pctxt(pctxt), m_pexecPlane(pexecPlane), m_pexecPlaneCur(pexecPlane), m_pexecPlaneMax(pexecPlane + cbExec), m_cfn(cfn)
+JitWriter::JitWriter(WasmContext *pctxt, uint8_t *pexecPlane, uint8_t *pwritePlane, size_t cbExec, size_t cfn, size_t cglbls)
+	: m_pctxt(pctxt), m_pexecPlane(pexecPlane), m_pexecPlaneCur(pexecPlane), m_pexecPlaneCommit(pexecPlane), m_pexecPlaneMax(pexecPlane + cbExec), m_cbWriteView(pwritePlane - pexecPlane), m_cfn(cfn)
 {
+	m_idWriter = g_idWriterNext++;
+	RegisterJitCode(m_pexecPlane, cbExec);
+	Verify(cbExec <= cbExecPlaneReserve, "Execution plane too large for rel32 addressing");
+	// The function table and globals must be committed before we can write them
+	m_cindirect = numeric_cast<uint32_t>(m_pctxt->m_vecIndirectFnTable.size());
+	Verify(m_cindirect < (1U << 28), "Table too large");	// call sites scale the index by the entry size in 32 bits
+	size_t cbHeader = sizeof(void*) * (cfn + 11) + sizeof(IndirectEntry) * (m_cindirect + 1) + sizeof(uint64_t) * cglbls + sizeof(FunctionProfile) * cfn + 2 * 4096;
+	_CommitExecPlane(m_pexecPlane + cbHeader);
+
 	uint8_t *pvZeroStart = m_pexecPlaneCur;
 	m_pexecPlaneCur += sizeof(void*) * cfn;	// allocate the function table, ensuring its within 32-bits of all our code
 	
-	m_pfnCallIndirectShim = (void**)m_pexecPlaneCur;
-	m_pfnBranchTable = ((void**)m_pexecPlaneCur) + 1;
-	m_pfnU64ToF32 = ((void**)m_pexecPlaneCur) + 2;
-	m_pfnU64ToF64 = ((void**)m_pexecPlaneCur) + 3;
-	m_pfnGrowMemoryOp = ((void**)m_pexecPlaneCur) + 4;
-	m_pfnF32ToU64Trunc = ((void**)m_pexecPlaneCur) + 5;
-	m_pfnF64ToU64Trunc = ((void**)m_pexecPlaneCur) + 6;
-	m_pexecPlaneCur += sizeof(*m_pfnCallIndirectShim) * 7;
+	m_pfnIndirectCallTrap = (void**)m_pexecPlaneCur;
+	m_pfnU64ToF32 = ((void**)m_pexecPlaneCur) + 1;
+	m_pfnU64ToF64 = ((void**)m_pexecPlaneCur) + 2;
+	m_pfnGrowMemoryOp = ((void**)m_pexecPlaneCur) + 3;
+	m_pfnF32ToU64Trunc = ((void**)m_pexecPlaneCur) + 4;
+	m_pfnF64ToU64Trunc = ((void**)m_pexecPlaneCur) + 5;
+	m_pfnTierUpShim = ((void**)m_pexecPlaneCur) + 6;
+	m_pfnOsrShim = ((void**)m_pexecPlaneCur) + 7;
+	m_pfnLazyCallShim = ((void**)m_pexecPlaneCur) + 8;
+	m_pfnIndirectCacheShim = ((void**)m_pexecPlaneCur) + 9;
+	m_pfnStackOverflowTrap = ((void**)m_pexecPlaneCur) + 10;
+	m_pexecPlaneCur += sizeof(*m_pfnIndirectCallTrap) * 11;
+	m_pexecPlaneCur += (alignof(IndirectEntry) - reinterpret_cast<uint64_t>(m_pexecPlaneCur)) % alignof(IndirectEntry);
+	m_rgindirect = (IndirectEntry*)m_pexecPlaneCur;
+	m_pexecPlaneCur += sizeof(IndirectEntry) * m_cindirect;
 
 	m_pexecPlaneCur += (4096 - reinterpret_cast<uint64_t>(m_pexecPlaneCur)) % 4096;
 	m_pGlobalsStart = (uint64_t*)m_pexecPlaneCur;
 	m_pexecPlaneCur += (sizeof(uint64_t) * cglbls);
+	m_rgprofile = (FunctionProfile*)m_pexecPlaneCur;
+	m_pexecPlaneCur += (sizeof(FunctionProfile) * cfn);
 	m_pexecPlaneCur += (4096 - reinterpret_cast<uint64_t>(m_pexecPlaneCur)) % 4096;
 	m_pcodeStart = m_pexecPlaneCur;
-	memset(pvZeroStart, 0, m_pexecPlaneCur - pvZeroStart);	// these areas should be initialized to zero
+	memset(_PWritable(pvZeroStart), 0, m_pexecPlaneCur - pvZeroStart);	// these areas should be initialized to zero
+
+	// The executable view of the tables is read only and the globals are data, only code pages are executable
+	OsProtectMemory(m_pexecPlane, (uint8_t*)m_pGlobalsStart - m_pexecPlane, PageProtection::ReadOnly);
+	if (m_pcodeStart > (uint8_t*)m_pGlobalsStart)
+		OsProtectMemory(m_pGlobalsStart, m_pcodeStart - (uint8_t*)m_pGlobalsStart, PageProtection::ReadWrite);
 
 	for (size_t iimportfn = 0; iimportfn < m_pctxt->m_vecimports.size(); ++iimportfn)
-		reinterpret_cast<void**>(m_pexecPlane)[iimportfn] = WasmToC;
-	*m_pfnCallIndirectShim = CallIndirectShim;
-	*m_pfnBranchTable = BranchTable;
-	*m_pfnU64ToF32 = U64ToF32;
-	*m_pfnU64ToF64 = U64ToF64;
-	*m_pfnGrowMemoryOp = GrowMemoryOp;
-	*m_pfnF32ToU64Trunc = F32ToU64Trunc;
-	*m_pfnF64ToU64Trunc = F64ToU64Trunc;
+		_PWritable(reinterpret_cast<void**>(m_pexecPlane))[iimportfn] = reinterpret_cast<void*>(WasmToC);
+	*_PWritable(m_pfnIndirectCallTrap) = reinterpret_cast<void*>(IndirectCallTrap);
+	*_PWritable(m_pfnU64ToF32) = reinterpret_cast<void*>(U64ToF32);
+	*_PWritable(m_pfnU64ToF64) = reinterpret_cast<void*>(U64ToF64);
+	*_PWritable(m_pfnGrowMemoryOp) = reinterpret_cast<void*>(GrowMemoryOp);
+	*_PWritable(m_pfnF32ToU64Trunc) = reinterpret_cast<void*>(F32ToU64Trunc);
+	*_PWritable(m_pfnF64ToU64Trunc) = reinterpret_cast<void*>(F64ToU64Trunc);
+	*_PWritable(m_pfnTierUpShim) = reinterpret_cast<void*>(TierUpShim);
+	*_PWritable(m_pfnOsrShim) = reinterpret_cast<void*>(OsrShim);
+	*_PWritable(m_pfnLazyCallShim) = reinterpret_cast<void*>(LazyCallShim);
+	*_PWritable(m_pfnIndirectCacheShim) = reinterpret_cast<void*>(IndirectCacheShim);
+	*_PWritable(m_pfnStackOverflowTrap) = reinterpret_cast<void*>(StackOverflowTrap);
+
+	// Functions without code are compiled by LazyCallShim, the entry's function index is in ecx when it is called
+	for (uint32_t iindirect = 0; iindirect < m_cindirect; ++iindirect)
+	{
+		IndirectEntry &entry = _PWritable(m_rgindirect)[iindirect];
+		uint32_t ifn = m_pctxt->m_vecIndirectFnTable[iindirect];
+		if (ifn >= cfn)
+		{
+			entry.itype = UINT32_MAX;	// no call site expects this type so every call traps
+			continue;
+		}
+		entry.itype = m_pctxt->ITypeCanonicalFromIType(m_pctxt->m_vecfn_entries[ifn]);
+		entry.ifn = ifn;
+		entry.pfn = (ifn < m_pctxt->m_vecimports.size()) ? reinterpret_cast<void*>(WasmToC) : reinterpret_cast<void*>(LazyCallShim);
+		m_vecpairIndirect.push_back(std::make_pair(ifn, iindirect));
+	}
+	std::sort(m_vecpairIndirect.begin(), m_vecpairIndirect.end());
 
 	for (size_t iglbl = 0; iglbl < cglbls; ++iglbl)
 	{
-		m_pGlobalsStart[iglbl] = pctxt->m_vecglbls[iglbl].val;
+		_PWritable(m_pGlobalsStart)[iglbl] = pctxt->m_vecglbls[iglbl].val;
+	}
+
+	for (size_t ifn = 0; ifn < cfn; ++ifn)
+	{
+		_PWritable(m_rgprofile)[ifn].cCallsLeft = pctxt->m_opts.cTierUpCalls;
+		_PWritable(m_rgprofile)[ifn].cBackEdgesLeft = pctxt->m_opts.cTierUpBackEdges;
 	}
+	m_vecfTieredUp.resize(cfn);
+	m_vecspinlined.resize(cfn);
+	m_vecpvStub.resize(cfn);
+	m_vecfInlineChecked.resize(cfn);
 }
 
 JitWriter::~JitWriter()
 {
+	UnregisterJitCode(m_pexecPlane);
 	if (m_pheap != nullptr)
-		VirtualFree(m_pheap, 0, MEM_RELEASE);
+		OsReleaseMemory(m_pheap, cbHeapReserve);
+	OsReleaseDualMapped(m_pexecPlane, _PWritable(m_pexecPlane), m_pexecPlaneMax - m_pexecPlane);
 }
 
-void JitWriter::SafePushCode(const void *pv, size_t cb)
+void JitWriter::_CommitExecPlane(uint8_t *pbEnd)
 {
-	if (m_pexecPlaneCur + cb > m_pexecPlaneMax)
+	if (pbEnd <= m_pexecPlaneCommit)
+		return;
+	if (pbEnd > m_pexecPlaneMax)
 		throw RuntimeException("No room to compile function");
-	memcpy(m_pexecPlaneCur, pv, cb);
+
+	// Round up to whole chunks so we aren't calling into the OS for every function
+	size_t cbCommit = pbEnd - m_pexecPlaneCommit;
+	cbCommit = ((cbCommit + cbExecPlaneCommitChunk - 1) / cbExecPlaneCommitChunk) * cbExecPlaneCommitChunk;
+	cbCommit = std::min<size_t>(cbCommit, m_pexecPlaneMax - m_pexecPlaneCommit);
+	OsCommitDualMapped(m_pexecPlaneCommit, _PWritable(m_pexecPlaneCommit), cbCommit, PageProtection::ExecuteRead);
+	memset(_PWritable(m_pexecPlaneCommit), 0xF4, cbCommit);	// fill with hlts (because 00 is effectively a NOP)
+	m_pexecPlaneCommit += cbCommit;
+}
+
+void JitWriter::SafePushCode(const void *pv, size_t cb)
+{
+	if (m_pexecPlaneCur + cb > m_pexecPlaneCommit)
+		_CommitExecPlane(m_pexecPlaneCur + cb);
+	memcpy(_PWritable(m_pexecPlaneCur), pv, cb);
 	m_pexecPlaneCur += cb;
 }
 
-void JitWriter::_PushExpandStack()
+void JitWriter::_EmitRex(bool f64, uint8_t regOp, uint8_t index, uint8_t base)
 {
-	// RAX -> stack
-	// mov [rdi], rax		{ 0x48, 0x89, 0x07 }
-	// add rdi, 8			{ 0x48, 0x83, 0xC7, 0x08 }
-	static const uint8_t rgcode[] = { 0x48, 0x89, 0x07, 0x48, 0x83, 0xC7, 0x08 };
-	SafePushCode(rgcode, _countof(rgcode));
+	uint8_t rex = 0x40;
+	if (f64)
+		rex |= 0x08;	// REX.W
+	if (regOp & 8)
+		rex |= 0x04;	// REX.R
+	if (index & 8)
+		rex |= 0x02;	// REX.X
+	if (base & 8)
+		rex |= 0x01;	// REX.B
+	if (rex != 0x40)
+		SafePushCode(rex);
 }
 
-// NOTE: Must not affect flags
-void JitWriter::_PopContractStack()
+void JitWriter::_EmitRegReg(std::initializer_list<uint8_t> rgop, bool f64, uint8_t regOp, uint8_t rm)
 {
-	// mov rax, [rdi - 8]	{ 0x48, 0x8b, 0x47, 0xf8 }
-	// lea rdi, [rdi - 8]	{ 0x48, 0x8D, 0x7F, 0xF8 }
-	static const uint8_t rgcode[] = { 0x48, 0x8B, 0x47, 0xF8, 0x48, 0x8D, 0x7F, 0xF8 };
-	SafePushCode(rgcode, _countof(rgcode));
+	// op reg, rm	(mod == 11)
+	_EmitRex(f64, regOp, 0, rm);
+	for (uint8_t op : rgop)
+		SafePushCode(op);
+	SafePushCode(uint8_t(0xC0 | ((regOp & 7) << 3) | (rm & 7)));
 }
 
-void JitWriter::_PopSecondParam(bool fSwapParams)
+void JitWriter::_EmitRegMem(std::initializer_list<uint8_t> rgop, bool f64, uint8_t regOp, Reg base, int32_t disp)
 {
-	if (fSwapParams)
-	{
-		// mov rcx, rax
-		// mov rax, [rdi - 8]
-		// sub rdi, 8
-		static const uint8_t rgcode[] = { 0x48, 0x89, 0xC1, 0x48, 0x8B, 0x47, 0xF8, 0x48, 0x83, 0xEF, 0x08 };
-		SafePushCode(rgcode, _countof(rgcode));
-	}
+	// op reg, [base + disp]
+	_EmitRex(f64, regOp, 0, base);
+	for (uint8_t op : rgop)
+		SafePushCode(op);
+	uint8_t mod;
+	if (disp == 0 && (base & 7) != rbp)
+		mod = 0x00;
+	else if (disp == static_cast<int8_t>(disp))
+		mod = 0x40;
 	else
-	{
-		// mov rcx, [rdi - 8]
-		// sub rdi, 8
-		static const uint8_t rgcode[] = { 0x48, 0x8B, 0x4F, 0xF8, 0x48, 0x83, 0xEF, 0x08 };
-		SafePushCode(rgcode, _countof(rgcode));
-	}
+		mod = 0x80;
+	SafePushCode(uint8_t(mod | ((regOp & 7) << 3) | (base & 7)));
+	if ((base & 7) == rsp)
+		SafePushCode(uint8_t(0x24));	// SIB: no index
+	if (mod == 0x40)
+		SafePushCode(static_cast<int8_t>(disp));
+	else if (mod == 0x80)
+		SafePushCode(disp);
 }
 
-
-void JitWriter::LoadMem(uint32_t offset, bool f64Dst /* else 32 */, uint32_t cbSrc, bool fSignExtend)
+void JitWriter::_EmitRegMemIndex(std::initializer_list<uint8_t> rgop, bool f64, uint8_t regOp, Reg base, Reg index, int32_t disp)
 {
-	// add eax, offset	; note this implicitly ands with 0xffffffff ensuring that when referenced as rax it will always be a positive number between 0 and 2^32 - 1
-	static const uint8_t rgcodeAdd[] = { 0x05 };
-	SafePushCode(rgcodeAdd);
-	SafePushCode(offset);
-
-	const char *szCode = nullptr;
-	if (fSignExtend)
-	{
-		if (f64Dst)
-		{
-			switch (cbSrc)
-			{
-			default:
-				Verify(false);
-				break;
-
-			case 1:
-				// movsx rax, byte ptr [rsi+rax]
-				szCode = "\x48\x0F\xBE\x04\x06";
-				break;
-
-			case 2:
-				// movsx rax, word ptr [rsi+rax]
-				szCode = "\x48\x0F\xBF\x04\x06";
-				break;
-
-			case 4:
-				// movsx rax, dword ptr [rsi+rax]
-				szCode = "\x48\x63\x04\x06";
-				break;
-			}
-		}
-		else
-		{
-			switch (cbSrc)
-			{
-			default:
-				Verify(false);
-				break;
-
-			case 1:
-				// movsx eax, byte ptr [rsi + rax]
-				szCode = "\x0F\xBE\x04\x06";
-				break;
-
-			case 2:
-				// movsx eax, word ptr [rsi + rax]
-				szCode = "\x0F\xBF\x04\x06";
-			}
-		}
-	}
+	// op reg, [base + index + disp]
+	Verify(index != rsp);
+	_EmitRex(f64, regOp, index, base);
+	for (uint8_t op : rgop)
+		SafePushCode(op);
+	uint8_t mod;
+	if (disp == 0 && (base & 7) != rbp)	// rbp and r13 can't be encoded without a displacement
+		mod = 0x00;
+	else if (disp == static_cast<int8_t>(disp))
+		mod = 0x40;
 	else
-	{
-		switch (cbSrc)
-		{
-		case 1:
-			// movzx eax, byte ptr [rsi+rax]
-			szCode = "\x0F\xB6\x04\x06";
-			break;
-
-		case 2:
-			// movzx eax, word ptr [rsi + rax]
-			szCode = "\x0F\xB7\x04\x06";
-			break;
-
-		case 4:
-			// mov eax, dword ptr [rsi + rax]
-			szCode = "\x8B\x04\x06";
-			break;
-
-		case 8:
-			Verify(f64Dst);
-			// mov rax, qword ptr [rsi + rax]
-			szCode = "\x48\x8B\x04\x06";
-			break;
-
-		default:
-			Verify(false);
-		}
-	}
-	Verify(szCode != nullptr);
-	SafePushCode(szCode, strlen(szCode));
+		mod = 0x80;
+	SafePushCode(uint8_t(mod | 0x04 | ((regOp & 7) << 3)));
+	SafePushCode(uint8_t(((index & 7) << 3) | (base & 7)));
+	if (mod == 0x40)
+		SafePushCode(static_cast<int8_t>(disp));
+	else if (mod == 0x80)
+		SafePushCode(disp);
 }
-void JitWriter::StoreMem(uint32_t offset, uint32_t cbDst)
+
+void JitWriter::_EmitRegRip(std::initializer_list<uint8_t> rgop, bool f64, uint8_t regOp, const void *pvTarget)
 {
-	_PopSecondParam();
-	// add ecx, offset	; note this implicitly ands with 0xffffffff ensuring that when referenced as rax it will always be a positive number between 0 and 2^32 - 1
-	static const uint8_t rgcodeAdd[] = { 0x81, 0xC1 };
-	SafePushCode(rgcodeAdd);
+	// op reg, [rip + rel32]
+	_EmitRex(f64, regOp, 0, 0);
+	for (uint8_t op : rgop)
+		SafePushCode(op);
+	SafePushCode(uint8_t(0x05 | ((regOp & 7) << 3)));
+	int64_t offset64 = reinterpret_cast<const uint8_t*>(pvTarget) - (m_pexecPlaneCur + 4);
+	int32_t offset = static_cast<int32_t>(offset64);
+	Verify(offset64 == offset);
 	SafePushCode(offset);
-
-	const char *szCode = nullptr;
-	switch (cbDst)
-	{
-	default:
-		Verify(false);
-		break;
-
-	case 1:
-		// mov [rsi + rcx], al
-		szCode = "\x88\x04\x0E";
-		break;
-
-	case 2:
-		// mov [rsi + rcx], ax
-		szCode = "\x66\x89\x04\x0E";
-		break;
-
-	case 4:
-		// mov [rsi + rcx], eax
-		szCode = "\x89\x04\x0E";
-		break;
-
-	case 8:
-		// mov [rsi + rcx], rax
-		szCode = "\x48\x89\x04\x0E";
-		break;
-	}
-	Verify(szCode != nullptr);
-	SafePushCode(szCode, strlen(szCode));
 }
 
-void JitWriter::Sub32()
+void JitWriter::_MovRegReg(Reg regDst, Reg regSrc)
 {
-	_PopSecondParam(true);
-	// sub eax, ecx
-	static const uint8_t rgcode[] = { 0x29, 0xC8 };
-	SafePushCode(rgcode, _countof(rgcode));
+	// mov regDst, regSrc
+	_EmitRegReg({ 0x89 }, true, regSrc, regDst);
 }
 
-void JitWriter::Add32()
+void JitWriter::_MovGprToXmm(Xmm xmm, Reg reg, bool f64)
 {
-	_PopSecondParam();
-	// add eax, ecx
-	static const uint8_t rgcode[] = { 0x01, 0xC8 };
-	SafePushCode(rgcode, _countof(rgcode));
+	// movd xmm, reg32 / movq xmm, reg
+	SafePushCode(uint8_t(0x66));
+	_EmitRegReg({ 0x0F, 0x6E }, f64, xmm, reg);
 }
 
-void JitWriter::Add64()
+void JitWriter::_MovXmmToGpr(Reg reg, Xmm xmm, bool f64)
 {
-	_PopSecondParam();
-	// add rax, rcx
-	static const uint8_t rgcode[] = { 0x48, 0x01, 0xC8 };
-	SafePushCode(rgcode);
+	// movd reg32, xmm / movq reg, xmm
+	SafePushCode(uint8_t(0x66));
+	_EmitRegReg({ 0x0F, 0x7E }, f64, xmm, reg);
 }
 
-void JitWriter::Sub64()
+void JitWriter::_MoveEntry(Reg regDst, Reg regSrc)
 {
-	_PopSecondParam(true);
-	// sub rax, rcx
-	static const uint8_t rgcode[] = { 0x48, 0x29, 0xC8 };
-	SafePushCode(rgcode);
+	if (regDst == regSrc)
+		return;
+	if (_FXmm(regDst) && _FXmm(regSrc))
+	{
+		// movaps xmmDst, xmmSrc
+		_EmitRegReg({ 0x0F, 0x28 }, false, _XmmOf(regDst), _XmmOf(regSrc));
+	}
+	else if (_FXmm(regDst))
+	{
+		_MovGprToXmm(_XmmOf(regDst), regSrc, true);
+	}
+	else if (_FXmm(regSrc))
+	{
+		_MovXmmToGpr(regDst, _XmmOf(regSrc), true);
+	}
+	else
+	{
+		_MovRegReg(regDst, regSrc);
+	}
 }
 
-void JitWriter::Popcnt32()
+void JitWriter::_LoadEntry(Reg reg, Reg base, int32_t disp)
 {
-	// mov [rdi], eax		; popcnt wants a memory operand - gross
-	// popcnt eax, [rdi]
-	const uint8_t rgcode[] = { 0x89, 0x07, 0xF3, 0x0F, 0xB8, 0x07 };
-	SafePushCode(rgcode, _countof(rgcode));
+	if (_FXmm(reg))
+	{
+		// movq xmm, [base + disp]
+		SafePushCode(uint8_t(0xF3));
+		_EmitRegMem({ 0x0F, 0x7E }, false, _XmmOf(reg), base, disp);
+	}
+	else
+	{
+		// mov reg, [base + disp]
+		_EmitRegMem({ 0x8B }, true, reg, base, disp);
+	}
 }
 
-void JitWriter::Popcnt64()
+void JitWriter::_StoreEntry(Reg reg, Reg base, int32_t disp)
 {
-	// mov[rdi], rax
-	// popcnt rax, qword ptr[rdi]
-	const uint8_t rgcode[] = { 0x48, 0x89, 0x07, 0xF3, 0x48, 0x0F, 0xB8, 0x07 };
-	SafePushCode(rgcode);
+	if (_FXmm(reg))
+	{
+		// movq [base + disp], xmm
+		SafePushCode(uint8_t(0x66));
+		_EmitRegMem({ 0x0F, 0xD6 }, false, _XmmOf(reg), base, disp);
+	}
+	else
+	{
+		// mov [base + disp], reg
+		_EmitRegMem({ 0x89 }, true, reg, base, disp);
+	}
 }
 
-void JitWriter::PushC32(uint32_t c)
+// NOTE: Must not affect flags
+void JitWriter::_PushEntry(Reg reg)
 {
-	_PushExpandStack();
-	if (c == 0)	// micro optimize zeroing
+	if (_FXmm(reg))
 	{
-		// xor eax, eax
-		static const uint8_t rgcode[] = { 0x31, 0xC0 };
-		SafePushCode(rgcode, _countof(rgcode));
+		// lea rsp, [rsp - 8]
+		// movq [rsp], xmm
+		_ReleaseStack(-int32_t(sizeof(uint64_t)));
+		_StoreEntry(reg, rsp, 0);
 	}
 	else
 	{
-		// mov eax, c
-		static const uint8_t rgcode[] = { 0xB8 };
-		SafePushCode(rgcode, sizeof(uint8_t));
-		SafePushCode(&c, sizeof(c));
+		// push reg
+		_EmitRex(false, 0, 0, reg);
+		SafePushCode(uint8_t(0x50 | (reg & 7)));
 	}
 }
 
-void JitWriter::PushC64(uint64_t c)
+// NOTE: Must not affect flags
+void JitWriter::_PopEntry(Reg reg)
 {
-	_PushExpandStack();
-	if (c == 0) // micro optimize zeroing
+	if (_FXmm(reg))
 	{
-		// xor rax, rax
-		static const uint8_t rgcode[] = { 0x48, 0x31, 0xC0 };
-		SafePushCode(rgcode, _countof(rgcode));
+		// movq xmm, [rsp]
+		// lea rsp, [rsp + 8]
+		_LoadEntry(reg, rsp, 0);
+		_ReleaseStack(int32_t(sizeof(uint64_t)));
 	}
 	else
 	{
-		// mov rax, c
-		static const uint8_t rgcode[] = { 0x48, 0xB8 };
-		SafePushCode(rgcode, _countof(rgcode));
-		SafePushCode(&c, sizeof(c));
+		// pop reg
+		_EmitRex(false, 0, 0, reg);
+		SafePushCode(uint8_t(0x58 | (reg & 7)));
 	}
 }
 
-void JitWriter::PushF32(float val)
+JitWriter::Reg JitWriter::_AllocReg()
 {
-	int32_t ival = *reinterpret_cast<int32_t*>(&val);
-	PushC32(ival);
+	// scratch registers that may hold cached operands, none of these are used by the runtime
+	static const Reg rgregCache[] = { rax, rcx, rdx, r8, r9, r10, r11 };
+	for (;;)
+	{
+		for (Reg reg : rgregCache)
+		{
+			if (((m_maskRegsUsed | m_maskRegsLocked) & RegMask(reg)) == 0)
+				return reg;
+		}
+		// Out of registers so move the deepest cached operand to memory
+		Verify(!m_vecregStack.empty());
+		_SpillBottom();
+	}
 }
 
-void JitWriter::PushF64(double val)
+JitWriter::Reg JitWriter::_AllocXmm()
 {
-	int64_t ival = *reinterpret_cast<int64_t*>(&val);
-	PushC64(ival);
+	// xmm0 and xmm1 are scratch for the emitters and the asm helpers
+	static const Xmm rgxmmCache[] = { xmm2, xmm3, xmm4, xmm5, xmm6, xmm7 };
+	for (;;)
+	{
+		for (Xmm xmm : rgxmmCache)
+		{
+			if (((m_maskRegsUsed | m_maskRegsLocked) & RegMask(_RegOfXmm(xmm))) == 0)
+				return _RegOfXmm(xmm);
+		}
+		Verify(!m_vecregStack.empty());
+		_SpillBottom();
+	}
 }
 
-void JitWriter::Ud2()
+void JitWriter::_PushReg(Reg reg)
 {
-	// NYI: ud2
-	static const uint8_t rgcode[] = { 0x0F, 0x0B };
-	SafePushCode(rgcode, _countof(rgcode));
+	Verify((m_maskRegsUsed & RegMask(reg)) == 0);
+	m_vecregStack.push_back(reg);
+	m_maskRegsUsed |= RegMask(reg);
 }
 
-void JitWriter::SetLocal(uint32_t idx, bool fPop)
+JitWriter::Reg JitWriter::_PopReg(RegClass rc)
 {
-	// mov [rbx+idx], rax
-	static const uint8_t rgcode[] = { 0x48, 0x89, 0x83 };
-	SafePushCode(rgcode, _countof(rgcode));
-	idx *= sizeof(uint64_t);
-	SafePushCode(&idx, sizeof(idx));
-	if (fPop)
-		_PopContractStack();
+	_EnsureCached(1, rc);
+	Reg reg = m_vecregStack.back();
+	m_vecregStack.pop_back();
+	m_maskRegsUsed &= ~RegMask(reg);
+	return reg;
 }
 
-void JitWriter::GetLocal(uint32_t idx)
+void JitWriter::_SpillBottom()
 {
-	_PushExpandStack();
-	// mov rax, [rbx+idx]
-	static const uint8_t rgcode[] = { 0x48, 0x8B, 0x83 };
-	idx *= sizeof(uint64_t);
-	SafePushCode(rgcode, _countof(rgcode));
-	SafePushCode(&idx, sizeof(idx));
+	Reg reg = m_vecregStack.front();
+	_PushEntry(reg);
+	++m_cstackMem;
+	m_vecregStack.erase(m_vecregStack.begin());
+	m_maskRegsUsed &= ~RegMask(reg);
 }
 
-void JitWriter::EnterBlock()
+void JitWriter::_EnsureCached(size_t centries, RegClass rc)
 {
-	_PushExpandStack();	// backup rax
-	// push rdi
-	static const uint8_t rgcode[] = { 0x57 };
-	SafePushCode(rgcode, _countof(rgcode));
+	Verify(!m_fConstPending);
+	if (m_vecregStack.size() < centries)
+	{
+		// Pop the missing operands off the memory stack, these go below everything already cached
+		size_t cload = centries - m_vecregStack.size();
+		std::vector<Reg> vecregLoad;
+		for (size_t iload = 0; iload < cload; ++iload)
+		{
+			size_t cregsCachedBefore = m_vecregStack.size();
+			Reg reg = (rc == RegClass::Xmm) ? _AllocXmm() : _AllocReg();
+			Verify(m_vecregStack.size() == cregsCachedBefore);	// a spill here would reorder the stack
+			_PopEntry(reg);
+			--m_cstackMem;
+			m_maskRegsLocked |= RegMask(reg);
+			vecregLoad.push_back(reg);
+		}
+		for (Reg reg : vecregLoad)
+		{
+			m_maskRegsLocked &= ~RegMask(reg);
+			m_maskRegsUsed |= RegMask(reg);
+		}
+		m_vecregStack.insert(m_vecregStack.begin(), vecregLoad.rbegin(), vecregLoad.rend());
+	}
+	for (size_t ientry = 0; ientry < centries; ++ientry)
+		_EnsureClass(ientry, rc);
 }
 
-int32_t *JitWriter::EnterIF()
+// NOTE: Must not affect flags
+void JitWriter::_EnsureClass(size_t iFromTop, RegClass rc)
 {
-	// sub rdi, 8
-	// test rax, rax
-	// mov rax, [rdi]
-	static const uint8_t rgcodeTest[] = { 0x48, 0x83, 0xEF, 0x08, 0x48, 0x85, 0xC0, 0x48, 0x8B, 0x07 };
-	SafePushCode(rgcodeTest);
-	// jz rel32
-	static const uint8_t rgcodeJz[] = {0x0F, 0x84};
-	SafePushCode(rgcodeJz);
-	int32_t *prel32Ret = (int32_t*)m_pexecPlaneCur;
-	SafePushCode(int32_t(0));	// placeholder
+	Reg regCur = _StackReg(iFromTop);
+	if (rc == RegClass::Any || _FXmm(regCur) == (rc == RegClass::Xmm))
+		return;
+	m_maskRegsLocked |= RegMask(regCur);
+	Reg regNew = (rc == RegClass::Xmm) ? _AllocXmm() : _AllocReg();
+	m_maskRegsLocked &= ~RegMask(regCur);
+	Verify(iFromTop < m_vecregStack.size() && _StackReg(iFromTop) == regCur);	// spills only reach the entries below
+	_MoveEntry(regNew, regCur);
+	m_vecregStack[m_vecregStack.size() - 1 - iFromTop] = regNew;
+	m_maskRegsUsed &= ~RegMask(regCur);
+	m_maskRegsUsed |= RegMask(regNew);
+}
 
-	_PushExpandStack();	// backup rax
+void JitWriter::_ReplaceTop(Reg reg)
+{
+	// The operation left the result of the top entry in another register
+	Reg &regTop = m_vecregStack.back();
+	m_maskRegsUsed &= ~RegMask(regTop);
+	regTop = reg;
+	Verify((m_maskRegsUsed & RegMask(reg)) == 0);
+	m_maskRegsUsed |= RegMask(reg);
+}
 
-	// push rdi
-	static const uint8_t rgcode[] = { 0x57 };
-	SafePushCode(rgcode);
+// NOTE: Must not affect flags
+void JitWriter::_MoveToReg(size_t iFromTop, Reg reg)
+{
+	Reg regCur = _StackReg(iFromTop);
+	if (regCur == reg)
+		return;
 
-	return prel32Ret;
+	auto itregOther = std::find(m_vecregStack.begin(), m_vecregStack.end(), reg);
+	if (itregOther != m_vecregStack.end() && _FXmm(reg) == _FXmm(regCur))
+	{
+		// Another operand is using the register so trade places with it
+		if (_FXmm(reg))
+		{
+			// movaps xmm0, reg
+			// movaps reg, regCur
+			// movaps regCur, xmm0
+			_MoveEntry(_RegOfXmm(xmm0), reg);
+			_MoveEntry(reg, regCur);
+			_MoveEntry(regCur, _RegOfXmm(xmm0));
+		}
+		else
+		{
+			// xchg reg, regCur
+			_EmitRegReg({ 0x87 }, true, reg, regCur);
+		}
+		*itregOther = regCur;
+	}
+	else
+	{
+		if (itregOther != m_vecregStack.end())
+		{
+			// The other operand is in the wrong class to trade with, it moves somewhere else of its own
+			m_maskRegsLocked |= RegMask(regCur);
+			_EvictReg(reg);
+			m_maskRegsLocked &= ~RegMask(regCur);
+			Verify(iFromTop < m_vecregStack.size() && _StackReg(iFromTop) == regCur);	// spills only reach the entries below
+		}
+		Verify((m_maskRegsLocked & RegMask(reg)) == 0);
+		_MoveEntry(reg, regCur);
+		m_maskRegsUsed &= ~RegMask(regCur);
+		m_maskRegsUsed |= RegMask(reg);
+	}
+	m_vecregStack[m_vecregStack.size() - 1 - iFromTop] = reg;
 }
 
-void JitWriter::LeaveBlock(bool fHasReturn)
+void JitWriter::_EvictReg(Reg reg)
 {
-	// pop rdi
-	static const uint8_t rgcode[] = { 0x5F };
-	SafePushCode(rgcode, _countof(rgcode));
-	if (!fHasReturn)
-		_PopContractStack();
+	if ((m_maskRegsUsed & RegMask(reg)) == 0)
+		return;
+	Reg regNew = _FXmm(reg) ? _AllocXmm() : _AllocReg();	// Note: may spill the operand we're evicting
+	if ((m_maskRegsUsed & RegMask(reg)) == 0)
+		return;
+	auto itreg = std::find(m_vecregStack.begin(), m_vecregStack.end(), reg);
+	_MoveEntry(regNew, reg);
+	*itreg = regNew;
+	m_maskRegsUsed &= ~RegMask(reg);
+	m_maskRegsUsed |= RegMask(regNew);
 }
 
-void JitWriter::Eqz32()
+// NOTE: Must not affect flags
+void JitWriter::_SpillStack()
 {
-	//	test eax, eax		{ 0x85, 0xC0 }
-	//	mov eax, 1			{ 0xb8, 0x01, 0x00, 0x00, 0x00}
-	//  jz  Lz				{ 0x74, 0x02 }
-	//	xor eax, eax		{ 0x31, 0xC0 }
-	// Lz:
-	static const uint8_t rgcode[] = { 0x85, 0xC0, 0xB8, 0x01, 0x00, 0x00, 0x00, 0x74, 0x02, 0x31, 0xC0 };
-	SafePushCode(rgcode, _countof(rgcode));
+	Verify(!m_fConstPending);
+	for (Reg reg : m_vecregStack)
+	{
+		_PushEntry(reg);
+		++m_cstackMem;
+	}
+	m_vecregStack.clear();
+	m_maskRegsUsed = 0;
 }
 
-void JitWriter::Eqz64()
+// NOTE: Must not affect flags
+void JitWriter::_FlushStack()
 {
-	//	test rax, rax		{ 0x48, 0x85, 0xC0 }
-	//	mov eax, 1			{ 0xb8, 0x01, 0x00, 0x00, 0x00}
-	//  jz  Lz				{ 0x74, 0x02 }
-	//	xor eax, eax		{ 0x31, 0xC0 }
-	// Lz:
-	static const uint8_t rgcode[] = { 0x48, 0x85, 0xC0, 0xB8, 0x01, 0x00, 0x00, 0x00, 0x74, 0x02, 0x31, 0xC0 };
-	SafePushCode(rgcode, _countof(rgcode));
+	_EnsureCached(1, RegClass::Any);
+	Reg regTop = m_vecregStack.back();
+	m_vecregStack.pop_back();
+	_SpillStack();	// stores only so regTop is intact
+	_MoveEntry(rax, regTop);
+	_ResetStack(m_cstackMem, true);
 }
 
-void JitWriter::Compare(CompareType type, bool fSigned, bool f64)
+void JitWriter::_ResetStack(int32_t cstackMem, bool fTopInReg, Reg regTop)
 {
-	_PopSecondParam();
-	//		cmp rcx, rax		{ 0x48, 0x39, 0xc1 }			// yes the order is reversed... this is by the spec
-	//		mov eax, 1			{ b8 01 00 00 00}
-	//		jcc LTrue			{ XX, 0x02 }	2-byte forward rel jump
-	//		xor eax, eax		{ 31 c0 }
-	// LTrue:
-	static const uint8_t rgcodeCmp64[] = { 0x48, 0x39, 0xc1 };
-	static const uint8_t rgcodeCmp32[] = { 0x39, 0xC1 };
-	static const uint8_t rgcodePre[] = { 0xb8, 0x01, 0x00, 0x00, 0x00 };
-	static const uint8_t rgcodePost[] = { 0x02, 0x31, 0xc0 };
+	m_cstackMem = cstackMem;
+	m_vecregStack.clear();
+	m_maskRegsUsed = 0;
+	if (fTopInReg)
+		_PushReg(regTop);
+}
 
-	if (f64)
-		SafePushCode(rgcodeCmp64, _countof(rgcodeCmp64));
+void JitWriter::_DropTop()
+{
+	if (m_fConstPending)
+	{
+		m_fConstPending = false;	// never made it into a register
+		return;
+	}
+	if (m_vecregStack.empty())
+	{
+		_ReleaseStack(_DispStack(1));	// the entry is already in memory so it only has to be popped
+		--m_cstackMem;
+	}
 	else
-		SafePushCode(rgcodeCmp32, _countof(rgcodeCmp32));
-
-	SafePushCode(rgcodePre, _countof(rgcodePre));
-	uint8_t cmpOp = 0xCC;	// int3 BUG
-	switch (type)
 	{
-	case CompareType::LessThan:
-		if (fSigned)
-			cmpOp = 0x7C;	// JL  rel8
-		else
-			cmpOp = 0x72;	// JB  rel8
-		break;
-
-	case CompareType::LessThanEqual:
-		if (fSigned)
-			cmpOp = 0x7E;	// JLE rel8
-		else
-			cmpOp = 0x76;	// JBE rel8
-		break;
-
-	case CompareType::Equal:
-		cmpOp = 0x74;		// JE rel8
-		break;
-
-	case CompareType::NotEqual:
-		cmpOp = 0x75;		// JNE rel8
-		break;
+		_PopReg(RegClass::Any);
+	}
+}
 
-	case CompareType::GreaterThanEqual:
-		if (fSigned)
-			cmpOp = 0x7D;	// JGE rel8
-		else
-			cmpOp = 0x73;	// JAE rel8
-		break;
+// NOTE: Must not affect flags
+void JitWriter::_ReleaseStack(int32_t cb)
+{
+	// lea rsp, [rsp + cb]
+	if (cb != 0)
+		_EmitRegMem({ 0x8D }, true, rsp, rsp, cb);
+}
 
-	case CompareType::GreaterThan:
-		if (fSigned)
-			cmpOp = 0x7F;	// JG rel8
-		else
-			cmpOp = 0x77;	// JA rel8
-		break;
+int32_t JitWriter::_DispLocal(uint32_t idx, uint32_t cparams, uint32_t clocals)
+{
+	int32_t disp = int32_t(clocals - 1 - idx) * int32_t(sizeof(uint64_t));
+	if (idx < _CargsStack(cparams))
+		disp += int32_t(2 * sizeof(void*));	// the return address and the saved rbp are between the stack arguments and the other locals
+	return disp;
+}
 
-	default:
-		Verify(false);
+JitWriter::Reg JitWriter::_RegArg(const value_type *rgtype, uint32_t cargs, uint32_t iarg, size_t *piargSave)
+{
+	// Clear of rcx, rdx and r8 which calls use for the function index and the call_indirect lookup
+	static const Reg rgregArg[cargsReg] = { rax, r9, r10, r11 };
+	static const Xmm rgxmmArg[cargsReg] = { xmm2, xmm3, xmm4, xmm5 };
+	uint32_t iargFirst = _CargsStack(cargs);
+	Verify(iarg >= iargFirst && iarg < cargs);
+	uint32_t cfloatBefore = 0;
+	for (uint32_t iargPrev = iargFirst; iargPrev < iarg; ++iargPrev)
+	{
+		if (_FFloatType(rgtype[iargPrev]))
+			++cfloatBefore;
 	}
-	SafePushCode(&cmpOp, sizeof(cmpOp));
-	SafePushCode(rgcodePost, _countof(rgcodePost));
+	uint32_t cintBefore = iarg - iargFirst - cfloatBefore;
+	bool fFloat = _FFloatType(rgtype[iarg]);
+	if (piargSave != nullptr)
+		*piargSave = fFloat ? cargsReg + cfloatBefore : cintBefore;
+	return fFloat ? _RegOfXmm(rgxmmArg[cfloatBefore]) : rgregArg[cintBefore];
 }
 
-void JitWriter::CallAsmOp(void **pfn)
+// NOTE: Must not affect flags
+void JitWriter::_LoadLabelResult(const Label &label)
 {
-	static const uint8_t rgcodeCallIndirect[] = { uint8_t(0xFF), uint8_t(0x15) };
-	SafePushCode(rgcodeCallIndirect);
-	ptrdiff_t diffFn = reinterpret_cast<ptrdiff_t>(pfn) - (reinterpret_cast<ptrdiff_t>(m_pexecPlaneCur) + 4);
-	Verify(static_cast<int32_t>(diffFn) == diffFn);
-	SafePushCode(int32_t(diffFn));
+	if (!label.fResult)
+		return;
+	_EnsureCached(1, RegClass::Any);
+	_MoveToReg(0, _RegResult(label.type));
 }
 
-void JitWriter::Convert(value_type typeDst, value_type typeSrc, bool fSigned)
+int32_t *JitWriter::_JumpLabel(const Label &label, uint8_t cc)
 {
-	const char *szConv = nullptr;
-	switch (typeDst)
+	_LoadLabelResult(label);	// does not affect flags, a fallthrough keeps the result where it is now
+	int32_t cbRelease = _DispStack(m_cstackMem - label.cstackMem);	// only negative in unreachable code
+	if (cbRelease <= 0)
+		return (cc == ccNone) ? Jump(label.pvTarget) : JumpCc(cc, label.pvTarget);
+
+	// The entries above the label's are popped on the way, a conditional branch only pops them when it is taken
+	//		j!cc LSkip
+	//		lea rsp, [rsp + cbRelease]
+	//		jmp target
+	//	LSkip:
+	uint8_t *pbSkip = nullptr;
+	if (cc != ccNone)
 	{
-	case value_type::i32:
-		switch (typeSrc)
-		{
-		case value_type::f32:
-			if (fSigned)
-			{
-				// movd xmm0, eax
-				// CVTTSS2SI eax, xmm0
-				szConv = "\x66\x0F\x6E\xC0\xF3\x0F\x2C\xC0";
-			}
-			else
-			{
-				// movd xmm0, eax
-				// CVTTSS2SI rax, xmm0
-				// mov eax, eax
-				szConv = "\x66\x0F\x6E\xC0\xF3\x48\x0F\x2C\xC0\x89\xC0";
-			}
-			break;
+		SafePushCode(uint8_t(0x70 | (cc ^ 1)));
+		SafePushCode(uint8_t(0));
+		pbSkip = m_pexecPlaneCur;
+	}
+	_ReleaseStack(cbRelease);
+	int32_t *prel32 = Jump(label.pvTarget);
+	if (pbSkip != nullptr)
+		*_PWritable(pbSkip - 1) = numeric_cast<uint8_t>(m_pexecPlaneCur - pbSkip);
+	return prel32;
+}
 
-		case value_type::f64:
-			if (fSigned)
-			{
-				// movq xmm0, rax
-				// CVTTSD2SI eax, xmm0
-				szConv = "\x66\x48\x0F\x6E\xC0\xF2\x0F\x2C\xC0";
-			}
-			else
-			{
-				// movq xmm0, rax
-				// CVTTSD2SI rax, xmm0
-				// mov eax, eax
-				szConv = "\x66\x48\x0F\x6E\xC0\xF2\x48\x0F\x2C\xC0\x89\xC0";
-			}
-			break;
+
+void JitWriter::LoadMem(uint32_t offset, bool f64Dst /* else 32 */, uint32_t cbSrc, bool fSignExtend, bool fFloat)
+{
+	Reg reg;
+	Reg regAddr = rax;
+	int32_t dispConst = 0;
+	bool fConstAddr = m_fConstPending && (m_cPending + offset) < 0x80000000;
+	if (fConstAddr)
+	{
+		// The effective address is known so it goes straight into the displacement: op reg, [rsi + disp32]
+		dispConst = int32_t(m_cPending + offset);
+		m_fConstPending = false;
+		reg = fFloat ? _AllocXmm() : _AllocReg();
+		_PushReg(reg);
+	}
+	else
+	{
+		if (m_fConstPending)
+			_MaterializeConstant();
+		_EnsureCached(1);
+		regAddr = _StackReg(0);
+		dispConst = _DispAddress(regAddr, offset);
+		reg = regAddr;
+		if (fFloat)
+		{
+			// floats are loaded straight into an xmm register, the address register stays intact until the next gpr allocation
+			_PopReg();
+			reg = _AllocXmm();
+			_PushReg(reg);
 		}
-		break;
+	}
+	auto EmitLoad = [&](std::initializer_list<uint8_t> rgop, bool f64)
+	{
+		uint8_t regOp = _FXmm(reg) ? uint8_t(_XmmOf(reg)) : uint8_t(reg);
+		if (fConstAddr)
+			_EmitRegMem(rgop, f64, regOp, rsi, dispConst);
+		else
+			_EmitRegMemIndex(rgop, f64, regOp, rsi, regAddr, dispConst);
+	};
 
-	case value_type::i64:
-		switch (typeSrc)
+	if (fFloat)
+	{
+		if (cbSrc == 8)
 		{
-		case value_type::f32:
-			if (fSigned)
-			{
-				// movd xmm0, eax
-				// CVTTSS2SI rax, xmm0
-				szConv = "\x66\x0F\x6E\xC0\xF3\x48\x0F\x2C\xC0";
-			}
-			else
-			{
-				CallAsmOp(m_pfnF32ToU64Trunc);
-				return;
-			}
-			break;
-		
-		case value_type::f64:
-			if (fSigned)
-			{
-				// movq xmm0, rax
-				// cvttsd2si rax, xmm0
-				szConv = "\x66\x48\x0F\x6E\xC0\xF2\x48\x0F\x2C\xC0";
-			}
-			else
-			{
-				CallAsmOp(m_pfnF64ToU64Trunc);
-				return;
-			}
+			// movq xmm, qword ptr [rsi+reg]
+			SafePushCode(uint8_t(0xF3));
+			EmitLoad({ 0x0F, 0x7E }, false);
 		}
-		break;
+		else
+		{
+			// movd xmm, dword ptr [rsi+reg]
+			Verify(cbSrc == 4);
+			SafePushCode(uint8_t(0x66));
+			EmitLoad({ 0x0F, 0x6E }, false);
+		}
+	}
+	else if (fSignExtend)
+	{
+		switch (cbSrc)
+		{
+		default:
+			Verify(false);
+			break;
 
-	case value_type::f32:
-		switch (typeSrc)
+		case 1:
+			// movsx reg, byte ptr [rsi+reg]
+			EmitLoad({ 0x0F, 0xBE }, f64Dst);
+			break;
+
+		case 2:
+			// movsx reg, word ptr [rsi+reg]
+			EmitLoad({ 0x0F, 0xBF }, f64Dst);
+			break;
+
+		case 4:
+			Verify(f64Dst);
+			// movsxd reg, dword ptr [rsi+reg]
+			EmitLoad({ 0x63 }, true);
+			break;
+		}
+	}
+	else
+	{
+		switch (cbSrc)
 		{
-		case value_type::i32:
-			if (fSigned)
-			{
-				// cvtsi2ss xmm0, eax
-				// movd eax, xmm0
-				szConv = "\xF3\x0F\x2A\xC0\x66\x0F\x7E\xC0";
-			}
-			else
-			{
-				// cvtsi2ss xmm0, rax
-				// movd eax, xmm0
-				szConv = "\xF3\x48\x0F\x2A\xC0\x66\x0F\x7E\xC0";
-			}
+		case 1:
+			// movzx reg32, byte ptr [rsi+reg]
+			EmitLoad({ 0x0F, 0xB6 }, false);
 			break;
 
-		case value_type::i64:
-			if (fSigned)
-			{
-				// cvtsi2ss xmm0, rax
-				// movd eax, xmm0
-				szConv = "\xF3\x48\x0F\x2A\xC0\x66\x0F\x7E\xC0";
-			}
-			else
-			{
-				CallAsmOp(m_pfnU64ToF32);
-				return;
-			}
+		case 2:
+			// movzx reg32, word ptr [rsi+reg]
+			EmitLoad({ 0x0F, 0xB7 }, false);
 			break;
 
-		case value_type::f64:
-			// movq xmm0, rax
-			// cvtsd2ss xmm0, xmm0
-			// movd eax, xmm0
-			szConv = "\x66\x48\x0F\x6E\xC0\xF2\x0F\x5A\xC0\x66\x0F\x7E\xC0";
+		case 4:
+			// mov reg32, dword ptr [rsi+reg]
+			EmitLoad({ 0x8B }, false);
+			break;
+
+		case 8:
+			Verify(f64Dst);
+			// mov reg, qword ptr [rsi+reg]
+			EmitLoad({ 0x8B }, true);
 			break;
+
+		default:
+			Verify(false);
 		}
-		break;
+	}
+}
+// Zero extends the i32 address and returns the displacement that goes with it, [rsi + regAddr + disp] is then the
+//	full 33-bit effective address so an access past 4GB faults in the heap reservation instead of wrapping around
+int32_t JitWriter::_DispAddress(Reg regAddr, uint32_t offset)
+{
+	// mov regAddr32, regAddr32
+	_EmitRegReg({ 0x8B }, false, regAddr, regAddr);
+	if (offset < 0x80000000)
+		return int32_t(offset);
+
+	// Too big for a disp32
+	//	mov regOffset32, offset
+	//	add regAddr, regOffset
+	Reg regOffset = _AllocReg();
+	_MovRegImm(regOffset, offset);
+	_EmitRegReg({ 0x03 }, true, regAddr, regOffset);
+	return 0;
+}
 
-	case value_type::f64:
-		switch (typeSrc)
+void JitWriter::StoreMem(uint32_t offset, uint32_t cbDst)
+{
+	int32_t immVal;
+	if (_FPopImm32(cbDst == 8, &immVal))
+	{
+		_EnsureCached(1);
+		Reg regAddr = _StackReg(0);
+		int32_t disp = _DispAddress(regAddr, offset);
+		_PopReg();
+		switch (cbDst)
 		{
-		case value_type::i32:
-			if (!fSigned)
-			{
-				// cvtsi2sd xmm0, rax
-				// movq rax, xmm0
-				szConv = "\xF2\x48\x0F\x2A\xC0\x66\x48\x0F\x7E\xC0";
-			}
-			else
-			{
-				// cvtsi2sd xmm0, eax
-				// movq rax, xmm0
-				szConv = "\xF2\x0F\x2A\xC0\x66\x48\x0F\x7E\xC0";
-			}
+		default:
+			Verify(false);
 			break;
-		case value_type::i64:
-			if (!fSigned)
-			{
-				// call [m_pfnU64ToF64]
-				CallAsmOp(m_pfnU64ToF64);
-				return;
-			}
-			else
-			{
-				// cvtsi2sd xmm0, rax
-				// movq rax, xmm0
-				szConv = "\xF2\x48\x0F\x2A\xC0\x66\x48\x0F\x7E\xC0";
-			}
+
+		case 1:
+			// mov byte ptr [rsi + regAddr + disp], imm8
+			_EmitRegMemIndex({ 0xC6 }, false, 0, rsi, regAddr, disp);
+			SafePushCode(uint8_t(immVal));
 			break;
-		case value_type::f32:
-			// movd xmm0, eax
-			// cvtss2sd xmm0, xmm0
-			// movq rax, xmm0
-			szConv = "\x66\x0F\x6E\xC0\xF3\x0F\x5A\xC0\x66\x48\x0F\x7E\xC0";
+
+		case 2:
+			// mov word ptr [rsi + regAddr + disp], imm16
+			SafePushCode(uint8_t(0x66));
+			_EmitRegMemIndex({ 0xC7 }, false, 0, rsi, regAddr, disp);
+			SafePushCode(uint16_t(immVal));
+			break;
+
+		case 4:
+		case 8:
+			// mov dword/qword ptr [rsi + regAddr + disp], imm32
+			_EmitRegMemIndex({ 0xC7 }, cbDst == 8, 0, rsi, regAddr, disp);
+			SafePushCode(immVal);
 			break;
 		}
+		return;
+	}
+
+	// A float is stored from wherever it is, narrow stores need a byte or word register
+	_EnsureCached(2, RegClass::Any);
+	_EnsureClass(1, RegClass::Gpr);
+	if (cbDst < 4)
+		_EnsureClass(0, RegClass::Gpr);
+	int32_t disp = _DispAddress(_StackReg(1), offset);
+	Reg regVal = _PopReg(RegClass::Any);
+	Reg regAddr = _PopReg();
+
+	if (_FXmm(regVal))
+	{
+		// movd dword ptr [rsi + regAddr + disp], xmm
+		// movq qword ptr [rsi + regAddr + disp], xmm
+		SafePushCode(uint8_t(0x66));
+		_EmitRegMemIndex({ 0x0F, uint8_t(cbDst == 8 ? 0xD6 : 0x7E) }, false, _XmmOf(regVal), rsi, regAddr, disp);
+		return;
+	}
+
+	switch (cbDst)
+	{
+	default:
+		Verify(false);
+		break;
+
+	case 1:
+		// mov [rsi + regAddr + disp], regVal8
+		_EmitRegMemIndex({ 0x88 }, false, regVal, rsi, regAddr, disp);
+		break;
+
+	case 2:
+		// mov [rsi + regAddr + disp], regVal16
+		SafePushCode(uint8_t(0x66));
+		_EmitRegMemIndex({ 0x89 }, false, regVal, rsi, regAddr, disp);
+		break;
+
+	case 4:
+		// mov [rsi + regAddr + disp], regVal32
+		_EmitRegMemIndex({ 0x89 }, false, regVal, rsi, regAddr, disp);
+		break;
+
+	case 8:
+		// mov [rsi + regAddr + disp], regVal
+		_EmitRegMemIndex({ 0x89 }, true, regVal, rsi, regAddr, disp);
 		break;
 	}
-	Verify(szConv != nullptr);
-	SafePushCode(szConv, strlen(szConv));
 }
 
-void JitWriter::FloatCompare(CompareType type)
+void JitWriter::_EmitAluImm(uint8_t opext, bool f64, Reg reg, int32_t imm)
 {
-	// Note: Because cmpss only does less than compares we may swap the operands
-	bool fSwap = false;
-	switch (type)
+	if (imm == static_cast<int8_t>(imm))
 	{
-	case CompareType::GreaterThan:
-	case CompareType::GreaterThanEqual:
-		fSwap = true;
+		// op reg, imm8	(sign extended)
+		_EmitRegReg({ 0x83 }, f64, opext, reg);
+		SafePushCode(static_cast<int8_t>(imm));
 	}
+	else
+	{
+		// op reg, imm32
+		_EmitRegReg({ 0x81 }, f64, opext, reg);
+		SafePushCode(imm);
+	}
+}
+
+void JitWriter::BinaryOp(std::initializer_list<uint8_t> rgop, bool f64)
+{
+	// The classic ALU ops (add, or, and, sub, xor, cmp) encode reg,reg as (opext << 3) | 1 and have an 81 /opext immediate form
+	int32_t imm;
+	if (rgop.size() == 1 && (*rgop.begin() & 0xC7) == 0x01 && _FPopImm32(f64, &imm))
+	{
+		_EnsureCached(1);
+		_EmitAluImm(*rgop.begin() >> 3, f64, _StackReg(0), imm);
+		return;
+	}
+
+	// op regFirst, regSecond	; result replaces the first operand
+	_EnsureCached(2);
+	Reg regSecond = _PopReg();
+	Reg regFirst = _StackReg(0);
+	_EmitRegReg(rgop, f64, regSecond, regFirst);
+}
+
+void JitWriter::Sub32()
+{
+	// sub reg32, reg32
+	BinaryOp({ 0x29 }, false);
+}
+
+void JitWriter::Add32()
+{
+	// add reg32, reg32
+	BinaryOp({ 0x01 }, false);
+}
+
+void JitWriter::Add64()
+{
+	// add reg, reg
+	BinaryOp({ 0x01 }, true);
+}
+
+void JitWriter::Sub64()
+{
+	// sub reg, reg
+	BinaryOp({ 0x29 }, true);
+}
+
+void JitWriter::Popcnt32()
+{
+	_EnsureCached(1);
+	Reg reg = _StackReg(0);
+	// popcnt reg32, reg32
+	SafePushCode(uint8_t(0xF3));
+	_EmitRegReg({ 0x0F, 0xB8 }, false, reg, reg);
+}
+
+void JitWriter::Popcnt64()
+{
+	_EnsureCached(1);
+	Reg reg = _StackReg(0);
+	// popcnt reg, reg
+	SafePushCode(uint8_t(0xF3));
+	_EmitRegReg({ 0x0F, 0xB8 }, true, reg, reg);
+}
+
+void JitWriter::PushC32(uint32_t c)
+{
+	Reg reg = _AllocReg();
+	if (c == 0)	// micro optimize zeroing
+	{
+		// xor reg32, reg32
+		_EmitRegReg({ 0x31 }, false, reg, reg);
+	}
+	else
+	{
+		// mov reg32, c
+		_EmitRex(false, 0, 0, reg);
+		SafePushCode(uint8_t(0xB8 | (reg & 7)));
+		SafePushCode(&c, sizeof(c));
+	}
+	_PushReg(reg);
+}
+
+void JitWriter::PushC64(uint64_t c)
+{
+	Reg reg = _AllocReg();
+	_MovRegImm(reg, c);
+	_PushReg(reg);
+}
+
+void JitWriter::_MovRegImm(Reg reg, uint64_t c)
+{
+	if (c == 0) // micro optimize zeroing
+	{
+		// xor reg32, reg32		; implicitly clears the upper half
+		_EmitRegReg({ 0x31 }, false, reg, reg);
+	}
+	else if (c <= UINT32_MAX)
+	{
+		// mov reg32, c
+		_EmitRex(false, 0, 0, reg);
+		SafePushCode(uint8_t(0xB8 | (reg & 7)));
+		SafePushCode(uint32_t(c));
+	}
+	else
+	{
+		// mov reg, c
+		_EmitRex(true, 0, 0, reg);
+		SafePushCode(uint8_t(0xB8 | (reg & 7)));
+		SafePushCode(&c, sizeof(c));
+	}
+}
+
+void JitWriter::PushF32(float val)
+{
+	int32_t ival;
+	memcpy(&ival, &val, sizeof(ival));
+	if (ival == 0)
+	{
+		// xorps xmm, xmm
+		Reg reg = _AllocXmm();
+		_EmitRegReg({ 0x0F, 0x57 }, false, _XmmOf(reg), _XmmOf(reg));
+		_PushReg(reg);
+		return;
+	}
+	PushC32(ival);	// float operations move it over with a single movq
+}
+
+void JitWriter::PushF64(double val)
+{
+	int64_t ival;
+	memcpy(&ival, &val, sizeof(ival));
+	if (ival == 0)
+	{
+		PushF32(0.0f);
+		return;
+	}
+	PushC64(ival);
+}
+
+void JitWriter::Ud2()
+{
+	// NYI: ud2
+	static const uint8_t rgcode[] = { 0x0F, 0x0B };
+	SafePushCode(rgcode, _countof(rgcode));
+}
+
+void JitWriter::SetLocal(uint32_t idx, bool fPop)
+{
+	Reg regLocal;
+	if (_FPinnedLocal(idx, &regLocal))
+	{
+		// mov regLocal, reg
+		_EnsureCached(1, _FXmm(regLocal) ? RegClass::Xmm : RegClass::Gpr);
+		_MoveEntry(regLocal, _StackReg(0));
+	}
+	else
+	{
+		// mov [rsp + local], reg
+		_EnsureCached(1, RegClass::Any);
+		_StoreEntry(_StackReg(0), rsp, _DispLocalFromRsp(idx));
+	}
+	if (fPop)
+		_PopReg(RegClass::Any);
+}
+
+void JitWriter::GetLocal(uint32_t idx)
+{
+	Reg regLocal;
+	bool fPinned = _FPinnedLocal(idx, &regLocal);
+	bool fXmm = fPinned ? _FXmm(regLocal) : bool(m_vecfFloatLocal[idx]);
+	Reg reg = fXmm ? _AllocXmm() : _AllocReg();
+	if (fPinned)
+	{
+		// mov reg, regLocal
+		_MoveEntry(reg, regLocal);
+	}
+	else
+	{
+		// mov reg, [rsp + local]
+		_LoadEntry(reg, rsp, _DispLocalFromRsp(idx));
+	}
+	_PushReg(reg);
+}
+
+JitWriter::Label JitWriter::EnterBlock(value_type type, bool fLoop)
+{
+	_SpillStack();
+	Label label;
+	label.type = type;
+	label.pvTarget = fLoop ? m_pexecPlaneCur : nullptr;
+	label.cstackMem = m_cstackMem;
+	label.fResult = !fLoop && type != value_type::empty_block;	// branches to a loop start it again
+	return label;
+}
 
-	// sub rdi, 8 (for the variable we're about to pop)
-	static const uint8_t rgcodeFixRdi[] = { 0x48, 0x83, 0xEF, 0x08 };
-	SafePushCode(rgcodeFixRdi);
+int32_t *JitWriter::EnterIF(value_type type, Label *plabel)
+{
+	uint8_t cc = _PopCondition();
+	*plabel = EnterBlock(type, false /*fLoop*/);	// does not affect flags
+	return JumpCc(cc ^ 1, nullptr);
+}
+
+void JitWriter::LeaveBlock(const Label &label)
+{
+	// The fallthrough arrives with exactly the label's entries, the result is the only one that may be cached
+	_LoadLabelResult(label);
+	_ResetStack(label.cstackMem, label.fResult, _RegResult(label.type));
+}
+
+// NOTE: Must not affect flags
+void JitWriter::_MaterializeCondition()
+{
+	if (m_ccPending == ccNone)
+		return;
+	Reg reg = _AllocReg();	// Note: spills are mov/lea only
+	//	setcc reg8
+	//	movzx reg32, reg8
+	_EmitRegReg({ 0x0F, uint8_t(0x90 | m_ccPending) }, false, 0, reg);
+	_EmitRegReg({ 0x0F, 0xB6 }, false, reg, reg);
+	_PushReg(reg);
+	m_ccPending = ccNone;
+}
+
+uint8_t JitWriter::_PopCondition()
+{
+	uint8_t cc = m_ccPending;
+	if (cc != ccNone)
+	{
+		// The comparison that produced the value left it in the flags, use them directly
+		m_ccPending = ccNone;
+		return cc;
+	}
+	Reg reg = _PopReg();
+	// test reg32, reg32
+	_EmitRegReg({ 0x85 }, false, reg, reg);
+	return 0x5;	// NZ
+}
+
+bool JitWriter::_FConstantConsumer(opcode op)
+{
+	switch (op)
+	{
+	case opcode::i32_add: case opcode::i32_sub: case opcode::i32_mul:
+	case opcode::i32_and: case opcode::i32_or: case opcode::i32_xor:
+	case opcode::i32_shl: case opcode::i32_shr_s: case opcode::i32_shr_u: case opcode::i32_rotl: case opcode::i32_rotr:
+	case opcode::i32_eq: case opcode::i32_ne: case opcode::i32_lt_s: case opcode::i32_lt_u: case opcode::i32_gt_s:
+	case opcode::i32_gt_u: case opcode::i32_le_s: case opcode::i32_le_u: case opcode::i32_ge_s: case opcode::i32_ge_u:
+	case opcode::i32_div_s: case opcode::i32_div_u: case opcode::i32_rem_s: case opcode::i32_rem_u:
+	case opcode::i64_add: case opcode::i64_sub: case opcode::i64_mul:
+	case opcode::i64_and: case opcode::i64_or: case opcode::i64_xor:
+	case opcode::i64_shl: case opcode::i64_shr_s: case opcode::i64_shr_u: case opcode::i64_rotl: case opcode::i64_rotr:
+	case opcode::i64_eq: case opcode::i64_ne: case opcode::i64_lt_s: case opcode::i64_lt_u: case opcode::i64_gt_s:
+	case opcode::i64_gt_u: case opcode::i64_le_s: case opcode::i64_le_u: case opcode::i64_ge_s: case opcode::i64_ge_u:
+	case opcode::i64_div_s: case opcode::i64_div_u: case opcode::i64_rem_s: case opcode::i64_rem_u:
+	case opcode::i32_load: case opcode::i64_load: case opcode::f32_load: case opcode::f64_load:
+	case opcode::i32_load8_s: case opcode::i32_load8_u: case opcode::i32_load16_s: case opcode::i32_load16_u:
+	case opcode::i64_load8_s: case opcode::i64_load8_u: case opcode::i64_load16_s: case opcode::i64_load16_u:
+	case opcode::i64_load32_s: case opcode::i64_load32_u:
+	case opcode::i32_store: case opcode::i64_store: case opcode::f32_store: case opcode::f64_store:
+	case opcode::i32_store8: case opcode::i32_store16: case opcode::i64_store8: case opcode::i64_store16: case opcode::i64_store32:
+	case opcode::drop:
+		return true;	// the emitters materialize the constant themselves if it doesn't fit
+	default:
+		return false;
+	}
+}
+
+void JitWriter::_DeferConstant(uint64_t c)
+{
+	Verify(!m_fConstPending);
+	m_fConstPending = true;
+	m_cPending = c;
+}
+
+void JitWriter::_MaterializeConstant()
+{
+	if (!m_fConstPending)
+		return;
+	m_fConstPending = false;
+	PushC64(m_cPending);	// i32 constants are zero extended so this emits the same mov reg32
+}
+
+bool JitWriter::_FPopImm32(bool f64, int32_t *pimm)
+{
+	if (!m_fConstPending)
+		return false;
+	if (f64 && static_cast<int64_t>(m_cPending) != static_cast<int32_t>(m_cPending))
+	{
+		_MaterializeConstant();
+		return false;
+	}
+	*pimm = static_cast<int32_t>(m_cPending);
+	m_fConstPending = false;
+	return true;
+}
+
+void JitWriter::Eqz32()
+{
+	Reg reg = _PopReg();
+	//	test reg32, reg32
+	_EmitRegReg({ 0x85 }, false, reg, reg);
+	m_ccPending = 0x4;	// Z
+}
+
+void JitWriter::Eqz64()
+{
+	Reg reg = _PopReg();
+	//	test reg, reg
+	_EmitRegReg({ 0x85 }, true, reg, reg);
+	m_ccPending = 0x4;	// Z
+}
 
-	if (fSwap)
+void JitWriter::Compare(CompareType type, bool fSigned, bool f64)
+{
+	int32_t imm;
+	if (_FPopImm32(f64, &imm))
 	{
-		// movd xmm0, eax
-		// movd xmm1, [rdi]
-		static const uint8_t rgcodeMov[] = { 0x66, 0x0F, 0x6E, 0xC0, 0x66, 0x0F, 0x6E, 0x0F };
-		SafePushCode(rgcodeMov);
+		//	cmp regFirst, imm
+		_EmitAluImm(7, f64, _PopReg(), imm);
 	}
 	else
 	{
-		// movd xmm1, eax		; second operand
-		// movd xmm0, [rdi]		; first operand
-		static const uint8_t rgcodeMov[] = { 0x66, 0x0F, 0x6E, 0xC8, 0x66, 0x0F, 0x6E, 0x07 };
-		SafePushCode(rgcodeMov);
+		_EnsureCached(2);
+		Reg regSecond = _PopReg();
+		Reg regFirst = _PopReg();
+		//		cmp regFirst, regSecond
+		_EmitRegReg({ 0x39 }, f64, regSecond, regFirst);
 	}
+	//	the result stays in the flags until someone needs it (see _MaterializeCondition)
 
-	uint8_t cmpssImm;
+	uint8_t cc = 0xCC;	// BUG
 	switch (type)
 	{
-	default:
-		Verify(false);
-
 	case CompareType::LessThan:
-	case CompareType::GreaterThan:
-		cmpssImm = 1;
+		if (fSigned)
+			cc = 0xC;	// L
+		else
+			cc = 0x2;	// B
 		break;
 
 	case CompareType::LessThanEqual:
-	case CompareType::GreaterThanEqual:
-		cmpssImm = 2;
+		if (fSigned)
+			cc = 0xE;	// LE
+		else
+			cc = 0x6;	// BE
 		break;
 
 	case CompareType::Equal:
-		cmpssImm = 0;
+		cc = 0x4;		// E
 		break;
 
 	case CompareType::NotEqual:
-		cmpssImm = 4;
+		cc = 0x5;		// NE
+		break;
+
+	case CompareType::GreaterThanEqual:
+		if (fSigned)
+			cc = 0xD;	// GE
+		else
+			cc = 0x3;	// AE
+		break;
+
+	case CompareType::GreaterThan:
+		if (fSigned)
+			cc = 0xF;	// G
+		else
+			cc = 0x7;	// A
 		break;
+
+	default:
+		Verify(false);
 	}
-	// cmpss xmm0, xmm1, imm8
-	static const uint8_t rgcodeCmpss[] = { 0xF3, 0x0F, 0xC2, 0xC1 };
-	SafePushCode(rgcodeCmpss);
-	SafePushCode(uint8_t(cmpssImm));
+	m_ccPending = cc;
+}
 
-	// movd eax, xmm0
-	// and eax, 1
-	static const uint8_t rgcodeReduceFlag[] = { 0x66, 0x0F, 0x7E, 0xC0, 0x83, 0xE0, 0x01 };
-	SafePushCode(rgcodeReduceFlag);
+void JitWriter::CallAsmOp(void **pfn)
+{
+	// The helpers take their operand in rax and clobber the other scratch registers
+	_FlushStack();
+	static const uint8_t rgcodeCallIndirect[] = { uint8_t(0xFF), uint8_t(0x15) };
+	SafePushCode(rgcodeCallIndirect);
+	ptrdiff_t diffFn = reinterpret_cast<ptrdiff_t>(pfn) - (reinterpret_cast<ptrdiff_t>(m_pexecPlaneCur) + 4);
+	Verify(static_cast<int32_t>(diffFn) == diffFn);
+	SafePushCode(int32_t(diffFn));
 }
 
-void JitWriter::DoubleCompare(CompareType type)
+void JitWriter::Convert(value_type typeDst, value_type typeSrc, bool fSigned)
 {
-	// Note: Because cmpsd only does less than compares we may swap the operands
-	bool fSwap = false;
-	switch (type)
+	// unsigned 64-bit conversions need a helper
+	if (!fSigned)
 	{
-	case CompareType::GreaterThan:
-	case CompareType::GreaterThanEqual:
-		fSwap = true;
+		if (typeDst == value_type::i64 && typeSrc == value_type::f32)
+		{
+			CallAsmOp(m_pfnF32ToU64Trunc);
+			return;
+		}
+		if (typeDst == value_type::i64 && typeSrc == value_type::f64)
+		{
+			CallAsmOp(m_pfnF64ToU64Trunc);
+			return;
+		}
+		if (typeDst == value_type::f32 && typeSrc == value_type::i64)
+		{
+			CallAsmOp(m_pfnU64ToF32);
+			return;
+		}
+		if (typeDst == value_type::f64 && typeSrc == value_type::i64)
+		{
+			// call [m_pfnU64ToF64]
+			CallAsmOp(m_pfnU64ToF64);
+			return;
+		}
+	}
+
+	bool fDstInt = (typeDst == value_type::i32 || typeDst == value_type::i64);
+	bool fSrcInt = (typeSrc == value_type::i32 || typeSrc == value_type::i64);
+	Verify(fDstInt != fSrcInt || typeDst != typeSrc);
+	if (fDstInt)
+	{
+		// float -> int, the result goes to a new gpr
+		Verify(!fSrcInt);
+		Xmm xmmSrc = _XmmOf(_PopReg(RegClass::Xmm));
+		Reg reg = _AllocReg();
+		// cvttss2si/cvttsd2si reg32, xmm	(signed i32)
+		// cvttss2si/cvttsd2si reg, xmm		(i64, unsigned i32 is the low half of the 64-bit result)
+		bool f64Cvt = (typeDst == value_type::i64 || !fSigned);
+		SafePushCode(uint8_t(typeSrc == value_type::f64 ? 0xF2 : 0xF3));
+		_EmitRegReg({ 0x0F, 0x2C }, f64Cvt, reg, xmmSrc);
+		if (typeDst == value_type::i32 && !fSigned)
+		{
+			// mov reg32, reg32
+			_EmitRegReg({ 0x89 }, false, reg, reg);
+		}
+		_PushReg(reg);
+		return;
+	}
+
+	if (fSrcInt)
+	{
+		// int -> float into a zeroed register so an f32 keeps its upper bits clear
+		//	xorps xmm, xmm
+		//	cvtsi2ss/cvtsi2sd xmm, reg32	(signed i32)
+		//	cvtsi2ss/cvtsi2sd xmm, reg		(i64, or unsigned i32 since the upper half is zero)
+		Reg regSrc = _PopReg();
+		Reg reg = _AllocXmm();
+		_EmitRegReg({ 0x0F, 0x57 }, false, _XmmOf(reg), _XmmOf(reg));
+		SafePushCode(uint8_t(typeDst == value_type::f64 ? 0xF2 : 0xF3));
+		_EmitRegReg({ 0x0F, 0x2A }, typeSrc == value_type::i64 || !fSigned, _XmmOf(reg), regSrc);
+		_PushReg(reg);
+		return;
 	}
 
-	if (fSwap)
+	_EnsureCached(1, RegClass::Xmm);
+	Reg regSrc = _StackReg(0);
+	if (typeDst == value_type::f64)
 	{
-		// movq xmm0, rax
-		// movq xmm1, [rdi]
-		static const uint8_t rgcodeMov[] = { 0x66, 0x48, 0x0F, 0x6E, 0xC0, 0xF3, 0x0F, 0x7E, 0x0F };
-		SafePushCode(rgcodeMov);
+		// cvtss2sd xmm, xmm
+		Verify(typeSrc == value_type::f32);
+		SafePushCode(uint8_t(0xF3));
+		_EmitRegReg({ 0x0F, 0x5A }, false, _XmmOf(regSrc), _XmmOf(regSrc));
 	}
 	else
 	{
-		// movq xmm1, rax		; second operand
-		// movq xmm0, [rdi]		; first operand
-		static const uint8_t rgcodeMov[] = { 0x66, 0x48, 0x0F, 0x6E, 0xC8, 0xF3, 0x0F, 0x7E, 0x07 };
-		SafePushCode(rgcodeMov);
+		// xorps xmmNew, xmmNew
+		// cvtsd2ss xmmNew, xmm
+		Verify(typeDst == value_type::f32 && typeSrc == value_type::f64);
+		m_maskRegsLocked |= RegMask(regSrc);
+		Reg reg = _AllocXmm();
+		m_maskRegsLocked &= ~RegMask(regSrc);
+		_EmitRegReg({ 0x0F, 0x57 }, false, _XmmOf(reg), _XmmOf(reg));
+		SafePushCode(uint8_t(0xF2));
+		_EmitRegReg({ 0x0F, 0x5A }, false, _XmmOf(reg), _XmmOf(regSrc));
+		_ReplaceTop(reg);
 	}
+}
 
-	uint8_t cmpsdImm;
-	switch (type)
+void JitWriter::FloatCompare(CompareType type, bool fDouble)
+{
+	_EnsureCached(2, RegClass::Xmm);
+	Xmm xmmSecond = _XmmOf(_PopReg(RegClass::Xmm));
+	Xmm xmmFirst = _XmmOf(_PopReg(RegClass::Xmm));
+	auto EmitUcomis = [&](Xmm xmmA, Xmm xmmB)
 	{
-	default:
-		Verify(false);
+		// ucomiss/ucomisd xmmA, xmmB	; unordered sets ZF, PF and CF so A and AE are false for NaNs
+		if (fDouble)
+			SafePushCode(uint8_t(0x66));
+		_EmitRegReg({ 0x0F, 0x2E }, false, xmmA, xmmB);
+	};
 
+	switch (type)
+	{
 	case CompareType::LessThan:
+		EmitUcomis(xmmSecond, xmmFirst);
+		m_ccPending = 0x7;	// A
+		return;
+	case CompareType::LessThanEqual:
+		EmitUcomis(xmmSecond, xmmFirst);
+		m_ccPending = 0x3;	// AE
+		return;
 	case CompareType::GreaterThan:
-		cmpsdImm = 1;
+		EmitUcomis(xmmFirst, xmmSecond);
+		m_ccPending = 0x7;	// A
+		return;
+	case CompareType::GreaterThanEqual:
+		EmitUcomis(xmmFirst, xmmSecond);
+		m_ccPending = 0x3;	// AE
+		return;
+	default:
 		break;
+	}
 
-	case CompareType::LessThanEqual:
-	case CompareType::GreaterThanEqual:
-		cmpsdImm = 2;
+	// (In)equality also depends on PF so it doesn't fit a single condition code, cmpss produces it as a mask
+	//	cmpeqss/cmpneqss xmmFirst, xmmSecond
+	//	movd reg32, xmmFirst
+	//	and reg32, 1
+	Verify(type == CompareType::Equal || type == CompareType::NotEqual);
+	SafePushCode(uint8_t(fDouble ? 0xF2 : 0xF3));
+	_EmitRegReg({ 0x0F, 0xC2 }, false, xmmFirst, xmmSecond);
+	SafePushCode(uint8_t(type == CompareType::Equal ? 0 : 4));
+	Reg reg = _AllocReg();
+	_MovXmmToGpr(reg, xmmFirst, false);
+	_EmitRegReg({ 0x83 }, false, 4, reg);
+	SafePushCode(uint8_t(1));
+	_PushReg(reg);
+}
+
+void JitWriter::FloatUnary(UnaryOperation op, bool fDouble)
+{
+	_EnsureCached(1, RegClass::Xmm);
+	Xmm xmm = _XmmOf(_StackReg(0));
+	switch (op)
+	{
+	case UnaryOperation::Neg:
+	case UnaryOperation::Abs:
+	{
+		// The sign bit is the most significant in IEEE float format, the mask is built in xmm0
+		//	pcmpeqd xmm0, xmm0
+		//	psllq xmm0, 63			; neg: 1 << 63
+		//	psrlq xmm0, 32			; neg f32: 1 << 31
+		//	psrlq xmm0, 1 / 33		; abs: everything below the sign
+		//	xorps/andps xmm, xmm0
+		static const uint8_t rgcodeOnes[] = { 0x66, 0x0F, 0x76, 0xC0 };
+		SafePushCode(rgcodeOnes);
+		auto EmitShift = [&](uint8_t opext, uint8_t cshift)
+		{
+			SafePushCode(uint8_t(0x66));
+			_EmitRegReg({ 0x0F, 0x73 }, false, opext, xmm0);
+			SafePushCode(cshift);
+		};
+		if (op == UnaryOperation::Neg)
+		{
+			EmitShift(6, 63);
+			if (!fDouble)
+				EmitShift(2, 32);
+			_EmitRegReg({ 0x0F, 0x57 }, false, xmm, xmm0);
+		}
+		else
+		{
+			EmitShift(2, fDouble ? 1 : 33);
+			_EmitRegReg({ 0x0F, 0x54 }, false, xmm, xmm0);
+		}
 		break;
+	}
 
-	case CompareType::Equal:
-		cmpsdImm = 0;
+	case UnaryOperation::Sqrt:
+		// sqrtss/sqrtsd xmm, xmm
+		SafePushCode(uint8_t(fDouble ? 0xF2 : 0xF3));
+		_EmitRegReg({ 0x0F, 0x51 }, false, xmm, xmm);
 		break;
 
-	case CompareType::NotEqual:
-		cmpsdImm = 4;
+	default:
+	{
+		if (!FCpuHasSse41())
+		{
+			_FloatRoundSse2(op, fDouble);
+			break;
+		}
+		// roundss/roundsd xmm, xmm, mode		(SSE4.1, the mode doesn't raise precision exceptions)
+		uint8_t mode = 0;
+		switch (op)
+		{
+		case UnaryOperation::Nearest:
+			mode = 0x8;	// to nearest even
+			break;
+		case UnaryOperation::Floor:
+			mode = 0x9;
+			break;
+		case UnaryOperation::Ceil:
+			mode = 0xA;
+			break;
+		case UnaryOperation::Trunc:
+			mode = 0xB;
+			break;
+		default:
+			Verify(false);
+		}
+		SafePushCode(uint8_t(0x66));
+		_EmitRegReg({ 0x0F, 0x3A, uint8_t(fDouble ? 0x0B : 0x0A) }, false, xmm, xmm);
+		SafePushCode(mode);
 		break;
 	}
-	// sub rdi, 8			; fixup stack for the op we just loaded
-	// cmpsd xmm0, xmm1, imm8
-	static const uint8_t rgcodeCmpss[] = { 0x48, 0x83, 0xEF, 0x08, 0xF2, 0x0F, 0xC2, 0xC1 };
-	SafePushCode(rgcodeCmpss);
-	SafePushCode(uint8_t(cmpsdImm));
-
-	// movd eax, xmm0
-	// and eax, 1
-	static const uint8_t rgcodeReduceFlag[] = { 0x66, 0x0F, 0x7E, 0xC0, 0x83, 0xE0, 0x01 };
-	SafePushCode(rgcodeReduceFlag);
+	}
 }
 
-void JitWriter::FloatNeg(bool f64)
+void JitWriter::_FloatRoundSse2(UnaryOperation op, bool fDouble)
 {
-	// the sign bit is the most significant in IEEE float format
-	if (f64)
-	{
-		// mov rcx, 0x8000000000000000
-		// xor rax, rcx
-		static const uint8_t rgcode[] = { 0x48, 0xB9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x48, 0x31, 0xC8 };
-		SafePushCode(rgcode);
-	}
-	else
+	// Without roundss/roundsd the value goes through a 64-bit integer, which holds anything that can still have a
+	//	fraction.  The conversion only fails (0x8000000000000000) for NaN and values that are integers already.
+	//		cvttsd2si reg, xmm			; cvtsd2si for nearest, the rounding mode is to nearest even
+	//		cmp reg, 1					; overflows only for 0x8000000000000000
+	//		jo LKeep
+	//		cvtsi2sd xmm0, reg
+	//		mov reg, 1.0				; floor and ceil step back when the truncation went the wrong way
+	//		movq xmm1, reg
+	//		ucomisd xmm0, xmm			; ucomisd xmm, xmm0 for ceil
+	//		jbe LSign
+	//		subsd xmm0, xmm1			; addsd for ceil
+	//	LSign:
+	//		mov reg, 1 << 63			; the result has the sign of the operand, -0.5 truncates to -0
+	//		movq xmm1, reg
+	//		andps xmm1, xmm
+	//		orps xmm0, xmm1
+	//		movsd xmm, xmm0
+	//		jmp LDone
+	//	LKeep:
+	//		xorps xmm1, xmm1
+	//		addsd xmm, xmm1				; quiets a signaling NaN, integers stay as they are
+	//	LDone:
+	Xmm xmm = _XmmOf(_StackReg(0));
+	Reg reg = _AllocReg();
+	uint8_t prefix = fDouble ? 0xF2 : 0xF3;
+	SafePushCode(prefix);
+	_EmitRegReg({ 0x0F, uint8_t(op == UnaryOperation::Nearest ? 0x2D : 0x2C) }, true, reg, xmm);
+	_EmitAluImm(7, true, reg, 1);
+	static const uint8_t rgcodeJo[] = { 0x70, 0x00 };
+	SafePushCode(rgcodeJo);
+	uint8_t *pbJoKeep = m_pexecPlaneCur;
+	SafePushCode(prefix);
+	_EmitRegReg({ 0x0F, 0x2A }, true, xmm0, reg);
+	if (op == UnaryOperation::Floor || op == UnaryOperation::Ceil)
 	{
-		// mov ecx, 0x80000000
-		// xor eax, ecx
-		static const uint8_t rgcode[] = { 0xB9, 0x00, 0x00, 0x00, 0x80, 0x31, 0xC8 };
-		SafePushCode(rgcode);
+		_MovRegImm(reg, fDouble ? 0x3FF0000000000000 : 0x3F800000);
+		_MovGprToXmm(xmm1, reg, fDouble);
+		if (fDouble)
+			SafePushCode(uint8_t(0x66));
+		if (op == UnaryOperation::Floor)
+			_EmitRegReg({ 0x0F, 0x2E }, false, xmm0, xmm);
+		else
+			_EmitRegReg({ 0x0F, 0x2E }, false, xmm, xmm0);
+		static const uint8_t rgcodeJbe[] = { 0x76, 0x00 };
+		SafePushCode(rgcodeJbe);
+		uint8_t *pbJbeSign = m_pexecPlaneCur;
+		SafePushCode(prefix);
+		_EmitRegReg({ 0x0F, uint8_t(op == UnaryOperation::Floor ? 0x5C : 0x58) }, false, xmm0, xmm1);
+		*_PWritable(pbJbeSign - 1) = numeric_cast<uint8_t>(m_pexecPlaneCur - pbJbeSign);
 	}
+	_MovRegImm(reg, fDouble ? 0x8000000000000000 : 0x80000000);
+	_MovGprToXmm(xmm1, reg, fDouble);
+	_EmitRegReg({ 0x0F, 0x54 }, false, xmm1, xmm);
+	_EmitRegReg({ 0x0F, 0x56 }, false, xmm0, xmm1);
+	SafePushCode(prefix);
+	_EmitRegReg({ 0x0F, 0x10 }, false, xmm, xmm0);
+	static const uint8_t rgcodeJmp[] = { 0xEB, 0x00 };
+	SafePushCode(rgcodeJmp);
+	uint8_t *pbJmpDone = m_pexecPlaneCur;
+
+	*_PWritable(pbJoKeep - 1) = numeric_cast<uint8_t>(m_pexecPlaneCur - pbJoKeep);
+	_EmitRegReg({ 0x0F, 0x57 }, false, xmm1, xmm1);
+	SafePushCode(prefix);
+	_EmitRegReg({ 0x0F, 0x58 }, false, xmm, xmm1);
+	*_PWritable(pbJmpDone - 1) = numeric_cast<uint8_t>(m_pexecPlaneCur - pbJmpDone);
 }
 
-int32_t *JitWriter::JumpNIf(void *pvJmp)
+void JitWriter::FloatCopySign(bool f64)
 {
-	int32_t offset = -6;
-	// test rax, rax { 0x48, 0x85, 0xC0 }
-	static const uint8_t rgcodeTest[] = { 0x48, 0x85, 0xC0 };
-	SafePushCode(rgcodeTest, _countof(rgcodeTest));
-	_PopContractStack();		// does not affect flags
+	_EnsureCached(2, RegClass::Xmm);
+	Xmm xmmSign = _XmmOf(_PopReg(RegClass::Xmm));
+	Xmm xmmMagnitude = _XmmOf(_StackReg(0));
+	// pcmpeqd xmm0, xmm0
+	// psrlq xmm0, 1 / 33		; everything below the sign bit
+	// andps xmmMagnitude, xmm0
+	// andnps xmm0, xmmSign		; just the sign (an f32's upper half is zero)
+	// orps xmmMagnitude, xmm0
+	static const uint8_t rgcodeOnes[] = { 0x66, 0x0F, 0x76, 0xC0 };
+	SafePushCode(rgcodeOnes);
+	SafePushCode(uint8_t(0x66));
+	_EmitRegReg({ 0x0F, 0x73 }, false, 2, xmm0);
+	SafePushCode(uint8_t(f64 ? 1 : 33));
+	_EmitRegReg({ 0x0F, 0x54 }, false, xmmMagnitude, xmm0);
+	_EmitRegReg({ 0x0F, 0x55 }, false, xmm0, xmmSign);
+	_EmitRegReg({ 0x0F, 0x56 }, false, xmmMagnitude, xmm0);
+}
+
+void JitWriter::FloatMinMax(bool fMax, bool fDouble)
+{
+	_EnsureCached(2, RegClass::Xmm);
+	Xmm xmmSecond = _XmmOf(_PopReg(RegClass::Xmm));
+	Xmm xmmFirst = _XmmOf(_StackReg(0));
+	// minss/maxss return the second operand when either is NaN or both are zero, so doing it both ways and combining
+	//	the bits gets -0 for min(-0, +0) and +0 for max.  A NaN comes from an add so it stays canonical when it was.
+	//	movaps xmm0, xmmFirst
+	//	minss xmm0, xmmSecond
+	//	movaps xmm1, xmmSecond
+	//	minss xmm1, xmmFirst
+	//	orps xmm0, xmm1			; andps for max
+	//	movaps xmm1, xmmFirst
+	//	cmpunordss xmm1, xmmSecond	; all ones if either is NaN
+	//	addss xmmFirst, xmmSecond
+	//	andps xmmFirst, xmm1
+	//	andnps xmm1, xmm0
+	//	orps xmmFirst, xmm1
+	uint8_t prefix = fDouble ? 0xF2 : 0xF3;
+	uint8_t opSse = fMax ? 0x5F : 0x5D;
+	_EmitRegReg({ 0x0F, 0x28 }, false, xmm0, xmmFirst);
+	SafePushCode(prefix);
+	_EmitRegReg({ 0x0F, opSse }, false, xmm0, xmmSecond);
+	_EmitRegReg({ 0x0F, 0x28 }, false, xmm1, xmmSecond);
+	SafePushCode(prefix);
+	_EmitRegReg({ 0x0F, opSse }, false, xmm1, xmmFirst);
+	_EmitRegReg({ 0x0F, uint8_t(fMax ? 0x54 : 0x56) }, false, xmm0, xmm1);
+	_EmitRegReg({ 0x0F, 0x28 }, false, xmm1, xmmFirst);
+	SafePushCode(prefix);
+	_EmitRegReg({ 0x0F, 0xC2 }, false, xmm1, xmmSecond);
+	SafePushCode(uint8_t(3));
+	SafePushCode(prefix);
+	_EmitRegReg({ 0x0F, 0x58 }, false, xmmFirst, xmmSecond);
+	_EmitRegReg({ 0x0F, 0x54 }, false, xmmFirst, xmm1);
+	_EmitRegReg({ 0x0F, 0x55 }, false, xmm1, xmm0);
+	_EmitRegReg({ 0x0F, 0x56 }, false, xmmFirst, xmm1);
+}
 
+int32_t *JitWriter::JumpCc(uint8_t cc, void *pvJmp)
+{
+	int32_t offset = -6;
 	if (pvJmp != nullptr)
 	{
 		int64_t offset64 = reinterpret_cast<uint8_t*>(pvJmp) - (reinterpret_cast<uint8_t*>(m_pexecPlaneCur) + 6);
 		offset = static_cast<int32_t>(offset64);
 		Verify(offset64 == offset);
 	}
-	// JZ rel32	{ 0x0F, 0x84, REL32 }
-	static const uint8_t rgcodeJRel[] = { 0x0F, 0x84 };
+	// Jcc rel32	{ 0x0F, 0x80 | cc, REL32 }
+	const uint8_t rgcodeJRel[] = { 0x0F, uint8_t(0x80 | cc) };
 	SafePushCode(rgcodeJRel, _countof(rgcodeJRel));
 	int32_t *poffsetRet = (int32_t*)m_pexecPlaneCur;
 	SafePushCode(&offset, sizeof(offset));
@@ -820,7 +1646,7 @@ int32_t *JitWriter::JumpNIf(void *pvJmp)
 int32_t *JitWriter::Jump(void *pvJmp)
 {
 	int32_t offset = -5;
-	
+
 	if (pvJmp != nullptr)
 	{
 		int64_t offset64 = reinterpret_cast<uint8_t*>(pvJmp) - (reinterpret_cast<uint8_t*>(m_pexecPlaneCur) + 5);
@@ -835,407 +1661,718 @@ int32_t *JitWriter::Jump(void *pvJmp)
 	return poffsetRet;
 }
 
-void JitWriter::CallIfn(uint32_t ifn, uint32_t clocalsCaller, uint32_t cargsCallee, bool fReturnValue, bool fIndirect)
+void JitWriter::CallIfn(uint32_t ifn, const FunctionTypeEntry *ptypeCallee, bool fIndirect)
 {
-	// Stage 1: Push arguments
-	//	add	 rbx, (clocalsCaller * sizeof(uint64_t))
-	static const uint8_t rgcodeAllocLocals[] = { 0x48, 0x81, 0xC3 };
-	SafePushCode(rgcodeAllocLocals, _countof(rgcodeAllocLocals));
-	uint32_t cbLocals = (clocalsCaller * sizeof(uint64_t));
-	SafePushCode(&cbLocals, sizeof(cbLocals));
+	// Wasm callees pin their own locals, imports go through C which only preserves the general purpose registers
+	bool fImport = !fIndirect && ifn < m_pctxt->m_vecimports.size();
+	_SavePinnedLocals(fImport);
 
 	if (fIndirect)
 	{
-		// the top of stack is the function index
-		// back it up into rcx (mov rcx, rax)
-		static const uint8_t rgT[] = { 0x48, 0x89, 0xC1 };
-		SafePushCode(rgT);
-		_PopContractStack();
+		// the top of stack is the function index, keep it in rcx
+		_EnsureCached(1);
+		_MoveToReg(0, rcx);
+		_PopReg();
+		m_maskRegsLocked |= RegMask(rcx);
 	}
 
-	// pop arguments into the newly allocated local variable region
-	while (cargsCallee > 0)
-	{
-		SetLocal(cargsCallee - 1, true);
-		--cargsCallee;
-	}
-	
-	_PushExpandStack();	// put the top of the stack into RAM so we can recover it
-	//  push rdi		; backup the operand stack
-	static const uint8_t rgcode[] = { 0x57 };
-	SafePushCode(rgcode, _countof(rgcode));
+	// Stage 1: The arguments are the top of the operand stack.  Everything below the ones passed in registers goes to
+	//	memory, which pushes the stack arguments in order right where the callee expects them.
+	uint32_t cargs = ptypeCallee->cparams;
+	uint32_t cargsStack = _CargsStack(cargs);
+	size_t cargsInReg = cargs - cargsStack;
+	_EnsureCached(cargsInReg, RegClass::Any);
+	while (m_vecregStack.size() > cargsInReg)
+		_SpillBottom();
+	for (uint32_t iarg = cargsStack; iarg < cargs; ++iarg)
+		_MoveToReg(cargs - 1 - iarg, _RegArg(ptypeCallee->rgparam_type, cargs, iarg));
+	// the callee may use any scratch register, the ones holding arguments are its now
+	m_vecregStack.clear();
+	m_maskRegsUsed = 0;
+	m_maskRegsLocked = 0;
 
 	if (fIndirect)
 	{
 		// ifn is the type in this case
-		// mov eax, ifn
-		SafePushCode(uint8_t(0xB8));
-		SafePushCode(uint32_t(ifn));
-
-		// call [m_pfnCallIndirectShim]
-		static const uint8_t rgcodeCallIndirect[] = { uint8_t(0xFF), uint8_t(0x15) };
-		SafePushCode(rgcodeCallIndirect);
-		ptrdiff_t diffFn = reinterpret_cast<ptrdiff_t>(m_pfnCallIndirectShim) - reinterpret_cast<ptrdiff_t>(m_pexecPlaneCur + 4);
-		Verify(static_cast<int32_t>(diffFn) == diffFn);
-		SafePushCode(int32_t(diffFn));
+		CallIndirect(ifn);
 	}
 	else
 	{
+		// Stage 2, call the actual function
 		if (ifn < m_pctxt->m_vecimports.size())
 		{
 			// mov ecx ifn ; so we know the function
 			static const uint8_t rgcodeFnNum[] = { 0xB9 };
 			SafePushCode(rgcodeFnNum);
 			SafePushCode(ifn);
-		}
 
-		// Stage 2, call the actual function
-		// call [rip - PfnVector]
-		static const uint8_t rgcodeCall[] = { 0xFF, 0x15 };
-		int32_t offset = RelAddrPfnVector(ifn, 6);
-		SafePushCode(rgcodeCall, _countof(rgcodeCall));
-		SafePushCode(&offset, sizeof(offset));
+			// call [rip - PfnVector]
+			static const uint8_t rgcodeCall[] = { 0xFF, 0x15 };
+			int32_t offset = RelAddrPfnVector(ifn, 6);
+			SafePushCode(rgcodeCall, _countof(rgcodeCall));
+			SafePushCode(&offset, sizeof(offset));
+		}
+		else
+		{
+			_EmitCallFn(ifn);
+		}
 	}
 
-	// Stage 3, on return cleanup the stack
-	//	pop rdi
-	//	sub rbx, (clocalsCaller * sizeof(uint64_t))
-	static const uint8_t rgcodeCleanup[] = { 0x5F, 0x48, 0x81, 0xEB };
-	SafePushCode(rgcodeCleanup, _countof(rgcodeCleanup));
-	SafePushCode(&cbLocals, sizeof(cbLocals));
+	// Stage 3, on return pop the stack arguments
+	//	lea rsp, [rsp + 8*cargsStack]
+	_ReleaseStack(_DispStack(int32_t(cargsStack)));
+	m_cstackMem -= int32_t(cargsStack);
+	_RestorePinnedLocals(fImport);
 
-	// Stage 4, if there was no return value then place our last operand back in rax
-	if (!fReturnValue)
-	{
-		_PopContractStack();
-	}
+	// Stage 4, the return value is the new top of the stack
+	if (ptypeCallee->fHasReturnValue)
+		_PushReg(_RegResult(ptypeCallee->return_type));
 }
 
-void JitWriter::FnPrologue(uint32_t clocals, uint32_t cargs)
+void JitWriter::_EmitStackCheck()
 {
-	// memset local variables to zero
-	// ZeroMemory(rbx + (cargs * sizeof(uint64_t)), (clocals - cargs) * sizeof(uint64_t))
-	uint32_t clocalsNoArgs = clocals - cargs;
+	//		cmp rsp, [rbx + stackLimit]
+	//		jae LContinue
+	//		call [m_pfnStackOverflowTrap]
+	//	LContinue:
+	_EmitRegMem({ 0x3B }, true, rsp, rbx, int32_t(offsetof(ExecutionControlBlock, stackLimit)));
+	static const uint8_t rgcodeJae[] = { 0x73, 0x06 };
+	SafePushCode(rgcodeJae);
+	_EmitRegRip({ 0xFF }, false, 2, m_pfnStackOverflowTrap);
+}
+
+void JitWriter::_EmitFramePointer()
+{
+	// Debuggers and profilers walk wasm frames through the rbp chain, the frames have no unwind info
+	//	push rbp
+	//	mov rbp, rsp
+	static const uint8_t rgcode[] = { 0x55, 0x48, 0x89, 0xE5 };
+	SafePushCode(rgcode);
+}
 
+void JitWriter::FnPrologue(uint32_t ifn, const std::vector<value_type> &vectypeLocal, uint32_t cargs)
+{
+	if (m_pctxt->m_opts.fOptimizingTier)
+		_EmitTierUpCounter(ifn);	// must be first, _SetFnEntry patches it
+	_EmitFramePointer();
+	// Runaway recursion stops here while there is still stack left for the C code wasm calls into
+	_EmitStackCheck();
+
+	// The caller pushed the stack arguments, push the register ones and then the rest of the locals zeroed.  Pinned
+	//	arguments are taken straight from their registers.
+	uint32_t clocals = numeric_cast<uint32_t>(vectypeLocal.size());
+	uint32_t cargsStack = _CargsStack(cargs);
+	m_cparamsFn = cargs;
+	m_clocalsFn = clocals;
+	for (uint32_t iarg = cargsStack; iarg < cargs; ++iarg)
+		_PushEntry(_RegArg(vectypeLocal.data(), cargs, iarg));
+	for (auto &pairPin : m_vecpinnedLocals)
+	{
+		if (pairPin.first >= cargsStack && pairPin.first < cargs)
+			_MoveEntry(pairPin.second, _RegArg(vectypeLocal.data(), cargs, pairPin.first));
+	}
+	uint32_t clocalsNoArgs = clocals - cargs;
 	if (clocalsNoArgs > 0)
 	{
-		// xor eax, eax						; rax is clobbered so no need to save it
-		// mov rdx, rdi						; backup rdi
-		// lea rdi, [rbx + localOffset]
-		// mov rcx, (clocals - cargs)
-		// rep stos qword ptr [rdi]
-		// mov rdi, rdx
-
-		static const uint8_t rgcodeXorEax[] = { 0x31, 0xC0, 0x48, 0x89, 0xFA };	// xor eax, eax  mov rdx, rdi
+		// xor eax, eax						; the arguments in registers are saved already
+		static const uint8_t rgcodeXorEax[] = { 0x31, 0xC0 };
 		SafePushCode(rgcodeXorEax);
+		if (clocalsNoArgs <= clocalsZeroUnroll)
+		{
+			// push rax ...
+			for (uint32_t ilocal = 0; ilocal < clocalsNoArgs; ++ilocal)
+				SafePushCode(uint8_t(0x50));
+		}
+		else
+		{
+			//		mov ecx, (clocals - cargs)
+			//	LZero:
+			//		push rax
+			//		dec ecx
+			//		jnz LZero
+			SafePushCode(uint8_t(0xB9));
+			SafePushCode(clocalsNoArgs);
+			static const uint8_t rgcodeLoop[] = { 0x50, 0xFF, 0xC9, 0x75, 0xFB };
+			SafePushCode(rgcodeLoop);
+		}
+	}
+	m_maskRegsLocked = 0;
+	_ResetStack(0, false /*fTopInRax*/);
 
-		static const uint8_t rgcodeLeaRdx[] = { 0x48, 0x8D, 0xBB };	// lea rdi, [rbx + XYZ]
-		int32_t cbOffset = (cargs * sizeof(uint64_t));
-		SafePushCode(rgcodeLeaRdx, _countof(rgcodeLeaRdx));
-		SafePushCode(&cbOffset, sizeof(cbOffset));
-
-		static const uint8_t rgcodeMovRcx[] = { 0x48, 0xC7, 0xC1 };	// mov rcx, XYZ
-		SafePushCode(rgcodeMovRcx, _countof(rgcodeMovRcx));
-
-		SafePushCode(&clocalsNoArgs, sizeof(clocalsNoArgs));
-
-		static const uint8_t rgcodeRepStos[] = { 0xF3, 0x48, 0xAB };	// rep stos qword ptr [rdx]
-		SafePushCode(rgcodeRepStos, _countof(rgcodeRepStos));
-
-		static const uint8_t rgcodeRestoreRdi[] = { 0x48, 0x89, 0xD7 };
-		SafePushCode(rgcodeRestoreRdi);
+	for (auto &pairPin : m_vecpinnedLocals)
+	{
+		if (pairPin.first < cargsStack)
+		{
+			// mov reg, [rsp + local]
+			_LoadEntry(pairPin.second, rsp, _DispLocalFromRsp(pairPin.first));
+		}
+		else if (pairPin.first < cargs)
+		{
+			continue;	// already moved
+		}
+		else if (_FXmm(pairPin.second))
+		{
+			// xorps xmm, xmm
+			_EmitRegReg({ 0x0F, 0x57 }, false, _XmmOf(pairPin.second), _XmmOf(pairPin.second));
+		}
+		else
+		{
+			// xor reg32, reg32
+			_EmitRegReg({ 0x31 }, false, pairPin.second, pairPin.second);
+		}
 	}
-	_PushExpandStack();
-	// push rdi
-	SafePushCode(uint8_t(0x57));
 }
 
 void JitWriter::LogicOp(LogicOperation op)
 {
-	bool fSwapParams = false;
-	switch (op)
-	{
-	case LogicOperation::ShiftLeft:
-	case LogicOperation::ShiftRight:
-	case LogicOperation::ShiftRightUnsigned:
-	case LogicOperation::RotateLeft:
-	case LogicOperation::RotateRight:
-		fSwapParams = true;
-	}
-	_PopSecondParam(fSwapParams);
-	const char *rgcode = nullptr;
 	switch (op)
 	{
 	case LogicOperation::And:
-		// and eax, ecx
-		rgcode = "\x21\xC8";
-		break;
+		// and reg32, reg32
+		BinaryOp({ 0x21 }, false);
+		return;
 	case LogicOperation::Or:
-		// or eax, ecx
-		rgcode = "\x09\xC8";
-		break;
+		// or reg32, reg32
+		BinaryOp({ 0x09 }, false);
+		return;
 	case LogicOperation::Xor:
-		// xor eax, ecx
-		rgcode = "\x31\xC8";
+		// xor reg32, reg32
+		BinaryOp({ 0x31 }, false);
+		return;
+	default:
 		break;
+	}
+
+	uint8_t opext = 0xFF;
+	switch (op)
+	{
 	case LogicOperation::ShiftLeft:
-		// shl eax, cl
-		rgcode = "\xD3\xE0";
+		// shl reg32, cl
+		opext = 4;
 		break;
 	case LogicOperation::ShiftRight:
-		// sar eax, cl
-		rgcode = "\xD3\xF8";
+		// sar reg32, cl
+		opext = 7;
 		break;
 	case LogicOperation::ShiftRightUnsigned:
-		// shr eax, cl
-		rgcode = "\xD3\xE8";
+		// shr reg32, cl
+		opext = 5;
 		break;
 	case LogicOperation::RotateLeft:
-		// rol eax, cl
-		rgcode = "\xD3\xC0";
+		// rol reg32, cl
+		opext = 0;
 		break;
 	case LogicOperation::RotateRight:
-		// ror eax, cl
-		rgcode = "\xD3\xC8";
+		// ror reg32, cl
+		opext = 1;
 		break;
 
 	default:
 		Verify(false);
 	}
-	SafePushCode(rgcode, strlen(rgcode));
+
+	int32_t imm;
+	if (_FPopImm32(false, &imm))
+	{
+		// op reg32, imm8
+		_EnsureCached(1);
+		_EmitRegReg({ 0xC1 }, false, opext, _StackReg(0));
+		SafePushCode(uint8_t(imm & 31));
+		return;
+	}
+
+	// Shifts need their count in cl
+	_EnsureCached(2);
+	_MoveToReg(0, rcx);
+	_PopReg();
+	_EmitRegReg({ 0xD3 }, false, opext, _StackReg(0));
 }
 
 void JitWriter::LogicOp64(LogicOperation op)
 {
-	bool fSwapParams = false;
-	switch (op)
-	{
-	case LogicOperation::ShiftLeft:
-	case LogicOperation::ShiftRight:
-	case LogicOperation::ShiftRightUnsigned:
-	case LogicOperation::RotateLeft:
-	case LogicOperation::RotateRight:
-		fSwapParams = true;
-	}
-	_PopSecondParam(fSwapParams);
-	const char *rgcode = nullptr;
 	switch (op)
 	{
 	case LogicOperation::And:
-		// and rax, rcx
-		rgcode = "\x48\x21\xC8";
-		break;
+		// and reg, reg
+		BinaryOp({ 0x21 }, true);
+		return;
 	case LogicOperation::Or:
-		// or rax, rcx
-		rgcode = "\x48\x09\xC8";
-		break;
+		// or reg, reg
+		BinaryOp({ 0x09 }, true);
+		return;
 	case LogicOperation::Xor:
-		// xor rax, rcx
-		rgcode = "\x48\x31\xC8";
+		// xor reg, reg
+		BinaryOp({ 0x31 }, true);
+		return;
+	default:
 		break;
+	}
+
+	uint8_t opext = 0xFF;
+	switch (op)
+	{
 	case LogicOperation::ShiftLeft:
-		// shl rax, cl
-		rgcode = "\x48\xD3\xE0";
+		// shl reg, cl
+		opext = 4;
 		break;
 	case LogicOperation::ShiftRight:
-		// sar rax, cl
-		rgcode = "\x48\xD3\xF8";
+		// sar reg, cl
+		opext = 7;
 		break;
 	case LogicOperation::ShiftRightUnsigned:
-		// shr rax, cl
-		rgcode = "\x48\xD3\xE8";
+		// shr reg, cl
+		opext = 5;
 		break;
 	case LogicOperation::RotateLeft:
-		rgcode = "\x48\xD3\xC0";
+		// rol reg, cl
+		opext = 0;
 		break;
 	case LogicOperation::RotateRight:
-		rgcode = "\x48\xD3\xC8";
+		// ror reg, cl
+		opext = 1;
 		break;
 	default:
 		Verify(false);
 	}
-	SafePushCode(rgcode, strlen(rgcode));
+
+	if (m_fConstPending)
+	{
+		// op reg, imm8	; only the low 6 bits of the count matter so any constant fits
+		m_fConstPending = false;
+		_EnsureCached(1);
+		_EmitRegReg({ 0xC1 }, true, opext, _StackReg(0));
+		SafePushCode(uint8_t(m_cPending & 63));
+		return;
+	}
+
+	// Shifts need their count in cl
+	_EnsureCached(2);
+	_MoveToReg(0, rcx);
+	_PopReg();
+	_EmitRegReg({ 0xD3 }, true, opext, _StackReg(0));
 }
 
 void JitWriter::Select()
 {
-	//	sub rdi, 16			; pop 2 vals from stack
-	//	xor rcx, rcx		; zero our index
-	//	test eax, eax		; test the conditional
-	//	jnz FirstArg		; jump if index should be zero
-	//	add rcx, 8			; else index should be 8 (bytes)
-	// FirstArg:
-	//	mov rax, [rdi+rcx]	; load the value
-	static const uint8_t rgcode[] = { 0x48, 0x83, 0xEF, 0x10, 0x48, 0x31, 0xC9, 0x85, 0xC0, 0x75, 0x04, 0x48, 0x83, 0xC1, 0x08, 0x48, 0x8B, 0x04, 0x0F };
-	SafePushCode(rgcode, _countof(rgcode));
+	// Values that are already in xmm registers are floats and are picked there, anything else goes through cmov
+	size_t ientryFirst = (m_ccPending != ccNone) ? 1 : 2;
+	if (m_vecregStack.size() > ientryFirst && (_FXmm(_StackReg(ientryFirst)) || _FXmm(_StackReg(ientryFirst - 1))))
+	{
+		_MaterializeCondition();
+		_EnsureCached(3, RegClass::Any);
+		_EnsureClass(0, RegClass::Gpr);
+		_EnsureClass(1, RegClass::Xmm);
+		_EnsureClass(2, RegClass::Xmm);
+		Reg regCond = _PopReg();
+		Xmm xmmSecond = _XmmOf(_PopReg(RegClass::Xmm));
+		Xmm xmmFirst = _XmmOf(_StackReg(0));
+		//	cmp regCond32, 1
+		//	sbb regCond, regCond		; all ones if the condition is zero
+		//	movq xmm0, regCond
+		//	xorps xmmSecond, xmmFirst
+		//	andps xmmSecond, xmm0
+		//	xorps xmmFirst, xmmSecond	; xmmSecond where the mask is set
+		_EmitRegReg({ 0x83 }, false, 7, regCond);
+		SafePushCode(uint8_t(1));
+		_EmitRegReg({ 0x19 }, true, regCond, regCond);
+		_MovGprToXmm(xmm0, regCond, true /*f64*/);
+		_EmitRegReg({ 0x0F, 0x57 }, false, xmmSecond, xmmFirst);
+		_EmitRegReg({ 0x0F, 0x54 }, false, xmmSecond, xmm0);
+		_EmitRegReg({ 0x0F, 0x57 }, false, xmmFirst, xmmSecond);
+		return;
+	}
+	if (m_ccPending != ccNone)
+	{
+		// The condition is still in the flags so pick the value without a branch
+		uint8_t cc = _PopCondition();
+		_EnsureCached(2);	// does not affect flags
+		Reg regSecond = _PopReg();
+		Reg regFirst = _StackReg(0);
+		//	cmovncc regFirst, regSecond
+		_EmitRegReg({ 0x0F, uint8_t(0x40 | (cc ^ 1)) }, true, regFirst, regSecond);
+		return;
+	}
+	_EnsureCached(3);
+	Reg regCond = _PopReg();
+	Reg regSecond = _PopReg();
+	Reg regFirst = _StackReg(0);
+	//	test regCond32, regCond32
+	//	cmovz regFirst, regSecond
+	_EmitRegReg({ 0x85 }, false, regCond, regCond);
+	_EmitRegReg({ 0x0F, 0x44 }, true, regFirst, regSecond);
+}
+
+void JitWriter::CallIndirect(uint32_t itype)
+{
+	// The table index is in rcx.  The first call through the site caches its target, after that a matching index
+	//	calls it directly and anything else does the full lookup.
+	//	LSite:
+	//		cmp ecx, idxCached				; -1 until filled
+	//		jne LLookup
+	//		nop
+	//		call rel32						; target of idxCached, LTrap until filled
+	//		jmp LDone
+	//	LLookup:
+	//		jmp LFill						; becomes a 2 byte nop once the cache was filled
+	//		cmp ecx, cindirect
+	//		jae LTrap
+	//		shl ecx, 4
+	//		lea rdx, [m_rgindirect]
+	//		add rdx, rcx
+	//		cmp dword ptr [rdx], itype		; IndirectEntry::itype
+	//		jne LTrap
+	//		mov ecx, [rdx + 4]				; IndirectEntry::ifn for imports and lazy compilation
+	//		call [rdx + 8]					; IndirectEntry::pfn
+	//		jmp LDone
+	//	LFill:
+	//		mov edx, itype
+	//		lea r8, [LSite]
+	//		call [m_pfnIndirectCacheShim]
+	//		jmp LSite
+	//	LTrap:
+	//		call [m_pfnIndirectCallTrap]
+	//	LDone:
+	// The offsets patched by FillIndirectCache must stay in sync with this
+	while ((reinterpret_cast<uintptr_t>(m_pexecPlaneCur) & 3) != 2)
+		SafePushCode(uint8_t(0x90));
+	uint8_t *pbSite = m_pexecPlaneCur;
+	static const uint8_t rgcodeCheckCache[] = { 0x81, 0xF9, 0xFF, 0xFF, 0xFF, 0xFF, 0x75, 0x00, 0x90, 0xE8 };
+	SafePushCode(rgcodeCheckCache);
+	int32_t *prel32Cached = reinterpret_cast<int32_t*>(m_pexecPlaneCur);
+	SafePushCode(int32_t(0));
+	static const uint8_t rgcodeJmp8[] = { 0xEB, 0x00 };
+	SafePushCode(rgcodeJmp8);
+	uint8_t *pbJmpDoneHit = m_pexecPlaneCur;
+
+	uint8_t *pbLookup = m_pexecPlaneCur;
+	Verify(pbLookup == pbSite + 16);
+	SafePushCode(rgcodeJmp8);
+	uint8_t *pbJmpFill = m_pexecPlaneCur;
+	static const uint8_t rgcodeCmpCount[] = { 0x81, 0xF9 };
+	SafePushCode(rgcodeCmpCount);
+	SafePushCode(m_cindirect);
+	static const uint8_t rgcodeJae[] = { 0x73, 0x00 };
+	SafePushCode(rgcodeJae);
+	uint8_t *pbJaeTrap = m_pexecPlaneCur;
+	static const uint8_t rgcodeShl[] = { 0xC1, 0xE1, 0x04 };
+	SafePushCode(rgcodeShl);
+	_EmitRegRip({ 0x8D }, true, rdx, m_rgindirect);
+	static const uint8_t rgcodeCheckType[] = { 0x48, 0x01, 0xCA, 0x81, 0x3A };
+	SafePushCode(rgcodeCheckType);
+	SafePushCode(itype);
+	static const uint8_t rgcodeJne[] = { 0x75, 0x00 };
+	SafePushCode(rgcodeJne);
+	uint8_t *pbJneTrap = m_pexecPlaneCur;
+	static const uint8_t rgcodeCall[] = { 0x8B, 0x4A, 0x04, 0xFF, 0x52, 0x08, 0xEB, 0x00 };
+	SafePushCode(rgcodeCall);
+	uint8_t *pbJmpDoneLookup = m_pexecPlaneCur;
+
+	*_PWritable(pbJmpFill - 1) = numeric_cast<uint8_t>(m_pexecPlaneCur - pbJmpFill);
+	SafePushCode(uint8_t(0xBA));
+	SafePushCode(itype);
+	_EmitRegRip({ 0x8D }, true, r8, pbSite);
+	_EmitRegRip({ 0xFF }, false, 2, m_pfnIndirectCacheShim);
+	SafePushCode(uint8_t(0xEB));
+	SafePushCode(numeric_cast<int8_t>(pbSite - (m_pexecPlaneCur + 1)));
+
+	*_PWritable(pbJaeTrap - 1) = numeric_cast<uint8_t>(m_pexecPlaneCur - pbJaeTrap);
+	*_PWritable(pbJneTrap - 1) = numeric_cast<uint8_t>(m_pexecPlaneCur - pbJneTrap);
+	*_PWritable(prel32Cached) = numeric_cast<int32_t>(m_pexecPlaneCur - reinterpret_cast<uint8_t*>(prel32Cached + 1));
+	_EmitRegRip({ 0xFF }, false, 2, m_pfnIndirectCallTrap);
+
+	*_PWritable(pbSite + 7) = numeric_cast<uint8_t>(pbLookup - (pbSite + 8));
+	*_PWritable(pbJmpDoneHit - 1) = numeric_cast<uint8_t>(m_pexecPlaneCur - pbJmpDoneHit);
+	*_PWritable(pbJmpDoneLookup - 1) = numeric_cast<uint8_t>(m_pexecPlaneCur - pbJmpDoneLookup);
+}
+
+void JitWriter::FillIndirectCache(uint8_t *pbSite, uint32_t idx, uint32_t itype)
+{
+	std::lock_guard<std::mutex> lock(m_mutexCompile);
+	// Only the first call through a site fills it, later misses do the lookup.  The target is written before the
+	//	index so a thread seeing the index also sees the target.
+	uint8_t *pbJmpFill = pbSite + 16;
+	if (*pbJmpFill != 0xEB)
+		return;	// another thread got here first
+	Verify(pbSite[0] == 0x81 && pbSite[9] == 0xE8);
+	if (idx < m_cindirect && m_rgindirect[idx].itype == itype && m_rgindirect[idx].ifn >= m_pctxt->m_vecimports.size())
+	{
+		// Imports need ecx to hold the function index, they always take the lookup
+		uint32_t ifn = m_rgindirect[idx].ifn;
+		uint8_t *pbTarget = reinterpret_cast<uint8_t**>(m_pexecPlane)[ifn];
+		if (pbTarget == nullptr)
+			pbTarget = _PbStub(ifn);
+		reinterpret_cast<std::atomic<int32_t>*>(_PWritable(pbSite + 10))->store(numeric_cast<int32_t>(pbTarget - (pbSite + 14)), std::memory_order_release);
+		reinterpret_cast<std::atomic<uint32_t>*>(_PWritable(pbSite + 2))->store(idx, std::memory_order_release);
+	}
+	reinterpret_cast<std::atomic<uint16_t>*>(_PWritable(pbJmpFill))->store(0x9066, std::memory_order_release);	// 66 90 nop
 }
 
 void JitWriter::FnEpilogue(bool fRetVal)
 {
 	UNREFERENCED_PARAMETER(fRetVal);
-#if 0	// now that we push rdi in the prologue we don't need this
-	if (fRetVal)
+	// Pop whatever is left of the operand stack and the locals we pushed, the caller pops the stack arguments
+	//	leave
+	//	ret
+	static const uint8_t rgcode[] = { 0xC9, 0xC3 };
+	SafePushCode(rgcode, _countof(rgcode));
+}
+
+void JitWriter::_RecordCodeMap(uint32_t ifn, uint32_t ibBytecode)
+{
+	if (m_vecspinlined[ifn] != nullptr)
 	{
-		// sub rdi, 8
-		static const uint8_t rgcodeSub[] = { 0x48, 0x83, 0xEF, 0x08 };
-		SafePushCode(rgcodeSub);
+		// report the function the bytes were copied from
+		const std::vector<InlineMapEntry> &vecmap = m_vecspinlined[ifn]->vecmap;
+		auto itr = std::upper_bound(vecmap.begin(), vecmap.end(), ibBytecode, [](uint32_t ib, const InlineMapEntry &entry)
+		{
+			return ib < entry.ibInlined;
+		});
+		Verify(itr != vecmap.begin());
+		--itr;
+		ifn = itr->ifn;
+		ibBytecode = itr->ibBytecode + (ibBytecode - itr->ibInlined);
 	}
-#endif
-	// ret
-	static const uint8_t rgcode[] = { 0xC3 };
-	SafePushCode(rgcode, _countof(rgcode));
+	if (!m_veccodemap.empty() && m_veccodemap.back().pbCode == m_pexecPlaneCur)
+		m_veccodemap.pop_back();	// the previous opcode didn't generate any code
+	CodeMapEntry entry;
+	entry.pbCode = m_pexecPlaneCur;
+	entry.ifn = ifn;
+	entry.ibBytecode = ibBytecode;
+	m_veccodemap.push_back(entry);
+}
+
+bool JitWriter::FLookupBytecode(const void *pvCode, uint32_t *pifn, uint32_t *pibBytecode) const
+{
+	const uint8_t *pbCode = reinterpret_cast<const uint8_t*>(pvCode);
+	if (pbCode < m_pcodeStart || pbCode >= m_pexecPlaneCur)
+		return false;
+	auto itr = std::upper_bound(m_veccodemap.begin(), m_veccodemap.end(), pbCode, [](const uint8_t *pb, const CodeMapEntry &entry)
+	{
+		return pb < entry.pbCode;
+	});
+	if (itr == m_veccodemap.begin())
+		return false;
+	--itr;
+	*pifn = itr->ifn;
+	*pibBytecode = itr->ibBytecode;
+	return true;
 }
 
 void JitWriter::_SetDbgReg(uint32_t op)
 {
-	// mov r12, op
-	static const uint8_t rgcode[] = { 0x49, 0xC7, 0xC4 };
-	SafePushCode(rgcode, _countof(rgcode));
+	// mov dword ptr [rbx + ExecutionControlBlock::dbgOpcode], op	; r12 is used for locals so the stamp lives in the ECB
+	_EmitRegMem({ 0xC7 }, false, 0, rbx, int32_t(offsetof(ExecutionControlBlock, dbgOpcode)));
 	SafePushCode(&op, sizeof(op));
 }
 
 void JitWriter::Mul32()
 {
-	// mul dword ptr [rdi-8]		; note: clobbers edx
-	// sub rdi, 8
-	static const uint8_t rgcode[] = { 0xF7, 0x67, 0xF8, 0x48, 0x83, 0xEF, 0x08 };
-	SafePushCode(rgcode);
+	int32_t imm;
+	if (_FPopImm32(false, &imm))
+	{
+		_EnsureCached(1);
+		Reg reg = _StackReg(0);
+		// imul reg32, reg32, imm32
+		_EmitRegReg({ 0x69 }, false, reg, reg);
+		SafePushCode(imm);
+		return;
+	}
+	_EnsureCached(2);
+	Reg regSecond = _PopReg();
+	Reg regFirst = _StackReg(0);
+	// imul regFirst32, regSecond32		; the low half is the same for signed and unsigned
+	_EmitRegReg({ 0x0F, 0xAF }, false, regFirst, regSecond);
 }
 
 
 void JitWriter::Mul64()
 {
-	// mul qword ptr [rdi-8]		; note: clobbers rdx
-	// sub rdi, 8
-	static const uint8_t rgcode[] = { 0x48, 0xF7, 0x67, 0xF8, 0x48, 0x83, 0xEF, 0x08 };
-	SafePushCode(rgcode);
+	int32_t imm;
+	if (_FPopImm32(true, &imm))
+	{
+		_EnsureCached(1);
+		Reg reg = _StackReg(0);
+		// imul reg, reg, imm32
+		_EmitRegReg({ 0x69 }, true, reg, reg);
+		SafePushCode(imm);
+		return;
+	}
+	_EnsureCached(2);
+	Reg regSecond = _PopReg();
+	Reg regFirst = _StackReg(0);
+	// imul regFirst, regSecond
+	_EmitRegReg({ 0x0F, 0xAF }, true, regFirst, regSecond);
 }
 
-
-void JitWriter::BranchTableParse(const uint8_t **ppoperand, size_t *pcbOperand, const std::vector<std::pair<value_type, void*>> &stackBlockTypeAddr, std::vector<std::vector<int32_t*>> &stackVecFixups, std::vector<std::vector<void**>> &stackVecFixupsAbsolute)
+void JitWriter::BranchTableParse(const uint8_t **ppoperand, size_t *pcbOperand, const std::vector<Label> &stackLabel, std::vector<std::vector<int32_t*>> &stackVecFixups)
 {
 	uint32_t target_count = safe_read_buffer<varuint32>(ppoperand, pcbOperand);
-	std::vector<uint32_t> vectargets;
-	vectargets.reserve(target_count);
-	for (uint32_t itarget = 0; itarget < target_count; ++itarget)
+	std::vector<uint32_t> vectargets;	// the default target is last
+	vectargets.reserve(size_t(target_count) + 1);
+	for (uint32_t itarget = 0; itarget <= target_count; ++itarget)
 	{
 		vectargets.push_back(safe_read_buffer<varuint32>(ppoperand, pcbOperand));
 	}
-	uint32_t default_target = safe_read_buffer<varuint32>(ppoperand, pcbOperand);
 
-	auto &pairBlockDft = *(stackBlockTypeAddr.rbegin() + default_target);
-	bool fRetVal = (pairBlockDft.first != value_type::empty_block);
+	// Every distinct target collects the jumps that go to it
+	std::vector<uint32_t> vecdepthTarget;
+	std::vector<size_t> vecitarget;		// the target for each table entry
+	for (uint32_t depth : vectargets)
+	{
+		Verify(depth < stackLabel.size());
+		auto itdepth = std::find(vecdepthTarget.begin(), vecdepthTarget.end(), depth);
+		vecitarget.push_back(itdepth - vecdepthTarget.begin());
+		if (itdepth == vecdepthTarget.end())
+			vecdepthTarget.push_back(depth);
+	}
 
-	// Setup the parameters and call thr BranchTable helper
-	//	rcx - table pointer
-	//
-	//	lea rcx, [rip+distance_to_branch_table]		{ 0x48, 0x8D, 0x0D, rel32 }
-	//	jmp [m_pfnBranchTable]						{ 0xFF, 0x25, rel32 }
-	int32_t branchtable_offset = 6;
-	static const uint8_t rgcodeLea[] = { 0x48, 0x8D, 0x0D };
-	SafePushCode(rgcodeLea);
-	SafePushCode(branchtable_offset);
-	
-	static const uint8_t rgcodeJmp[] = { 0xFF, 0x25 };
-	SafePushCode(rgcodeJmp);
-	ptrdiff_t diffFn = reinterpret_cast<ptrdiff_t>(m_pfnBranchTable) - reinterpret_cast<ptrdiff_t>(m_pexecPlaneCur + 4);
-	Verify(diffFn == static_cast<int32_t>(diffFn));
-	SafePushCode(static_cast<int32_t>(diffFn));
-
-	// Now write the branch table
-	/*
-	;	Table Format:
-	;		dword count
-	;		dword fReturnVal
-	;		--default_target--
-	;		qword distance (how many blocks we're jumping)
-	;		qword target_addr
-	;		--table_targets---
-	;		.... * count
-	*/
-	// Header
-	SafePushCode(target_count);
-	SafePushCode(int32_t(fRetVal));
-	// default target
-	SafePushCode(uint64_t(default_target));
-	SafePushCode(pairBlockDft.second);
-	if (pairBlockDft.second == nullptr)
-		(stackVecFixupsAbsolute.rbegin() + default_target)->push_back(reinterpret_cast<void**>(m_pexecPlaneCur) - 1);
-	// table targets
-	for (uint32_t itarget = 0; itarget < target_count; ++itarget)
-	{
-		uint64_t target = vectargets[itarget];
-		SafePushCode(target);
-		auto &pairBlock = *(stackBlockTypeAddr.rbegin() + target);
-		SafePushCode(pairBlock.second);
-		if (pairBlock.second == nullptr)
-			(stackVecFixupsAbsolute.rbegin() + target)->push_back(reinterpret_cast<void**>(m_pexecPlaneCur) - 1);
+	// Runs of consecutive indices going to the same target, the default run covers everything from target_count up
+	std::vector<uint32_t> vecidxRun;	// first index of each run
+	std::vector<size_t> vecitargetRun;
+	for (uint32_t idx = 0; idx <= target_count; ++idx)
+	{
+		if (idx == 0 || vecitarget[idx] != vecitarget[idx - 1])
+		{
+			vecidxRun.push_back(idx);
+			vecitargetRun.push_back(vecitarget[idx]);
+		}
+	}
+
+	// The index goes in rcx and the result (every target has the same one) in its register, the rest stays where it is
+	const Label &labelDefault = *(stackLabel.rbegin() + vectargets.back());
+	bool fResult = labelDefault.fResult;
+	_EnsureCached(fResult ? 2 : 1, RegClass::Any);
+	_EnsureClass(0, RegClass::Gpr);
+	if (fResult)
+		_MoveToReg(1, _RegResult(labelDefault.type));
+	_MoveToReg(0, rcx);
+	_PopReg();
+
+	std::vector<std::vector<int32_t*>> vecvecpfixTarget(vecdepthTarget.size());
+	uint64_t *rgpvTable = nullptr;
+	int32_t *prel32Table = nullptr;
+	if (vecidxRun.size() <= crunBranchTreeMax)
+	{
+		_BranchTableTree(vecidxRun, vecitargetRun, 0, vecidxRun.size() - 1, vecvecpfixTarget);
+	}
+	else
+	{
+		// cmp ecx, target_count
+		// jae default
+		// lea rdx, [rip+table]
+		// jmp [rdx+rcx*8]
+		_EmitRegReg({ 0x81 }, false, 7, rcx);
+		SafePushCode(target_count);
+		static const uint8_t rgcodeJae[] = { 0x0F, 0x83 };
+		SafePushCode(rgcodeJae);
+		vecvecpfixTarget[vecitarget.back()].push_back(reinterpret_cast<int32_t*>(m_pexecPlaneCur));
+		SafePushCode(int32_t(0));
+		static const uint8_t rgcodeLea[] = { 0x48, 0x8D, 0x15 };
+		SafePushCode(rgcodeLea);
+		prel32Table = reinterpret_cast<int32_t*>(m_pexecPlaneCur);
+		SafePushCode(int32_t(0));
+		static const uint8_t rgcodeJmp[] = { 0xFF, 0x24, 0xCA };
+		SafePushCode(rgcodeJmp);
+
+		// The table holds the absolute address of each entry's target, it is filled in once they are all known
+		_AlignCode(sizeof(uint64_t));
+		*_PWritable(prel32Table) = numeric_cast<int32_t>(m_pexecPlaneCur - (reinterpret_cast<uint8_t*>(prel32Table) + sizeof(*prel32Table)));
+		rgpvTable = reinterpret_cast<uint64_t*>(m_pexecPlaneCur);
+		for (uint32_t idx = 0; idx < target_count; ++idx)
+			SafePushCode(uint64_t(0));
+	}
+
+	std::vector<void*> vecpvTarget;
+	for (size_t itarget = 0; itarget < vecdepthTarget.size(); ++itarget)
+	{
+		uint32_t depth = vecdepthTarget[itarget];
+		const Label &label = *(stackLabel.rbegin() + depth);
+		// Targets with fewer entries in memory than we have get a pad that pops the rest.  Loop heads are known
+		//	already, otherwise the table needs a pad for labels that are only fixed up at their end.
+		int32_t cbRelease = _DispStack(m_cstackMem - label.cstackMem);
+		void *pvTarget = label.pvTarget;
+		if (cbRelease > 0 || (rgpvTable != nullptr && label.pvTarget == nullptr))
+		{
+			pvTarget = m_pexecPlaneCur;
+			for (int32_t *poffsetFix : vecvecpfixTarget[itarget])
+				*_PWritable(poffsetFix) = numeric_cast<int32_t>(m_pexecPlaneCur - (reinterpret_cast<uint8_t*>(poffsetFix) + sizeof(*poffsetFix)));
+			vecvecpfixTarget[itarget].clear();
+			// lea rsp, [rsp + cbRelease]
+			// jmp target
+			if (cbRelease > 0)
+				_ReleaseStack(cbRelease);
+			vecvecpfixTarget[itarget].push_back(Jump(label.pvTarget));
+		}
+		if (rgpvTable != nullptr)
+			vecpvTarget.push_back(pvTarget);
+		for (int32_t *poffsetFix : vecvecpfixTarget[itarget])
+		{
+			if (label.pvTarget != nullptr)
+				*_PWritable(poffsetFix) = numeric_cast<int32_t>(reinterpret_cast<uint8_t*>(label.pvTarget) - (reinterpret_cast<uint8_t*>(poffsetFix) + sizeof(*poffsetFix)));
+			else
+				(stackVecFixups.rbegin() + depth)->push_back(poffsetFix);
+		}
+	}
+
+	if (rgpvTable != nullptr)
+	{
+		for (uint32_t idx = 0; idx < target_count; ++idx)
+			_PWritable(rgpvTable)[idx] = reinterpret_cast<uint64_t>(vecpvTarget[vecitarget[idx]]);
 	}
 }
 
-void JitWriter::FloatArithmetic(ArithmeticOperation op, bool fDouble)
+void JitWriter::_BranchTableTree(const std::vector<uint32_t> &vecidxRun, const std::vector<size_t> &vecitargetRun, size_t irunFirst, size_t irunLast, std::vector<std::vector<int32_t*>> &vecvecpfixTarget)
 {
-	// sub rdi, 8
-	static const uint8_t rgcodeSubRdi[] = { 0x48, 0x83, 0xEF, 0x08 };
-	SafePushCode(rgcodeSubRdi);
-	if (fDouble)
+	// Binary search over the runs with the index in ecx, every leaf jumps to its target
+	if (irunFirst == irunLast)
 	{
-		// movq xmm1, rax
-		// movq xmm0, qword ptr [rdi]
-		static const uint8_t rgcodeSetup[] = { 0x66, 0x48, 0x0F, 0x6E, 0xC8, 0xF3, 0x0F, 0x7E, 0x07 };
-		SafePushCode(rgcodeSetup);
+		vecvecpfixTarget[vecitargetRun[irunFirst]].push_back(Jump(nullptr));
+		return;
 	}
-	else
+	size_t irunMid = (irunFirst + irunLast + 1) / 2;
+	// cmp ecx, idxMid
+	// jae upper
+	_EmitRegReg({ 0x81 }, false, 7, rcx);
+	SafePushCode(vecidxRun[irunMid]);
+	static const uint8_t rgcodeJae[] = { 0x0F, 0x83 };
+	SafePushCode(rgcodeJae);
+	int32_t *prel32Upper = reinterpret_cast<int32_t*>(m_pexecPlaneCur);
+	SafePushCode(int32_t(0));
+	_BranchTableTree(vecidxRun, vecitargetRun, irunFirst, irunMid - 1, vecvecpfixTarget);
+	if (irunMid == irunLast)
 	{
-		// movd xmm1, eax
-		// movd xmm0, dword ptr [rdi]
-		static const uint8_t rgcodeSetup[] = { 0x66, 0x0F, 0x6E, 0xC8, 0x66, 0x0F, 0x6E, 0x07 };
-		SafePushCode(rgcodeSetup);
+		vecvecpfixTarget[vecitargetRun[irunMid]].push_back(prel32Upper);	// straight to the target
+		return;
 	}
+	*_PWritable(prel32Upper) = numeric_cast<int32_t>(m_pexecPlaneCur - (reinterpret_cast<uint8_t*>(prel32Upper) + sizeof(*prel32Upper)));
+	_BranchTableTree(vecidxRun, vecitargetRun, irunMid, irunLast, vecvecpfixTarget);
+}
+
+void JitWriter::FloatArithmetic(ArithmeticOperation op, bool fDouble)
+{
+	_EnsureCached(2, RegClass::Xmm);
+	Xmm xmmSecond = _XmmOf(_PopReg(RegClass::Xmm));
+	Xmm xmmFirst = _XmmOf(_StackReg(0));
 
-	const char *szCode = nullptr;
+	uint8_t opSse = 0;
 	switch (op)
 	{
 	case ArithmeticOperation::Add:
-		if (fDouble)
-			szCode = "\xF2\x0F\x58\xC1";	// addsd xmm0, xmm1
-		else
-			szCode = "\xF3\x0F\x58\xC1";	// addss xmm0, xmm1
+		opSse = 0x58;	// addss/addsd xmmFirst, xmmSecond
 		break;
 	case ArithmeticOperation::Sub:
-		if (fDouble)
-			szCode = "\xF2\x0F\x5C\xC1";	// subsd xmm0, xmm1
-		else
-			szCode = "\xF3\x0F\x5C\xC1";	// subss xmm0, xmm1
+		opSse = 0x5C;	// subss/subsd xmmFirst, xmmSecond
 		break;
 	case ArithmeticOperation::Multiply:
-		if (fDouble)
-			szCode = "\xF2\x0F\x59\xC1";	// mulsd xmm0, xmm1
-		else
-			szCode = "\xF3\x0F\x59\xC1";	// mulss xmm0, xmm1
+		opSse = 0x59;	// mulss/mulsd xmmFirst, xmmSecond
 		break;
 	case ArithmeticOperation::Divide:
-		if (fDouble)
-			szCode = "\xF2\x0F\x5E\xC1";	// divsd xmm0, xmm1
-		else
-			szCode = "\xF3\x0F\x5E\xC1";	// divss xmm0, xmm1
+		opSse = 0x5E;	// divss/divsd xmmFirst, xmmSecond
 		break;
 	}
-	Verify(szCode != nullptr);
-	SafePushCode(szCode, strlen(szCode));
-
-	if (fDouble)
-	{
-		// movq rax, xmm0
-		static const uint8_t rgcode[] = { 0x66, 0x48, 0x0F, 0x7E, 0xC0 };
-		SafePushCode(rgcode);
-	}
-	else
-	{
-		// movd eax, xmm0
-		static const uint8_t rgcode[] = { 0x66, 0x0F, 0x7E, 0xC0 };
-		SafePushCode(rgcode);
-	}
+	Verify(opSse != 0);
+	SafePushCode(uint8_t(fDouble ? 0xF2 : 0xF3));
+	_EmitRegReg({ 0x0F, opSse }, false, xmmFirst, xmmSecond);
 }
 
 
@@ -1245,31 +2382,34 @@ void JitWriter::GetGlobal(uint32_t idx)
 
 	if (glbl.fMutable)
 	{
-		_PushExpandStack();
-		const char *szCode = nullptr;
+		bool f64 = false;
 		switch (glbl.type)
 		{
 		case value_type::f32:
 		case value_type::i32:
-			// mov eax, [m_pGlobalsStart + idx*8] (rip relative)
-			szCode = "\x8B\x05";
 			break;
 
 		case value_type::f64:
 		case value_type::i64:
-			// mov rax, [m_pGlobalsStart + idx*8] (rip relative)
-			szCode = "\x48\x8B\x05";
+			f64 = true;
 			break;
 
 		default:
 			Verify(false);
 		}
-		SafePushCode(szCode, strlen(szCode));
-		// now push the address offset
-		int64_t offset64 = reinterpret_cast<uint8_t*>(m_pGlobalsStart + idx) - (m_pexecPlaneCur + 4);
-		int32_t offset = static_cast<int32_t>(offset64);
-		Verify(offset64 == offset);
-		SafePushCode(offset);
+		if (glbl.type == value_type::f32 || glbl.type == value_type::f64)
+		{
+			// movd/movq xmm, [m_pGlobalsStart + idx*8] (rip relative)
+			Reg reg = _AllocXmm();
+			SafePushCode(uint8_t(f64 ? 0xF3 : 0x66));
+			_EmitRegRip({ 0x0F, uint8_t(f64 ? 0x7E : 0x6E) }, false, _XmmOf(reg), m_pGlobalsStart + idx);
+			_PushReg(reg);
+			return;
+		}
+		// mov reg, [m_pGlobalsStart + idx*8] (rip relative)
+		Reg reg = _AllocReg();
+		_EmitRegRip({ 0x8B }, f64, reg, m_pGlobalsStart + idx);
+		_PushReg(reg);
 	}
 	else
 	{
@@ -1294,179 +2434,920 @@ void JitWriter::SetGlobal(uint32_t idx)
 	auto &glbl = m_pctxt->m_vecglbls.at(idx);
 
 	Verify(glbl.fMutable);
-	const char *szCode = nullptr;
+	bool f64 = false;
 	switch (glbl.type)
 	{
 	case value_type::f32:
 	case value_type::i32:
-		szCode = "\x89\x05";
 		break;
 
 	case value_type::f64:
 	case value_type::i64:
-		szCode = "\x48\x89\x05";
+		f64 = true;
 		break;
 
 	default:
 		Verify(false);
 	}
-	SafePushCode(szCode, strlen(szCode));
-	int64_t offset64 = reinterpret_cast<uint8_t*>(m_pGlobalsStart + idx) - (m_pexecPlaneCur + 4);
-	int32_t offset = static_cast<int32_t>(offset64);
-	Verify(offset64 == offset);
-	SafePushCode(offset);
-	_PopContractStack();
+	Reg reg = _PopReg(RegClass::Any);
+	if (_FXmm(reg))
+	{
+		// movd/movq [m_pGlobalsStart + idx*8], xmm (rip relative)
+		SafePushCode(uint8_t(0x66));
+		_EmitRegRip({ 0x0F, uint8_t(f64 ? 0xD6 : 0x7E) }, false, _XmmOf(reg), m_pGlobalsStart + idx);
+		return;
+	}
+	// mov [m_pGlobalsStart + idx*8], reg (rip relative)
+	_EmitRegRip({ 0x89 }, f64, reg, m_pGlobalsStart + idx);
 }
 
 void JitWriter::ExtendSigned32_64()
 {
-	// mov [rdi], eax
-	// movsxd rax, dword ptr [rdi]
-	static const uint8_t rgcode[] = { 0x89, 0x07, 0x48, 0x63, 0x07 };
-	SafePushCode(rgcode);
+	_EnsureCached(1);
+	Reg reg = _StackReg(0);
+	// movsxd reg, reg32
+	_EmitRegReg({ 0x63 }, true, reg, reg);
 }
 
 void JitWriter::CountTrailingZeros(bool f64)
 {
-	if (f64)
+	_EnsureCached(1);
+	Reg reg = _StackReg(0);
+	// tzcnt reg, reg
+	SafePushCode(uint8_t(0xF3));
+	_EmitRegReg({ 0x0F, 0xBC }, f64, reg, reg);
+}
+
+void JitWriter::CountLeadingZeros(bool f64)
+{
+	_EnsureCached(1);
+	Reg reg = _StackReg(0);
+	// lzcnt reg, reg
+	SafePushCode(uint8_t(0xF3));
+	_EmitRegReg({ 0x0F, 0xBD }, f64, reg, reg);
+}
+
+// Magic numbers for division by a constant (Hacker's Delight, chapter 10), q = mulhi(n, magic) >> shift plus fixups
+template<typename T>
+static void MagicSigned(T d, T *pmagic, uint32_t *pshift)
+{
+	// d is a two's complement divisor with |d| >= 2
+	const uint32_t cbits = sizeof(T) * 8;
+	const T tSign = T(1) << (cbits - 1);
+	T ad = (d & tSign) ? T(0) - d : d;
+	T t = tSign + (d >> (cbits - 1));
+	T anc = t - 1 - t % ad;		// |nc|, the largest dividend with the same remainder as -1 or 0
+	uint32_t p = cbits - 1;
+	T q1 = tSign / anc;
+	T r1 = tSign - q1 * anc;
+	T q2 = tSign / ad;
+	T r2 = tSign - q2 * ad;
+	T delta;
+	do
+	{
+		++p;
+		q1 *= 2;
+		r1 *= 2;
+		if (r1 >= anc)
+		{
+			++q1;
+			r1 -= anc;
+		}
+		q2 *= 2;
+		r2 *= 2;
+		if (r2 >= ad)
+		{
+			++q2;
+			r2 -= ad;
+		}
+		delta = ad - r2;
+	} while (q1 < delta || (q1 == delta && r1 == 0));
+	*pmagic = (d & tSign) ? T(0) - (q2 + 1) : (q2 + 1);
+	*pshift = p - cbits;
+}
+
+template<typename T>
+static void MagicUnsigned(T d, T *pmagic, uint32_t *pshift, bool *pfAdd)
+{
+	// d >= 2, *pfAdd is set when the magic number needs one more bit than T has
+	const uint32_t cbits = sizeof(T) * 8;
+	const T tSign = T(1) << (cbits - 1);
+	*pfAdd = false;
+	T nc = T(0) - 1 - (T(0) - d) % d;
+	uint32_t p = cbits - 1;
+	T q1 = tSign / nc;
+	T r1 = tSign - q1 * nc;
+	T q2 = (tSign - 1) / d;
+	T r2 = (tSign - 1) - q2 * d;
+	T delta;
+	do
+	{
+		++p;
+		if (r1 >= nc - r1)
+		{
+			q1 = 2 * q1 + 1;
+			r1 = 2 * r1 - nc;
+		}
+		else
+		{
+			q1 = 2 * q1;
+			r1 = 2 * r1;
+		}
+		if (r2 + 1 >= d - r2)
+		{
+			if (q2 >= tSign - 1)
+				*pfAdd = true;
+			q2 = 2 * q2 + 1;
+			r2 = 2 * r2 + 1 - d;
+		}
+		else
+		{
+			if (q2 >= tSign)
+				*pfAdd = true;
+			q2 = 2 * q2;
+			r2 = 2 * r2 + 1;
+		}
+		delta = d - 1 - r2;
+	} while (p < 2 * cbits && (q1 < delta || (q1 == delta && r1 == 0)));
+	*pmagic = q2 + 1;
+	*pshift = p - cbits;
+}
+
+bool JitWriter::_FDivConstInline(bool fSigned, bool fModulo, bool f64, uint64_t divisor)
+{
+	if (!f64)
+		divisor = uint32_t(divisor);
+	if (divisor == 0)
+		return false;	// div raises the trap
+	// INT_MIN / -1 overflows and must trap, the remainder is just 0
+	bool fMinusOne = f64 ? (divisor == UINT64_MAX) : (divisor == UINT32_MAX);
+	return !(fSigned && !fModulo && fMinusOne);
+}
+
+JitWriter::Reg JitWriter::_EmitDivConst(bool fSigned, bool fModulo, bool f64, uint64_t divisor, Reg regDividend)
+{
+	// The dividend can't be in rax or rdx, both are clobbered.  Returns the register holding the result which is
+	//	regDividend, rax or rdx.
+	const uint8_t cbits = f64 ? 64 : 32;
+	if (!f64)
+		divisor = uint32_t(divisor);
+	int64_t sdivisor = f64 ? int64_t(divisor) : int64_t(int32_t(divisor));
+	Verify(_FDivConstInline(fSigned, fModulo, f64, divisor) && regDividend != rax && regDividend != rdx);
+	auto EmitShift = [&](uint8_t opext, Reg reg, uint32_t cshift)
+	{
+		// shl/shr/sar reg, cshift
+		if (cshift == 0)
+			return;
+		_EmitRegReg({ 0xC1 }, f64, opext, reg);
+		SafePushCode(uint8_t(cshift));
+	};
+
+	if (divisor == 1 || (fSigned && sdivisor == -1))
+	{
+		if (fModulo)
+		{
+			// xor dividend, dividend
+			_EmitRegReg({ 0x31 }, false, regDividend, regDividend);
+		}
+		return regDividend;
+	}
+
+	uint64_t absdivisor = (fSigned && sdivisor < 0) ? (uint64_t(0) - divisor) & (f64 ? UINT64_MAX : UINT32_MAX) : divisor;
+	if ((absdivisor & (absdivisor - 1)) == 0)
+	{
+		uint32_t cshift = 0;
+		while ((uint64_t(1) << cshift) != absdivisor)
+			++cshift;
+		if (!fSigned)
+		{
+			if (!fModulo)
+			{
+				// shr dividend, cshift
+				EmitShift(5, regDividend, cshift);
+			}
+			else if (cshift < 32)
+			{
+				// and dividend, divisor - 1
+				_EmitAluImm(4, f64, regDividend, int32_t(divisor - 1));
+			}
+			else
+			{
+				// shl dividend, 64 - cshift
+				// shr dividend, 64 - cshift
+				EmitShift(4, regDividend, 64 - cshift);
+				EmitShift(5, regDividend, 64 - cshift);
+			}
+			return regDividend;
+		}
+
+		// Signed division rounds toward zero so negative dividends are biased by |divisor| - 1 first
+		//	mov rax, dividend
+		//	sar rax, cbits - 1
+		//	shr rax, cbits - cshift
+		//	add rax, dividend
+		_MovRegReg(rax, regDividend);
+		EmitShift(7, rax, cbits - 1);
+		EmitShift(5, rax, cbits - cshift);
+		_EmitRegReg({ 0x01 }, f64, regDividend, rax);
+		if (!fModulo)
+		{
+			// sar rax, cshift
+			// neg rax		; negative divisors
+			EmitShift(7, rax, cshift);
+			if (sdivisor < 0)
+				_EmitRegReg({ 0xF7 }, f64, 3, rax);
+			return rax;
+		}
+		if (cshift < 32)
+		{
+			// and rax, -|divisor|
+			_EmitAluImm(4, f64, rax, int32_t(-(int64_t(1) << cshift)));
+		}
+		else
+		{
+			// shr rax, cshift
+			// shl rax, cshift
+			EmitShift(5, rax, cshift);
+			EmitShift(4, rax, cshift);
+		}
+		// sub dividend, rax
+		_EmitRegReg({ 0x29 }, f64, rax, regDividend);
+		return regDividend;
+	}
+
+	Reg regQuotient = rdx;
+	if (fSigned)
 	{
-		// tzcnt rax, rax
-		static const uint8_t rgcode[] = { 0xF3, 0x48, 0x0F, 0xBC, 0xC0 };
-		SafePushCode(rgcode);
+		uint32_t cshift;
+		bool fMagicNeg;
+		uint64_t magic;
+		if (f64)
+		{
+			MagicSigned<uint64_t>(divisor, &magic, &cshift);
+			fMagicNeg = int64_t(magic) < 0;
+		}
+		else
+		{
+			uint32_t magic32;
+			MagicSigned<uint32_t>(uint32_t(divisor), &magic32, &cshift);
+			magic = magic32;
+			fMagicNeg = int32_t(magic32) < 0;
+		}
+		//	mov rax, magic
+		//	imul dividend			; rdx = high half
+		//	add/sub rdx, dividend	; when the magic number's sign differs from the divisor's
+		//	sar rdx, cshift
+		//	mov rax, rdx
+		//	shr rax, cbits - 1
+		//	add rdx, rax			; round toward zero
+		_MovRegImm(rax, magic);
+		_EmitRegReg({ 0xF7 }, f64, 5, regDividend);
+		if (sdivisor > 0 && fMagicNeg)
+			_EmitRegReg({ 0x01 }, f64, regDividend, rdx);
+		else if (sdivisor < 0 && !fMagicNeg)
+			_EmitRegReg({ 0x29 }, f64, regDividend, rdx);
+		EmitShift(7, rdx, cshift);
+		_MovRegReg(rax, rdx);
+		EmitShift(5, rax, cbits - 1);
+		_EmitRegReg({ 0x01 }, f64, rax, rdx);
 	}
 	else
 	{
-		// tzcnt eax, eax
-		static const uint8_t rgcode[] = { 0xF3, 0x0F, 0xBC, 0xC0 };
-		SafePushCode(rgcode);
+		uint32_t cshift;
+		bool fAdd;
+		uint64_t magic;
+		if (f64)
+		{
+			MagicUnsigned<uint64_t>(divisor, &magic, &cshift, &fAdd);
+		}
+		else
+		{
+			uint32_t magic32;
+			MagicUnsigned<uint32_t>(uint32_t(divisor), &magic32, &cshift, &fAdd);
+			magic = magic32;
+		}
+		//	mov rax, magic
+		//	mul dividend			; rdx = high half
+		_MovRegImm(rax, magic);
+		_EmitRegReg({ 0xF7 }, f64, 4, regDividend);
+		if (!fAdd)
+		{
+			//	shr rdx, cshift
+			EmitShift(5, rdx, cshift);
+		}
+		else
+		{
+			// The magic number has an implicit extra bit, add the dividend in without overflowing
+			//	mov rax, dividend
+			//	sub rax, rdx
+			//	shr rax, 1
+			//	add rax, rdx
+			//	shr rax, cshift - 1
+			_MovRegReg(rax, regDividend);
+			_EmitRegReg({ 0x29 }, f64, rdx, rax);
+			EmitShift(5, rax, 1);
+			_EmitRegReg({ 0x01 }, f64, rdx, rax);
+			EmitShift(5, rax, cshift - 1);
+			regQuotient = rax;
+		}
 	}
-}
+	if (!fModulo)
+		return regQuotient;
 
-void JitWriter::CountLeadingZeros(bool f64)
-{
-	if (f64)
+	// remainder = dividend - quotient * divisor
+	if (!f64 || sdivisor == int32_t(sdivisor))
 	{
-		// lzcnt rax, rax
-		static const uint8_t rgcode[] = { 0xF3, 0x48, 0x0F, 0xBD, 0xC0 };
-		SafePushCode(rgcode);
+		// imul quotient, quotient, divisor
+		_EmitRegReg({ 0x69 }, f64, regQuotient, regQuotient);
+		SafePushCode(int32_t(divisor));
 	}
 	else
 	{
-		// lzcnt eax, eax
-		static const uint8_t rgcode[] = { 0xF3, 0x0F, 0xBD, 0xC0 };
-		SafePushCode(rgcode);
+		// mov other, divisor
+		// imul quotient, other
+		Reg regOther = (regQuotient == rax) ? rdx : rax;
+		_MovRegImm(regOther, divisor);
+		_EmitRegReg({ 0x0F, 0xAF }, f64, regQuotient, regOther);
 	}
+	// sub dividend, quotient
+	_EmitRegReg({ 0x29 }, f64, regQuotient, regDividend);
+	return regDividend;
 }
 
 void JitWriter::Div(bool fSigned, bool fModulo, bool f64)
 {
+	if (m_fConstPending && _FDivConstInline(fSigned, fModulo, f64, m_cPending))
+	{
+		// Constant divisors become multiplies and shifts, they only need rax and rdx as scratch
+		m_fConstPending = false;
+		_EnsureCached(1);
+		m_maskRegsLocked |= RegMask(rax) | RegMask(rdx);
+		if (_StackReg(0) == rax || _StackReg(0) == rdx)
+			_MoveToReg(0, _AllocReg());
+		Reg regDividend = _StackReg(0);
+		m_maskRegsLocked |= RegMask(regDividend);
+		_EvictReg(rax);
+		_EvictReg(rdx);
+		m_maskRegsLocked = 0;
+		Reg regResult = _EmitDivConst(fSigned, fModulo, f64, m_cPending, regDividend);
+		m_vecregStack.back() = regResult;
+		m_maskRegsUsed &= ~RegMask(regDividend);
+		m_maskRegsUsed |= RegMask(regResult);
+		return;
+	}
+	_MaterializeConstant();
+
+	// div/idiv need the dividend in rax and clobber rdx so setup our operands accordingly
+	_EnsureCached(2);
+	_MoveToReg(1, rax);
+	if (_StackReg(0) == rdx)
+	{
+		m_maskRegsLocked |= RegMask(rax);
+		_MoveToReg(0, _AllocReg());
+		m_maskRegsLocked &= ~RegMask(rax);
+	}
+	m_maskRegsLocked |= RegMask(rax) | RegMask(_StackReg(0));
+	_EvictReg(rdx);
+	m_maskRegsLocked = 0;
+	Reg regDivisor = _StackReg(0);
+
 	if (fSigned && fModulo)
 	{
 		// To satisify the wasm spec and prevent overflow exceptions convert the divisor to its absolute value
-		//  do this before the xchg below so the divisor is already in eax
 
-		// Fancy branchless abs(eax):
-		//		cdq
-		//		xor eax, edx
-		//		sub eax, edx
+		// Fancy branchless abs(divisor):
+		//		mov edx, divisor
+		//		sar edx, 31
+		//		xor divisor, edx
+		//		sub divisor, edx
+		_EmitRegReg({ 0x89 }, f64, regDivisor, rdx);
+		_EmitRegReg({ 0xC1 }, f64, 7, rdx);
+		SafePushCode(uint8_t(f64 ? 63 : 31));
+		_EmitRegReg({ 0x31 }, f64, rdx, regDivisor);
+		_EmitRegReg({ 0x29 }, f64, rdx, regDivisor);
+	}
+
+	if (fSigned)
+	{
 		if (f64)
 		{
-			static const uint8_t rgcodeFancy[] = { 0x48, 0x99, 0x48, 0x31, 0xD0, 0x48, 0x29, 0xD0 };
-			SafePushCode(rgcodeFancy);
+			static const uint8_t rgcodeCqo[] = { 0x48, 0x99 };	// cqo to load rdx with the sign extension
+			SafePushCode(rgcodeCqo);
+		}
+		else
+		{
+			SafePushCode(uint8_t(0x99));	// cdq to load edx with the sign extension
+		}
+	}
+	else
+	{
+		// xor edx, edx { 0x31, 0xD2 }
+		static const uint8_t rgcodeClearEdx[] = { 0x31, 0xD2 };
+		SafePushCode(rgcodeClearEdx);
+	}
+
+	if (fSigned)
+	{
+		//  idiv divisor
+		_EmitRegReg({ 0xF7 }, f64, 7, regDivisor);
+	}
+	else
+	{
+		// div divisor
+		_EmitRegReg({ 0xF7 }, f64, 6, regDivisor);
+	}
+	_PopReg();
+
+	if (fModulo)
+	{
+		// take the remainder that's in edx
+		m_vecregStack.back() = rdx;
+		m_maskRegsUsed &= ~RegMask(rax);
+		m_maskRegsUsed |= RegMask(rdx);
+	}
+}
+
+// Advance past the immediate operands of an opcode
+static void SkipImmediates(opcode op, const uint8_t **ppop, size_t *pcb)
+{
+	switch (op)
+	{
+	case opcode::block:
+	case opcode::loop:
+	case opcode::IF:
+		safe_read_buffer<value_type>(ppop, pcb);
+		break;
+
+	case opcode::br:
+	case opcode::br_if:
+	case opcode::call:
+	case opcode::get_local:
+	case opcode::set_local:
+	case opcode::tee_local:
+	case opcode::get_global:
+	case opcode::set_global:
+		safe_read_buffer<varuint32>(ppop, pcb);
+		break;
+
+	case opcode::br_table:
+	{
+		uint32_t target_count = safe_read_buffer<varuint32>(ppop, pcb);
+		for (uint32_t itarget = 0; itarget <= target_count; ++itarget)	// <= for the default target
+			safe_read_buffer<varuint32>(ppop, pcb);
+		break;
+	}
+
+	case opcode::call_indirect:
+		safe_read_buffer<varuint32>(ppop, pcb);
+		safe_read_buffer<char>(ppop, pcb);	// reserved
+		break;
+
+	case opcode::current_memory:
+	case opcode::grow_memory:
+		safe_read_buffer<uint8_t>(ppop, pcb);	// reserved
+		break;
+
+	case opcode::i32_const:
+		safe_read_buffer<varint32>(ppop, pcb);
+		break;
+	case opcode::i64_const:
+		safe_read_buffer<varint64>(ppop, pcb);
+		break;
+	case opcode::f32_const:
+		safe_read_buffer<float>(ppop, pcb);
+		break;
+	case opcode::f64_const:
+		safe_read_buffer<double>(ppop, pcb);
+		break;
+
+	default:
+		if (op >= opcode::i32_load && op <= opcode::i64_store32)
+		{
+			safe_read_buffer<varuint32>(ppop, pcb);	// alignment
+			safe_read_buffer<varuint32>(ppop, pcb);	// offset
 		}
+		break;
+	}
+}
+
+static const uint32_t cinlineLocalsMax = 16;	// declared locals of an inline candidate
+
+const FunctionCodeEntry *JitWriter::_PfncBody(uint32_t ifn)
+{
+	if (!m_vecfInlineChecked[ifn])
+	{
+		m_vecfInlineChecked[ifn] = true;
+		if (m_pctxt->m_opts.cbInlineMax > 0)
+			_InlineCallees(ifn);
+	}
+	if (m_vecspinlined[ifn] != nullptr)
+		return m_vecspinlined[ifn]->spfnc.get();
+	return m_pctxt->m_vecfn_code[ifn - m_pctxt->m_vecimports.size()].get();
+}
+
+bool JitWriter::_FInlineCandidate(uint32_t ifnCaller, uint32_t ifnCallee) const
+{
+	// A callee without calls can't recurse and needs no inlining of its own
+	if (ifnCallee == ifnCaller || ifnCallee < m_pctxt->m_vecimports.size() || ifnCallee >= m_cfn)
+		return false;
+	const FunctionCodeEntry *pfnc = m_pctxt->m_vecfn_code[ifnCallee - m_pctxt->m_vecimports.size()].get();
+	if (pfnc->vecbytecode.size() > m_pctxt->m_opts.cbInlineMax)
+		return false;
+	uint32_t clocals = 0;
+	for (uint32_t ilocalInfo = 0; ilocalInfo < pfnc->clocalVars; ++ilocalInfo)
+	{
+		clocals += pfnc->rglocals[ilocalInfo].count;
+		if (clocals > cinlineLocalsMax)
+			return false;	// locals aren't part of the bytecode size but each one is zeroed at every call
+	}
+	const uint8_t *pop = pfnc->vecbytecode.data();
+	size_t cb = pfnc->vecbytecode.size();
+	while (cb > 0)
+	{
+		opcode op = safe_read_buffer<opcode>(&pop, &cb);
+		if (op == opcode::call || op == opcode::call_indirect)
+			return false;
+		SkipImmediates(op, &pop, &cb);
+	}
+	return true;
+}
+
+static void PushVaruint32(std::vector<uint8_t> *pvec, uint32_t val)
+{
+	do
+	{
+		uint8_t b = val & 0x7F;
+		val >>= 7;
+		if (val != 0)
+			b |= 0x80;
+		pvec->push_back(b);
+	} while (val != 0);
+}
+
+void JitWriter::_InlineCallees(uint32_t ifn)
+{
+	const size_t cfnImports = m_pctxt->m_vecimports.size();
+	const FunctionCodeEntry *pfncCaller = m_pctxt->m_vecfn_code[ifn - cfnImports].get();
+	const FunctionTypeEntry *ptypeCaller = m_pctxt->m_vecfn_types[m_pctxt->m_vecfn_entries[ifn]].get();
+	uint32_t clocalsCaller = ptypeCaller->cparams;
+	for (uint32_t ilocalInfo = 0; ilocalInfo < pfncCaller->clocalVars; ++ilocalInfo)
+		clocalsCaller += pfncCaller->rglocals[ilocalInfo].count;
+
+	std::unique_ptr<InlinedBody> spinlined = std::make_unique<InlinedBody>();
+	std::vector<uint8_t> vecbytecode;
+	std::vector<value_type> vectypeExtra;	// the callees' locals, shared by every inlined call since they can't nest
+	bool fInlined = false;
+
+	// Appends bytes that came from (ifnSrc, ibSrc), consecutive copies from the same function share a map entry
+	auto emit = [&](const uint8_t *pb, size_t cb, uint32_t ifnSrc, uint32_t ibSrc)
+	{
+		uint32_t ibInlined = numeric_cast<uint32_t>(vecbytecode.size());
+		std::vector<InlineMapEntry> &vecmap = spinlined->vecmap;
+		if (vecmap.empty() || vecmap.back().ifn != ifnSrc || ibInlined - vecmap.back().ibInlined != ibSrc - vecmap.back().ibBytecode)
+			vecmap.push_back({ ibInlined, ifnSrc, ibSrc });
+		vecbytecode.insert(vecbytecode.end(), pb, pb + cb);
+	};
+	auto emitOpIdx = [&](opcode op, uint32_t idx, uint32_t ifnSrc, uint32_t ibSrc)
+	{
+		std::vector<uint8_t> vecop;
+		vecop.push_back(uint8_t(op));
+		PushVaruint32(&vecop, idx);
+		emit(vecop.data(), vecop.size(), ifnSrc, ibSrc);
+	};
+
+	const uint8_t *pop = pfncCaller->vecbytecode.data();
+	size_t cb = pfncCaller->vecbytecode.size();
+	while (cb > 0)
+	{
+		const uint8_t *popStart = pop;
+		uint32_t ibCall = numeric_cast<uint32_t>(pop - pfncCaller->vecbytecode.data());
+		opcode op = safe_read_buffer<opcode>(&pop, &cb);
+		uint32_t ifnCallee = 0;
+		if (op == opcode::call)
+			ifnCallee = safe_read_buffer<varuint32>(&pop, &cb);
 		else
+			SkipImmediates(op, &pop, &cb);
+		if (op != opcode::call || !_FInlineCandidate(ifn, ifnCallee))
+		{
+			emit(popStart, pop - popStart, ifn, ibCall);
+			continue;
+		}
+
+		// Give each of the callee's locals a slot, the n-th local of a type always gets the same one
+		const FunctionCodeEntry *pfncCallee = m_pctxt->m_vecfn_code[ifnCallee - cfnImports].get();
+		const FunctionTypeEntry *ptypeCallee = m_pctxt->m_vecfn_types[m_pctxt->m_vecfn_entries[ifnCallee]].get();
+		std::vector<value_type> vectypeCallee(ptypeCallee->rgparam_type, ptypeCallee->rgparam_type + ptypeCallee->cparams);
+		for (uint32_t ilocalInfo = 0; ilocalInfo < pfncCallee->clocalVars; ++ilocalInfo)
+			vectypeCallee.insert(vectypeCallee.end(), pfncCallee->rglocals[ilocalInfo].count, pfncCallee->rglocals[ilocalInfo].type);
+		std::vector<uint32_t> vecidxLocal;
+		std::map<value_type, size_t> mapcUsed;
+		for (value_type type : vectypeCallee)
+		{
+			size_t iextra = 0;
+			for (size_t cseen = mapcUsed[type]++; iextra < vectypeExtra.size(); ++iextra)
+			{
+				if (vectypeExtra[iextra] == type && cseen-- == 0)
+					break;
+			}
+			if (iextra == vectypeExtra.size())
+				vectypeExtra.push_back(type);
+			vecidxLocal.push_back(clocalsCaller + numeric_cast<uint32_t>(iextra));
+		}
+
+		// The arguments are popped into the parameters' slots before the block so it starts with an empty stack
+		//		set_local param(n-1) ... set_local param0
+		//		type.const 0, set_local local ...
+		//		block (result type)
+		for (uint32_t iparam = ptypeCallee->cparams; iparam-- > 0; )
+			emitOpIdx(opcode::set_local, vecidxLocal[iparam], ifn, ibCall);
+		for (size_t ilocal = ptypeCallee->cparams; ilocal < vectypeCallee.size(); ++ilocal)
+		{
+			static const uint8_t rgcodeF32Zero[] = { uint8_t(opcode::f32_const), 0, 0, 0, 0 };
+			static const uint8_t rgcodeF64Zero[] = { uint8_t(opcode::f64_const), 0, 0, 0, 0, 0, 0, 0, 0 };
+			switch (vectypeCallee[ilocal])
+			{
+			case value_type::i32:
+				emitOpIdx(opcode::i32_const, 0, ifn, ibCall);
+				break;
+			case value_type::i64:
+				emitOpIdx(opcode::i64_const, 0, ifn, ibCall);
+				break;
+			case value_type::f32:
+				emit(rgcodeF32Zero, sizeof(rgcodeF32Zero), ifn, ibCall);
+				break;
+			case value_type::f64:
+				emit(rgcodeF64Zero, sizeof(rgcodeF64Zero), ifn, ibCall);
+				break;
+			default:
+				throw RuntimeException("Invalid local type");
+			}
+			emitOpIdx(opcode::set_local, vecidxLocal[ilocal], ifn, ibCall);
+		}
+		const uint8_t rgcodeBlock[] = { uint8_t(opcode::block), uint8_t(ptypeCallee->fHasReturnValue ? ptypeCallee->return_type : value_type::empty_block) };
+		emit(rgcodeBlock, sizeof(rgcodeBlock), ifn, ibCall);
+
+		// Copy the body, its final end closes the block
+		const uint8_t *popCallee = pfncCallee->vecbytecode.data();
+		size_t cbCallee = pfncCallee->vecbytecode.size();
+		uint32_t cdepth = 0;
+		while (cbCallee > 0)
 		{
-			static const uint8_t rgcodeFancy[] = { 0x99, 0x31, 0xD0, 0x29, 0xD0 };
-			SafePushCode(rgcodeFancy);
+			const uint8_t *popStartCallee = popCallee;
+			uint32_t ibCallee = numeric_cast<uint32_t>(popCallee - pfncCallee->vecbytecode.data());
+			opcode opCallee = safe_read_buffer<opcode>(&popCallee, &cbCallee);
+			switch (opCallee)
+			{
+			case opcode::get_local:
+			case opcode::set_local:
+			case opcode::tee_local:
+			{
+				uint32_t idx = safe_read_buffer<varuint32>(&popCallee, &cbCallee);
+				Verify(idx < vecidxLocal.size());
+				emitOpIdx(opCallee, vecidxLocal[idx], ifnCallee, ibCallee);
+				continue;
+			}
+			case opcode::ret:
+				emitOpIdx(opcode::br, cdepth, ifnCallee, ibCallee);
+				continue;
+			case opcode::block:
+			case opcode::loop:
+			case opcode::IF:
+				++cdepth;
+				break;
+			case opcode::end:
+				if (cdepth > 0)
+					--cdepth;
+				break;
+			default:
+				break;
+			}
+			SkipImmediates(opCallee, &popCallee, &cbCallee);
+			emit(popStartCallee, popCallee - popStartCallee, ifnCallee, ibCallee);
 		}
+		fInlined = true;
 	}
+	if (!fInlined)
+		return;
 
-	// sub rdi, 8 - pop off one of our operands.  Do this early so we don't have to offset our memory accesses below
-	static const uint8_t rgcodeSubRdi[] = { 0x48, 0x83, 0xEF, 0x08 };
-	SafePushCode(rgcodeSubRdi);
+	// The caller's local declarations followed by one entry per run of extra locals of the same type
+	std::vector<local_entry> veclocal(pfncCaller->rglocals, pfncCaller->rglocals + pfncCaller->clocalVars);
+	for (value_type type : vectypeExtra)
+	{
+		if (!veclocal.empty() && veclocal.back().type == type)
+			++veclocal.back().count;
+		else
+			veclocal.push_back({ 1, type });
+	}
+	spinlined->spfnc = FunctionCodeEntry::CreateFunctionCodeEntry(numeric_cast<uint32_t>(veclocal.size()));
+	std::copy(veclocal.begin(), veclocal.end(), spinlined->spfnc->rglocals);
+	spinlined->spfnc->vecbytecode = std::move(vecbytecode);
+	m_vecspinlined[ifn] = std::move(spinlined);
+}
 
-	if (f64)
+void JitWriter::SelectPinnedLocals(const FunctionCodeEntry *pfnc, const std::vector<value_type> &vectypeLocal)
+{
+	static const Reg rgregPinned[] = { r12, r13, r14, r15, rdi };
+	static const Xmm rgxmmPinned[] = { xmm8, xmm9, xmm10, xmm11 };
+	m_vecpinnedLocals.clear();
+	uint32_t clocals = numeric_cast<uint32_t>(vectypeLocal.size());
+
+	// Weight each local access by its loop nesting (x8 per loop).  Calls cost a save and a restore of every pinned local
+	std::vector<uint64_t> vecweight(clocals);
+	uint64_t weightCalls = 0;
+	std::vector<bool> stackfLoop;
+	uint32_t cloopDepth = 0;
+	const uint8_t *pop = pfnc->vecbytecode.data();
+	size_t cb = pfnc->vecbytecode.size();
+	while (cb > 0)
 	{
-		//	xchg rax, qword ptr [rdi]		; operands in the wrong order
-		static const uint8_t rgcodeXchg[] = { 0x48, 0x87, 0x07 };
-		SafePushCode(rgcodeXchg);
+		const uint8_t *popImm = pop + 1;
+		size_t cbImm = cb - 1;
+		opcode op = static_cast<opcode>(*pop);
+		uint64_t weight = uint64_t(1) << (3 * std::min<uint32_t>(cloopDepth, 6));
+		switch (op)
+		{
+		case opcode::block:
+		case opcode::IF:
+			stackfLoop.push_back(false);
+			break;
+		case opcode::loop:
+			stackfLoop.push_back(true);
+			++cloopDepth;
+			break;
+		case opcode::end:
+			if (!stackfLoop.empty())
+			{
+				if (stackfLoop.back())
+					--cloopDepth;
+				stackfLoop.pop_back();
+			}
+			break;
+
+		case opcode::get_local:
+		case opcode::set_local:
+		case opcode::tee_local:
+		{
+			const uint8_t *popT = popImm;
+			size_t cbT = cbImm;
+			uint32_t idx = safe_read_buffer<varuint32>(&popT, &cbT);
+			if (idx < clocals)
+				vecweight[idx] += weight;
+			break;
+		}
+
+		case opcode::call:
+		case opcode::call_indirect:
+			weightCalls += weight;
+			break;
+
+		default:
+			break;
+		}
+		SkipImmediates(op, &popImm, &cbImm);
+		pop = popImm;
+		cb = cbImm;
 	}
-	else
+
+	std::vector<uint32_t> vecidx;
+	for (uint32_t idx = 0; idx < clocals; ++idx)
 	{
-		//	xchg eax, dword ptr [rdi]		; operands in the wrong order
-		static const uint8_t rgcodeXchg[] = { 0x87, 0x07 };
-		SafePushCode(rgcodeXchg);
+		if (vecweight[idx] > 2 * weightCalls)
+			vecidx.push_back(idx);
 	}
-	if (fSigned)
+	std::stable_sort(vecidx.begin(), vecidx.end(), [&](uint32_t idxA, uint32_t idxB) { return vecweight[idxA] > vecweight[idxB]; });
+	size_t cpinnedGpr = 0;
+	size_t cpinnedXmm = 0;
+	for (uint32_t idx : vecidx)
 	{
-		if (f64)
+		if (vectypeLocal[idx] == value_type::f32 || vectypeLocal[idx] == value_type::f64)
 		{
-			static const uint8_t rgcodeCqo[] = { 0x48, 0x99 };	// cqo to load rdx with the sign extension
-			SafePushCode(rgcodeCqo);
+			if (cpinnedXmm < _countof(rgxmmPinned))
+				m_vecpinnedLocals.push_back(std::make_pair(idx, _RegOfXmm(rgxmmPinned[cpinnedXmm++])));
 		}
-		else
+		else if (cpinnedGpr < _countof(rgregPinned))
 		{
-			SafePushCode(uint8_t(0x99));	// cdq to load edx with the sign extension
+			m_vecpinnedLocals.push_back(std::make_pair(idx, rgregPinned[cpinnedGpr++]));
 		}
 	}
-	else
+}
+
+bool JitWriter::_FPinnedLocal(uint32_t idx, Reg *preg) const
+{
+	for (auto &pairPin : m_vecpinnedLocals)
 	{
-		// xor edx, edx { 0x31, 0xD2 }
-		static const uint8_t rgcodeClearEdx[] = { 0x31, 0xD2 };
-		SafePushCode(rgcodeClearEdx);
+		if (pairPin.first == idx)
+		{
+			*preg = pairPin.second;
+			return true;
+		}
 	}
+	return false;
+}
 
-	if (f64)
-		SafePushCode(uint8_t(0x48));	// rex prefix to make the following div instruction a 64-bit op
-	if (fSigned)
+void JitWriter::_SavePinnedLocals(bool fXmmOnly)
+{
+	for (auto &pairPin : m_vecpinnedLocals)
 	{
-		//  idiv dword ptr [rdi]
-		static const uint8_t rgcodeDiv[] = { 0xF7, 0x3F };
-		SafePushCode(rgcodeDiv);
+		// mov [rsp + local], reg
+		if (!fXmmOnly || _FXmm(pairPin.second))
+			_StoreEntry(pairPin.second, rsp, _DispLocalFromRsp(pairPin.first));
 	}
-	else
+}
+
+void JitWriter::_RestorePinnedLocals(bool fXmmOnly)
+{
+	for (auto &pairPin : m_vecpinnedLocals)
 	{
-		// div dword ptr [rdi]
-		static const uint8_t rgcodeDiv[] = { 0xF7, 0x37 };
-		SafePushCode(rgcodeDiv);
+		// mov reg, [rsp + local]
+		if (!fXmmOnly || _FXmm(pairPin.second))
+			_LoadEntry(pairPin.second, rsp, _DispLocalFromRsp(pairPin.first));
 	}
+}
 
-	if (fModulo)
+void JitWriter::_SkipUnreachable(const uint8_t **ppop, size_t *pcb, size_t cdepth, uint32_t clocals, uint32_t *pcblockDead) const
+{
+	opcode op = safe_read_buffer<opcode>(ppop, pcb);
+	const uint8_t *popImm = *ppop;
+	size_t cbImm = *pcb;
+	switch (op)
 	{
-		if (f64)
-			SafePushCode(uint8_t(0x48));	// REX prefix to convert to 64-bit registers below
-		// take the remainder that's in edx
-		// mov eax, edx { 0x89, 0xD0 }
-		static const uint8_t rgcodeMovEaxEdx[] = { 0x89, 0xD0 };
-		SafePushCode(rgcodeMovEaxEdx);
+	case opcode::block:
+	case opcode::loop:
+	case opcode::IF:
+		++*pcblockDead;
+		break;
+
+	case opcode::end:
+		--*pcblockDead;		// the caller handles the end of the block that became unreachable
+		break;
+
+	case opcode::br:
+	case opcode::br_if:
+		Verify(safe_read_buffer<varuint32>(&popImm, &cbImm) < cdepth);
+		break;
+
+	case opcode::br_table:
+	{
+		uint32_t target_count = safe_read_buffer<varuint32>(&popImm, &cbImm);
+		for (uint32_t itarget = 0; itarget <= target_count; ++itarget)
+			Verify(safe_read_buffer<varuint32>(&popImm, &cbImm) < cdepth);
+		break;
+	}
+
+	case opcode::call:
+		Verify(safe_read_buffer<varuint32>(&popImm, &cbImm) < m_cfn);
+		break;
+
+	case opcode::get_local:
+	case opcode::set_local:
+	case opcode::tee_local:
+		Verify(safe_read_buffer<varuint32>(&popImm, &cbImm) < clocals);
+		break;
+
+	default:
+		if (op > opcode::f64_reinterpret_i64 || (op > opcode::ELSE && op < opcode::end) || (op > opcode::call_indirect && op < opcode::drop))
+			throw RuntimeException("Invalid opcode");
+		break;
 	}
+	SkipImmediates(op, ppop, pcb);
 }
 
 void JitWriter::CompileFn(uint32_t ifn)
 {
-	size_t cfnImports = 0;
 	Verify(ifn >= m_pctxt->m_vecimports.size(), "Attempt to compile an import");
-	FunctionCodeEntry *pfnc = m_pctxt->m_vecfn_code[ifn - m_pctxt->m_vecimports.size()].get();
+	const FunctionCodeEntry *pfnc = _PfncBody(ifn);
 	const uint8_t *pop = pfnc->vecbytecode.data();
 	size_t cb = pfnc->vecbytecode.size();
-	std::vector<std::pair<value_type, void*>> stackBlockTypeAddr;
+	std::vector<Label> stackLabel;
 	std::vector<std::vector<int32_t*>> stackVecFixupsRelative;
-	std::vector<std::vector<void**>> stackVecFixupsAbsolute;
 
-	reinterpret_cast<void**>(m_pexecPlane)[ifn] = m_pexecPlaneCur;	// set our entry in the vector table
+	if (m_pctxt->m_opts.fOptimizingTier && m_pctxt->m_opts.cTierUpCalls == 0)
+	{
+		if (FCompileOptimized(ifn))
+			return;
+	}
+
+	_AlignCode(16);
+	void *pvEntry = m_pexecPlaneCur;	// published in the function table once the code is complete
 
 	size_t itype = m_pctxt->m_vecfn_entries[ifn];
-	uint32_t cparams = m_pctxt->m_vecfn_types[itype]->cparams;
-	uint32_t clocals = cparams;
+	const FunctionTypeEntry *ptype = m_pctxt->m_vecfn_types[itype].get();
+	uint32_t cparams = ptype->cparams;
+	std::vector<value_type> vectypeLocal(ptype->rgparam_type, ptype->rgparam_type + cparams);
 	for (size_t ilocalInfo = 0; ilocalInfo < pfnc->clocalVars; ++ilocalInfo)
 	{
-		clocals += pfnc->rglocals[ilocalInfo].count;
+		vectypeLocal.insert(vectypeLocal.end(), pfnc->rglocals[ilocalInfo].count, pfnc->rglocals[ilocalInfo].type);
 	}
+	uint32_t clocals = numeric_cast<uint32_t>(vectypeLocal.size());
+	m_vecfFloatLocal.assign(clocals, false);
+	for (uint32_t idx = 0; idx < clocals; ++idx)
+		m_vecfFloatLocal[idx] = (vectypeLocal[idx] == value_type::f32 || vectypeLocal[idx] == value_type::f64);
 
-	std::vector<uint32_t> vecifnCompile;
-
-	FnPrologue(clocals, cparams);
+	SelectPinnedLocals(pfnc, vectypeLocal);
+	_RecordCodeMap(ifn, 0);
+	FnPrologue(ifn, vectypeLocal, cparams);
 
+#ifdef PRINT_DISASSEMBLY
 	const char *szFnName = nullptr;
 	for (size_t iexport = 0; iexport < m_pctxt->m_vecexports.size(); ++iexport)
 	{
@@ -1480,24 +3361,43 @@ void JitWriter::CompileFn(uint32_t ifn)
 		}
 	}
 
-#ifdef PRINT_DISASSEMBLY
 	if (szFnName != nullptr)
 		printf("Function %s (%d):\n", szFnName, ifn);
 	else
 		printf("Function %d:\n", ifn);
 #endif
 
-	stackBlockTypeAddr.push_back(std::make_pair(value_type::none, nullptr));	// nullptr means we need to fixup addrs
+	// Branches to the function's own label are returns
+	stackLabel.push_back(Label{ ptype->fHasReturnValue ? ptype->return_type : value_type::none, nullptr, 0, ptype->fHasReturnValue });
 	stackVecFixupsRelative.push_back(std::vector<int32_t*>());
-	stackVecFixupsAbsolute.push_back(std::vector<void**>());
+	bool fUnreachable = false;	// after br, br_table, return or unreachable until something branches to an end or else
+	uint32_t cblockDead = 0;	// blocks opened in the unreachable code
 	while (cb > 0)
 	{
+		if (fUnreachable && !(cblockDead == 0 && ((opcode)*pop == opcode::end || (opcode)*pop == opcode::ELSE)))
+		{
+			_SkipUnreachable(&pop, &cb, stackLabel.size() + cblockDead, clocals, &cblockDead);
+			continue;
+		}
+		switch ((opcode)*pop)
+		{
+		case opcode::IF:
+		case opcode::br_if:
+		case opcode::select:
+			break;	// these consume a pending comparison directly from the flags
+		default:
+			_MaterializeCondition();
+		}
+		if (m_fConstPending && !_FConstantConsumer((opcode)*pop))
+			_MaterializeConstant();
 		cb--;	// count *pop
 		++pop;
-		_SetDbgReg(*(pop - 1));
+		_RecordCodeMap(ifn, numeric_cast<uint32_t>(pop - 1 - pfnc->vecbytecode.data()));
+		if (m_pctxt->m_opts.fDebugStamps)
+			_SetDbgReg(*(pop - 1));
 #ifdef PRINT_DISASSEMBLY
 		printf("%p (%X):\t", m_pexecPlaneCur, *(pop - 1));
-		for (size_t itab = 0; itab < stackBlockTypeAddr.size(); ++itab)
+		for (size_t itab = 0; itab < stackLabel.size(); ++itab)
 			printf("\t");
 #endif
 		switch ((opcode)*(pop - 1))
@@ -1508,8 +3408,10 @@ void JitWriter::CompileFn(uint32_t ifn)
 #ifdef PRINT_DISASSEMBLY
 			printf("unreachable\n");
 #endif
+			_SavePinnedLocals();	// leave the frame intact for whoever handles the trap
 			static const uint8_t rgcode[] = { 0x0F, 0x0B };
 			SafePushCode(rgcode, _countof(rgcode));
+			fUnreachable = true;
 			break;
 		}
 
@@ -1525,23 +3427,22 @@ void JitWriter::CompileFn(uint32_t ifn)
 #ifdef PRINT_DISASSEMBLY
 			printf("block\n");
 #endif
-			stackBlockTypeAddr.push_back(std::make_pair(type, nullptr));	// nullptr means we need to fixup addrs
+			stackLabel.push_back(EnterBlock(type, false /*fLoop*/));
 			stackVecFixupsRelative.push_back(std::vector<int32_t*>());
-			stackVecFixupsAbsolute.push_back(std::vector<void**>());
-			EnterBlock();
 			break;
 		}
 
 		case opcode::loop:
 		{
+			uint32_t ibLoop = numeric_cast<uint32_t>(pop - 1 - pfnc->vecbytecode.data());
 			value_type type = safe_read_buffer<value_type>(&pop, &cb);
 #ifdef PRINT_DISASSEMBLY
 			printf("loop\n");
 #endif
-			stackBlockTypeAddr.push_back(std::make_pair(type, m_pexecPlaneCur));
+			stackLabel.push_back(EnterBlock(type, true /*fLoop*/));
 			stackVecFixupsRelative.push_back(std::vector<int32_t*>());
-			stackVecFixupsAbsolute.push_back(std::vector<void**>());
-			EnterBlock();
+			if (m_pctxt->m_opts.fOptimizingTier)
+				_EmitOsrCounter(ifn, ibLoop);
 			break;
 		}
 
@@ -1551,10 +3452,10 @@ void JitWriter::CompileFn(uint32_t ifn)
 #ifdef PRINT_DISASSEMBLY
 			printf("if\n");
 #endif
-			stackBlockTypeAddr.push_back(std::make_pair(type, nullptr));	// nullptr means we need to fixup addrs
+			Label label;
+			int32_t *pifFix = EnterIF(type, &label);
+			stackLabel.push_back(label);
 			stackVecFixupsRelative.push_back(std::vector<int32_t*>());
-			stackVecFixupsAbsolute.push_back(std::vector<void**>());
-			int32_t *pifFix = EnterIF();
 			(stackVecFixupsRelative.rbegin())->push_back(pifFix);
 			break;
 		}
@@ -1565,17 +3466,18 @@ void JitWriter::CompileFn(uint32_t ifn)
 			printf("ELSE\n");
 #endif
 			Verify(stackVecFixupsRelative.back().size() > 0);
-			LeaveBlock(true);
-			int32_t *prel32End = Jump(nullptr);	// if we got here its from the IF block above so jump to the end
-			(stackVecFixupsRelative.rbegin())->push_back(prel32End);
+			const Label &label = stackLabel.back();
+			if (!fUnreachable)
+			{
+				int32_t *prel32End = _JumpLabel(label, ccNone);	// if we got here its from the IF block above so jump to the end
+				(stackVecFixupsRelative.rbegin())->push_back(prel32End);
+			}
+			fUnreachable = false;	// the IF's jump comes here
 			// Fixup the else pointer to go here (only the first, all others still branch to the end)
 			int32_t *poffsetFix = stackVecFixupsRelative.back().front();
 			stackVecFixupsRelative.back().erase(stackVecFixupsRelative.back().begin());	// remove it
-			*poffsetFix = numeric_cast<int32_t>(m_pexecPlaneCur - (reinterpret_cast<uint8_t*>(poffsetFix) + sizeof(*poffsetFix)));
-			_PushExpandStack();
-			// push rdi
-			static const uint8_t rgcode[] = { 0x57 };
-			SafePushCode(rgcode);
+			*_PWritable(poffsetFix) = numeric_cast<int32_t>(m_pexecPlaneCur - (reinterpret_cast<uint8_t*>(poffsetFix) + sizeof(*poffsetFix)));
+			_ResetStack(label.cstackMem, false /*fTopInRax*/);	// we arrive here from the IF with the stack it started with
 			break;
 		}
 
@@ -1585,21 +3487,14 @@ void JitWriter::CompileFn(uint32_t ifn)
 #ifdef PRINT_DISASSEMBLY
 			printf("br %u\n", depth);
 #endif
-			Verify(depth < stackBlockTypeAddr.size());
-			auto &pairBlock = *(stackBlockTypeAddr.rbegin() + depth);
-
-			// leave intermediate blocks (lie that we have a return so we don't do useless stack operations)
-			for (uint32_t idepth = 0; idepth < depth; ++idepth)
-			{
-				LeaveBlock(true);
-			}
-			LeaveBlock(pairBlock.first != value_type::empty_block);
-
-			int32_t *pdeltaFix = Jump(pairBlock.second);
-			if (pairBlock.second == nullptr)
+			Verify(depth < stackLabel.size());
+			const Label &label = *(stackLabel.rbegin() + depth);
+			int32_t *pdeltaFix = _JumpLabel(label, ccNone);
+			if (label.pvTarget == nullptr)
 			{
 				(stackVecFixupsRelative.rbegin() + depth)->push_back(pdeltaFix);
 			}
+			fUnreachable = true;
 			break;
 		}
 		case opcode::br_if:
@@ -1608,23 +3503,14 @@ void JitWriter::CompileFn(uint32_t ifn)
 #ifdef PRINT_DISASSEMBLY
 			printf("br_if %u\n", depth);
 #endif
-			Verify(depth < stackBlockTypeAddr.size());
-			auto &pairBlock = *(stackBlockTypeAddr.rbegin() + depth);
-
-			int32_t *pdeltaNoJmp = JumpNIf(nullptr);	// skip everything if we won't jump
-			// leave intermediate blocks (lie that we have a return so we don't do useless stack operations)
-			for (uint32_t idepth = 0; idepth < depth; ++idepth)
-			{
-				LeaveBlock(true);
-			}
-			LeaveBlock(pairBlock.first != value_type::empty_block);
-
-			int32_t *pdeltaFix = Jump(pairBlock.second);
-			if (pairBlock.second == nullptr)
+			Verify(depth < stackLabel.size());
+			const Label &label = *(stackLabel.rbegin() + depth);
+			uint8_t cc = _PopCondition();
+			int32_t *pdeltaFix = _JumpLabel(label, cc);
+			if (label.pvTarget == nullptr)
 			{
 				(stackVecFixupsRelative.rbegin() + depth)->push_back(pdeltaFix);
 			}
-			*pdeltaNoJmp = numeric_cast<int32_t>(m_pexecPlaneCur - (reinterpret_cast<uint8_t*>(pdeltaNoJmp) + sizeof(*pdeltaNoJmp)));
 			break;
 		}
 		case opcode::br_table:
@@ -1632,7 +3518,8 @@ void JitWriter::CompileFn(uint32_t ifn)
 #ifdef PRINT_DISASSEMBLY
 			printf("br_table\n");
 #endif
-			BranchTableParse(&pop, &cb, stackBlockTypeAddr, stackVecFixupsRelative, stackVecFixupsAbsolute);
+			BranchTableParse(&pop, &cb, stackLabel, stackVecFixupsRelative);
+			fUnreachable = true;
 			break;
 		}
 
@@ -1641,12 +3528,14 @@ void JitWriter::CompileFn(uint32_t ifn)
 #ifdef PRINT_DISASSEMBLY
 			printf("return\n");
 #endif
-			// add rsp, (cblock * 8)
-			static const uint8_t rgcode[] = { 0x48, 0x81, 0xC4 };
-			int32_t cbSub = numeric_cast<int32_t>(stackVecFixupsRelative.size() * 8);
-			SafePushCode(rgcode);
-			SafePushCode(cbSub);
+			if (m_pctxt->m_vecfn_types[itype]->fHasReturnValue)
+			{
+				// the return value goes in its register, the rest of the operand stack is abandoned
+				_EnsureCached(1, RegClass::Any);
+				_MoveEntry(_RegResult(m_pctxt->m_vecfn_types[itype]->return_type), _StackReg(0));
+			}
 			FnEpilogue(m_pctxt->m_vecfn_types[itype]->fHasReturnValue);
+			fUnreachable = true;
 			break;
 		}
 
@@ -1657,9 +3546,8 @@ void JitWriter::CompileFn(uint32_t ifn)
 			printf("call %d\n", idx);
 #endif
 			Verify(idx < m_cfn);
-			vecifnCompile.push_back(idx);
 			auto ptype = m_pctxt->m_vecfn_types.at(m_pctxt->m_vecfn_entries.at(idx)).get();
-			CallIfn(idx, clocals, ptype->cparams, ptype->fHasReturnValue, false /*fIndirect*/);
+			CallIfn(idx, ptype, false /*fIndirect*/);
 			break;
 		}
 		case opcode::call_indirect:
@@ -1670,7 +3558,7 @@ void JitWriter::CompileFn(uint32_t ifn)
 			uint32_t idx = safe_read_buffer<varuint32>(&pop, &cb);
 			safe_read_buffer<char>(&pop, &cb);	// reserved
 			auto ptype = m_pctxt->m_vecfn_types.at(idx).get();
-			CallIfn(m_pctxt->ITypeCanonicalFromIType(idx), clocals, ptype->cparams, ptype->fHasReturnValue, true /*fIndirect*/);
+			CallIfn(m_pctxt->ITypeCanonicalFromIType(idx), ptype, true /*fIndirect*/);
 			break;
 		}
 
@@ -1679,7 +3567,7 @@ void JitWriter::CompileFn(uint32_t ifn)
 #ifdef PRINT_DISASSEMBLY
 			printf("drop\n");
 #endif
-			_PopContractStack();
+			_DropTop();
 			break;
 		}
 		case opcode::select:
@@ -1697,7 +3585,7 @@ void JitWriter::CompileFn(uint32_t ifn)
 #ifdef PRINT_DISASSEMBLY
 			printf("i32.const %d\n", val);
 #endif
-			PushC32(val);
+			_DeferConstant(val);
 			break;
 		}
 		case opcode::i64_const:
@@ -1706,7 +3594,7 @@ void JitWriter::CompileFn(uint32_t ifn)
 #ifdef PRINT_DISASSEMBLY
 			printf("i64.const %llu\n", val);
 #endif
-			PushC64(val);
+			_DeferConstant(val);
 			break;
 		}
 		case opcode::f32_const:
@@ -1865,80 +3753,91 @@ void JitWriter::CompileFn(uint32_t ifn)
 #ifdef PRINT_DISASSEMBLY
 			printf("f32.eq\n");
 #endif
-			FloatCompare(CompareType::Equal);
+			FloatCompare(CompareType::Equal, false /*fDouble*/);
 			break;
 		case opcode::f32_ne:
 #ifdef PRINT_DISASSEMBLY
 			printf("f32.ne\n");
 #endif
-			FloatCompare(CompareType::NotEqual);
+			FloatCompare(CompareType::NotEqual, false /*fDouble*/);
 			break;
 		case opcode::f32_lt:
 #ifdef PRINT_DISASSEMBLY
 			printf("f32.lt\n");
 #endif
-			FloatCompare(CompareType::LessThan);
+			FloatCompare(CompareType::LessThan, false /*fDouble*/);
 			break;
 		case opcode::f32_gt:
 #ifdef PRINT_DISASSEMBLY
 			printf("f32.gt\n");
 #endif
-			FloatCompare(CompareType::GreaterThan);
+			FloatCompare(CompareType::GreaterThan, false /*fDouble*/);
 			break;
 		case opcode::f32_le:
 #ifdef PRINT_DISASSEMBLY
 			printf("f32.le\n");
 #endif
-			FloatCompare(CompareType::LessThanEqual);
+			FloatCompare(CompareType::LessThanEqual, false /*fDouble*/);
 			break;
 		case opcode::f32_ge:
 #ifdef PRINT_DISASSEMBLY
 			printf("f32.ge\n");
 #endif
-			FloatCompare(CompareType::GreaterThanEqual);
+			FloatCompare(CompareType::GreaterThanEqual, false /*fDouble*/);
 			break;
 
 		case opcode::f64_eq:
 #ifdef PRINT_DISASSEMBLY
 			printf("f64.eq\n");
 #endif
-			DoubleCompare(CompareType::Equal);
+			FloatCompare(CompareType::Equal, true /*fDouble*/);
 			break;
 		case opcode::f64_ne:
 #ifdef PRINT_DISASSEMBLY
 			printf("f64.ne\n");
 #endif
-			DoubleCompare(CompareType::NotEqual);
+			FloatCompare(CompareType::NotEqual, true /*fDouble*/);
 			break;
 		case opcode::f64_lt:
 #ifdef PRINT_DISASSEMBLY
 			printf("f64.lt\n");
 #endif
-			DoubleCompare(CompareType::LessThan);
+			FloatCompare(CompareType::LessThan, true /*fDouble*/);
+			break;
 		case opcode::f64_gt:
 #ifdef PRINT_DISASSEMBLY
 			printf("f64.gt\n");
 #endif
-			DoubleCompare(CompareType::GreaterThan);
+			FloatCompare(CompareType::GreaterThan, true /*fDouble*/);
 			break;
 		case opcode::f64_le:
 #ifdef PRINT_DISASSEMBLY
 			printf("f64.le\n");
 #endif
-			DoubleCompare(CompareType::LessThanEqual);
+			FloatCompare(CompareType::LessThanEqual, true /*fDouble*/);
 			break;
 		case opcode::f64_ge:
 #ifdef PRINT_DISASSEMBLY
 			printf("f64.ge\n");
 #endif
-			DoubleCompare(CompareType::GreaterThanEqual);
+			FloatCompare(CompareType::GreaterThanEqual, true /*fDouble*/);
 			break;
 
 		case opcode::f32_load:
+		{
+			safe_read_buffer<varuint32>(&pop, &cb);	// alignment, NYI
+			uint32_t offset = safe_read_buffer<varuint32>(&pop, &cb);
+#ifdef PRINT_DISASSEMBLY
+			printf("f32.load $%X\n", offset);
+#endif
+			LoadMem(offset, false, 4, false, true /*fFloat*/);
+			break;
+		}
+
 		case opcode::i64_load32_u:
 		case opcode::i32_load:
 		{
-			uint32_t align = safe_read_buffer<varuint32>(&pop, &cb);	// NYI alignment
+			safe_read_buffer<varuint32>(&pop, &cb);	// alignment, NYI
 			uint32_t offset = safe_read_buffer<varuint32>(&pop, &cb);
 #ifdef PRINT_DISASSEMBLY
 			printf("i32.load $%X\n", offset);
@@ -1949,19 +3848,19 @@ void JitWriter::CompileFn(uint32_t ifn)
 
 		case opcode::f64_load:
 		{
-			uint32_t align = safe_read_buffer<varuint32>(&pop, &cb);	// NYI alignment
+			safe_read_buffer<varuint32>(&pop, &cb);	// alignment, NYI
 			uint32_t offset = safe_read_buffer<varuint32>(&pop, &cb);
 #ifdef PRINT_DISASSEMBLY
 			printf("f64.load $%X\n", offset);
 #endif
-			LoadMem(offset, true, 8, false);
+			LoadMem(offset, true, 8, false, true /*fFloat*/);
 			break;
 		}
 
 		case opcode::i64_load8_u:
 		case opcode::i32_load8_u:
 		{
-			uint32_t align = safe_read_buffer<varuint32>(&pop, &cb);	// NYI alignment
+			safe_read_buffer<varuint32>(&pop, &cb);	// alignment, NYI
 			uint32_t offset = safe_read_buffer<varuint32>(&pop, &cb);
 #ifdef PRINT_DISASSEMBLY
 			printf("i32_load8_u $%X\n", offset);
@@ -1971,7 +3870,7 @@ void JitWriter::CompileFn(uint32_t ifn)
 		}
 		case opcode::i32_load8_s:
 		{
-			uint32_t align = safe_read_buffer<varuint32>(&pop, &cb);	// NYI alignment
+			safe_read_buffer<varuint32>(&pop, &cb);	// alignment, NYI
 			uint32_t offset = safe_read_buffer<varuint32>(&pop, &cb);
 #ifdef PRINT_DISASSEMBLY
 			printf("i32_load8_s $%X\n", offset);
@@ -1981,7 +3880,7 @@ void JitWriter::CompileFn(uint32_t ifn)
 		}
 		case opcode::i32_load16_s:
 		{
-			uint32_t align = safe_read_buffer<varuint32>(&pop, &cb);	// NYI alignment
+			safe_read_buffer<varuint32>(&pop, &cb);	// alignment, NYI
 			uint32_t offset = safe_read_buffer<varuint32>(&pop, &cb);
 #ifdef PRINT_DISASSEMBLY
 			printf("i32_load16_s $%X\n", offset);
@@ -1992,7 +3891,7 @@ void JitWriter::CompileFn(uint32_t ifn)
 
 		case opcode::i64_load:
 		{
-			uint32_t align = safe_read_buffer<varuint32>(&pop, &cb);	// NYI alignment
+			safe_read_buffer<varuint32>(&pop, &cb);	// alignment, NYI
 			uint32_t offset = safe_read_buffer<varuint32>(&pop, &cb);
 #ifdef PRINT_DISASSEMBLY
 			printf("i64.load $%X\n", offset);
@@ -2003,7 +3902,7 @@ void JitWriter::CompileFn(uint32_t ifn)
 
 		case opcode::i64_load8_s:
 		{
-			uint32_t align = safe_read_buffer<varuint32>(&pop, &cb);	// NYI alignment
+			safe_read_buffer<varuint32>(&pop, &cb);	// alignment, NYI
 			uint32_t offset = safe_read_buffer<varuint32>(&pop, &cb);
 #ifdef PRINT_DISASSEMBLY
 			printf("i64.load8_s $%X\n", offset);
@@ -2015,7 +3914,7 @@ void JitWriter::CompileFn(uint32_t ifn)
 		case opcode::i32_load16_u:
 		case opcode::i64_load16_u:
 		{
-			uint32_t align = safe_read_buffer<varuint32>(&pop, &cb);	// NYI alignment
+			safe_read_buffer<varuint32>(&pop, &cb);	// alignment, NYI
 			uint32_t offset = safe_read_buffer<varuint32>(&pop, &cb);
 #ifdef PRINT_DISASSEMBLY
 			printf("i64/32.load16_u $%X\n", offset);
@@ -2026,7 +3925,7 @@ void JitWriter::CompileFn(uint32_t ifn)
 
 		case opcode::i64_load16_s:
 		{
-			uint32_t align = safe_read_buffer<varuint32>(&pop, &cb);	// NYI alignment
+			safe_read_buffer<varuint32>(&pop, &cb);	// alignment, NYI
 			uint32_t offset = safe_read_buffer<varuint32>(&pop, &cb);
 #ifdef PRINT_DISASSEMBLY
 			printf("i64.load16_s $%X\n", offset);
@@ -2037,7 +3936,7 @@ void JitWriter::CompileFn(uint32_t ifn)
 
 		case opcode::i64_load32_s:
 		{
-			uint32_t align = safe_read_buffer<varuint32>(&pop, &cb);	// NYI alignment
+			safe_read_buffer<varuint32>(&pop, &cb);	// alignment, NYI
 			uint32_t offset = safe_read_buffer<varuint32>(&pop, &cb);
 #ifdef PRINT_DISASSEMBLY
 			printf("i64_load32_s $%X\n", offset);
@@ -2099,7 +3998,7 @@ void JitWriter::CompileFn(uint32_t ifn)
 		case opcode::i32_store:
 		case opcode::f32_store:
 		{
-			uint32_t align = safe_read_buffer<varuint32>(&pop, &cb);	// NYI alignment
+			safe_read_buffer<varuint32>(&pop, &cb);	// alignment, NYI
 			uint32_t offset = safe_read_buffer<varuint32>(&pop, &cb);
 #ifdef PRINT_DISASSEMBLY
 			printf("i32.store $%X\n", offset);
@@ -2111,7 +4010,7 @@ void JitWriter::CompileFn(uint32_t ifn)
 		case opcode::f64_store:
 		case opcode::i64_store:
 		{
-			uint32_t align = safe_read_buffer<varuint32>(&pop, &cb);	// NYI alignment
+			safe_read_buffer<varuint32>(&pop, &cb);	// alignment, NYI
 			uint32_t offset = safe_read_buffer<varuint32>(&pop, &cb);
 #ifdef PRINT_DISASSEMBLY
 			printf("i64.store $%X\n", offset);
@@ -2123,7 +4022,7 @@ void JitWriter::CompileFn(uint32_t ifn)
 		case opcode::i64_store16:
 		case opcode::i32_store16:
 		{
-			uint32_t align = safe_read_buffer<varuint32>(&pop, &cb);	// NYI alignment
+			safe_read_buffer<varuint32>(&pop, &cb);	// alignment, NYI
 			uint32_t offset = safe_read_buffer<varuint32>(&pop, &cb);
 #ifdef PRINT_DISASSEMBLY
 			printf("i32.store16 $%X\n", offset);
@@ -2135,7 +4034,7 @@ void JitWriter::CompileFn(uint32_t ifn)
 		case opcode::i64_store8:
 		case opcode::i32_store8:
 		{
-			uint32_t align = safe_read_buffer<varuint32>(&pop, &cb);	// NYI alignment
+			safe_read_buffer<varuint32>(&pop, &cb);	// alignment, NYI
 			uint32_t offset = safe_read_buffer<varuint32>(&pop, &cb);
 #ifdef PRINT_DISASSEMBLY
 			printf("i32.store8 $%X\n", offset);
@@ -2366,7 +4265,43 @@ void JitWriter::CompileFn(uint32_t ifn)
 #ifdef PRINT_DISASSEMBLY
 			printf("f32.neg\n");
 #endif
-			FloatNeg(false /*fDouble*/);
+			FloatUnary(UnaryOperation::Neg, false /*fDouble*/);
+			break;
+		case opcode::f32_abs:
+#ifdef PRINT_DISASSEMBLY
+			printf("f32.abs\n");
+#endif
+			FloatUnary(UnaryOperation::Abs, false /*fDouble*/);
+			break;
+		case opcode::f32_sqrt:
+#ifdef PRINT_DISASSEMBLY
+			printf("f32.sqrt\n");
+#endif
+			FloatUnary(UnaryOperation::Sqrt, false /*fDouble*/);
+			break;
+		case opcode::f32_ceil:
+#ifdef PRINT_DISASSEMBLY
+			printf("f32.ceil\n");
+#endif
+			FloatUnary(UnaryOperation::Ceil, false /*fDouble*/);
+			break;
+		case opcode::f32_floor:
+#ifdef PRINT_DISASSEMBLY
+			printf("f32.floor\n");
+#endif
+			FloatUnary(UnaryOperation::Floor, false /*fDouble*/);
+			break;
+		case opcode::f32_trunc:
+#ifdef PRINT_DISASSEMBLY
+			printf("f32.trunc\n");
+#endif
+			FloatUnary(UnaryOperation::Trunc, false /*fDouble*/);
+			break;
+		case opcode::f32_nearest:
+#ifdef PRINT_DISASSEMBLY
+			printf("f32.nearest\n");
+#endif
+			FloatUnary(UnaryOperation::Nearest, false /*fDouble*/);
 			break;
 		case opcode::f32_add:
 #ifdef PRINT_DISASSEMBLY
@@ -2393,21 +4328,65 @@ void JitWriter::CompileFn(uint32_t ifn)
 			FloatArithmetic(ArithmeticOperation::Divide, false /*fDouble*/);
 			break;
 		case opcode::f32_copysign:
-			Ud2();	// doesn't work
 #ifdef PRINT_DISASSEMBLY
 			printf("f32.copysign\n");
 #endif
-			// and eax, 8000'0000h
-			// xor [rdi - 8], eax
-			SafePushCode("\x25\x00\x00\x00\x80\x31\x47\xF8", 8);
-			_PopContractStack();
+			FloatCopySign(false /*fDouble*/);
+			break;
+		case opcode::f32_min:
+#ifdef PRINT_DISASSEMBLY
+			printf("f32.min\n");
+#endif
+			FloatMinMax(false /*fMax*/, false /*fDouble*/);
+			break;
+		case opcode::f32_max:
+#ifdef PRINT_DISASSEMBLY
+			printf("f32.max\n");
+#endif
+			FloatMinMax(true /*fMax*/, false /*fDouble*/);
 			break;
 
 		case opcode::f64_neg:
 #ifdef PRINT_DISASSEMBLY
 			printf("f64.neg\n");
 #endif
-			FloatNeg(true /*fDouble*/);
+			FloatUnary(UnaryOperation::Neg, true /*fDouble*/);
+			break;
+		case opcode::f64_abs:
+#ifdef PRINT_DISASSEMBLY
+			printf("f64.abs\n");
+#endif
+			FloatUnary(UnaryOperation::Abs, true /*fDouble*/);
+			break;
+		case opcode::f64_sqrt:
+#ifdef PRINT_DISASSEMBLY
+			printf("f64.sqrt\n");
+#endif
+			FloatUnary(UnaryOperation::Sqrt, true /*fDouble*/);
+			break;
+		case opcode::f64_ceil:
+#ifdef PRINT_DISASSEMBLY
+			printf("f64.ceil\n");
+#endif
+			FloatUnary(UnaryOperation::Ceil, true /*fDouble*/);
+			break;
+		case opcode::f64_floor:
+#ifdef PRINT_DISASSEMBLY
+			printf("f64.floor\n");
+#endif
+			FloatUnary(UnaryOperation::Floor, true /*fDouble*/);
+			break;
+		case opcode::f64_trunc:
+#ifdef PRINT_DISASSEMBLY
+			printf("f64.trunc\n");
+#endif
+			FloatUnary(UnaryOperation::Trunc, true /*fDouble*/);
+			break;
+		case opcode::f64_nearest:
+#ifdef PRINT_DISASSEMBLY
+			printf("f64.nearest\n");
+#endif
+			FloatUnary(UnaryOperation::Nearest, true /*fDouble*/);
 			break;
 		case opcode::f64_add:
 #ifdef PRINT_DISASSEMBLY
@@ -2437,18 +4416,25 @@ void JitWriter::CompileFn(uint32_t ifn)
 #ifdef PRINT_DISASSEMBLY
 			printf("f64.copysign\n");
 #endif
-			Ud2();	// doesn't work
-			// mov rcx, 0x8000000000000000
-			// and rax, rcx
-			// xor[rdi - 8], rax
-			SafePushCode("\x48\xB9\x00\x00\x00\x00\x00\x00\x00\x80\x48\x21\xC8\x48\x31\x47\xF8", 17);
-			_PopContractStack();
+			FloatCopySign(true /*fDouble*/);
+			break;
+		case opcode::f64_min:
+#ifdef PRINT_DISASSEMBLY
+			printf("f64.min\n");
+#endif
+			FloatMinMax(false /*fMax*/, true /*fDouble*/);
+			break;
+		case opcode::f64_max:
+#ifdef PRINT_DISASSEMBLY
+			printf("f64.max\n");
+#endif
+			FloatMinMax(true /*fMax*/, true /*fDouble*/);
 			break;
 
 		case opcode::i32_wrap_i64:
 		{
-			const uint8_t rgcode[] = { 0x89, 0xC0 };	// mov eax, eax	; truncates upper 64-bits
-			SafePushCode(rgcode);
+			_EnsureCached(1);
+			_EmitRegReg({ 0x89 }, false, _StackReg(0), _StackReg(0));	// mov reg32, reg32	; truncates upper 64-bits
 			break;
 		}
 		case opcode::i32_trunc_s_f32:
@@ -2581,47 +4567,52 @@ void JitWriter::CompileFn(uint32_t ifn)
 #ifdef PRINT_DISASSEMBLY
 			printf("end\n");
 #endif
-			if (stackBlockTypeAddr.size() > 1)
+			Verify(!stackLabel.empty());
+			if (fUnreachable)
 			{
-				LeaveBlock(stackBlockTypeAddr.back().first != value_type::empty_block);	// don't "leave" the function
+				// Only the branches get here, they left the label's entries with the result in its register
+				if (!stackVecFixupsRelative.back().empty())
+				{
+					const Label &label = stackLabel.back();
+					_ResetStack(label.cstackMem, label.fResult, _RegResult(label.type));
+					fUnreachable = false;
+				}
 			}
-			else
+			else if (!stackVecFixupsRelative.back().empty() || stackLabel.size() == 1)
 			{
-				Verify(stackBlockTypeAddr.back().first == value_type::none);
-				LeaveBlock(true);
+				LeaveBlock(stackLabel.back());
 			}
-			// Jump targets are after the LeaveBlock because the branch already performs the work (TODO: Maybe not do that?)
+			// else nothing branches here (loops and blocks nobody leaves early) so the fallthrough's stack carries on
 			for (int32_t *poffsetFix : stackVecFixupsRelative.back())
 			{
-				*poffsetFix = numeric_cast<int32_t>(m_pexecPlaneCur - (reinterpret_cast<uint8_t*>(poffsetFix) + sizeof(*poffsetFix)));
-			}
-			for (void **pp : stackVecFixupsAbsolute.back())
-			{
-				*pp = m_pexecPlaneCur;
+				*_PWritable(poffsetFix) = numeric_cast<int32_t>(m_pexecPlaneCur - (reinterpret_cast<uint8_t*>(poffsetFix) + sizeof(*poffsetFix)));
 			}
 
-			stackBlockTypeAddr.pop_back();
+			stackLabel.pop_back();
 			stackVecFixupsRelative.pop_back();
-			stackVecFixupsAbsolute.pop_back();
 			break;
 
 		case opcode::current_memory:
 		{
-			uint8_t reserved = safe_read_buffer<uint8_t>(&pop, &cb);
+			safe_read_buffer<uint8_t>(&pop, &cb);	// reserved
 #ifdef PRINT_DISASSEMBLY
 			printf("current_memory\n");
 #endif
 			PushC32(0);						// re-use grow_memory, just give a delta of 0
+			_SavePinnedLocals(true /*fXmmOnly*/);	// GrowMemoryOp calls into C
 			CallAsmOp(m_pfnGrowMemoryOp);
+			_RestorePinnedLocals(true /*fXmmOnly*/);
 			break;
 		}
 		case opcode::grow_memory:
 		{
-			uint8_t reserved = safe_read_buffer<uint8_t>(&pop, &cb);
+			safe_read_buffer<uint8_t>(&pop, &cb);	// reserved
 #ifdef PRINT_DISASSEMBLY
 			printf("grow_memory\n");
 #endif
+			_SavePinnedLocals(true /*fXmmOnly*/);
 			CallAsmOp(m_pfnGrowMemoryOp);
+			_RestorePinnedLocals(true /*fXmmOnly*/);
 			break;
 		}
 			
@@ -2630,113 +4621,406 @@ void JitWriter::CompileFn(uint32_t ifn)
 
 		}
 	}
-	FnEpilogue(m_pctxt->m_vecfn_types[itype]->fHasReturnValue);
+	if (!fUnreachable)
+		FnEpilogue(m_pctxt->m_vecfn_types[itype]->fHasReturnValue);
 
-	for (uint32_t ifnCompile : vecifnCompile)
-	{
-		void *&pfn = reinterpret_cast<void**>(m_pexecPlane)[ifnCompile];
-		if (pfn == nullptr)
-		{
-			CompileFn(ifnCompile);
-		}
-	}
+	_SetFnEntry(ifn, pvEntry);
+	_ResolveCalls();
 #ifdef PRINT_DISASSEMBLY
 	printf("\n\n");
 #endif
 }
 
-extern "C" uint64_t ExternCallFnASM(ExecutionControlBlock *pctl);
+bool JitWriter::FCompileOptimized(uint32_t ifn)
+{
+	OptimizingCompiler compiler(this, ifn);
+	void *pvEntry = compiler.PvCompile();
+	if (pvEntry == nullptr)
+		return false;
+	_SetFnEntry(ifn, pvEntry);
+	return true;
+}
+
+void JitWriter::_SetFnEntry(uint32_t ifn, void *pv)
+{
+	// Other threads may be calling through the table, make sure they see the finished code
+	static_assert(sizeof(std::atomic<void*>) == sizeof(void*), "function table entries are plain pointers");
+	void **ppfn = _PWritable(reinterpret_cast<void**>(m_pexecPlane) + ifn);
+	uint8_t *pbOld = reinterpret_cast<uint8_t*>(reinterpret_cast<std::atomic<void*>*>(ppfn)->exchange(pv, std::memory_order_release));
+	auto itrIndirect = std::lower_bound(m_vecpairIndirect.begin(), m_vecpairIndirect.end(), std::make_pair(ifn, uint32_t(0)));
+	for (; itrIndirect != m_vecpairIndirect.end() && itrIndirect->first == ifn; ++itrIndirect)
+		reinterpret_cast<std::atomic<void*>*>(&_PWritable(m_rgindirect)[itrIndirect->second].pfn)->store(pv, std::memory_order_release);
+	if (pbOld == nullptr)
+		return;
+
+	// Direct calls still go to the old code, its entry becomes a jmp rel32 to the new one.  The first 8 bytes of a
+	//	baseline entry are the tier up counter's dec and jnz which nothing jumps into, and the entry is 8 byte aligned
+	//	so the patch is a single store.
+	Verify(pbOld[0] == 0xFF && (reinterpret_cast<uintptr_t>(pbOld) & 7) == 0);
+	uint64_t code;
+	memcpy(&code, pbOld, sizeof(code));
+	int32_t rel32 = numeric_cast<int32_t>(reinterpret_cast<uint8_t*>(pv) - (pbOld + 5));
+	code = (code & ~0xFF'FFFF'FFFFULL) | 0xE9 | (uint64_t(uint32_t(rel32)) << 8);
+	reinterpret_cast<std::atomic<uint64_t>*>(_PWritable(pbOld))->store(code, std::memory_order_release);
+}
+
+void JitWriter::_AlignCode(size_t cbAlign)
+{
+	// int 3 padding, nothing should run it
+	while (reinterpret_cast<uintptr_t>(m_pexecPlaneCur) & (cbAlign - 1))
+		SafePushCode(uint8_t(0xCC));
+}
+
+void JitWriter::_EmitCallFn(uint32_t ifn)
+{
+	// nop ...		; the rel32 is 4 byte aligned so patching it is a single store
+	// call rel32	; resolved once the function is finished
+	while ((reinterpret_cast<uintptr_t>(m_pexecPlaneCur) + 1) & 3)
+		SafePushCode(uint8_t(0x90));
+	SafePushCode(uint8_t(0xE8));
+	m_veccallFixup.push_back(std::make_pair(ifn, reinterpret_cast<int32_t*>(m_pexecPlaneCur)));
+	SafePushCode(int32_t(0));
+}
+
+void JitWriter::_ResolveCalls()
+{
+	for (const auto &pairFixup : m_veccallFixup)
+	{
+		uint8_t *pbTarget = reinterpret_cast<uint8_t**>(m_pexecPlane)[pairFixup.first];
+		if (pbTarget == nullptr)
+			pbTarget = _PbStub(pairFixup.first);
+		*_PWritable(pairFixup.second) = numeric_cast<int32_t>(pbTarget - reinterpret_cast<uint8_t*>(pairFixup.second + 1));
+	}
+	m_veccallFixup.clear();
+}
+
+uint8_t *JitWriter::_PbStub(uint32_t ifn)
+{
+	if (m_vecpvStub[ifn] == nullptr)
+	{
+		//	mov ecx, ifn
+		//	jmp [m_pfnLazyCallShim]		; the return address is still the call to patch
+		m_vecpvStub[ifn] = m_pexecPlaneCur;
+		SafePushCode(uint8_t(0xB9));
+		SafePushCode(ifn);
+		static const uint8_t rgcodeJmp[] = { 0xFF, 0x25 };
+		SafePushCode(rgcodeJmp);
+		SafePushCode(numeric_cast<int32_t>(reinterpret_cast<uint8_t*>(m_pfnLazyCallShim) - (m_pexecPlaneCur + 4)));
+	}
+	return reinterpret_cast<uint8_t*>(m_vecpvStub[ifn]);
+}
+
+void *JitWriter::PvLazyCompile(uint32_t ifn, uint8_t *pbRet)
+{
+	std::lock_guard<std::mutex> lock(m_mutexCompile);
+	void *pvEntry = reinterpret_cast<void**>(m_pexecPlane)[ifn];
+	if (pvEntry == nullptr)
+	{
+		CompileFn(ifn);
+		pvEntry = reinterpret_cast<void**>(m_pexecPlane)[ifn];
+	}
+
+	// Later calls from this site go straight to the code, other sites patch themselves when they first run.  Calls
+	//	through the indirect table come here without a stub and have nothing to patch.
+	int32_t *prel32 = reinterpret_cast<int32_t*>(pbRet) - 1;
+	if (m_vecpvStub[ifn] != nullptr && pbRet[-5] == 0xE8 && pbRet + *prel32 == m_vecpvStub[ifn])
+	{
+		Verify((reinterpret_cast<uintptr_t>(prel32) & 3) == 0);
+		int32_t rel32 = numeric_cast<int32_t>(reinterpret_cast<uint8_t*>(pvEntry) - pbRet);
+		reinterpret_cast<std::atomic<int32_t>*>(_PWritable(prel32))->store(rel32, std::memory_order_release);
+	}
+	return pvEntry;
+}
+
+void JitWriter::_EmitTierUpCounter(uint32_t ifn)
+{
+	// Afterwards we continue in whatever the function table holds.  rcx is free at the entry, TierUpShim keeps the
+	//	argument registers intact.
+	//		dec dword ptr [cCallsLeft]
+	//		jnz LContinue
+	//		mov ecx, ifn
+	//		call [m_pfnTierUpShim]
+	//		jmp [PfnVector + ifn]
+	//	LContinue:
+	_EmitRegRip({ 0xFF }, false, 1, &m_rgprofile[ifn].cCallsLeft);
+	static const uint8_t rgcodeJnz[] = { 0x75, 0x00 };
+	SafePushCode(rgcodeJnz);
+	uint8_t *pbJnzEnd = m_pexecPlaneCur;
+
+	SafePushCode(uint8_t(0xB9));
+	SafePushCode(ifn);
+	static const uint8_t rgcodeCall[] = { 0xFF, 0x15 };
+	SafePushCode(rgcodeCall);
+	SafePushCode(numeric_cast<int32_t>(reinterpret_cast<uint8_t*>(m_pfnTierUpShim) - (m_pexecPlaneCur + 4)));
+	static const uint8_t rgcodeJmp[] = { 0xFF, 0x25 };
+	int32_t offset = RelAddrPfnVector(ifn, 6);
+	SafePushCode(rgcodeJmp);
+	SafePushCode(offset);
+	*_PWritable(pbJnzEnd - 1) = numeric_cast<uint8_t>(m_pexecPlaneCur - pbJnzEnd);
+}
+
+void JitWriter::_EmitOsrCounter(uint32_t ifn, uint32_t ibLoop)
+{
+	// Emitted at a loop head with nothing cached, rcx and rdx are free.  If the optimized code can be entered here
+	//	we jump in with the operand stack and the locals in the frame, its return goes straight to our caller.
+	//		dec dword ptr [cBackEdgesLeft]
+	//		jnz LContinue			; rel32, the saves and restores of many pinned locals don't fit a rel8
+	//		mov [rsp+local], pinned ...
+	//		mov ecx, ifn
+	//		mov edx, ibLoop
+	//		call [m_pfnOsrShim]		; rcx = entry or 0
+	//		test rcx, rcx
+	//		jz LRestore
+	//		jmp rcx
+	//	LRestore:
+	//		mov xmm, [rsp+local] ...	; the shim called into C
+	//	LContinue:
+	_EmitRegRip({ 0xFF }, false, 1, &m_rgprofile[ifn].cBackEdgesLeft);
+	static const uint8_t rgcodeJnz[] = { 0x0F, 0x85 };
+	SafePushCode(rgcodeJnz);
+	int32_t *prel32Jnz = reinterpret_cast<int32_t*>(m_pexecPlaneCur);
+	SafePushCode(int32_t(0));
+
+	_SavePinnedLocals();
+	SafePushCode(uint8_t(0xB9));
+	SafePushCode(ifn);
+	SafePushCode(uint8_t(0xBA));
+	SafePushCode(ibLoop);
+	static const uint8_t rgcodeCall[] = { 0xFF, 0x15 };
+	SafePushCode(rgcodeCall);
+	SafePushCode(numeric_cast<int32_t>(reinterpret_cast<uint8_t*>(m_pfnOsrShim) - (m_pexecPlaneCur + 4)));
+	static const uint8_t rgcodeTestJz[] = { 0x48, 0x85, 0xC9, 0x74, 0x00 };
+	SafePushCode(rgcodeTestJz);
+	uint8_t *pbJzEnd = m_pexecPlaneCur;
+	static const uint8_t rgcodeJmpRcx[] = { 0xFF, 0xE1 };
+	SafePushCode(rgcodeJmpRcx);
+
+	*_PWritable(pbJzEnd - 1) = numeric_cast<uint8_t>(m_pexecPlaneCur - pbJzEnd);
+	_RestorePinnedLocals(true /*fXmmOnly*/);
+	*_PWritable(prel32Jnz) = numeric_cast<int32_t>(m_pexecPlaneCur - reinterpret_cast<uint8_t*>(prel32Jnz + 1));
+}
+
+void JitWriter::TierUp(uint32_t ifn)
+{
+	std::lock_guard<std::mutex> lock(m_mutexCompile);
+	_TierUp(ifn);
+}
+
+void *JitWriter::PvOsrEntry(uint32_t ifn, uint32_t ibLoop)
+{
+	std::lock_guard<std::mutex> lock(m_mutexCompile);
+	_TierUp(ifn);	// later calls shouldn't need to go through here
+
+	OptimizingCompiler compiler(this, ifn, ibLoop);
+	return compiler.PvCompile();
+}
+
+void JitWriter::_TierUp(uint32_t ifn)
+{
+	FunctionProfile *pprofile = _PWritable(m_rgprofile + ifn);
+	pprofile->cCallsLeft = UINT32_MAX;		// one attempt is enough, the counters may keep running in old code
+	pprofile->cBackEdgesLeft = UINT32_MAX;
+	if (m_vecfTieredUp[ifn])
+		return;
+	m_vecfTieredUp[ifn] = true;
+	FCompileOptimized(ifn);
+}
+
+// These are called from JIT code whose frames have no unwind info, so no exception may leave them.  Failing to
+//	optimize or to fill a cache leaves the code as it was, a function that can't be compiled traps the call.
+extern "C" void TierUp(ExecutionControlBlock *pectl, uint32_t ifn)
+{
+	try
+	{
+		pectl->pjitWriter->TierUp(ifn);
+	}
+	catch (...)
+	{
+		// stays on the baseline code, _TierUp doesn't try again
+	}
+}
+
+extern "C" void *OsrEntry(ExecutionControlBlock *pectl, uint32_t ifn, uint32_t ibLoop)
+{
+	try
+	{
+		return pectl->pjitWriter->PvOsrEntry(ifn, ibLoop);
+	}
+	catch (...)
+	{
+		return nullptr;
+	}
+}
 
+extern "C" void *LazyCompile(ExecutionControlBlock *pectl, uint32_t ifn, uint8_t *pbRet)
+{
+	try
+	{
+		return pectl->pjitWriter->PvLazyCompile(ifn, pbRet);
+	}
+	catch (...)
+	{
+		// LazyCallShim continues at the trap, ExternCallFn throws the error once the JIT frames are gone
+		pectl->pjitWriter->_PexecctxtCurrentThread()->m_excptPending = std::current_exception();
+		return reinterpret_cast<void*>(CompileFailedTrap);
+	}
+}
 
-void JitWriter::ProtectForRuntime()
+extern "C" void FillIndirectCache(ExecutionControlBlock *pectl, uint32_t idx, uint32_t itype, uint8_t *pbSite)
 {
-	DWORD dwT;
-	Verify(VirtualProtect(m_pexecPlane, (uint8_t*)m_pGlobalsStart - m_pexecPlane, PAGE_READONLY, &dwT));
-	Verify(VirtualProtect(m_pcodeStart, m_pexecPlaneCur - m_pcodeStart, PAGE_EXECUTE_READ, &dwT));
+	try
+	{
+		pectl->pjitWriter->FillIndirectCache(pbSite, idx, itype);
+	}
+	catch (...)
+	{
+		// the site keeps doing the lookup
+	}
 }
 
-void JitWriter::UnprotectRuntime()
+extern "C" uint64_t ExternCallFnASM(ExecutionControlBlock *pctl);
+
+static const char *SzFromTrapKind(TrapKind kind)
 {
-	DWORD dwT;
-	Verify(VirtualProtect(m_pexecPlane, (uint8_t*)m_pGlobalsStart - m_pexecPlane, PAGE_READWRITE, &dwT));
-	Verify(VirtualProtect(m_pcodeStart, m_pexecPlaneCur - m_pcodeStart, PAGE_READWRITE, &dwT));
+	switch (kind)
+	{
+	case TrapKind::Unreachable:
+		return "unreachable";
+	case TrapKind::MemoryOutOfBounds:
+		return "out of bounds memory access";
+	case TrapKind::IntegerDivide:
+		return "integer divide by zero or overflow";
+	case TrapKind::StackOverflow:
+		return "stack overflow";
+	case TrapKind::IndirectCall:
+		return "invalid indirect call";
+	case TrapKind::CompileFailed:
+		return "function failed to compile";
+	default:
+		return "unknown";
+	}
 }
 
-ExpressionService::Variant JitWriter::ExternCallFn(uint32_t ifn, void *pvAddr, ExpressionService::Variant *rgargs, uint32_t cargs)
+
+ExpressionService::Variant JitWriter::ExternCallFn(uint32_t ifn, void * /*pvAddr*/, ExpressionService::Variant *rgargs, uint32_t cargs)
 {
 	uint64_t retV;
 	size_t itype = m_pctxt->m_vecfn_entries.at(ifn);
 	auto ptype = m_pctxt->m_vecfn_types[itype].get();
-	void *&pfn = reinterpret_cast<void**>(m_pexecPlane)[ifn];
+	// Other threads may be publishing code in the table (see _SetFnEntry)
+	std::atomic<void*> *ppfn = reinterpret_cast<std::atomic<void*>*>(reinterpret_cast<void**>(m_pexecPlane) + ifn);
+	void *pfn = ppfn->load(std::memory_order_acquire);
 	if (pfn == nullptr)
 	{
-		CompileFn(ifn);
+		std::lock_guard<std::mutex> lock(m_mutexCompile);
+		pfn = ppfn->load(std::memory_order_acquire);
+		if (pfn == nullptr)
+		{
+			CompileFn(ifn);
+			pfn = ppfn->load(std::memory_order_acquire);
+		}
 	}
 	
-	m_vecoperand.resize(4096 * 100);
-	m_veclocals.resize(4096 * 100);
 	Verify(pfn != nullptr);
-	if (m_pheap == nullptr)
-	{
-		// Reserve 8GB of memory for our heap plane, this is 2^33 because effective addresses can compute to 33 bits (even though we actually truncate to 32 we reserve the max to prevent security flaws if we truncate incorrectly)
-		m_pheap = VirtualAlloc(nullptr, 0x200000000, MEM_RESERVE, PAGE_NOACCESS);
-		Verify(VirtualAlloc(m_pheap, 0x100000000, MEM_COMMIT, PAGE_READWRITE) != nullptr);
-		Verify(m_pctxt->m_vecmem.size() < 0x100000000);
-		memcpy(m_pheap, m_pctxt->m_vecmem.data(), m_pctxt->m_vecmem.size());
-	}
+	std::call_once(m_onceHeap, [this]() { _ReserveHeap(); });
+
+	ExecutionContext *pexecctxt = _PexecctxtCurrentThread();
+	Verify(!pexecctxt->m_fInUse, "Reentrant calls into wasm are not supported");
 
-	// Process Arguments
-	for (uint32_t iarg = 0; iarg < cargs; ++iarg)
+	// Process Arguments, ExternCallFnASM pushes the stack ones and loads the rest into their registers
+	Verify(cargs == ptype->cparams, "Wrong number of arguments");
+	uint32_t cargsStack = _CargsStack(cargs);
+	std::vector<uint64_t> vecarg(cargsStack);
+	for (uint32_t iarg = 0; iarg < cargsStack; ++iarg)
 	{
-		m_veclocals[iarg] = rgargs[iarg].val;
+		vecarg[iarg] = rgargs[iarg].val;
 	}
 
-	ExecutionControlBlock ectl;
-	ectl.pjitWriter = this;
+	// The module level fields were filled in when the context was created
+	ExecutionControlBlock &ectl = pexecctxt->m_ectl;
+	ectl.dbgOpcode = 0;
+	ectl.trapAddress = nullptr;
+	ectl.trapKind = uint64_t(TrapKind::Unknown);
+	ectl.faultAddress = nullptr;
 	ectl.pfnEntry = pfn;
-	ectl.operandStack = m_vecoperand.data();
-	ectl.localsStack = m_veclocals.data();
-	if (m_pctxt->m_vecmem_types.size() > 0)
-	{
-		ectl.cbHeap = m_pctxt->m_vecmem_types[0].initial_size * (64 * 1024);
-	}
-	else
+	ectl.rgargs = vecarg.data();
+	ectl.cargs = cargsStack;
+	memset(ectl.rgargsReg, 0, sizeof(ectl.rgargsReg));
+	for (uint32_t iarg = cargsStack; iarg < cargs; ++iarg)
 	{
-		ectl.cbHeap = 0;
+		size_t iargSave;
+		_RegArg(ptype->rgparam_type, cargs, iarg, &iargSave);
+		ectl.rgargsReg[iargSave] = rgargs[iarg].val;
 	}
 	ectl.memoryBase = m_pheap;
-	ectl.cFnIndirect = m_pctxt->m_vecIndirectFnTable.size();
-	ectl.rgfnIndirect = m_pctxt->m_vecIndirectFnTable.data();
-	ectl.rgFnTypeIndicies = m_pctxt->m_vecfn_entries.data();
-	ectl.cFnTypeIndicies = m_pctxt->m_vecfn_entries.size();
-	ectl.rgFnPtrs = (void*)m_pexecPlane;
-	ectl.cFnPtrs = m_cfn;
-	
-	ProtectForRuntime();
-	retV = ExternCallFnASM(&ectl);
-	UnprotectRuntime();
-	Verify(retV);
-	Verify(ectl.operandStack >= m_vecoperand.data());
-	Verify(ectl.localsStack >= m_veclocals.data());
-	if (ectl.cbHeap > 0)
-		m_pctxt->m_vecmem_types[0].initial_size = numeric_cast<uint32_t>(ectl.cbHeap / (64 * 1024));
 
+	pexecctxt->m_fInUse = true;
+	retV = ExternCallFnASM(&ectl);
+	pexecctxt->m_fInUse = false;
+	if (!retV)
+	{
+		TrapKind kind = TrapKind(ectl.trapKind);
+		if (kind == TrapKind::CompileFailed && pexecctxt->m_excptPending)
+		{
+			// Same error as when ExternCallFn compiles the function itself
+			std::exception_ptr excpt = pexecctxt->m_excptPending;
+			pexecctxt->m_excptPending = nullptr;
+			std::rethrow_exception(excpt);
+		}
+		if (kind == TrapKind::MemoryOutOfBounds)
+		{
+			// Faults outside the heap reservation are the stack's guard page, frames too big for the entry check
+			uint8_t *pbFault = reinterpret_cast<uint8_t*>(ectl.faultAddress);
+			uint8_t *pbHeap = reinterpret_cast<uint8_t*>(m_pheap);
+			if (pbFault < pbHeap || pbFault >= pbHeap + cbHeapReserve)
+				kind = TrapKind::StackOverflow;
+		}
+		std::string strErr = std::string("Trap (") + SzFromTrapKind(kind) + ")";
+		uint32_t ifnTrap, ibTrap;
+		if (FLookupBytecode(ectl.trapAddress, &ifnTrap, &ibTrap))
+		{
+			const auto &vecbytecode = m_pctxt->m_vecfn_code[ifnTrap - m_pctxt->m_vecimports.size()]->vecbytecode;
+			char szLocation[128];
+			snprintf(szLocation, _countof(szLocation), " in function %u at bytecode offset 0x%x (opcode 0x%02x)", ifnTrap, ibTrap, vecbytecode[ibTrap]);
+			strErr += szLocation;
+		}
+		throw TrapException(kind, strErr);
+	}
 	ExpressionService::Variant varRet;
 	
 	varRet.type = ptype->fHasReturnValue ? ptype->return_type : value_type::none;
 	if (ptype->fHasReturnValue)
-		varRet.val = ectl.retvalue;
+		varRet.val = _FFloatType(ptype->return_type) ? ectl.retvalueFloat : ectl.retvalue;
 	return varRet;
 }
 
-extern "C" void CompileFn(ExecutionControlBlock *pectl, uint32_t ifn)
+ExecutionContext *JitWriter::_PexecctxtCurrentThread()
 {
-	pectl->pjitWriter->UnprotectRuntime();
-	pectl->pjitWriter->CompileFn(ifn);
-	pectl->pjitWriter->ProtectForRuntime();
+	if (g_execctxtcache.idWriter == m_idWriter)
+		return g_execctxtcache.pexecctxt;
+
+	InstallTrapHandler();	// first call into this module from this thread
+
+	std::lock_guard<std::mutex> lock(m_mutexExecctxt);
+	std::thread::id idThread = std::this_thread::get_id();
+	ExecutionContext *pexecctxt = nullptr;
+	for (auto &pairCtxt : m_vecexecctxt)
+	{
+		if (pairCtxt.first == idThread)
+			pexecctxt = pairCtxt.second.get();
+	}
+	if (pexecctxt == nullptr)
+	{
+		auto spexecctxt = std::make_unique<ExecutionContext>(this);
+		pexecctxt = spexecctxt.get();
+		m_vecexecctxt.push_back(std::make_pair(idThread, std::move(spexecctxt)));
+	}
+	g_execctxtcache.idWriter = m_idWriter;
+	g_execctxtcache.pexecctxt = pexecctxt;
+	return pexecctxt;
 }
 
-uint32_t JitWriter::GrowMemory(ExecutionControlBlock *pectl, uint32_t cpages)
+uint32_t JitWriter::GrowMemory(uint32_t cpages)
 {
 	size_t cb = size_t(cpages) * 64 * 1024;	// convert to bytes
 	size_t cbMax = 0x1'0000'0000;
@@ -2744,14 +5028,42 @@ uint32_t JitWriter::GrowMemory(ExecutionControlBlock *pectl, uint32_t cpages)
 	{
 		cbMax = m_pctxt->m_vecmem_types[0].maximum_size * (64 * 1024ULL);
 	}
-	if ((pectl->cbHeap + cb) > cbMax)
+	// Every thread sees the same memory so the size is checked and grown in one step
+	std::lock_guard<std::mutex> lock(m_mutexHeap);
+	uint64_t cbHeap = m_cbHeap.load(std::memory_order_relaxed);
+	if ((cbHeap + cb) > cbMax)
 		return -1;
-	Verify(pectl->cbHeap + cb < 0x1'0000'0000);
-	uint32_t cbRet = (uint32_t)(pectl->cbHeap / (64 * 1024));
-	pectl->cbHeap += cb;
-	return cbRet;
+	Verify(cbHeap + cb < 0x1'0000'0000);
+	_CommitHeap(cbHeap + cb);
+	m_cbHeap.store(cbHeap + cb, std::memory_order_release);
+	return (uint32_t)(cbHeap / (64 * 1024));
+}
+
+void JitWriter::_ReserveHeap()
+{
+	// Reserve 8GB of memory for our heap plane, this is 2^33 because effective addresses (a 32-bit address plus a 32-bit offset, see _DispAddress) compute to 33 bits
+	//	Only the current linear memory size is committed, everything past it faults
+	m_pheap = OsReserveMemory(nullptr, cbHeapReserve, PageProtection::NoAccess);
+	Verify(m_pheap != nullptr);
+	uint64_t cbHeap = m_pctxt->m_vecmem.size();
+	if (m_pctxt->m_vecmem_types.size() > 0)
+		cbHeap = std::max<uint64_t>(cbHeap, m_pctxt->m_vecmem_types[0].initial_size * (64 * 1024ULL));
+	Verify(cbHeap < 0x100000000);
+	std::lock_guard<std::mutex> lock(m_mutexHeap);
+	_CommitHeap(cbHeap);
+	memcpy(m_pheap, m_pctxt->m_vecmem.data(), m_pctxt->m_vecmem.size());
+	m_cbHeap.store(cbHeap, std::memory_order_release);
+}
+
+void JitWriter::_CommitHeap(size_t cbHeap)
+{
+	size_t cbCommit = (cbHeap + 4095) & ~size_t(4095);
+	if (cbCommit <= m_cbHeapCommit)
+		return;
+	OsCommitMemory(reinterpret_cast<uint8_t*>(m_pheap) + m_cbHeapCommit, cbCommit - m_cbHeapCommit);
+	m_cbHeapCommit = cbCommit;
 }
 extern "C" uint32_t GrowMemory(ExecutionControlBlock *pectl, uint32_t cpages)
 {
-	return pectl->pjitWriter->GrowMemory(pectl, cpages);
+	return pectl->pjitWriter->GrowMemory(cpages);
 }
\ No newline at end of file
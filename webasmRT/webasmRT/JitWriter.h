@@ -5,12 +5,39 @@
 #include "numeric_cast.h"
 #include "ExpressionService.h"
 
-extern "C" void CompileFn(struct ExecutionControlBlock *pectl, uint32_t ifn);
+extern "C" void TierUp(struct ExecutionControlBlock *pectl, uint32_t ifn);
+extern "C" void *OsrEntry(struct ExecutionControlBlock *pectl, uint32_t ifn, uint32_t ibLoop);
+extern "C" void *LazyCompile(struct ExecutionControlBlock *pectl, uint32_t ifn, uint8_t *pbRet);
+extern "C" void FillIndirectCache(struct ExecutionControlBlock *pectl, uint32_t idx, uint32_t itype, uint8_t *pbSite);
+
+// The execution plane holds the function table, globals and all code.  Everything in it is addressed with rel32
+//	displacements so it must stay well under 2GB, it is reserved up front and committed as code is generated.
+static const size_t cbExecPlaneReserve = 0x40000000;
+
+struct CompileOptions
+{
+#ifdef _DEBUG
+	bool fDebugStamps = true;	// write each opcode to ExecutionControlBlock::dbgOpcode before executing it
+#else
+	bool fDebugStamps = false;
+#endif
+	bool fOptimizingTier = false;	// recompile hot integer functions with the SSA optimizer, others stay on the baseline
+	uint32_t cTierUpCalls = 1000;		// calls before a function is recompiled, 0 skips the baseline entirely
+	uint32_t cTierUpBackEdges = 20000;	// loop iterations (over all of a function's loops) before it is recompiled
+	uint32_t cbInlineMax = 32;	// bytecode size of the largest callee inlined at a direct call, 0 disables inlining
+};
+
+class ExecutionContext;
+
 class JitWriter
 {
-	friend void CompileFn(ExecutionControlBlock *pectl, uint32_t ifn);
+	friend void TierUp(ExecutionControlBlock *pectl, uint32_t ifn);
+	friend void *OsrEntry(ExecutionControlBlock *pectl, uint32_t ifn, uint32_t ibLoop);
+	friend void *LazyCompile(ExecutionControlBlock *pectl, uint32_t ifn, uint8_t *pbRet);
+	friend void FillIndirectCache(ExecutionControlBlock *pectl, uint32_t idx, uint32_t itype, uint8_t *pbSite);
+	friend class OptimizingCompiler;
 public:
-	JitWriter(class WasmContext *pctxt, uint8_t *pexecPlane, size_t cbExec, size_t cfn, size_t cglbls);
+	JitWriter(class WasmContext *pctxt, uint8_t *pexecPlane, uint8_t *pwritePlane, size_t cbExec, size_t cfn, size_t cglbls);	// takes ownership of the dual mapped plane
 	~JitWriter();
 
 	void CompileFn(uint32_t ifn);
@@ -19,9 +46,16 @@ public:
 
 	// Psuedo private callbacks from ASM
 	uint64_t CReentryFn(int ifn, uint64_t *pvArgs, uint8_t *pvMemBase, ExecutionControlBlock *pecb);
-	uint32_t GrowMemory(ExecutionControlBlock *pectl, uint32_t cpages);
+	uint32_t GrowMemory(uint32_t cpages);
+
+	// Maps an address inside JIT code back to the function and bytecode offset that generated it
+	bool FLookupBytecode(const void *pvCode, uint32_t *pifn, uint32_t *pibBytecode) const;
 private:
 	void SafePushCode(const void *pv, size_t cb);
+	void _CommitExecPlane(uint8_t *pbEnd);
+	// All pointers into the execution plane are in the executable view, writes must go through this
+	template<typename T>
+	T *_PWritable(T *pExec) const { return reinterpret_cast<T*>(reinterpret_cast<uint8_t*>(pExec) + m_cbWriteView); }
 	template<typename T, size_t size>
 	size_t GetArrLength(T(&)[size]) { return size; }
 
@@ -70,29 +104,156 @@ private:
 		Multiply,
 		Divide,
 	};
+	enum class UnaryOperation
+	{
+		Neg,
+		Abs,
+		Sqrt,
+		Ceil,
+		Floor,
+		Trunc,
+		Nearest,
+	};
 
 	int32_t RelAddrPfnVector(uint32_t ifn, uint32_t opSize) const
 	{
 		return numeric_cast<int32_t>((m_pexecPlane + (sizeof(void*)*ifn)) - (m_pexecPlaneCur + opSize));
 	}
 
-	// Common code sequences (does not leave machine in valid state)
-	void _PushExpandStack();
-	void _PopContractStack();
-	void _PopSecondParam(bool fSwapParams = false);
+	// x86-64 registers in encoding order
+	enum Reg : uint8_t
+	{
+		rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi,
+		r8, r9, r10, r11, r12, r13, r14, r15,
+	};
+	enum Xmm : uint8_t
+	{
+		xmm0, xmm1, xmm2, xmm3, xmm4, xmm5, xmm6, xmm7,
+		xmm8, xmm9, xmm10, xmm11, xmm12, xmm13, xmm14, xmm15,
+	};
+	// Operand cache entries and pinned locals above the general purpose registers are xmm registers
+	static const uint8_t regXmmFirst = 16;
+	static bool _FXmm(Reg reg) { return reg >= regXmmFirst; }
+	static Xmm _XmmOf(Reg reg) { return Xmm(reg - regXmmFirst); }
+	static Reg _RegOfXmm(Xmm xmm) { return Reg(regXmmFirst + xmm); }
+	static uint32_t RegMask(Reg reg) { return 1U << reg; }
+
+	// Instruction encoding (regOp is either a register or the /digit opcode extension)
+	void _EmitRex(bool f64, uint8_t regOp, uint8_t index, uint8_t base);
+	void _EmitRegReg(std::initializer_list<uint8_t> rgop, bool f64, uint8_t regOp, uint8_t rm);
+	void _EmitRegMem(std::initializer_list<uint8_t> rgop, bool f64, uint8_t regOp, Reg base, int32_t disp);
+	void _EmitRegMemIndex(std::initializer_list<uint8_t> rgop, bool f64, uint8_t regOp, Reg base, Reg index, int32_t disp = 0);
+	void _EmitRegRip(std::initializer_list<uint8_t> rgop, bool f64, uint8_t regOp, const void *pvTarget);
+	void _MovRegReg(Reg regDst, Reg regSrc);
+	void _MovRegImm(Reg reg, uint64_t c);
+	void _MovGprToXmm(Xmm xmm, Reg reg, bool f64);
+	void _MovXmmToGpr(Reg reg, Xmm xmm, bool f64);
+	// Either register class, xmm registers are moved with movq
+	void _MoveEntry(Reg regDst, Reg regSrc);
+	void _LoadEntry(Reg reg, Reg base, int32_t disp);
+	void _StoreEntry(Reg reg, Reg base, int32_t disp);
+	void _PushEntry(Reg reg);	// NOTE: Must not affect flags
+	void _PopEntry(Reg reg);	// NOTE: Must not affect flags
+
+	// Operand stack register cache
+	//	The logical operand stack is [m_cstackMem entries on the native stack][m_vecregStack], the top of the stack is
+	//	m_vecregStack.back().  Spilling pushes and reloading pops so rsp is always on the top entry in memory, the
+	//	height is known while compiling (validation fixes it at every point) so everything in the frame is at an
+	//	offset from rsp that is known too.
+	//	f32 and f64 operands may be cached in xmm registers instead, an f32 always has zeros above its low 32 bits so
+	//	every move between the classes and to memory is a movq.  Operations pick the class they need with RegClass.
+	enum class RegClass
+	{
+		Gpr,
+		Xmm,
+		Any,	// whatever the entry is in already
+	};
+	Reg _AllocReg();
+	Reg _AllocXmm();
+	void _PushReg(Reg reg);
+	Reg _PopReg(RegClass rc = RegClass::Gpr);		// the register is free but holds the value until the next allocation of its class
+	Reg _StackReg(size_t iFromTop) const { return m_vecregStack[m_vecregStack.size() - 1 - iFromTop]; }
+	void _EnsureCached(size_t centries, RegClass rc = RegClass::Gpr);
+	void _EnsureClass(size_t iFromTop, RegClass rc);
+	void _ReplaceTop(Reg reg);
+	void _SpillBottom();
+	void _MoveToReg(size_t iFromTop, Reg reg);	// either class, NOTE: Must not affect flags
+	void _EvictReg(Reg reg);
+	void _SpillStack();	// every cached entry to memory, NOTE: Must not affect flags
+	void _FlushStack();	// everything but the top to memory and the top in rax, NOTE: Must not affect flags
+	void _ResetStack(int32_t cstackMem, bool fTopInReg, Reg regTop = rax);
+	void _DropTop();
+	void _ReleaseStack(int32_t cb);	// lea rsp, [rsp + cb], NOTE: Must not affect flags
+	static int32_t _DispStack(int32_t centries) { return centries * int32_t(sizeof(uint64_t)); }
+
+	// Wasm to wasm calls pass the last cargsReg arguments in registers, integers in rax, r9, r10, r11 and floats in
+	//	xmm2-xmm5 in the order they come.  The arguments before them are pushed in order by the caller, who also pops
+	//	them.  Results come back in _RegResult, the same register a branch carries them in.
+	static const uint32_t cargsReg = 4;
+	static uint32_t _CargsStack(uint32_t cargs) { return (cargs > cargsReg) ? cargs - cargsReg : 0; }
+	// iargSave is the argument's index in the blocks of saved argument registers the host thunks use, see
+	//	ExecutionControlBlock::rgargsReg and CReentryFn
+	static Reg _RegArg(const value_type *rgtype, uint32_t cargs, uint32_t iarg, size_t *piargSave = nullptr);
+	static bool _FFloatType(value_type type) { return type == value_type::f32 || type == value_type::f64; }
+	static Reg _RegResult(value_type type) { return _FFloatType(type) ? _RegOfXmm(xmm2) : rax; }
+
+	// A function's frame from rsp up is its operand stack entries in memory, the locals that aren't passed on the stack
+	//	(the prologue pushes the register arguments and then the other locals in order), the saved rbp that rbp points
+	//	at, the return address and the stack arguments.  _DispLocal is relative to the bottom of the locals, the
+	//	optimizing tier lays out its own frame around them.
+	static int32_t _DispLocal(uint32_t idx, uint32_t cparams, uint32_t clocals);
+	int32_t _DispLocalFromRsp(uint32_t idx) const { return _DispStack(m_cstackMem) + _DispLocal(idx, m_cparamsFn, m_clocalsFn); }
+
+	// Comparisons leave their result in the flags so a following if/br_if/select can use it directly
+	static const uint8_t ccNone = 0xFF;
+	void _MaterializeCondition();	// NOTE: Must not affect flags
+	uint8_t _PopCondition();		// returns the x86 condition code that is set when the popped i32 is nonzero
+
+	// Constants are held back so the instruction that consumes them can encode them as an immediate
+	static bool _FConstantConsumer(opcode op);
+	void _DeferConstant(uint64_t c);
+	void _MaterializeConstant();
+	bool _FPopImm32(bool f64, int32_t *pimm);	// pops a pending constant if it fits a sign extended imm32
+	void _EmitAluImm(uint8_t opext, bool f64, Reg reg, int32_t imm);
+
+	// Hot locals pinned to callee-saved registers, their frame slots are only valid around calls and traps.  Float
+	//	locals are pinned to xmm8-xmm11 which C may clobber, fXmmOnly saves just those around calls into C.
+	void SelectPinnedLocals(const FunctionCodeEntry *pfnc, const std::vector<value_type> &vectypeLocal);
+	bool _FPinnedLocal(uint32_t idx, Reg *preg) const;
+	void _SavePinnedLocals(bool fXmmOnly = false);
+	void _RestorePinnedLocals(bool fXmmOnly = false);
+
+	// Branch target of a block, loop or if.  On entry the operand stack goes to memory where it stays until the end,
+	//	so a branch only puts the result (if any) in _RegResult, pops the entries above the label's and jumps.
+	struct Label
+	{
+		value_type type;	// the result type, the function's own label has the return type
+		void *pvTarget;		// the loop head, nullptr for labels fixed up at their end
+		int32_t cstackMem;	// operand stack entries in memory when the block was entered
+		bool fResult;		// branches carry a value (never for loops)
+	};
+	void _LoadLabelResult(const Label &label);	// NOTE: Must not affect flags
+	int32_t *_JumpLabel(const Label &label, uint8_t cc);	// ccNone for an unconditional branch, returns the rel32 to fix up
+
 	void _SetDbgReg(uint32_t opcode);
+	void _RecordCodeMap(uint32_t ifn, uint32_t ibBytecode);
 
 	// common operations (does leave machine in valid state)
-	void LoadMem(uint32_t offset, bool f64Dst /* else 32 */, uint32_t cbSrc, bool fSignExtend);
+	void LoadMem(uint32_t offset, bool f64Dst /* else 32 */, uint32_t cbSrc, bool fSignExtend, bool fFloat = false);
+	int32_t _DispAddress(Reg regAddr, uint32_t offset);	// the address register must be on the operand stack
 	void StoreMem(uint32_t offset, uint32_t cbDst);
 
 	void Sub32();
 	void Add32();
+	void BinaryOp(std::initializer_list<uint8_t> rgop, bool f64);
 	void Mul32();
 	void Add64();
 	void Sub64();
 	void Mul64();
 	void Div(bool fSigned, bool fModulo, bool f64);
+	// Division by a constant with multiplies and shifts, anything that can trap still needs div
+	static bool _FDivConstInline(bool fSigned, bool fModulo, bool f64, uint64_t divisor);
+	Reg _EmitDivConst(bool fSigned, bool fModulo, bool f64, uint64_t divisor, Reg regDividend);
 	void Popcnt32();
 	void Popcnt64();
 	void PushC32(uint32_t c);
@@ -108,48 +269,153 @@ private:
 	void CountLeadingZeros(bool f64);
 	void Select();
 	void Compare(CompareType type, bool fSigned, bool f64);
-	void FloatCompare(CompareType type);
-	void DoubleCompare(CompareType type);
+	void FloatCompare(CompareType type, bool fDouble);
 	void Eqz32();
 	void Eqz64();
 	void CallAsmOp(void **pfn);
 	void LogicOp(LogicOperation op);
 	void LogicOp64(LogicOperation op);
 	void FloatArithmetic(ArithmeticOperation op, bool fDouble);
-	int32_t *JumpNIf(void *addr);	// returns a pointer to the offset encoded in the instruction for later adjustment
+	int32_t *JumpCc(uint8_t cc, void *addr);	// returns a pointer to the offset encoded in the instruction for later adjustment
 	int32_t *Jump(void *addr);
-	void CallIfn(uint32_t ifn, uint32_t clocalsCaller, uint32_t cargsCallee, bool fReturnValue, bool fIndirect);
+	void CallIfn(uint32_t ifn, const FunctionTypeEntry *ptypeCallee, bool fIndirect);
+	void CallIndirect(uint32_t itype);
+	void FillIndirectCache(uint8_t *pbSite, uint32_t idx, uint32_t itype);
 	void FnEpilogue(bool fRetVal);
-	void FnPrologue(uint32_t clocals, uint32_t cargs);
-	void BranchTableParse(const uint8_t **ppoperand, size_t *pcbOperand, const std::vector<std::pair<value_type, void*>> &stackBlockTypeAddr, std::vector<std::vector<int32_t*>> &stackVecFixups, std::vector<std::vector<void**>> &stackVecFixupsAbsolute);
+	void FnPrologue(uint32_t ifn, const std::vector<value_type> &vectypeLocal, uint32_t cargs);
+	void _EmitFramePointer();	// push rbp and point it at the saved value, leave undoes it
+	void _EmitStackCheck();	// traps with StackOverflow when rsp is below ExecutionControlBlock::stackLimit
+	void BranchTableParse(const uint8_t **ppoperand, size_t *pcbOperand, const std::vector<Label> &stackLabel, std::vector<std::vector<int32_t*>> &stackVecFixups);
+	// Validates one opcode of code nothing can reach without emitting anything, cdepth is the labels a branch may target
+	void _SkipUnreachable(const uint8_t **ppop, size_t *pcb, size_t cdepth, uint32_t clocals, uint32_t *pcblockDead) const;
+	void _BranchTableTree(const std::vector<uint32_t> &vecidxRun, const std::vector<size_t> &vecitargetRun, size_t irunFirst, size_t irunLast, std::vector<std::vector<int32_t*>> &vecvecpfixTarget);
 	void ExtendSigned32_64();
-	void FloatNeg(bool fDouble);
+	void FloatUnary(UnaryOperation op, bool fDouble);
+	void FloatCopySign(bool fDouble);
+	void _FloatRoundSse2(UnaryOperation op, bool fDouble);	// ceil, floor, trunc and nearest without SSE4.1
+	void FloatMinMax(bool fMax, bool fDouble);
 
 	void Ud2();
 
-	void EnterBlock();
-	int32_t *EnterIF();
-	void LeaveBlock(bool fHasReturn);
+	Label EnterBlock(value_type type, bool fLoop);
+	int32_t *EnterIF(value_type type, Label *plabel);	// returns the jump to the else or end
+	void LeaveBlock(const Label &label);	// falls through into a label that branches also go to
+
+	bool FCompileOptimized(uint32_t ifn);
+	void _SetFnEntry(uint32_t ifn, void *pv);	// publishes the function's code to running threads, old code forwards to it
+	void _AlignCode(size_t cbAlign);
+
+	// Calls to wasm functions are a direct call rel32.  While the callee has no code it goes to a stub that compiles
+	//	it and patches the call site, so functions that never run are never compiled.
+	void _EmitCallFn(uint32_t ifn);
+	void _ResolveCalls();	// points the calls emitted since the last resolve at their callee or its stub
+	uint8_t *_PbStub(uint32_t ifn);
+	void *PvLazyCompile(uint32_t ifn, uint8_t *pbRet);
 
-	void ProtectForRuntime();
-	void UnprotectRuntime();
+	// Small callees that make no calls themselves are spliced into the caller's bytecode before either tier sees it.
+	//	Their locals get extra slots in the caller's frame and a return becomes a branch out of the block that replaced
+	//	the call.  Both tiers compile the body returned here, bytecode offsets in it are mapped back for the code map.
+	const FunctionCodeEntry *_PfncBody(uint32_t ifn);
+	bool _FInlineCandidate(uint32_t ifnCaller, uint32_t ifnCallee) const;
+	void _InlineCallees(uint32_t ifn);
+
+	// Baseline code counts down calls and loop iterations, the function is recompiled when either reaches zero
+	struct FunctionProfile
+	{
+		uint32_t cCallsLeft;
+		uint32_t cBackEdgesLeft;
+	};
+	void _EmitTierUpCounter(uint32_t ifn);
+	void _EmitOsrCounter(uint32_t ifn, uint32_t ibLoop);
+	void TierUp(uint32_t ifn);
+	void *PvOsrEntry(uint32_t ifn, uint32_t ibLoop);	// on-stack replacement code for the loop, or nullptr
+	void _TierUp(uint32_t ifn);
+
+	ExecutionContext *_PexecctxtCurrentThread();
+	void _ReserveHeap();	// once, by the first call into the module
+	void _CommitHeap(size_t cbHeap);	// make linear memory accessible up to cbHeap, NOTE: m_mutexHeap must be held
 
 	class WasmContext *m_pctxt = nullptr;	// Parent
 	uint8_t *m_pexecPlane = nullptr;
 	uint8_t *m_pcodeStart = nullptr;
 	uint8_t *m_pexecPlaneCur = nullptr;
+	uint8_t *m_pexecPlaneCommit = nullptr;	// end of the committed part of the execution plane
 	uint8_t *m_pexecPlaneMax = nullptr;
-	void **m_pfnCallIndirectShim = nullptr;
-	void **m_pfnBranchTable = nullptr;
+	ptrdiff_t m_cbWriteView = 0;	// distance from the executable view of the plane to its writable view
+	void **m_pfnIndirectCallTrap = nullptr;
 	void **m_pfnU64ToF32 = nullptr;
 	void **m_pfnU64ToF64 = nullptr;
 	void **m_pfnGrowMemoryOp = nullptr;
 	void **m_pfnF32ToU64Trunc = nullptr;
 	void **m_pfnF64ToU64Trunc = nullptr;
+	void **m_pfnTierUpShim = nullptr;
+	void **m_pfnOsrShim = nullptr;
+	void **m_pfnLazyCallShim = nullptr;
+	void **m_pfnIndirectCacheShim = nullptr;
+	void **m_pfnStackOverflowTrap = nullptr;
+
+	// The table for call_indirect, flattened so call sites check the type and find the code with one lookup
+	struct IndirectEntry
+	{
+		uint32_t itype;	// canonical type index
+		uint32_t ifn;
+		void *pfn;		// the function's code, LazyCallShim until it has some
+	};
+	IndirectEntry *m_rgindirect = nullptr;
+	uint32_t m_cindirect = 0;
+	std::vector<std::pair<uint32_t, uint32_t>> m_vecpairIndirect;	// (function, table index) sorted by function
 	uint64_t *m_pGlobalsStart = nullptr;
+	FunctionProfile *m_rgprofile = nullptr;	// one per function, with the globals since the code writes to it
+	// Linear memory is shared by every thread, it is set up by the first call and only grows under m_mutexHeap
 	void *m_pheap = nullptr;
+	std::once_flag m_onceHeap;
+	std::mutex m_mutexHeap;
+	size_t m_cbHeapCommit = 0;
+	std::atomic<uint64_t> m_cbHeap{ 0 };	// current size of linear memory
 	size_t m_cfn;
+	std::mutex m_mutexCompile;	// threads may all compile lazily or tier up at the same time
+	std::vector<bool> m_vecfTieredUp;
+	std::vector<std::pair<uint32_t, int32_t*>> m_veccallFixup;	// (callee, rel32) of calls in the code being emitted
+	std::vector<void*> m_vecpvStub;	// lazy compile stub of each function, created on first use
+
+	std::vector<Reg> m_vecregStack;
+	int32_t m_cstackMem = 0;	// operand stack entries in memory, only negative in unreachable code
+	uint32_t m_maskRegsUsed = 0;	// registers holding cached operands
+	uint32_t m_maskRegsLocked = 0;	// registers reserved by the operation being emitted
+	uint8_t m_ccPending = ccNone;	// condition code of an i32 on top of the operand stack that is only in the flags
+	bool m_fConstPending = false;	// the top of the operand stack is m_cPending and has no register yet
+	uint64_t m_cPending = 0;
+	uint32_t m_cparamsFn = 0;	// frame shape of the function being compiled
+	uint32_t m_clocalsFn = 0;
+	std::vector<std::pair<uint32_t, Reg>> m_vecpinnedLocals;	// local index -> register
+	std::vector<bool> m_vecfFloatLocal;	// locals of the function being compiled that are read into xmm registers
+
+	// Native code -> bytecode side table, entries are in code address order since code is only appended
+	struct CodeMapEntry
+	{
+		const uint8_t *pbCode;	// first instruction generated for the opcode
+		uint32_t ifn;
+		uint32_t ibBytecode;	// offset of the opcode in the function body
+	};
+	std::vector<CodeMapEntry> m_veccodemap;
+
+	// Bodies with inlined callees, the map has an entry wherever the source of the bytes changes
+	struct InlineMapEntry
+	{
+		uint32_t ibInlined;
+		uint32_t ifn;
+		uint32_t ibBytecode;
+	};
+	struct InlinedBody
+	{
+		FunctionCodeEntry::unique_pfne_ptr spfnc;
+		std::vector<InlineMapEntry> vecmap;
+	};
+	std::vector<std::unique_ptr<InlinedBody>> m_vecspinlined;	// by function index, nullptr if nothing was inlined
+	std::vector<bool> m_vecfInlineChecked;
 
-	std::vector<uint64_t> m_vecoperand;
-	std::vector<uint64_t> m_veclocals;
+	// Each thread that calls in gets its own control block, they live until the JitWriter is destroyed
+	uint64_t m_idWriter;	// never reused so a thread's cached context can't be mistaken for a later JitWriter's
+	std::mutex m_mutexExecctxt;
+	std::vector<std::pair<std::thread::id, std::unique_ptr<ExecutionContext>>> m_vecexecctxt;
 };
\ No newline at end of file
@@ -0,0 +1,2825 @@
+#include "stdafx.h"
+#include "wasm_types.h"
+#include "Exceptions.h"
+#include "safe_access.h"
+#include "OptimizingCompiler.h"
+#include "WasmContext.h"
+
+// Beyond these the SSA tables get too big to be worth it, such functions stay on the baseline JIT
+static const uint32_t cvarMax = 4096;
+static const uint64_t cbitLivenessMax = 1ULL << 27;
+static const int32_t cbPage = 4096;	// frames bigger than this are probed a page at a time
+
+// x86 condition codes
+static const uint8_t ccB = 0x2;
+static const uint8_t ccAE = 0x3;
+static const uint8_t ccE = 0x4;
+static const uint8_t ccNE = 0x5;
+static const uint8_t ccBE = 0x6;
+static const uint8_t ccA = 0x7;
+static const uint8_t ccL = 0xC;
+static const uint8_t ccGE = 0xD;
+static const uint8_t ccLE = 0xE;
+static const uint8_t ccG = 0xF;
+
+static uint8_t CcSwapOperands(uint8_t cc)
+{
+	// a cc b == b CcSwapOperands(cc) a
+	switch (cc)
+	{
+	case ccB: return ccA;
+	case ccAE: return ccBE;
+	case ccBE: return ccAE;
+	case ccA: return ccB;
+	case ccL: return ccG;
+	case ccGE: return ccLE;
+	case ccLE: return ccGE;
+	case ccG: return ccL;
+	default: return cc;
+	}
+}
+
+template<typename TU, typename TS>
+static bool FEvalCc(uint8_t cc, TU a, TU b)
+{
+	switch (cc)
+	{
+	case ccB: return a < b;
+	case ccAE: return a >= b;
+	case ccE: return a == b;
+	case ccNE: return a != b;
+	case ccBE: return a <= b;
+	case ccA: return a > b;
+	case ccL: return TS(a) < TS(b);
+	case ccGE: return TS(a) >= TS(b);
+	case ccLE: return TS(a) <= TS(b);
+	case ccG: return TS(a) > TS(b);
+	}
+	Verify(false);
+	return false;
+}
+
+template<typename TU>
+static TU CountLeadingZeros(TU a)
+{
+	TU c = 0;
+	for (TU mask = TU(1) << (sizeof(TU) * 8 - 1); mask != 0 && !(a & mask); mask >>= 1)
+		++c;
+	return c;
+}
+
+template<typename TU>
+static TU CountTrailingZeros(TU a)
+{
+	TU c = 0;
+	for (TU mask = 1; mask != 0 && !(a & mask); mask <<= 1)
+		++c;
+	return c;
+}
+
+template<typename TU>
+static TU PopulationCount(TU a)
+{
+	TU c = 0;
+	for (; a != 0; a &= a - 1)
+		++c;
+	return c;
+}
+
+static bool FSkipImmediates(opcode op, const uint8_t **ppop, size_t *pcb)
+{
+	// Consumes the immediates of an opcode that is never executed
+	switch (op)
+	{
+	case opcode::block:
+	case opcode::loop:
+	case opcode::IF:
+		safe_read_buffer<value_type>(ppop, pcb);
+		break;
+
+	case opcode::br:
+	case opcode::br_if:
+	case opcode::call:
+	case opcode::get_local:
+	case opcode::set_local:
+	case opcode::tee_local:
+	case opcode::get_global:
+	case opcode::set_global:
+		safe_read_buffer<varuint32>(ppop, pcb);
+		break;
+
+	case opcode::call_indirect:
+		safe_read_buffer<varuint32>(ppop, pcb);
+		safe_read_buffer<uint8_t>(ppop, pcb);	// reserved
+		break;
+
+	case opcode::br_table:
+	{
+		uint32_t ctarget = safe_read_buffer<varuint32>(ppop, pcb);
+		for (uint32_t itarget = 0; itarget <= ctarget; ++itarget)	// the default is included
+			safe_read_buffer<varuint32>(ppop, pcb);
+		break;
+	}
+
+	case opcode::current_memory:
+	case opcode::grow_memory:
+		safe_read_buffer<uint8_t>(ppop, pcb);
+		break;
+
+	case opcode::i32_const:
+		safe_read_buffer<varint32>(ppop, pcb);
+		break;
+	case opcode::i64_const:
+		safe_read_buffer<varint64>(ppop, pcb);
+		break;
+	case opcode::f32_const:
+		safe_read_buffer<float>(ppop, pcb);
+		break;
+	case opcode::f64_const:
+		safe_read_buffer<double>(ppop, pcb);
+		break;
+
+	default:
+		if (op >= opcode::i32_load && op <= opcode::i64_store32)
+		{
+			safe_read_buffer<varuint32>(ppop, pcb);	// alignment
+			safe_read_buffer<varuint32>(ppop, pcb);	// offset
+		}
+		else if (op > opcode::f64_reinterpret_i64 || (op > opcode::ELSE && op < opcode::end) || (op > opcode::call_indirect && op < opcode::drop))
+		{
+			return false;
+		}
+		break;
+	}
+	return true;
+}
+
+OptimizingCompiler::OptimizingCompiler(JitWriter *pjit, uint32_t ifn, uint32_t ibOsr)
+	: m_pjit(pjit), m_pctxt(pjit->m_pctxt), m_ifn(ifn), m_ibOsr(ibOsr)
+{
+	m_pfnc = m_pjit->_PfncBody(ifn);
+	m_ptype = m_pctxt->m_vecfn_types[m_pctxt->m_vecfn_entries[ifn]].get();
+	m_cparams = m_ptype->cparams;
+	m_clocalsIn = m_cparams;
+	m_fOsr = (ibOsr != UINT32_MAX);
+}
+
+void *OptimizingCompiler::PvCompile()
+{
+	if (!_FBuild())
+		return nullptr;
+
+	_RemovePhiTrivia();
+	_FoldConstants();
+	_RemoveUnreachable();
+	_ComputeDominators();
+	_ValueNumber();
+	_FoldConstants();	// numbering exposes things like x - x
+	_RemoveUnreachable();
+	_ComputeDominators();
+	_HoistInvariants();
+	_EliminateDeadCode();
+	_SplitCriticalEdges();
+	_Compact();
+
+	if (!_FBuildIntervals())
+		return nullptr;
+	_AllocateRegisters();
+
+	m_pjit->_AlignCode(16);
+	void *pvEntry = m_pjit->m_pexecPlaneCur;
+	_EmitCode();
+	m_pjit->_ResolveCalls();
+	return pvEntry;
+}
+
+//
+// SSA construction, see Braun et al. "Simple and Efficient Construction of Static Single Assignment Form".
+//	Locals and block results are variables, the operand stack is tracked at compile time so it never exists.
+//
+
+bool OptimizingCompiler::_FIntegerType(value_type type, bool *pf64) const
+{
+	switch (type)
+	{
+	case value_type::i32:
+		*pf64 = false;
+		return true;
+	case value_type::i64:
+		*pf64 = true;
+		return true;
+	default:
+		return false;
+	}
+}
+
+uint32_t OptimizingCompiler::_NewBlock()
+{
+	m_vecblock.emplace_back();
+	return numeric_cast<uint32_t>(m_vecblock.size() - 1);
+}
+
+void OptimizingCompiler::_EnterBlock(uint32_t iblock)
+{
+	m_iblockCur = iblock;
+	m_veciblockLayout.push_back(iblock);
+}
+
+uint32_t OptimizingCompiler::_NewVar(bool f64)
+{
+	m_vecf64Var.push_back(f64);
+	return numeric_cast<uint32_t>(m_vecf64Var.size() - 1);
+}
+
+uint32_t OptimizingCompiler::_Emit(Op op, bool f64, std::initializer_list<uint32_t> rgopnd, uint64_t imm)
+{
+	return _Emit(op, f64, std::vector<uint32_t>(rgopnd), imm);
+}
+
+uint32_t OptimizingCompiler::_Emit(Op op, bool f64, std::vector<uint32_t> &&vecopnd, uint64_t imm)
+{
+	Verify(m_iblockCur != ivalNone);
+	Instr instr;
+	instr.op = op;
+	instr.f64 = f64;
+	instr.iblock = m_iblockCur;
+	instr.ibBytecode = m_ibCur;
+	instr.imm = imm;
+	instr.vecopnd = std::move(vecopnd);
+	m_vecinstr.push_back(std::move(instr));
+	uint32_t ival = numeric_cast<uint32_t>(m_vecinstr.size() - 1);
+	m_vecblock[m_iblockCur].vecival.push_back(ival);
+	return ival;
+}
+
+uint32_t OptimizingCompiler::_Const(bool f64, uint64_t c)
+{
+	// Constants don't belong to any block's code, they are materialized where they are used
+	if (!f64)
+		c = uint32_t(c);
+	auto itr = m_mapconst.find(std::make_pair(f64, c));
+	if (itr != m_mapconst.end())
+		return itr->second;
+	Instr instr;
+	instr.op = Op::Const;
+	instr.f64 = f64;
+	instr.imm = c;
+	m_vecinstr.push_back(std::move(instr));
+	uint32_t ival = numeric_cast<uint32_t>(m_vecinstr.size() - 1);
+	m_mapconst.insert(std::make_pair(std::make_pair(f64, c), ival));
+	return ival;
+}
+
+void OptimizingCompiler::_Terminate(Op op, std::vector<uint32_t> &&vecopnd, std::initializer_list<uint32_t> rgsucc)
+{
+	_Emit(op, false, std::move(vecopnd));
+	for (uint32_t iblockSucc : rgsucc)
+	{
+		Verify(!m_vecblock[iblockSucc].fSealed);
+		m_vecblock[m_iblockCur].vecsucc.push_back(iblockSucc);
+		m_vecblock[iblockSucc].vecpred.push_back(m_iblockCur);
+	}
+	m_iblockCur = ivalNone;
+}
+
+void OptimizingCompiler::_BranchTo(const Frame &frame, uint32_t ivalCond)
+{
+	// Branches to the function frame are returns, a conditional one gets a block of its own to return from
+	if (frame.kind == FrameKind::Function)
+	{
+		std::vector<uint32_t> vecopndRet;
+		if (m_ptype->fHasReturnValue)
+			vecopndRet.push_back(m_vecstack.back());
+		if (ivalCond == ivalNone)
+		{
+			_Terminate(Op::Return, std::move(vecopndRet), {});
+			return;
+		}
+		uint32_t iblockRet = _NewBlock();
+		uint32_t iblockNext = _NewBlock();
+		_Terminate(Op::Branch, { ivalCond }, { iblockRet, iblockNext });
+		_Seal(iblockRet);
+		_Seal(iblockNext);
+		_EnterBlock(iblockRet);
+		_Terminate(Op::Return, std::move(vecopndRet), {});
+		_EnterBlock(iblockNext);
+		return;
+	}
+
+	if (frame.ivarResult != ivalNone)
+		_WriteVar(frame.ivarResult, m_iblockCur, m_vecstack.back());
+	if (ivalCond == ivalNone)
+	{
+		_Terminate(Op::Jump, {}, { frame.iblockTarget });
+		return;
+	}
+	uint32_t iblockNext = _NewBlock();
+	_Terminate(Op::Branch, { ivalCond }, { frame.iblockTarget, iblockNext });
+	_Seal(iblockNext);
+	_EnterBlock(iblockNext);
+}
+
+void OptimizingCompiler::_WriteVar(uint32_t ivar, uint32_t iblock, uint32_t ival)
+{
+	std::vector<uint32_t> &vecdef = m_vecblock[iblock].vecdef;
+	if (vecdef.size() <= ivar)
+		vecdef.resize(ivar + 1, uint32_t(ivalNone));
+	vecdef[ivar] = ival;
+}
+
+uint32_t OptimizingCompiler::_DefVar(uint32_t ivar, uint32_t iblock) const
+{
+	const std::vector<uint32_t> &vecdef = m_vecblock[iblock].vecdef;
+	return (ivar < vecdef.size()) ? vecdef[ivar] : ivalNone;
+}
+
+uint32_t OptimizingCompiler::_ReadVar(uint32_t ivar, uint32_t iblock)
+{
+	uint32_t ival = _DefVar(ivar, iblock);
+	if (ival != ivalNone)
+		return _Resolve(ival);
+
+	// Walk straight line predecessors iteratively, only merges need to recurse
+	std::vector<uint32_t> veciblockChain;
+	uint32_t iblockWalk = iblock;
+	while (m_vecblock[iblockWalk].fSealed && m_vecblock[iblockWalk].vecpred.size() == 1)
+	{
+		veciblockChain.push_back(iblockWalk);
+		iblockWalk = m_vecblock[iblockWalk].vecpred[0];
+		ival = _DefVar(ivar, iblockWalk);
+		if (ival != ivalNone)
+			break;
+	}
+
+	if (ival != ivalNone)
+	{
+		ival = _Resolve(ival);
+	}
+	else if (!m_vecblock[iblockWalk].fSealed)
+	{
+		// Not all predecessors are known yet, the operands are filled in when the block is sealed
+		ival = _NewPhi(iblockWalk, ivar);
+		m_vecblock[iblockWalk].vecincomplete.push_back(std::make_pair(ivar, ival));
+		_WriteVar(ivar, iblockWalk, ival);
+	}
+	else if (m_vecblock[iblockWalk].vecpred.empty())
+	{
+		ival = _Const(m_vecf64Var[ivar], 0);	// only reachable from dead code
+		_WriteVar(ivar, iblockWalk, ival);
+	}
+	else
+	{
+		ival = _NewPhi(iblockWalk, ivar);
+		_WriteVar(ivar, iblockWalk, ival);	// break cycles through loops
+		ival = _AddPhiOperands(ivar, ival);
+		_WriteVar(ivar, iblockWalk, ival);
+	}
+
+	for (uint32_t iblockChain : veciblockChain)
+		_WriteVar(ivar, iblockChain, ival);
+	return ival;
+}
+
+uint32_t OptimizingCompiler::_NewPhi(uint32_t iblock, uint32_t ivar)
+{
+	Instr instr;
+	instr.op = Op::Phi;
+	instr.f64 = m_vecf64Var[ivar];
+	instr.iblock = iblock;
+	instr.ibBytecode = m_ibCur;
+	m_vecinstr.push_back(std::move(instr));
+	uint32_t ival = numeric_cast<uint32_t>(m_vecinstr.size() - 1);
+	m_vecblock[iblock].vecphi.push_back(ival);
+	return ival;
+}
+
+uint32_t OptimizingCompiler::_AddPhiOperands(uint32_t ivar, uint32_t ivalPhi)
+{
+	uint32_t iblock = m_vecinstr[ivalPhi].iblock;
+	for (size_t ipred = 0; ipred < m_vecblock[iblock].vecpred.size(); ++ipred)
+	{
+		uint32_t ival = _ReadVar(ivar, m_vecblock[iblock].vecpred[ipred]);
+		m_vecinstr[ivalPhi].vecopnd.push_back(ival);
+	}
+	return _TryRemoveTrivialPhi(ivalPhi);
+}
+
+uint32_t OptimizingCompiler::_TryRemoveTrivialPhi(uint32_t ivalPhi)
+{
+	// A phi that only merges one value (and maybe itself) is that value
+	uint32_t ivalSame = ivalNone;
+	for (uint32_t ivalOpnd : m_vecinstr[ivalPhi].vecopnd)
+	{
+		ivalOpnd = _Resolve(ivalOpnd);
+		if (ivalOpnd == ivalSame || ivalOpnd == ivalPhi)
+			continue;
+		if (ivalSame != ivalNone)
+			return ivalPhi;
+		ivalSame = ivalOpnd;
+	}
+	if (ivalSame == ivalNone)
+		ivalSame = _Const(m_vecinstr[ivalPhi].f64, 0);	// unreachable or undefined
+	_Forward(ivalPhi, ivalSame);
+	return ivalSame;
+}
+
+void OptimizingCompiler::_Seal(uint32_t iblock)
+{
+	// All predecessors are known now so the incomplete phis can get their operands
+	m_vecblock[iblock].fSealed = true;
+	std::vector<std::pair<uint32_t, uint32_t>> vecincomplete;
+	vecincomplete.swap(m_vecblock[iblock].vecincomplete);
+	for (auto &pairVarPhi : vecincomplete)
+		_AddPhiOperands(pairVarPhi.first, pairVarPhi.second);
+}
+
+uint32_t OptimizingCompiler::_Pop()
+{
+	Verify(m_vecstack.size() > m_vecframe.back().cstack, "Operand stack underflow");
+	uint32_t ival = m_vecstack.back();
+	m_vecstack.pop_back();
+	return ival;
+}
+
+bool OptimizingCompiler::_FBuild()
+{
+	bool fRet64 = false;
+	if (m_ptype->fHasReturnValue && !_FIntegerType(m_ptype->return_type, &fRet64))
+		return false;
+
+	uint32_t iblockEntry = _NewBlock();
+	m_vecblock[iblockEntry].fSealed = true;
+	_EnterBlock(iblockEntry);
+
+	// Arguments arrive in the frame, every other local starts out as zero.  When entering at a loop all locals and the
+	//	operand stack are in the frame and this block jumps straight to the loop, the code before it is unreachable.
+	for (uint32_t iparam = 0; iparam < m_cparams; ++iparam)
+	{
+		bool f64;
+		if (!_FIntegerType(m_ptype->rgparam_type[iparam], &f64))
+			return false;
+		uint32_t ivar = _NewVar(f64);
+		_WriteVar(ivar, iblockEntry, _Emit(Op::Param, f64, {}, iparam));
+	}
+	for (uint32_t ilocalInfo = 0; ilocalInfo < m_pfnc->clocalVars; ++ilocalInfo)
+	{
+		bool f64;
+		if (!_FIntegerType(m_pfnc->rglocals[ilocalInfo].type, &f64))
+			return false;
+		if (m_pfnc->rglocals[ilocalInfo].count > cvarMax - m_vecf64Var.size())
+			return false;
+		for (uint32_t ilocal = 0; ilocal < m_pfnc->rglocals[ilocalInfo].count; ++ilocal)
+		{
+			uint32_t ivar = _NewVar(f64);
+			_WriteVar(ivar, iblockEntry, (m_ibOsr != ivalNone) ? _Emit(Op::Param, f64, {}, ivar) : _Const(f64, 0));
+		}
+	}
+	uint32_t clocals = numeric_cast<uint32_t>(m_vecf64Var.size());
+	if (m_ibOsr != ivalNone)
+	{
+		m_clocalsIn = clocals;
+		m_iblockCur = ivalNone;
+		uint32_t iblockStart = _NewBlock();
+		m_vecblock[iblockStart].fSealed = true;
+		_EnterBlock(iblockStart);
+	}
+
+	Frame frameFn;
+	frameFn.kind = FrameKind::Function;
+	frameFn.iblockTarget = ivalNone;
+	frameFn.cstack = 0;
+	m_vecframe.push_back(frameFn);
+
+	const uint8_t *pop = m_pfnc->vecbytecode.data();
+	size_t cb = m_pfnc->vecbytecode.size();
+	size_t cblockSkip = 0;	// blocks opened inside unreachable code
+	while (cb > 0 && !m_vecframe.empty())
+	{
+		m_ibCur = numeric_cast<uint32_t>(pop - m_pfnc->vecbytecode.data());
+		opcode op = static_cast<opcode>(*pop);
+		++pop;
+		--cb;
+
+		if (m_iblockCur == ivalNone)
+		{
+			// Code after a branch is validated but never runs, only its nesting matters
+			if (op == opcode::end && cblockSkip > 0)
+			{
+				--cblockSkip;
+				continue;
+			}
+			if (op != opcode::end && (op != opcode::ELSE || cblockSkip > 0))
+			{
+				if (op == opcode::block || op == opcode::loop || op == opcode::IF)
+					++cblockSkip;
+				if (!FSkipImmediates(op, &pop, &cb))
+					return false;
+				continue;
+			}
+		}
+
+		switch (op)
+		{
+		case opcode::unreachable:
+			_Terminate(Op::Unreachable, {}, {});
+			break;
+
+		case opcode::nop:
+			break;
+
+		case opcode::block:
+		case opcode::loop:
+		case opcode::IF:
+		{
+			value_type type = safe_read_buffer<value_type>(&pop, &cb);
+			bool f64 = false;
+			if (type != value_type::empty_block && !_FIntegerType(type, &f64))
+				return false;
+
+			Frame frame;
+			frame.cstack = m_vecstack.size();
+			if (op == opcode::loop)
+			{
+				frame.kind = FrameKind::Loop;
+				frame.iblockTarget = _NewBlock();
+				m_vecblock[frame.iblockTarget].fLoopHeader = true;
+				_Terminate(Op::Jump, {}, { frame.iblockTarget });
+				if (m_ibCur == m_ibOsr)
+				{
+					// The baseline code's operand stack is in memory below its locals, the entries come in the same way
+					m_iblockCur = 0;
+					m_cstackIn = numeric_cast<uint32_t>(m_vecstack.size());
+					for (uint32_t ientry = 0; ientry < m_cstackIn; ++ientry)
+						m_vecstack[ientry] = _Emit(Op::Param, _F64(m_vecstack[ientry]), {}, m_clocalsIn + ientry);
+					_Terminate(Op::Jump, {}, { frame.iblockTarget });
+					m_ibOsr = ivalNone;
+				}
+				_EnterBlock(frame.iblockTarget);
+			}
+			else
+			{
+				if (type != value_type::empty_block)
+					frame.ivarResult = _NewVar(f64);
+				if (op == opcode::IF)
+				{
+					uint32_t ivalCond = _Pop();
+					frame.cstack = m_vecstack.size();
+					frame.kind = FrameKind::If;
+					uint32_t iblockThen = _NewBlock();
+					frame.iblockElse = _NewBlock();
+					_Terminate(Op::Branch, { ivalCond }, { iblockThen, frame.iblockElse });
+					_Seal(iblockThen);
+					_Seal(frame.iblockElse);
+					_EnterBlock(iblockThen);
+				}
+				else
+				{
+					frame.kind = FrameKind::Block;
+				}
+				frame.iblockTarget = _NewBlock();
+			}
+			m_vecframe.push_back(frame);
+			break;
+		}
+
+		case opcode::ELSE:
+		{
+			Frame &frame = m_vecframe.back();
+			Verify(frame.kind == FrameKind::If && frame.iblockElse != ivalNone);
+			if (m_iblockCur != ivalNone)
+				_BranchTo(frame, ivalNone);
+			m_vecstack.resize(frame.cstack);
+			_EnterBlock(frame.iblockElse);
+			frame.iblockElse = ivalNone;
+			break;
+		}
+
+		case opcode::end:
+		{
+			Frame frame = m_vecframe.back();
+			switch (frame.kind)
+			{
+			case FrameKind::Function:
+				if (m_iblockCur != ivalNone)
+					_BranchTo(frame, ivalNone);
+				break;
+
+			case FrameKind::Loop:
+			{
+				// falling out of a loop just continues, its result is already on the stack
+				_Seal(frame.iblockTarget);
+				uint32_t ivalResult = ivalNone;
+				if (m_iblockCur != ivalNone && m_vecstack.size() > frame.cstack)
+					ivalResult = m_vecstack.back();
+				m_vecstack.resize(frame.cstack);
+				if (ivalResult != ivalNone)
+					m_vecstack.push_back(ivalResult);
+				break;
+			}
+
+			case FrameKind::Block:
+			case FrameKind::If:
+				if (m_iblockCur != ivalNone)
+					_BranchTo(frame, ivalNone);
+				if (frame.iblockElse != ivalNone)
+				{
+					// an if without an else falls through to the end when the condition is false
+					Verify(frame.ivarResult == ivalNone);
+					_EnterBlock(frame.iblockElse);
+					_BranchTo(frame, ivalNone);
+				}
+				_Seal(frame.iblockTarget);
+				m_vecstack.resize(frame.cstack);
+				if (!m_vecblock[frame.iblockTarget].vecpred.empty())
+				{
+					_EnterBlock(frame.iblockTarget);
+					if (frame.ivarResult != ivalNone)
+						m_vecstack.push_back(_ReadVar(frame.ivarResult, frame.iblockTarget));
+				}
+				break;
+			}
+			m_vecframe.pop_back();
+			break;
+		}
+
+		case opcode::br:
+		case opcode::br_if:
+		{
+			uint32_t depth = safe_read_buffer<varuint32>(&pop, &cb);
+			Verify(depth < m_vecframe.size());
+			uint32_t ivalCond = (op == opcode::br_if) ? _Pop() : ivalNone;
+			Frame frame = *(m_vecframe.rbegin() + depth);
+			_BranchTo(frame, ivalCond);
+			break;
+		}
+
+		case opcode::ret:
+		{
+			Frame frame = m_vecframe.front();
+			_BranchTo(frame, ivalNone);
+			break;
+		}
+
+		case opcode::call:
+		{
+			uint32_t ifnCallee = safe_read_buffer<varuint32>(&pop, &cb);
+			Verify(ifnCallee < m_pjit->m_cfn);
+			auto ptypeCallee = m_pctxt->m_vecfn_types.at(m_pctxt->m_vecfn_entries.at(ifnCallee)).get();
+			bool fRet64 = false;
+			if (ptypeCallee->fHasReturnValue && !_FIntegerType(ptypeCallee->return_type, &fRet64))
+				return false;
+			std::vector<uint32_t> vecopnd(ptypeCallee->cparams);
+			for (uint32_t iparam = ptypeCallee->cparams; iparam > 0; --iparam)
+			{
+				bool f64;
+				if (!_FIntegerType(ptypeCallee->rgparam_type[iparam - 1], &f64))
+					return false;
+				vecopnd[iparam - 1] = _Pop();
+			}
+			uint32_t ival = _Emit(Op::Call, fRet64, std::move(vecopnd), ifnCallee);
+			if (ptypeCallee->fHasReturnValue)
+				m_vecstack.push_back(ival);
+			break;
+		}
+
+		case opcode::drop:
+			_Pop();
+			break;
+
+		case opcode::select:
+		{
+			uint32_t ivalCond = _Pop();
+			uint32_t ivalFalse = _Pop();
+			uint32_t ivalTrue = _Pop();
+			m_vecstack.push_back(_Emit(Op::Select, _F64(ivalTrue), { ivalTrue, ivalFalse, ivalCond }));
+			break;
+		}
+
+		case opcode::i32_const:
+			m_vecstack.push_back(_Const(false, uint32_t(int32_t(safe_read_buffer<varint32>(&pop, &cb)))));
+			break;
+		case opcode::i64_const:
+			m_vecstack.push_back(_Const(true, uint64_t(int64_t(safe_read_buffer<varint64>(&pop, &cb)))));
+			break;
+
+		case opcode::get_local:
+		{
+			uint32_t idx = safe_read_buffer<varuint32>(&pop, &cb);
+			Verify(idx < clocals);
+			m_vecstack.push_back(_ReadVar(idx, m_iblockCur));
+			break;
+		}
+		case opcode::set_local:
+		case opcode::tee_local:
+		{
+			uint32_t idx = safe_read_buffer<varuint32>(&pop, &cb);
+			Verify(idx < clocals);
+			uint32_t ival = _Pop();
+			_WriteVar(idx, m_iblockCur, ival);
+			if (op == opcode::tee_local)
+				m_vecstack.push_back(ival);
+			break;
+		}
+
+		case opcode::get_global:
+		case opcode::set_global:
+		{
+			uint32_t iglbl = safe_read_buffer<varuint32>(&pop, &cb);
+			auto &glbl = m_pctxt->m_vecglbls.at(iglbl);
+			bool f64;
+			if (!_FIntegerType(glbl.type, &f64))
+				return false;
+			if (op == opcode::set_global)
+			{
+				Verify(glbl.fMutable);
+				_Emit(Op::SetGlobal, f64, { _Pop() }, iglbl);
+			}
+			else if (glbl.fMutable)
+			{
+				m_vecstack.push_back(_Emit(Op::GetGlobal, f64, {}, iglbl));
+			}
+			else
+			{
+				m_vecstack.push_back(_Const(f64, glbl.val));
+			}
+			break;
+		}
+
+		case opcode::i32_load:
+		case opcode::i64_load:
+		case opcode::i32_load8_s:
+		case opcode::i32_load8_u:
+		case opcode::i32_load16_s:
+		case opcode::i32_load16_u:
+		case opcode::i64_load8_s:
+		case opcode::i64_load8_u:
+		case opcode::i64_load16_s:
+		case opcode::i64_load16_u:
+		case opcode::i64_load32_s:
+		case opcode::i64_load32_u:
+		{
+			safe_read_buffer<varuint32>(&pop, &cb);	// alignment
+			uint32_t offset = safe_read_buffer<varuint32>(&pop, &cb);
+			static const struct { opcode op; uint8_t cb; bool fSigned; bool f64; } rgload[] =
+			{
+				{ opcode::i32_load, 4, false, false },
+				{ opcode::i64_load, 8, false, true },
+				{ opcode::i32_load8_s, 1, true, false },
+				{ opcode::i32_load8_u, 1, false, false },
+				{ opcode::i32_load16_s, 2, true, false },
+				{ opcode::i32_load16_u, 2, false, false },
+				{ opcode::i64_load8_s, 1, true, true },
+				{ opcode::i64_load8_u, 1, false, true },
+				{ opcode::i64_load16_s, 2, true, true },
+				{ opcode::i64_load16_u, 2, false, true },
+				{ opcode::i64_load32_s, 4, true, true },
+				{ opcode::i64_load32_u, 4, false, true },
+			};
+			auto pload = std::find_if(std::begin(rgload), std::end(rgload), [&](const auto &load) { return load.op == op; });
+			uint32_t ival = _Emit(Op::Load, pload->f64, { _Pop() }, offset);
+			m_vecinstr[ival].cbMem = pload->cb;
+			m_vecinstr[ival].fSignExtend = pload->fSigned;
+			m_vecstack.push_back(ival);
+			break;
+		}
+
+		case opcode::i32_store:
+		case opcode::i64_store:
+		case opcode::i32_store8:
+		case opcode::i32_store16:
+		case opcode::i64_store8:
+		case opcode::i64_store16:
+		case opcode::i64_store32:
+		{
+			safe_read_buffer<varuint32>(&pop, &cb);	// alignment
+			uint32_t offset = safe_read_buffer<varuint32>(&pop, &cb);
+			uint8_t cbMem;
+			switch (op)
+			{
+			case opcode::i32_store8:
+			case opcode::i64_store8:
+				cbMem = 1;
+				break;
+			case opcode::i32_store16:
+			case opcode::i64_store16:
+				cbMem = 2;
+				break;
+			case opcode::i64_store:
+				cbMem = 8;
+				break;
+			default:
+				cbMem = 4;
+			}
+			uint32_t ivalValue = _Pop();
+			uint32_t ivalAddr = _Pop();
+			uint32_t ival = _Emit(Op::Store, _F64(ivalValue), { ivalAddr, ivalValue }, offset);
+			m_vecinstr[ival].cbMem = cbMem;
+			break;
+		}
+
+		case opcode::i32_eqz:
+		case opcode::i64_eqz:
+			m_vecstack.push_back(_Emit(Op::Eqz, false, { _Pop() }));
+			break;
+
+		case opcode::i32_eq: case opcode::i32_ne: case opcode::i32_lt_s: case opcode::i32_lt_u: case opcode::i32_gt_s:
+		case opcode::i32_gt_u: case opcode::i32_le_s: case opcode::i32_le_u: case opcode::i32_ge_s: case opcode::i32_ge_u:
+		case opcode::i64_eq: case opcode::i64_ne: case opcode::i64_lt_s: case opcode::i64_lt_u: case opcode::i64_gt_s:
+		case opcode::i64_gt_u: case opcode::i64_le_s: case opcode::i64_le_u: case opcode::i64_ge_s: case opcode::i64_ge_u:
+		{
+			// both widths list their comparisons in the same order
+			static const uint8_t rgcc[] = { ccE, ccNE, ccL, ccB, ccG, ccA, ccLE, ccBE, ccGE, ccAE };
+			size_t icc = (op >= opcode::i64_eq) ? size_t(op) - size_t(opcode::i64_eq) : size_t(op) - size_t(opcode::i32_eq);
+			uint32_t ivalB = _Pop();
+			uint32_t ivalA = _Pop();
+			uint32_t ival = _Emit(Op::Compare, false, { ivalA, ivalB });
+			m_vecinstr[ival].cc = rgcc[icc];
+			m_vecstack.push_back(ival);
+			break;
+		}
+
+		case opcode::i32_clz: case opcode::i32_ctz: case opcode::i32_popcnt:
+		case opcode::i64_clz: case opcode::i64_ctz: case opcode::i64_popcnt:
+		{
+			bool f64 = op >= opcode::i64_clz;
+			static const Op rgop[] = { Op::Clz, Op::Ctz, Op::Popcnt };
+			size_t iop = size_t(op) - size_t(f64 ? opcode::i64_clz : opcode::i32_clz);
+			m_vecstack.push_back(_Emit(rgop[iop], f64, { _Pop() }));
+			break;
+		}
+
+		case opcode::i32_add: case opcode::i32_sub: case opcode::i32_mul: case opcode::i32_div_s: case opcode::i32_div_u:
+		case opcode::i32_rem_s: case opcode::i32_rem_u: case opcode::i32_and: case opcode::i32_or: case opcode::i32_xor:
+		case opcode::i32_shl: case opcode::i32_shr_s: case opcode::i32_shr_u: case opcode::i32_rotl: case opcode::i32_rotr:
+		case opcode::i64_add: case opcode::i64_sub: case opcode::i64_mul: case opcode::i64_div_s: case opcode::i64_div_u:
+		case opcode::i64_rem_s: case opcode::i64_rem_u: case opcode::i64_and: case opcode::i64_or: case opcode::i64_xor:
+		case opcode::i64_shl: case opcode::i64_shr_s: case opcode::i64_shr_u: case opcode::i64_rotl: case opcode::i64_rotr:
+		{
+			bool f64 = op >= opcode::i64_add;
+			static const Op rgop[] = { Op::Add, Op::Sub, Op::Mul, Op::DivS, Op::DivU, Op::RemS, Op::RemU, Op::And, Op::Or, Op::Xor,
+				Op::Shl, Op::ShrS, Op::ShrU, Op::Rotl, Op::Rotr };
+			size_t iop = size_t(op) - size_t(f64 ? opcode::i64_add : opcode::i32_add);
+			uint32_t ivalB = _Pop();
+			uint32_t ivalA = _Pop();
+			m_vecstack.push_back(_Emit(rgop[iop], f64, { ivalA, ivalB }));
+			break;
+		}
+
+		case opcode::i32_wrap_i64:
+			m_vecstack.push_back(_Emit(Op::Wrap, false, { _Pop() }));
+			break;
+		case opcode::i64_extend_s_i32:
+			m_vecstack.push_back(_Emit(Op::ExtendS, true, { _Pop() }));
+			break;
+		case opcode::i64_extend_u_i32:
+			m_vecstack.push_back(_Emit(Op::ExtendU, true, { _Pop() }));
+			break;
+
+		default:
+			return false;	// floating point, indirect calls, br_table and memory management stay on the baseline JIT
+		}
+	}
+	Verify(m_vecframe.empty() && cb == 0, "Function body is not terminated correctly");
+	return m_ibOsr == ivalNone;	// the loop to enter may have been unreachable
+}
+
+//
+// Optimization
+//
+
+uint32_t OptimizingCompiler::_Resolve(uint32_t ival)
+{
+	uint32_t ivalRoot = ival;
+	while (m_vecinstr[ivalRoot].ivalForward != ivalNone)
+		ivalRoot = m_vecinstr[ivalRoot].ivalForward;
+	while (ival != ivalRoot)
+	{
+		uint32_t ivalNext = m_vecinstr[ival].ivalForward;
+		m_vecinstr[ival].ivalForward = ivalRoot;
+		ival = ivalNext;
+	}
+	return ivalRoot;
+}
+
+void OptimizingCompiler::_Forward(uint32_t ival, uint32_t ivalNew)
+{
+	Verify(_Resolve(ivalNew) != ival);
+	m_vecinstr[ival].ivalForward = ivalNew;
+	m_vecinstr[ival].fDead = true;
+}
+
+bool OptimizingCompiler::_FConst(uint32_t ival, uint64_t *pc)
+{
+	const Instr &instr = m_vecinstr[_Resolve(ival)];
+	if (instr.op != Op::Const)
+		return false;
+	if (pc != nullptr)
+		*pc = instr.imm;
+	return true;
+}
+
+bool OptimizingCompiler::_FPure(Op op)
+{
+	return op >= Op::Add && op <= Op::Select;
+}
+
+void OptimizingCompiler::_MakeConst(uint32_t ival, uint64_t c)
+{
+	Instr &instr = m_vecinstr[ival];
+	instr.op = Op::Const;
+	instr.imm = instr.f64 ? c : uint32_t(c);
+	instr.vecopnd.clear();
+}
+
+void OptimizingCompiler::_RemoveEdge(uint32_t iblockFrom, uint32_t iblockTo)
+{
+	std::vector<uint32_t> &vecsucc = m_vecblock[iblockFrom].vecsucc;
+	auto itrSucc = std::find(vecsucc.begin(), vecsucc.end(), iblockTo);
+	Verify(itrSucc != vecsucc.end());
+	vecsucc.erase(itrSucc);
+
+	Block &blkTo = m_vecblock[iblockTo];
+	auto itrPred = std::find(blkTo.vecpred.begin(), blkTo.vecpred.end(), iblockFrom);
+	Verify(itrPred != blkTo.vecpred.end());
+	size_t ipred = itrPred - blkTo.vecpred.begin();
+	blkTo.vecpred.erase(itrPred);
+	for (uint32_t ivalPhi : blkTo.vecphi)
+	{
+		std::vector<uint32_t> &vecopnd = m_vecinstr[ivalPhi].vecopnd;
+		if (!m_vecinstr[ivalPhi].fDead)
+			vecopnd.erase(vecopnd.begin() + ipred);
+	}
+}
+
+void OptimizingCompiler::_RemovePhiTrivia()
+{
+	bool fChanged = true;
+	while (fChanged)
+	{
+		fChanged = false;
+		for (Block &blk : m_vecblock)
+		{
+			for (size_t iphi = 0; iphi < blk.vecphi.size(); ++iphi)
+			{
+				uint32_t ivalPhi = blk.vecphi[iphi];
+				if (!m_vecinstr[ivalPhi].fDead && _TryRemoveTrivialPhi(ivalPhi) != ivalPhi)
+					fChanged = true;
+			}
+		}
+	}
+	for (Block &blk : m_vecblock)
+	{
+		blk.vecphi.erase(std::remove_if(blk.vecphi.begin(), blk.vecphi.end(), [&](uint32_t ival) { return m_vecinstr[ival].fDead; }), blk.vecphi.end());
+	}
+}
+
+template<typename TU, typename TS>
+bool OptimizingCompiler::_FEvalBinary(Op op, TU a, TU b, TU *pr)
+{
+	const TU cbitMask = sizeof(TU) * 8 - 1;
+	switch (op)
+	{
+	case Op::Add: *pr = a + b; return true;
+	case Op::Sub: *pr = a - b; return true;
+	case Op::Mul: *pr = a * b; return true;
+	case Op::And: *pr = a & b; return true;
+	case Op::Or: *pr = a | b; return true;
+	case Op::Xor: *pr = a ^ b; return true;
+	case Op::Shl: *pr = a << (b & cbitMask); return true;
+	case Op::ShrS: *pr = TU(TS(a) >> (b & cbitMask)); return true;
+	case Op::ShrU: *pr = a >> (b & cbitMask); return true;
+	case Op::Rotl: *pr = (a << (b & cbitMask)) | (a >> ((TU(0) - b) & cbitMask)); return true;
+	case Op::Rotr: *pr = (a >> (b & cbitMask)) | (a << ((TU(0) - b) & cbitMask)); return true;
+	case Op::DivU:
+	case Op::RemU:
+		if (b == 0)
+			return false;	// leave the trap to run time
+		*pr = (op == Op::DivU) ? a / b : a % b;
+		return true;
+	case Op::DivS:
+	case Op::RemS:
+	{
+		TS sa = TS(a), sb = TS(b);
+		if (sb == 0)
+			return false;
+		if (sb == -1)
+		{
+			if (op == Op::RemS)
+				*pr = 0;
+			else if (sa == std::numeric_limits<TS>::min())
+				return false;	// overflow traps
+			else
+				*pr = TU(-sa);
+			return true;
+		}
+		*pr = TU((op == Op::DivS) ? sa / sb : sa % sb);
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+bool OptimizingCompiler::_FFold(uint32_t ival)
+{
+	// NOTE: Never allocates values so the reference stays valid
+	Instr &instr = m_vecinstr[ival];
+	for (uint32_t &ivalOpnd : instr.vecopnd)
+		ivalOpnd = _Resolve(ivalOpnd);
+
+	uint64_t a = 0, b = 0;
+	bool fConstA = instr.vecopnd.size() > 0 && _FConst(instr.vecopnd[0], &a);
+	bool fConstB = instr.vecopnd.size() > 1 && _FConst(instr.vecopnd[1], &b);
+	const uint64_t maskWidth = instr.f64 ? ~uint64_t(0) : 0xFFFFFFFF;
+
+	switch (instr.op)
+	{
+	case Op::Phi:
+		return _TryRemoveTrivialPhi(ival) != ival;
+
+	case Op::Add: case Op::Mul: case Op::And: case Op::Or: case Op::Xor:
+		if (fConstA && !fConstB)
+		{
+			// commutative, keep the constant on the right where it can be an immediate
+			std::swap(instr.vecopnd[0], instr.vecopnd[1]);
+			std::swap(a, b);
+			std::swap(fConstA, fConstB);
+		}
+		// fall through
+	case Op::Sub: case Op::Shl: case Op::ShrS: case Op::ShrU: case Op::Rotl: case Op::Rotr:
+	case Op::DivS: case Op::DivU: case Op::RemS: case Op::RemU:
+	{
+		if (fConstA && fConstB)
+		{
+			bool fFolded;
+			uint64_t r;
+			if (instr.f64)
+			{
+				fFolded = _FEvalBinary<uint64_t, int64_t>(instr.op, a, b, &r);
+			}
+			else
+			{
+				uint32_t r32;
+				fFolded = _FEvalBinary<uint32_t, int32_t>(instr.op, uint32_t(a), uint32_t(b), &r32);
+				r = r32;
+			}
+			if (fFolded)
+			{
+				_MakeConst(ival, r);
+				return true;
+			}
+			return false;
+		}
+		if (fConstB)
+		{
+			bool fShift = instr.op >= Op::Shl && instr.op <= Op::Rotr;
+			if (fShift)
+				b &= instr.f64 ? 63 : 31;
+			if (b == 0 && (fShift || instr.op == Op::Add || instr.op == Op::Sub || instr.op == Op::Or || instr.op == Op::Xor))
+			{
+				_Forward(ival, instr.vecopnd[0]);
+				return true;
+			}
+			if (b == 1 && (instr.op == Op::Mul || instr.op == Op::DivS || instr.op == Op::DivU))
+			{
+				_Forward(ival, instr.vecopnd[0]);
+				return true;
+			}
+			if ((b == 0 && (instr.op == Op::Mul || instr.op == Op::And)) || (b == 1 && (instr.op == Op::RemS || instr.op == Op::RemU)))
+			{
+				_MakeConst(ival, 0);
+				return true;
+			}
+			if (b == maskWidth && instr.op == Op::And)
+			{
+				_Forward(ival, instr.vecopnd[0]);
+				return true;
+			}
+		}
+		if (instr.vecopnd[0] == instr.vecopnd[1])
+		{
+			if (instr.op == Op::Sub || instr.op == Op::Xor)
+			{
+				_MakeConst(ival, 0);
+				return true;
+			}
+			if (instr.op == Op::And || instr.op == Op::Or)
+			{
+				_Forward(ival, instr.vecopnd[0]);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	case Op::Compare:
+	{
+		bool fOpnd64 = _F64(instr.vecopnd[0]);
+		if (fConstA && fConstB)
+		{
+			bool f = fOpnd64 ? FEvalCc<uint64_t, int64_t>(instr.cc, a, b) : FEvalCc<uint32_t, int32_t>(instr.cc, uint32_t(a), uint32_t(b));
+			_MakeConst(ival, f ? 1 : 0);
+			return true;
+		}
+		if (instr.vecopnd[0] == instr.vecopnd[1])
+		{
+			_MakeConst(ival, FEvalCc<uint32_t, int32_t>(instr.cc, 0, 0) ? 1 : 0);
+			return true;
+		}
+		if (fConstA)
+		{
+			std::swap(instr.vecopnd[0], instr.vecopnd[1]);
+			instr.cc = CcSwapOperands(instr.cc);
+			return true;
+		}
+		return false;
+	}
+
+	case Op::Eqz:
+	{
+		if (fConstA)
+		{
+			_MakeConst(ival, a == 0 ? 1 : 0);
+			return true;
+		}
+		const Instr &instrOpnd = m_vecinstr[instr.vecopnd[0]];
+		if (instrOpnd.op == Op::Compare)
+		{
+			// eqz(a cc b) == a !cc b
+			instr.cc = instrOpnd.cc ^ 1;
+			instr.vecopnd = instrOpnd.vecopnd;
+			instr.op = Op::Compare;
+			return true;
+		}
+		return false;
+	}
+
+	case Op::Clz: case Op::Ctz: case Op::Popcnt: case Op::Wrap: case Op::ExtendS: case Op::ExtendU:
+	{
+		const Instr &instrOpnd = m_vecinstr[instr.vecopnd[0]];
+		if (instr.op == Op::Wrap && (instrOpnd.op == Op::ExtendS || instrOpnd.op == Op::ExtendU))
+		{
+			_Forward(ival, instrOpnd.vecopnd[0]);
+			return true;
+		}
+		if (!fConstA)
+			return false;
+		uint64_t r = 0;
+		switch (instr.op)
+		{
+		case Op::Clz: r = instr.f64 ? CountLeadingZeros<uint64_t>(a) : CountLeadingZeros<uint32_t>(uint32_t(a)); break;
+		case Op::Ctz: r = instr.f64 ? CountTrailingZeros<uint64_t>(a) : CountTrailingZeros<uint32_t>(uint32_t(a)); break;
+		case Op::Popcnt: r = PopulationCount<uint64_t>(a); break;
+		case Op::Wrap: r = uint32_t(a); break;
+		case Op::ExtendS: r = uint64_t(int64_t(int32_t(uint32_t(a)))); break;
+		case Op::ExtendU: r = uint32_t(a); break;
+		default: break;
+		}
+		_MakeConst(ival, r);
+		return true;
+	}
+
+	case Op::Select:
+	{
+		uint64_t c;
+		if (_FConst(instr.vecopnd[2], &c))
+		{
+			_Forward(ival, instr.vecopnd[c != 0 ? 0 : 1]);
+			return true;
+		}
+		if (instr.vecopnd[0] == instr.vecopnd[1])
+		{
+			_Forward(ival, instr.vecopnd[0]);
+			return true;
+		}
+		return false;
+	}
+
+	case Op::Branch:
+	{
+		if (fConstA)
+		{
+			Block &blk = m_vecblock[instr.iblock];
+			uint32_t iblockDrop = blk.vecsucc[a != 0 ? 1 : 0];
+			instr.op = Op::Jump;
+			instr.vecopnd.clear();
+			_RemoveEdge(instr.iblock, iblockDrop);
+			return true;
+		}
+		const Instr &instrOpnd = m_vecinstr[instr.vecopnd[0]];
+		if (instrOpnd.op == Op::Eqz && !_F64(instrOpnd.vecopnd[0]))
+		{
+			// branch on the operand with the targets swapped
+			instr.vecopnd[0] = instrOpnd.vecopnd[0];
+			std::swap(m_vecblock[instr.iblock].vecsucc[0], m_vecblock[instr.iblock].vecsucc[1]);
+			return true;
+		}
+		return false;
+	}
+
+	default:
+		return false;
+	}
+}
+
+void OptimizingCompiler::_FoldConstants()
+{
+	static const int cpassMax = 8;
+	for (int ipass = 0; ipass < cpassMax; ++ipass)
+	{
+		bool fChanged = false;
+		for (uint32_t iblock : m_veciblockLayout)
+		{
+			Block &blk = m_vecblock[iblock];
+			if (blk.fDead)
+				continue;
+			for (size_t iphi = 0; iphi < blk.vecphi.size(); ++iphi)
+			{
+				if (!m_vecinstr[blk.vecphi[iphi]].fDead && _FFold(blk.vecphi[iphi]))
+					fChanged = true;
+			}
+			for (uint32_t ival : blk.vecival)
+			{
+				if (!m_vecinstr[ival].fDead && _FFold(ival))
+					fChanged = true;
+			}
+		}
+		if (!fChanged)
+			break;
+	}
+}
+
+void OptimizingCompiler::_RemoveUnreachable()
+{
+	std::vector<bool> vecfReached(m_vecblock.size());
+	std::vector<uint32_t> vecwork = { 0 };
+	vecfReached[0] = true;
+	while (!vecwork.empty())
+	{
+		uint32_t iblock = vecwork.back();
+		vecwork.pop_back();
+		for (uint32_t iblockSucc : m_vecblock[iblock].vecsucc)
+		{
+			if (!vecfReached[iblockSucc])
+			{
+				vecfReached[iblockSucc] = true;
+				vecwork.push_back(iblockSucc);
+			}
+		}
+	}
+
+	for (uint32_t iblock = 0; iblock < m_vecblock.size(); ++iblock)
+	{
+		if (vecfReached[iblock] || m_vecblock[iblock].fDead)
+			continue;
+		m_vecblock[iblock].fDead = true;
+		std::vector<uint32_t> vecsucc = m_vecblock[iblock].vecsucc;
+		for (uint32_t iblockSucc : vecsucc)
+			_RemoveEdge(iblock, iblockSucc);
+		for (uint32_t ival : m_vecblock[iblock].vecphi)
+			m_vecinstr[ival].fDead = true;
+		for (uint32_t ival : m_vecblock[iblock].vecival)
+			m_vecinstr[ival].fDead = true;
+	}
+	_RemovePhiTrivia();	// merges may have lost predecessors
+}
+
+void OptimizingCompiler::_ComputeDominators()
+{
+	// Cooper, Harvey and Kennedy "A Simple, Fast Dominance Algorithm"
+	m_veciblockRpo.clear();
+	for (Block &blk : m_vecblock)
+	{
+		blk.irpo = UINT32_MAX;
+		blk.idom = UINT32_MAX;
+	}
+
+	std::vector<uint32_t> vecpostorder;
+	std::vector<std::pair<uint32_t, size_t>> stack;	// (block, next successor)
+	std::vector<bool> vecfVisited(m_vecblock.size());
+	stack.push_back(std::make_pair(0, 0));
+	vecfVisited[0] = true;
+	while (!stack.empty())
+	{
+		uint32_t iblock = stack.back().first;
+		size_t isucc = stack.back().second++;
+		if (isucc < m_vecblock[iblock].vecsucc.size())
+		{
+			uint32_t iblockSucc = m_vecblock[iblock].vecsucc[isucc];
+			if (!vecfVisited[iblockSucc])
+			{
+				vecfVisited[iblockSucc] = true;
+				stack.push_back(std::make_pair(iblockSucc, 0));
+			}
+		}
+		else
+		{
+			vecpostorder.push_back(iblock);
+			stack.pop_back();
+		}
+	}
+	m_veciblockRpo.assign(vecpostorder.rbegin(), vecpostorder.rend());
+	for (uint32_t irpo = 0; irpo < m_veciblockRpo.size(); ++irpo)
+		m_vecblock[m_veciblockRpo[irpo]].irpo = irpo;
+
+	m_vecblock[0].idom = 0;
+	bool fChanged = true;
+	while (fChanged)
+	{
+		fChanged = false;
+		for (size_t irpo = 1; irpo < m_veciblockRpo.size(); ++irpo)
+		{
+			Block &blk = m_vecblock[m_veciblockRpo[irpo]];
+			uint32_t idomNew = UINT32_MAX;
+			for (uint32_t iblockPred : blk.vecpred)
+			{
+				if (m_vecblock[iblockPred].idom == UINT32_MAX)
+					continue;	// not processed yet
+				if (idomNew == UINT32_MAX)
+				{
+					idomNew = iblockPred;
+					continue;
+				}
+				uint32_t iblockA = iblockPred, iblockB = idomNew;
+				while (iblockA != iblockB)
+				{
+					while (m_vecblock[iblockA].irpo > m_vecblock[iblockB].irpo)
+						iblockA = m_vecblock[iblockA].idom;
+					while (m_vecblock[iblockB].irpo > m_vecblock[iblockA].irpo)
+						iblockB = m_vecblock[iblockB].idom;
+				}
+				idomNew = iblockA;
+			}
+			if (blk.idom != idomNew)
+			{
+				blk.idom = idomNew;
+				fChanged = true;
+			}
+		}
+	}
+}
+
+bool OptimizingCompiler::_FDominates(uint32_t iblockA, uint32_t iblockB) const
+{
+	for (;;)
+	{
+		if (iblockA == iblockB)
+			return true;
+		if (iblockB == 0)
+			return false;
+		iblockB = m_vecblock[iblockB].idom;
+	}
+}
+
+void OptimizingCompiler::_ValueNumber()
+{
+	// Dominator based value numbering: a pure operation that was already computed in a dominating block is reused
+	std::vector<std::vector<uint32_t>> vecveciblockChildren(m_vecblock.size());
+	for (size_t irpo = 1; irpo < m_veciblockRpo.size(); ++irpo)
+	{
+		uint32_t iblock = m_veciblockRpo[irpo];
+		vecveciblockChildren[m_vecblock[iblock].idom].push_back(iblock);
+	}
+
+	std::map<std::vector<uint64_t>, uint32_t> mapkeyval;
+	std::vector<std::vector<uint64_t>> veckeyScoped;	// undo log, popped when leaving a subtree
+	auto NumberBlock = [&](uint32_t iblock)
+	{
+		for (uint32_t ival : m_vecblock[iblock].vecival)
+		{
+			Instr &instr = m_vecinstr[ival];
+			if (instr.fDead || !_FPure(instr.op))
+				continue;
+			std::vector<uint64_t> veckey = { uint64_t(instr.op), uint64_t(instr.f64), uint64_t(instr.cc) };
+			for (uint32_t &ivalOpnd : instr.vecopnd)
+			{
+				ivalOpnd = _Resolve(ivalOpnd);
+				veckey.push_back(ivalOpnd);
+			}
+			bool fCommutative = instr.op == Op::Add || instr.op == Op::Mul || instr.op == Op::And || instr.op == Op::Or || instr.op == Op::Xor
+				|| (instr.op == Op::Compare && (instr.cc == ccE || instr.cc == ccNE));
+			if (fCommutative && veckey[3] > veckey[4])
+				std::swap(veckey[3], veckey[4]);
+
+			auto itr = mapkeyval.find(veckey);
+			if (itr != mapkeyval.end())
+			{
+				_Forward(ival, itr->second);
+			}
+			else
+			{
+				mapkeyval.insert(std::make_pair(veckey, ival));
+				veckeyScoped.push_back(std::move(veckey));
+			}
+		}
+	};
+
+	struct Visit
+	{
+		uint32_t iblock;
+		size_t ichild;
+		size_t ckeyScoped;
+	};
+	std::vector<Visit> stack;
+	NumberBlock(0);
+	stack.push_back({ 0, 0, 0 });
+	while (!stack.empty())
+	{
+		Visit &visit = stack.back();
+		if (visit.ichild < vecveciblockChildren[visit.iblock].size())
+		{
+			uint32_t iblockChild = vecveciblockChildren[visit.iblock][visit.ichild++];
+			size_t ckeyScoped = veckeyScoped.size();
+			NumberBlock(iblockChild);
+			stack.push_back({ iblockChild, 0, ckeyScoped });
+		}
+		else
+		{
+			while (veckeyScoped.size() > visit.ckeyScoped)
+			{
+				mapkeyval.erase(veckeyScoped.back());
+				veckeyScoped.pop_back();
+			}
+			stack.pop_back();
+		}
+	}
+}
+
+void OptimizingCompiler::_HoistInvariants()
+{
+	// Pure operations whose operands are all defined outside a loop move to the block that enters the loop.  They
+	//	can't trap so executing them when the loop body wouldn't have is harmless.
+	struct Loop
+	{
+		uint32_t iblockPreheader;
+		std::vector<bool> vecfBody;
+		size_t cblockBody;
+	};
+	std::vector<Loop> vecloop;
+	for (uint32_t iblockHeader : m_veciblockRpo)
+	{
+		const Block &blkHeader = m_vecblock[iblockHeader];
+		if (!blkHeader.fLoopHeader)
+			continue;
+		Loop loop;
+		loop.iblockPreheader = ivalNone;
+		loop.vecfBody.resize(m_vecblock.size());
+		loop.vecfBody[iblockHeader] = true;
+		loop.cblockBody = 1;
+		std::vector<uint32_t> vecwork;
+		bool fValid = true;
+		for (uint32_t iblockPred : blkHeader.vecpred)
+		{
+			if (_FDominates(iblockHeader, iblockPred))
+			{
+				vecwork.push_back(iblockPred);	// back edge
+			}
+			else if (loop.iblockPreheader == ivalNone && m_vecblock[iblockPred].vecsucc.size() == 1)
+			{
+				loop.iblockPreheader = iblockPred;
+			}
+			else
+			{
+				fValid = false;
+			}
+		}
+		if (!fValid || vecwork.empty() || loop.iblockPreheader == ivalNone)
+			continue;
+		while (!vecwork.empty())
+		{
+			uint32_t iblock = vecwork.back();
+			vecwork.pop_back();
+			if (loop.vecfBody[iblock])
+				continue;
+			loop.vecfBody[iblock] = true;
+			++loop.cblockBody;
+			for (uint32_t iblockPred : m_vecblock[iblock].vecpred)
+				vecwork.push_back(iblockPred);
+		}
+		vecloop.push_back(std::move(loop));
+	}
+
+	// inner loops first so their invariants can keep moving outwards
+	std::stable_sort(vecloop.begin(), vecloop.end(), [](const Loop &loopA, const Loop &loopB) { return loopA.cblockBody < loopB.cblockBody; });
+	for (const Loop &loop : vecloop)
+	{
+		std::vector<uint32_t> vecivalHoist;
+		for (uint32_t iblock : m_veciblockRpo)
+		{
+			if (!loop.vecfBody[iblock])
+				continue;
+			std::vector<uint32_t> &vecival = m_vecblock[iblock].vecival;
+			for (size_t iival = 0; iival < vecival.size(); )
+			{
+				Instr &instr = m_vecinstr[vecival[iival]];
+				bool fHoist = !instr.fDead && _FPure(instr.op);
+				for (uint32_t &ivalOpnd : instr.vecopnd)
+				{
+					ivalOpnd = _Resolve(ivalOpnd);
+					const Instr &instrOpnd = m_vecinstr[ivalOpnd];
+					if (instrOpnd.op != Op::Const && loop.vecfBody[instrOpnd.iblock])
+						fHoist = false;
+				}
+				if (fHoist)
+				{
+					instr.iblock = loop.iblockPreheader;
+					vecivalHoist.push_back(vecival[iival]);
+					vecival.erase(vecival.begin() + iival);
+				}
+				else
+				{
+					++iival;
+				}
+			}
+		}
+		std::vector<uint32_t> &vecivalPreheader = m_vecblock[loop.iblockPreheader].vecival;
+		vecivalPreheader.insert(vecivalPreheader.end() - 1, vecivalHoist.begin(), vecivalHoist.end());	// before the jump
+	}
+}
+
+void OptimizingCompiler::_EliminateDeadCode()
+{
+	// Everything with a side effect (including a potential trap) is live, so is whatever they use
+	std::vector<bool> vecfLive(m_vecinstr.size());
+	std::vector<uint32_t> vecwork;
+	for (const Block &blk : m_vecblock)
+	{
+		if (blk.fDead)
+			continue;
+		for (uint32_t ival : blk.vecival)
+		{
+			if (!m_vecinstr[ival].fDead && m_vecinstr[ival].op >= Op::DivS)
+			{
+				vecfLive[ival] = true;
+				vecwork.push_back(ival);
+			}
+		}
+	}
+	while (!vecwork.empty())
+	{
+		uint32_t ival = vecwork.back();
+		vecwork.pop_back();
+		for (uint32_t &ivalOpnd : m_vecinstr[ival].vecopnd)
+		{
+			ivalOpnd = _Resolve(ivalOpnd);
+			if (!vecfLive[ivalOpnd])
+			{
+				vecfLive[ivalOpnd] = true;
+				vecwork.push_back(ivalOpnd);
+			}
+		}
+	}
+	for (uint32_t ival = 0; ival < m_vecinstr.size(); ++ival)
+	{
+		if (!vecfLive[ival])
+			m_vecinstr[ival].fDead = true;
+	}
+}
+
+void OptimizingCompiler::_SplitCriticalEdges()
+{
+	// Phi moves happen at the end of the predecessor, which needs to be the only way into the merge.  The new blocks
+	//	are placed right after the branch so the common path falls through.
+	std::vector<uint32_t> veciblockLayout;
+	for (uint32_t iblock : m_veciblockLayout)
+	{
+		if (m_vecblock[iblock].fDead)
+			continue;
+		veciblockLayout.push_back(iblock);
+		if (m_vecblock[iblock].vecsucc.size() < 2)
+			continue;
+		for (size_t isucc = 0; isucc < m_vecblock[iblock].vecsucc.size(); ++isucc)
+		{
+			uint32_t iblockSucc = m_vecblock[iblock].vecsucc[isucc];
+			if (m_vecblock[iblockSucc].vecpred.size() < 2 || m_vecblock[iblockSucc].vecphi.empty())
+				continue;
+			uint32_t iblockEdge = _NewBlock();
+			m_vecblock[iblockEdge].vecpred.push_back(iblock);
+			m_vecblock[iblockEdge].vecsucc.push_back(iblockSucc);
+			m_vecblock[iblock].vecsucc[isucc] = iblockEdge;
+			std::vector<uint32_t> &vecpred = m_vecblock[iblockSucc].vecpred;
+			*std::find(vecpred.begin(), vecpred.end(), iblock) = iblockEdge;
+
+			m_ibCur = m_vecinstr[m_vecblock[iblock].vecival.back()].ibBytecode;
+			m_iblockCur = iblockEdge;
+			_Emit(Op::Jump, false, {});
+			m_iblockCur = ivalNone;
+			veciblockLayout.push_back(iblockEdge);
+		}
+	}
+	m_veciblockLayout.swap(veciblockLayout);
+}
+
+void OptimizingCompiler::_Compact()
+{
+	auto FDead = [&](uint32_t ival) { return m_vecinstr[ival].fDead; };
+	for (uint32_t iblock : m_veciblockLayout)
+	{
+		Block &blk = m_vecblock[iblock];
+		blk.vecphi.erase(std::remove_if(blk.vecphi.begin(), blk.vecphi.end(), FDead), blk.vecphi.end());
+		blk.vecival.erase(std::remove_if(blk.vecival.begin(), blk.vecival.end(), FDead), blk.vecival.end());
+		for (uint32_t ival : blk.vecphi)
+		{
+			for (uint32_t &ivalOpnd : m_vecinstr[ival].vecopnd)
+				ivalOpnd = _Resolve(ivalOpnd);
+		}
+		for (uint32_t ival : blk.vecival)
+		{
+			for (uint32_t &ivalOpnd : m_vecinstr[ival].vecopnd)
+				ivalOpnd = _Resolve(ivalOpnd);
+		}
+	}
+}
+
+//
+// Register allocation
+//
+
+bool OptimizingCompiler::_FAllocated(uint32_t ival) const
+{
+	const Instr &instr = m_vecinstr[ival];
+	return instr.cuse > 0 && !instr.fFused && instr.op != Op::Const;
+}
+
+bool OptimizingCompiler::_FBuildIntervals()
+{
+	// Uses, and comparisons that can stay in the flags for the branch or select right after them
+	for (uint32_t iblock : m_veciblockLayout)
+	{
+		Block &blk = m_vecblock[iblock];
+		for (uint32_t ival : blk.vecphi)
+		{
+			for (uint32_t ivalOpnd : m_vecinstr[ival].vecopnd)
+				++m_vecinstr[ivalOpnd].cuse;
+		}
+		for (uint32_t ival : blk.vecival)
+		{
+			for (uint32_t ivalOpnd : m_vecinstr[ival].vecopnd)
+				++m_vecinstr[ivalOpnd].cuse;
+		}
+	}
+	for (uint32_t iblock : m_veciblockLayout)
+	{
+		Block &blk = m_vecblock[iblock];
+		for (size_t iival = 0; iival + 1 < blk.vecival.size(); ++iival)
+		{
+			Instr &instr = m_vecinstr[blk.vecival[iival]];
+			const Instr &instrNext = m_vecinstr[blk.vecival[iival + 1]];
+			if ((instr.op != Op::Compare && instr.op != Op::Eqz) || instr.cuse != 1)
+				continue;
+			uint32_t ival = blk.vecival[iival];
+			if ((instrNext.op == Op::Branch && instrNext.vecopnd[0] == ival)
+				|| (instrNext.op == Op::Select && instrNext.vecopnd[2] == ival && instrNext.vecopnd[0] != ival && instrNext.vecopnd[1] != ival))
+			{
+				instr.fFused = true;
+			}
+		}
+	}
+
+	size_t cval = m_vecinstr.size();
+	size_t cword = (cval + 63) / 64;
+	if (uint64_t(cword) * 64 * m_veciblockLayout.size() > cbitLivenessMax)
+		return false;
+
+	// Positions: each block starts with its phis, instructions are 2 apart so results (at +1) are distinct from uses
+	std::vector<int32_t> vecpos(cval, -1);
+	int32_t pos = 0;
+	for (uint32_t iblock : m_veciblockLayout)
+	{
+		Block &blk = m_vecblock[iblock];
+		blk.posStart = pos;
+		for (uint32_t ival : blk.vecival)
+		{
+			pos += 2;
+			vecpos[ival] = pos;
+			if (m_vecinstr[ival].op == Op::Call)
+				m_vecposCall.push_back(pos);
+		}
+		blk.posEnd = pos;
+		pos += 2;
+	}
+
+	// Liveness
+	std::vector<std::vector<uint64_t>> vecvecUse(m_vecblock.size()), vecvecDef(m_vecblock.size()), vecvecOut(m_vecblock.size());
+	auto FTest = [](const std::vector<uint64_t> &vec, uint32_t ival) { return (vec[ival / 64] >> (ival % 64)) & 1; };
+	auto Set = [](std::vector<uint64_t> &vec, uint32_t ival) { vec[ival / 64] |= uint64_t(1) << (ival % 64); };
+	for (uint32_t iblock : m_veciblockLayout)
+	{
+		Block &blk = m_vecblock[iblock];
+		std::vector<uint64_t> &vecUse = vecvecUse[iblock];
+		std::vector<uint64_t> &vecDef = vecvecDef[iblock];
+		vecUse.resize(cword);
+		vecDef.resize(cword);
+		blk.veclive.assign(cword, 0);
+		vecvecOut[iblock].assign(cword, 0);
+		for (uint32_t ival : blk.vecphi)
+			Set(vecDef, ival);
+		for (uint32_t ival : blk.vecival)
+		{
+			for (uint32_t ivalOpnd : m_vecinstr[ival].vecopnd)
+			{
+				if (_FAllocated(ivalOpnd) && !FTest(vecDef, ivalOpnd))
+					Set(vecUse, ivalOpnd);
+			}
+			Set(vecDef, ival);
+		}
+	}
+	bool fChanged = true;
+	while (fChanged)
+	{
+		fChanged = false;
+		for (auto itr = m_veciblockLayout.rbegin(); itr != m_veciblockLayout.rend(); ++itr)
+		{
+			uint32_t iblock = *itr;
+			Block &blk = m_vecblock[iblock];
+			std::vector<uint64_t> &vecOut = vecvecOut[iblock];
+			for (uint32_t iblockSucc : blk.vecsucc)
+			{
+				const Block &blkSucc = m_vecblock[iblockSucc];
+				for (size_t iword = 0; iword < cword; ++iword)
+					vecOut[iword] |= blkSucc.veclive[iword];
+				size_t ipred = std::find(blkSucc.vecpred.begin(), blkSucc.vecpred.end(), iblock) - blkSucc.vecpred.begin();
+				for (uint32_t ivalPhi : blkSucc.vecphi)
+				{
+					uint32_t ivalOpnd = m_vecinstr[ivalPhi].vecopnd[ipred];
+					if (_FAllocated(ivalOpnd))
+						Set(vecOut, ivalOpnd);
+				}
+			}
+			for (size_t iword = 0; iword < cword; ++iword)
+			{
+				uint64_t live = vecvecUse[iblock][iword] | (vecOut[iword] & ~vecvecDef[iblock][iword]);
+				if (live != blk.veclive[iword])
+				{
+					blk.veclive[iword] = live;
+					fChanged = true;
+				}
+			}
+		}
+	}
+
+	// Intervals are a single range from the first to the last position the value is live, holes are ignored
+	for (uint32_t iblock : m_veciblockLayout)
+	{
+		const Block &blk = m_vecblock[iblock];
+		for (uint32_t ival : blk.vecphi)
+			m_vecinstr[ival].posStart = m_vecinstr[ival].posEnd = blk.posStart;
+		for (uint32_t ival : blk.vecival)
+			m_vecinstr[ival].posStart = m_vecinstr[ival].posEnd = vecpos[ival] + 1;
+	}
+	auto Extend = [&](uint32_t ival, int32_t pos)
+	{
+		Instr &instr = m_vecinstr[ival];
+		instr.posStart = std::min(instr.posStart, pos);
+		instr.posEnd = std::max(instr.posEnd, pos);
+	};
+	for (uint32_t iblock : m_veciblockLayout)
+	{
+		const Block &blk = m_vecblock[iblock];
+		for (uint32_t ival : blk.vecival)
+		{
+			for (uint32_t ivalOpnd : m_vecinstr[ival].vecopnd)
+			{
+				if (_FAllocated(ivalOpnd))
+					Extend(ivalOpnd, vecpos[ival]);
+			}
+		}
+		for (uint32_t iblockPred : blk.vecpred)
+		{
+			size_t ipred = std::find(blk.vecpred.begin(), blk.vecpred.end(), iblockPred) - blk.vecpred.begin();
+			for (uint32_t ivalPhi : blk.vecphi)
+			{
+				uint32_t ivalOpnd = m_vecinstr[ivalPhi].vecopnd[ipred];
+				if (_FAllocated(ivalOpnd))
+					Extend(ivalOpnd, m_vecblock[iblockPred].posEnd);
+			}
+		}
+		for (size_t iword = 0; iword < cword; ++iword)
+		{
+			for (uint64_t bits = blk.veclive[iword]; bits != 0; bits &= bits - 1)
+			{
+				uint32_t ival = uint32_t(iword * 64 + CountTrailingZeros<uint64_t>(bits));
+				Extend(ival, blk.posStart);
+			}
+			for (uint64_t bits = vecvecOut[iblock][iword]; bits != 0; bits &= bits - 1)
+			{
+				uint32_t ival = uint32_t(iword * 64 + CountTrailingZeros<uint64_t>(bits));
+				Extend(ival, blk.posEnd);
+			}
+		}
+	}
+	return true;
+}
+
+void OptimizingCompiler::_AllocateRegisters()
+{
+	// Linear scan (Poletto and Sarkar).  rcx is reserved for shift counts and divisors, r10 and r11 are scratch for
+	//	operands that live in the frame.  A spilled value stays in its frame slot for its whole life.
+	static const Reg rgregAlloc[] = { JitWriter::rax, JitWriter::rdx, JitWriter::r8, JitWriter::r9, JitWriter::r12, JitWriter::r13, JitWriter::r14, JitWriter::r15, JitWriter::rdi };
+
+	std::vector<uint32_t> vecival;
+	std::vector<std::vector<uint32_t>> vecvecivalPhiUser(m_vecinstr.size());
+	for (uint32_t iblock : m_veciblockLayout)
+	{
+		const Block &blk = m_vecblock[iblock];
+		for (uint32_t ival : blk.vecphi)
+		{
+			if (_FAllocated(ival))
+				vecival.push_back(ival);
+			for (uint32_t ivalOpnd : m_vecinstr[ival].vecopnd)
+				vecvecivalPhiUser[ivalOpnd].push_back(ival);
+		}
+		for (uint32_t ival : blk.vecival)
+		{
+			if (_FAllocated(ival))
+				vecival.push_back(ival);
+		}
+	}
+	std::stable_sort(vecival.begin(), vecival.end(), [&](uint32_t ivalA, uint32_t ivalB) { return m_vecinstr[ivalA].posStart < m_vecinstr[ivalB].posStart; });
+
+	std::vector<int32_t> vecposSlotEnd;	// frame slots after the arguments, and the end of the last value in each
+	auto AssignSlot = [&](uint32_t ival)
+	{
+		Instr &instr = m_vecinstr[ival];
+		if (instr.op == Op::Param)
+		{
+			instr.loc = locSlot + int32_t(instr.imm);	// the argument is already in the frame
+			return;
+		}
+		size_t islot = 0;
+		while (islot < vecposSlotEnd.size() && vecposSlotEnd[islot] >= instr.posStart)
+			++islot;
+		if (islot == vecposSlotEnd.size())
+			vecposSlotEnd.push_back(0);
+		vecposSlotEnd[islot] = instr.posEnd;
+		instr.loc = locSlot + int32_t(m_clocalsIn + m_cstackIn + islot);
+	};
+
+	std::vector<uint32_t> vecivalActive;
+	uint32_t maskFree = 0;
+	for (Reg reg : rgregAlloc)
+		maskFree |= JitWriter::RegMask(reg);
+	for (uint32_t ival : vecival)
+	{
+		Instr &instr = m_vecinstr[ival];
+		for (size_t iactive = 0; iactive < vecivalActive.size(); )
+		{
+			const Instr &instrActive = m_vecinstr[vecivalActive[iactive]];
+			if (instrActive.posEnd < instr.posStart)
+			{
+				maskFree |= JitWriter::RegMask(Reg(instrActive.loc));
+				vecivalActive.erase(vecivalActive.begin() + iactive);
+			}
+			else
+			{
+				++iactive;
+			}
+		}
+
+		// calls clobber every register so anything live across one goes to the frame
+		auto itrCall = std::lower_bound(m_vecposCall.begin(), m_vecposCall.end(), instr.posStart);
+		if (itrCall != m_vecposCall.end() && *itrCall < instr.posEnd)
+		{
+			AssignSlot(ival);
+			continue;
+		}
+
+		if (maskFree != 0)
+		{
+			// prefer a register that makes a move disappear: the phi this value feeds or an operand that just died
+			Reg reg = JitWriter::rax;
+			bool fFound = false;
+			auto TryPrefer = [&](uint32_t ivalOther)
+			{
+				if (!fFound && _FReg(ivalOther) && (maskFree & JitWriter::RegMask(Reg(m_vecinstr[ivalOther].loc))))
+				{
+					reg = Reg(m_vecinstr[ivalOther].loc);
+					fFound = true;
+				}
+			};
+			for (uint32_t ivalPhi : vecvecivalPhiUser[ival])
+				TryPrefer(ivalPhi);
+			for (uint32_t ivalOpnd : instr.vecopnd)
+				TryPrefer(ivalOpnd);
+			for (size_t ireg = 0; !fFound && ireg < _countof(rgregAlloc); ++ireg)
+			{
+				if (maskFree & JitWriter::RegMask(rgregAlloc[ireg]))
+				{
+					reg = rgregAlloc[ireg];
+					fFound = true;
+				}
+			}
+			instr.loc = reg;
+			maskFree &= ~JitWriter::RegMask(reg);
+			vecivalActive.push_back(ival);
+			continue;
+		}
+
+		// Out of registers, whichever value lives longest goes to the frame
+		auto itrSpill = std::max_element(vecivalActive.begin(), vecivalActive.end(), [&](uint32_t ivalA, uint32_t ivalB) { return m_vecinstr[ivalA].posEnd < m_vecinstr[ivalB].posEnd; });
+		Instr &instrSpill = m_vecinstr[*itrSpill];
+		if (instrSpill.posEnd > instr.posEnd)
+		{
+			instr.loc = instrSpill.loc;
+			AssignSlot(*itrSpill);
+			*itrSpill = ival;
+		}
+		else
+		{
+			AssignSlot(ival);
+		}
+	}
+	m_cslots = m_clocalsIn + m_cstackIn + numeric_cast<uint32_t>(vecposSlotEnd.size());
+}
+
+//
+// Code generation
+//
+
+int32_t OptimizingCompiler::_DispSlot(int32_t loc) const
+{
+	// Spill slots are above the outgoing arguments, the values we were entered with are above the frame where the
+	//	baseline code would have them: its operand stack entries (the last one lowest) and then its locals
+	Verify(loc >= locSlot);
+	uint32_t islot = uint32_t(loc - locSlot);
+	if (islot >= m_clocalsIn + m_cstackIn)
+		return numeric_cast<int32_t>((m_cargsOut + islot - m_clocalsIn - m_cstackIn) * sizeof(uint64_t));
+	if (islot >= m_clocalsIn)
+		return m_cbFrame + numeric_cast<int32_t>((m_cstackIn - 1 - (islot - m_clocalsIn)) * sizeof(uint64_t));
+	return m_cbFrame + numeric_cast<int32_t>(m_cstackIn * sizeof(uint64_t)) + JitWriter::_DispLocal(islot, m_cparams, m_clocalsIn);
+}
+
+void OptimizingCompiler::_LoadConst(Reg reg, uint64_t c)
+{
+	if (c <= 0xFFFFFFFF)
+	{
+		// mov reg32, imm32		; zero extends
+		m_pjit->_EmitRex(false, 0, 0, reg);
+		m_pjit->SafePushCode(uint8_t(0xB8 | (reg & 7)));
+		m_pjit->SafePushCode(uint32_t(c));
+	}
+	else if (int64_t(c) == int32_t(c))
+	{
+		// mov reg, imm32		; sign extends
+		m_pjit->_EmitRegReg({ 0xC7 }, true, 0, reg);
+		m_pjit->SafePushCode(int32_t(c));
+	}
+	else
+	{
+		// mov reg, imm64
+		m_pjit->_EmitRex(true, 0, 0, reg);
+		m_pjit->SafePushCode(uint8_t(0xB8 | (reg & 7)));
+		m_pjit->SafePushCode(c);
+	}
+}
+
+void OptimizingCompiler::_MoveLoc(int32_t locDst, int32_t locSrc)
+{
+	// NOTE: Must not affect flags
+	if (locDst == locSrc)
+		return;
+	if (locDst < locSlot && locSrc < locSlot)
+	{
+		m_pjit->_MovRegReg(Reg(locDst), Reg(locSrc));
+	}
+	else if (locDst < locSlot)
+	{
+		// mov reg, [rsp + slot]
+		m_pjit->_EmitRegMem({ 0x8B }, true, Reg(locDst), JitWriter::rsp, _DispSlot(locSrc));
+	}
+	else if (locSrc < locSlot)
+	{
+		// mov [rsp + slot], reg
+		m_pjit->_EmitRegMem({ 0x89 }, true, Reg(locSrc), JitWriter::rsp, _DispSlot(locDst));
+	}
+	else
+	{
+		_MoveLoc(JitWriter::r11, locSrc);
+		_MoveLoc(locDst, JitWriter::r11);
+	}
+}
+
+void OptimizingCompiler::_LoadOpnd(Reg reg, uint32_t ival)
+{
+	// NOTE: Must not affect flags
+	uint64_t c;
+	if (_FConst(ival, &c))
+		_LoadConst(reg, c);
+	else
+		_MoveLoc(reg, m_vecinstr[ival].loc);
+}
+
+OptimizingCompiler::Reg OptimizingCompiler::_RegOpnd(uint32_t ival, Reg regScratch)
+{
+	if (_FReg(ival))
+		return Reg(m_vecinstr[ival].loc);
+	_LoadOpnd(regScratch, ival);
+	return regScratch;
+}
+
+void OptimizingCompiler::_StoreDst(uint32_t ival, Reg reg)
+{
+	if (m_vecinstr[ival].loc >= 0)
+		_MoveLoc(m_vecinstr[ival].loc, reg);
+}
+
+void OptimizingCompiler::_EmitAlu(uint8_t opRm, uint8_t opext, bool f64, Reg reg, uint32_t ivalSrc)
+{
+	// op reg, src		; opRm is the "reg, r/m" form and opext the /digit of the immediate form
+	uint64_t c;
+	if (_FConst(ivalSrc, &c))
+	{
+		if (!f64 || int64_t(c) == int32_t(c))
+		{
+			m_pjit->_EmitAluImm(opext, f64, reg, int32_t(c));
+			return;
+		}
+		_LoadConst(JitWriter::r11, c);
+		m_pjit->_EmitRegReg({ opRm }, f64, reg, JitWriter::r11);
+	}
+	else if (_FReg(ivalSrc))
+	{
+		m_pjit->_EmitRegReg({ opRm }, f64, reg, uint8_t(m_vecinstr[ivalSrc].loc));
+	}
+	else
+	{
+		m_pjit->_EmitRegMem({ opRm }, f64, reg, JitWriter::rsp, _DispSlot(m_vecinstr[ivalSrc].loc));
+	}
+}
+
+bool OptimizingCompiler::_FPrepareAddress(uint32_t ivalAddr, uint64_t offset, int32_t *pdisp)
+{
+	// Returns true if the effective address is [rsi + r10 + disp] and false for [rsi + disp].  The sum is done in
+	//	64-bits so it can't wrap, the heap reservation covers the full 33-bit range.
+	uint64_t c;
+	if (_FConst(ivalAddr, &c) && c + offset < 0x80000000)
+	{
+		*pdisp = int32_t(c + offset);
+		return false;
+	}
+
+	// mov r10d, addr
+	if (_FConst(ivalAddr, &c))
+		_LoadConst(JitWriter::r10, c);
+	else if (_FReg(ivalAddr))
+		m_pjit->_EmitRegReg({ 0x8B }, false, JitWriter::r10, uint8_t(m_vecinstr[ivalAddr].loc));
+	else
+		m_pjit->_EmitRegMem({ 0x8B }, false, JitWriter::r10, JitWriter::rsp, _DispSlot(m_vecinstr[ivalAddr].loc));
+
+	if (offset < 0x80000000)
+	{
+		*pdisp = int32_t(offset);
+	}
+	else
+	{
+		// mov ecx, offset
+		// add r10, rcx
+		_LoadConst(JitWriter::rcx, offset);
+		m_pjit->_EmitRegReg({ 0x03 }, true, JitWriter::r10, JitWriter::rcx);
+		*pdisp = 0;
+	}
+	return true;
+}
+
+void OptimizingCompiler::_EmitAddress(std::initializer_list<uint8_t> rgop, bool f64, uint8_t regOp, bool fIndex, int32_t disp)
+{
+	if (fIndex)
+		m_pjit->_EmitRegMemIndex(rgop, f64, regOp, JitWriter::rsi, JitWriter::r10, disp);
+	else
+		m_pjit->_EmitRegMem(rgop, f64, regOp, JitWriter::rsi, disp);
+}
+
+void OptimizingCompiler::_EmitCompare(uint32_t ival)
+{
+	// Sets the flags, m_ccLast is the condition that is true when the value would have been 1
+	const Instr &instr = m_vecinstr[ival];
+	bool fOpnd64 = _F64(instr.vecopnd[0]);
+	Reg regA = _RegOpnd(instr.vecopnd[0], JitWriter::r10);
+	uint64_t c;
+	if (instr.op == Op::Eqz || (_FConst(instr.vecopnd[1], &c) && c == 0))
+	{
+		// test a, a		; same flags as cmp a, 0 for every condition
+		m_pjit->_EmitRegReg({ 0x85 }, fOpnd64, regA, regA);
+		m_ccLast = (instr.op == Op::Eqz) ? ccE : instr.cc;
+		return;
+	}
+	// cmp a, b
+	_EmitAlu(0x3B, 7, fOpnd64, regA, instr.vecopnd[1]);
+	m_ccLast = instr.cc;
+}
+
+uint8_t OptimizingCompiler::_CcCondition(uint32_t ival)
+{
+	const Instr &instr = m_vecinstr[ival];
+	if (instr.fFused)
+	{
+		_EmitCompare(ival);
+		return m_ccLast;
+	}
+	if (_FReg(ival))
+	{
+		// test cond32, cond32
+		m_pjit->_EmitRegReg({ 0x85 }, false, uint8_t(instr.loc), uint8_t(instr.loc));
+	}
+	else if (instr.loc >= locSlot)
+	{
+		// cmp dword ptr [rsp + slot], 0
+		m_pjit->_EmitRegMem({ 0x83 }, false, 7, JitWriter::rsp, _DispSlot(instr.loc));
+		m_pjit->SafePushCode(uint8_t(0));
+	}
+	else
+	{
+		Reg reg = _RegOpnd(ival, JitWriter::r11);
+		m_pjit->_EmitRegReg({ 0x85 }, false, reg, reg);
+	}
+	return ccNE;
+}
+
+uint32_t OptimizingCompiler::_IblockTarget(uint32_t iblock) const
+{
+	// Blocks that only hold moves which turned out to be no-ops are skipped over
+	for (size_t cstep = 0; cstep < m_veciblockLayout.size(); ++cstep)
+	{
+		if (!_FForwarder(iblock))
+			break;
+		iblock = m_vecblock[iblock].vecsucc[0];
+	}
+	return iblock;
+}
+
+bool OptimizingCompiler::_FForwarder(uint32_t iblock) const
+{
+	const Block &blk = m_vecblock[iblock];
+	if (iblock == 0 || blk.vecival.size() != 1 || m_vecinstr[blk.vecival[0]].op != Op::Jump || !blk.vecphi.empty())
+		return false;
+	const Block &blkSucc = m_vecblock[blk.vecsucc[0]];
+	size_t ipred = std::find(blkSucc.vecpred.begin(), blkSucc.vecpred.end(), iblock) - blkSucc.vecpred.begin();
+	for (uint32_t ivalPhi : blkSucc.vecphi)
+	{
+		const Instr &instrPhi = m_vecinstr[ivalPhi];
+		const Instr &instrSrc = m_vecinstr[instrPhi.vecopnd[ipred]];
+		if (instrPhi.loc >= 0 && (instrSrc.op == Op::Const || instrSrc.loc != instrPhi.loc))
+			return false;
+	}
+	return true;
+}
+
+void OptimizingCompiler::_EmitJump(uint32_t iblockTo, uint8_t cc)
+{
+	uint8_t *pbTarget = m_vecblock[iblockTo].pbCode;
+	if (pbTarget != nullptr)
+	{
+		// backwards, use the short form if we can
+		ptrdiff_t diff = pbTarget - (m_pjit->m_pexecPlaneCur + 2);
+		if (diff == static_cast<int8_t>(diff))
+		{
+			// jmp/jcc rel8
+			m_pjit->SafePushCode(uint8_t(cc == ccAlways ? 0xEB : (0x70 | cc)));
+			m_pjit->SafePushCode(static_cast<int8_t>(diff));
+			return;
+		}
+	}
+	// jmp/jcc rel32
+	if (cc == ccAlways)
+	{
+		m_pjit->SafePushCode(uint8_t(0xE9));
+	}
+	else
+	{
+		m_pjit->SafePushCode(uint8_t(0x0F));
+		m_pjit->SafePushCode(uint8_t(0x80 | cc));
+	}
+	int32_t *prel32 = reinterpret_cast<int32_t*>(m_pjit->m_pexecPlaneCur);
+	m_pjit->SafePushCode(int32_t(0));
+	if (pbTarget != nullptr)
+		*m_pjit->_PWritable(prel32) = numeric_cast<int32_t>(pbTarget - m_pjit->m_pexecPlaneCur);
+	else
+		m_vecblock[iblockTo].vecfixup.push_back(prel32);
+}
+
+void OptimizingCompiler::_EmitMoves(uint32_t iblockFrom, uint32_t iblockTo)
+{
+	// The phis of the successor all change at once, order the moves so no source is overwritten before it is read
+	const Block &blkTo = m_vecblock[iblockTo];
+	if (blkTo.vecphi.empty())
+		return;
+	size_t ipred = std::find(blkTo.vecpred.begin(), blkTo.vecpred.end(), iblockFrom) - blkTo.vecpred.begin();
+	std::vector<Move> vecmove;
+	for (uint32_t ivalPhi : blkTo.vecphi)
+	{
+		const Instr &instrPhi = m_vecinstr[ivalPhi];
+		if (instrPhi.loc < 0)
+			continue;
+		uint32_t ivalSrc = instrPhi.vecopnd[ipred];
+		Move move;
+		move.locDst = instrPhi.loc;
+		move.locSrc = -1;
+		move.c = 0;
+		if (!_FConst(ivalSrc, &move.c))
+			move.locSrc = m_vecinstr[ivalSrc].loc;
+		if (move.locSrc != move.locDst)
+			vecmove.push_back(move);
+	}
+	_EmitParallelMoves(vecmove, JitWriter::r10);
+}
+
+void OptimizingCompiler::_EmitArgMoves(uint32_t ival)
+{
+	// Arguments may be in registers that other arguments go to, rcx is free at a call
+	const Instr &instr = m_vecinstr[ival];
+	const FunctionTypeEntry *ptypeCallee = m_pctxt->m_vecfn_types[m_pctxt->m_vecfn_entries[instr.imm]].get();
+	uint32_t cargs = numeric_cast<uint32_t>(instr.vecopnd.size());
+	std::vector<Move> vecmove;
+	for (uint32_t iarg = JitWriter::_CargsStack(cargs); iarg < cargs; ++iarg)
+	{
+		Move move;
+		move.locDst = JitWriter::_RegArg(ptypeCallee->rgparam_type, cargs, iarg);
+		move.locSrc = -1;
+		move.c = 0;
+		if (!_FConst(instr.vecopnd[iarg], &move.c))
+			move.locSrc = m_vecinstr[instr.vecopnd[iarg]].loc;
+		if (move.locSrc != move.locDst)
+			vecmove.push_back(move);
+	}
+	_EmitParallelMoves(vecmove, JitWriter::rcx);
+}
+
+void OptimizingCompiler::_EmitParamMoves()
+{
+	// Parameters that came in registers and were allocated one, the rest are read from the frame where they are used.
+	//	The allocatable registers include some of the argument registers so they may swap around.
+	std::vector<Move> vecmove;
+	for (uint32_t ival = 0; ival < m_vecinstr.size(); ++ival)
+	{
+		const Instr &instr = m_vecinstr[ival];
+		if (instr.op != Op::Param || instr.fDead || !_FReg(ival) || instr.imm < JitWriter::_CargsStack(m_cparams))
+			continue;
+		Move move;
+		move.locDst = instr.loc;
+		move.locSrc = JitWriter::_RegArg(m_ptype->rgparam_type, m_cparams, uint32_t(instr.imm));
+		move.c = 0;
+		if (move.locSrc != move.locDst)
+			vecmove.push_back(move);
+	}
+	_EmitParallelMoves(vecmove, JitWriter::rcx);
+}
+
+void OptimizingCompiler::_EmitParallelMoves(std::vector<Move> &vecmove, Reg regPark)
+{
+	while (!vecmove.empty())
+	{
+		bool fProgress = false;
+		for (size_t imove = 0; imove < vecmove.size(); )
+		{
+			int32_t locDst = vecmove[imove].locDst;
+			bool fBlocked = std::any_of(vecmove.begin(), vecmove.end(), [&](const Move &move) { return move.locSrc == locDst; });
+			if (fBlocked)
+			{
+				++imove;
+				continue;
+			}
+			if (vecmove[imove].locSrc < 0)
+			{
+				if (locDst < locSlot)
+				{
+					_LoadConst(Reg(locDst), vecmove[imove].c);
+				}
+				else
+				{
+					_LoadConst(JitWriter::r11, vecmove[imove].c);
+					_MoveLoc(locDst, JitWriter::r11);
+				}
+			}
+			else
+			{
+				_MoveLoc(locDst, vecmove[imove].locSrc);
+			}
+			vecmove.erase(vecmove.begin() + imove);
+			fProgress = true;
+		}
+		if (!fProgress)
+		{
+			// Every remaining move is part of a cycle, park one destination to break it
+			int32_t locPark = vecmove.front().locDst;
+			_MoveLoc(regPark, locPark);
+			for (Move &move : vecmove)
+			{
+				if (move.locSrc == locPark)
+					move.locSrc = regPark;
+			}
+		}
+	}
+}
+
+void OptimizingCompiler::_EmitCode()
+{
+	std::vector<uint32_t> veciblockEmit;
+	for (uint32_t iblock : m_veciblockLayout)
+	{
+		if (!_FForwarder(iblock))
+			veciblockEmit.push_back(iblock);
+	}
+
+	// The frame is the outgoing arguments of the biggest call and the spill slots
+	for (const Instr &instr : m_vecinstr)
+	{
+		if (instr.op == Op::Call && !instr.fDead)
+			m_cargsOut = std::max(m_cargsOut, JitWriter::_CargsStack(numeric_cast<uint32_t>(instr.vecopnd.size())));
+	}
+	m_cbFrame = numeric_cast<int32_t>((m_cargsOut + m_cslots - m_clocalsIn - m_cstackIn) * sizeof(uint64_t));
+
+#ifdef PRINT_DISASSEMBLY
+	printf("Function %d (optimized, %u values, %u blocks, %u frame slots):\n", m_ifn, uint32_t(m_vecinstr.size()), uint32_t(veciblockEmit.size()), m_cslots);
+#endif
+	m_pjit->_RecordCodeMap(m_ifn, 0);
+	if (!m_fOsr)
+	{
+		m_pjit->_EmitFramePointer();
+		m_pjit->_EmitStackCheck();
+		// push the register arguments, the frame above the spill slots is then the same as the baseline's
+		for (uint32_t iparam = JitWriter::_CargsStack(m_cparams); iparam < m_cparams; ++iparam)
+			m_pjit->_PushEntry(JitWriter::_RegArg(m_ptype->rgparam_type, m_cparams, iparam));
+	}
+	// sub rsp, cbFrame		; a page at a time for big frames so the guard pages are touched in order
+	//	test [rsp], esp
+	int32_t cbAlloc = m_cbFrame;
+	for (; cbAlloc > cbPage; cbAlloc -= cbPage)
+	{
+		m_pjit->_EmitAluImm(5, true, JitWriter::rsp, cbPage);
+		m_pjit->_EmitRegMem({ 0x85 }, false, JitWriter::rsp, JitWriter::rsp, 0);
+	}
+	if (cbAlloc != 0)
+		m_pjit->_EmitAluImm(5, true, JitWriter::rsp, cbAlloc);
+	if (!m_fOsr)
+		_EmitParamMoves();
+	for (size_t iemit = 0; iemit < veciblockEmit.size(); ++iemit)
+	{
+		uint32_t iblock = veciblockEmit[iemit];
+		Block &blk = m_vecblock[iblock];
+		blk.pbCode = m_pjit->m_pexecPlaneCur;
+		for (int32_t *prel32 : blk.vecfixup)
+			*m_pjit->_PWritable(prel32) = numeric_cast<int32_t>(blk.pbCode - (reinterpret_cast<uint8_t*>(prel32) + sizeof(*prel32)));
+		blk.vecfixup.clear();
+
+		m_iblockNext = (iemit + 1 < veciblockEmit.size()) ? veciblockEmit[iemit + 1] : ivalNone;
+		for (uint32_t ival : blk.vecival)
+		{
+			const Instr &instr = m_vecinstr[ival];
+			if (instr.op == Op::Const || instr.op == Op::Phi || instr.fFused)
+				continue;
+			m_pjit->_RecordCodeMap(m_ifn, instr.ibBytecode);
+			_EmitInstr(ival);
+		}
+	}
+	for (const Block &blk : m_vecblock)
+		Verify(blk.vecfixup.empty());
+}
+
+void OptimizingCompiler::_EmitInstr(uint32_t ival)
+{
+	const Instr &instr = m_vecinstr[ival];
+	switch (instr.op)
+	{
+	case Op::Param:
+		// The prologue already moved the register arguments, unless we came in at a loop with everything in the frame
+		if (_FReg(ival) && (m_fOsr || instr.imm < JitWriter::_CargsStack(m_cparams)))
+		{
+			// mov reg, [rsp + slot]
+			_MoveLoc(instr.loc, locSlot + int32_t(instr.imm));
+		}
+		break;
+
+	case Op::Add: case Op::Sub: case Op::And: case Op::Or: case Op::Xor: case Op::Mul:
+	{
+		static const struct { Op op; uint8_t opRm; uint8_t opext; } rgalu[] =
+		{
+			{ Op::Add, 0x03, 0 },
+			{ Op::Sub, 0x2B, 5 },
+			{ Op::And, 0x23, 4 },
+			{ Op::Or, 0x0B, 1 },
+			{ Op::Xor, 0x33, 6 },
+		};
+		uint32_t ivalA = instr.vecopnd[0];
+		uint32_t ivalB = instr.vecopnd[1];
+		Reg regDst = _RegDst(ival);
+		uint64_t c;
+		if (instr.op == Op::Mul && _FConst(ivalB, &c) && (!instr.f64 || int64_t(c) == int32_t(c)) && !_FConst(ivalA))
+		{
+			// imul dst, a, imm32		; three operand form, no move needed
+			if (_FReg(ivalA))
+				m_pjit->_EmitRegReg({ 0x69 }, instr.f64, regDst, uint8_t(m_vecinstr[ivalA].loc));
+			else
+				m_pjit->_EmitRegMem({ 0x69 }, instr.f64, regDst, JitWriter::rsp, _DispSlot(m_vecinstr[ivalA].loc));
+			m_pjit->SafePushCode(int32_t(c));
+			_StoreDst(ival, regDst);
+			break;
+		}
+		if (_FReg(ivalB) && m_vecinstr[ivalB].loc == regDst && ivalA != ivalB)
+		{
+			// the destination holds b, loading a into it would lose b
+			if (instr.op == Op::Sub)
+				regDst = JitWriter::r10;
+			else
+				std::swap(ivalA, ivalB);
+		}
+		_LoadOpnd(regDst, ivalA);
+		if (instr.op == Op::Mul)
+		{
+			// imul dst, b
+			Reg regB = _RegOpnd(ivalB, JitWriter::r11);
+			m_pjit->_EmitRegReg({ 0x0F, 0xAF }, instr.f64, regDst, regB);
+		}
+		else
+		{
+			auto palu = std::find_if(std::begin(rgalu), std::end(rgalu), [&](const auto &alu) { return alu.op == instr.op; });
+			_EmitAlu(palu->opRm, palu->opext, instr.f64, regDst, ivalB);
+		}
+		_StoreDst(ival, regDst);
+		break;
+	}
+
+	case Op::Shl: case Op::ShrS: case Op::ShrU: case Op::Rotl: case Op::Rotr:
+	{
+		static const uint8_t rgopext[] = { 4 /*shl*/, 7 /*sar*/, 5 /*shr*/, 0 /*rol*/, 1 /*ror*/ };
+		uint8_t opext = rgopext[size_t(instr.op) - size_t(Op::Shl)];
+		Reg regDst = _RegDst(ival);
+		uint64_t c;
+		if (_FConst(instr.vecopnd[1], &c))
+		{
+			// op dst, imm8
+			_LoadOpnd(regDst, instr.vecopnd[0]);
+			m_pjit->_EmitRegReg({ 0xC1 }, instr.f64, opext, regDst);
+			m_pjit->SafePushCode(uint8_t(c & (instr.f64 ? 63 : 31)));
+		}
+		else
+		{
+			// mov ecx, count
+			// op dst, cl
+			_LoadOpnd(JitWriter::rcx, instr.vecopnd[1]);
+			_LoadOpnd(regDst, instr.vecopnd[0]);
+			m_pjit->_EmitRegReg({ 0xD3 }, instr.f64, opext, regDst);
+		}
+		_StoreDst(ival, regDst);
+		break;
+	}
+
+	case Op::Clz: case Op::Ctz: case Op::Popcnt:
+	{
+		static const uint8_t rgop[] = { 0xBD /*lzcnt*/, 0xBC /*tzcnt*/, 0xB8 /*popcnt*/ };
+		Reg regSrc = _RegOpnd(instr.vecopnd[0], JitWriter::r11);
+		Reg regDst = _RegDst(ival);
+		m_pjit->SafePushCode(uint8_t(0xF3));
+		m_pjit->_EmitRegReg({ 0x0F, rgop[size_t(instr.op) - size_t(Op::Clz)] }, instr.f64, regDst, regSrc);
+		_StoreDst(ival, regDst);
+		break;
+	}
+
+	case Op::Eqz:
+	case Op::Compare:
+	{
+		// cmp a, b
+		// setcc dst8
+		// movzx dst32, dst8
+		_EmitCompare(ival);
+		Reg regDst = _RegDst(ival);
+		Reg regByte = _FByteReg(regDst) ? regDst : JitWriter::r10;
+		m_pjit->_EmitRegReg({ 0x0F, uint8_t(0x90 | m_ccLast) }, false, 0, regByte);
+		m_pjit->_EmitRegReg({ 0x0F, 0xB6 }, false, regDst, regByte);
+		_StoreDst(ival, regDst);
+		break;
+	}
+
+	case Op::Wrap:
+	case Op::ExtendU:
+	{
+		// mov dst32, src32
+		Reg regSrc = _RegOpnd(instr.vecopnd[0], JitWriter::r11);
+		Reg regDst = _RegDst(ival);
+		m_pjit->_EmitRegReg({ 0x8B }, false, regDst, regSrc);
+		_StoreDst(ival, regDst);
+		break;
+	}
+
+	case Op::ExtendS:
+	{
+		// movsxd dst, src32
+		Reg regSrc = _RegOpnd(instr.vecopnd[0], JitWriter::r11);
+		Reg regDst = _RegDst(ival);
+		m_pjit->_EmitRegReg({ 0x63 }, true, regDst, regSrc);
+		_StoreDst(ival, regDst);
+		break;
+	}
+
+	case Op::Select:
+	{
+		// dst = cond ? a : b
+		//	mov dst, a
+		//	cmov!cc dst, b
+		uint8_t cc = _CcCondition(instr.vecopnd[2]);
+		Reg regDst = _RegDst(ival);
+		uint32_t ivalMov = instr.vecopnd[0];
+		uint32_t ivalCmov = instr.vecopnd[1];
+		uint8_t ccCmov = cc ^ 1;
+		if (_FReg(ivalCmov) && m_vecinstr[ivalCmov].loc == regDst)
+		{
+			std::swap(ivalMov, ivalCmov);
+			ccCmov = cc;
+		}
+		_LoadOpnd(regDst, ivalMov);
+		if (_FConst(ivalCmov) || _FReg(ivalCmov))
+		{
+			Reg regSrc = _RegOpnd(ivalCmov, JitWriter::r11);
+			m_pjit->_EmitRegReg({ 0x0F, uint8_t(0x40 | ccCmov) }, instr.f64, regDst, regSrc);
+		}
+		else
+		{
+			m_pjit->_EmitRegMem({ 0x0F, uint8_t(0x40 | ccCmov) }, instr.f64, regDst, JitWriter::rsp, _DispSlot(m_vecinstr[ivalCmov].loc));
+		}
+		_StoreDst(ival, regDst);
+		break;
+	}
+
+	case Op::DivS: case Op::DivU: case Op::RemS: case Op::RemU:
+	{
+		// div needs rax and rdx, which the allocator hands out, so their values wait in r10 and r11
+		//	mov r10, rax
+		//	mov r11, rdx
+		//	mov rcx, divisor
+		//	mov rax, dividend
+		//	cdq/cqo or xor edx, edx
+		//	div/idiv rcx
+		//	mov rcx, rax/rdx
+		//	mov rax, r10
+		//	mov rdx, r11
+		//	mov dst, rcx
+		auto LocAfterSave = [&](uint32_t ivalOpnd) -> int32_t
+		{
+			int32_t loc = m_vecinstr[ivalOpnd].loc;
+			if (loc == JitWriter::rax)
+				return JitWriter::r10;
+			if (loc == JitWriter::rdx)
+				return JitWriter::r11;
+			return loc;
+		};
+		bool fSigned = instr.op == Op::DivS || instr.op == Op::RemS;
+		bool fRem = instr.op == Op::RemS || instr.op == Op::RemU;
+		m_pjit->_MovRegReg(JitWriter::r10, JitWriter::rax);
+		m_pjit->_MovRegReg(JitWriter::r11, JitWriter::rdx);
+		uint64_t c;
+		if (_FConst(instr.vecopnd[1], &c) && JitWriter::_FDivConstInline(fSigned, fRem, instr.f64, c))
+		{
+			// Constant divisors are a multiply and shifts on the dividend in rcx, rax and rdx are still free
+			uint64_t divisor = c;
+			if (_FConst(instr.vecopnd[0], &c))
+				_LoadConst(JitWriter::rcx, c);
+			else
+				_MoveLoc(JitWriter::rcx, LocAfterSave(instr.vecopnd[0]));
+			Reg regResult = m_pjit->_EmitDivConst(fSigned, fRem, instr.f64, divisor, JitWriter::rcx);
+			if (regResult != JitWriter::rcx)
+				m_pjit->_MovRegReg(JitWriter::rcx, regResult);
+			m_pjit->_MovRegReg(JitWriter::rax, JitWriter::r10);
+			m_pjit->_MovRegReg(JitWriter::rdx, JitWriter::r11);
+			_StoreDst(ival, JitWriter::rcx);
+			break;
+		}
+		if (_FConst(instr.vecopnd[1], &c))
+			_LoadConst(JitWriter::rcx, c);
+		else
+			_MoveLoc(JitWriter::rcx, LocAfterSave(instr.vecopnd[1]));
+		if (_FConst(instr.vecopnd[0], &c))
+			_LoadConst(JitWriter::rax, c);
+		else
+			_MoveLoc(JitWriter::rax, LocAfterSave(instr.vecopnd[0]));
+
+		if (instr.op == Op::RemS)
+		{
+			// INT_MIN % -1 must be 0 rather than trap, the remainder doesn't depend on the divisor's sign
+			//	mov rdx, rcx
+			//	sar rdx, 63
+			//	xor rcx, rdx
+			//	sub rcx, rdx
+			m_pjit->_EmitRegReg({ 0x89 }, instr.f64, JitWriter::rcx, JitWriter::rdx);
+			m_pjit->_EmitRegReg({ 0xC1 }, instr.f64, 7, JitWriter::rdx);
+			m_pjit->SafePushCode(uint8_t(instr.f64 ? 63 : 31));
+			m_pjit->_EmitRegReg({ 0x31 }, instr.f64, JitWriter::rdx, JitWriter::rcx);
+			m_pjit->_EmitRegReg({ 0x29 }, instr.f64, JitWriter::rdx, JitWriter::rcx);
+		}
+		if (fSigned)
+		{
+			// cdq / cqo
+			if (instr.f64)
+				m_pjit->SafePushCode(uint8_t(0x48));
+			m_pjit->SafePushCode(uint8_t(0x99));
+		}
+		else
+		{
+			// xor edx, edx
+			m_pjit->_EmitRegReg({ 0x31 }, false, JitWriter::rdx, JitWriter::rdx);
+		}
+		// div/idiv rcx
+		m_pjit->_EmitRegReg({ 0xF7 }, instr.f64, fSigned ? 7 : 6, JitWriter::rcx);
+		m_pjit->_MovRegReg(JitWriter::rcx, fRem ? JitWriter::rdx : JitWriter::rax);
+		m_pjit->_MovRegReg(JitWriter::rax, JitWriter::r10);
+		m_pjit->_MovRegReg(JitWriter::rdx, JitWriter::r11);
+		_StoreDst(ival, JitWriter::rcx);
+		break;
+	}
+
+	case Op::Load:
+	{
+		Reg regDst = _RegDst(ival);
+		int32_t disp;
+		bool fIndex = _FPrepareAddress(instr.vecopnd[0], instr.imm, &disp);
+		switch (instr.cbMem)
+		{
+		case 1:
+			// movsx/movzx dst, byte ptr [addr]
+			if (instr.fSignExtend)
+				_EmitAddress({ 0x0F, 0xBE }, instr.f64, regDst, fIndex, disp);
+			else
+				_EmitAddress({ 0x0F, 0xB6 }, false, regDst, fIndex, disp);
+			break;
+		case 2:
+			// movsx/movzx dst, word ptr [addr]
+			if (instr.fSignExtend)
+				_EmitAddress({ 0x0F, 0xBF }, instr.f64, regDst, fIndex, disp);
+			else
+				_EmitAddress({ 0x0F, 0xB7 }, false, regDst, fIndex, disp);
+			break;
+		case 4:
+			// movsxd dst, dword ptr [addr] / mov dst32, dword ptr [addr]
+			if (instr.fSignExtend)
+				_EmitAddress({ 0x63 }, true, regDst, fIndex, disp);
+			else
+				_EmitAddress({ 0x8B }, false, regDst, fIndex, disp);
+			break;
+		case 8:
+			// mov dst, qword ptr [addr]
+			_EmitAddress({ 0x8B }, true, regDst, fIndex, disp);
+			break;
+		default:
+			Verify(false);
+		}
+		_StoreDst(ival, regDst);
+		break;
+	}
+
+	case Op::Store:
+	{
+		uint64_t c = 0;
+		bool fImm = _FConst(instr.vecopnd[1], &c) && (instr.cbMem < 8 || int64_t(c) == int32_t(c));
+		Reg regValue = JitWriter::r11;
+		if (!fImm)
+			regValue = _RegOpnd(instr.vecopnd[1], JitWriter::r11);
+		if (instr.cbMem == 1 && !fImm && !_FByteReg(regValue))
+		{
+			m_pjit->_MovRegReg(JitWriter::r11, regValue);
+			regValue = JitWriter::r11;
+		}
+		int32_t disp;
+		bool fIndex = _FPrepareAddress(instr.vecopnd[0], instr.imm, &disp);
+		if (instr.cbMem == 2)
+			m_pjit->SafePushCode(uint8_t(0x66));
+		switch (instr.cbMem)
+		{
+		case 1:
+			// mov byte ptr [addr], imm8/value8
+			if (fImm)
+				_EmitAddress({ 0xC6 }, false, 0, fIndex, disp);
+			else
+				_EmitAddress({ 0x88 }, false, regValue, fIndex, disp);
+			break;
+		case 2:
+		case 4:
+		case 8:
+			// mov word/dword/qword ptr [addr], imm/value
+			if (fImm)
+				_EmitAddress({ 0xC7 }, instr.cbMem == 8, 0, fIndex, disp);
+			else
+				_EmitAddress({ 0x89 }, instr.cbMem == 8, regValue, fIndex, disp);
+			break;
+		default:
+			Verify(false);
+		}
+		if (fImm)
+		{
+			if (instr.cbMem == 1)
+				m_pjit->SafePushCode(uint8_t(c));
+			else if (instr.cbMem == 2)
+				m_pjit->SafePushCode(uint16_t(c));
+			else
+				m_pjit->SafePushCode(uint32_t(c));
+		}
+		break;
+	}
+
+	case Op::GetGlobal:
+	{
+		// mov dst, [m_pGlobalsStart + idx*8] (rip relative)
+		Reg regDst = _RegDst(ival);
+		m_pjit->_EmitRegRip({ 0x8B }, instr.f64, regDst, m_pjit->m_pGlobalsStart + instr.imm);
+		_StoreDst(ival, regDst);
+		break;
+	}
+
+	case Op::SetGlobal:
+	{
+		// mov [m_pGlobalsStart + idx*8], value (rip relative)
+		Reg regValue = _RegOpnd(instr.vecopnd[0], JitWriter::r11);
+		m_pjit->_EmitRegRip({ 0x89 }, instr.f64, regValue, m_pjit->m_pGlobalsStart + instr.imm);
+		break;
+	}
+
+	case Op::Call:
+	{
+		// The stack arguments go at the bottom of the frame where the baseline would have pushed them, the last one
+		//	lowest, then the others go in their registers
+		//	mov [rsp + (cargsStack-1-iarg)*8], arg ...
+		//	mov regArg, arg ...
+		//	call rel32			; call [rip + PfnVector] for imports
+		uint32_t ifnCallee = uint32_t(instr.imm);
+		size_t cargsStack = JitWriter::_CargsStack(numeric_cast<uint32_t>(instr.vecopnd.size()));
+		for (size_t iarg = 0; iarg < cargsStack; ++iarg)
+		{
+			int32_t disp = numeric_cast<int32_t>((cargsStack - 1 - iarg) * sizeof(uint64_t));
+			uint64_t c;
+			if (_FConst(instr.vecopnd[iarg], &c) && int64_t(c) == int32_t(c))
+			{
+				// mov qword ptr [rsp + disp], imm32
+				m_pjit->_EmitRegMem({ 0xC7 }, true, 0, JitWriter::rsp, disp);
+				m_pjit->SafePushCode(int32_t(c));
+				continue;
+			}
+			Reg regArg = _RegOpnd(instr.vecopnd[iarg], JitWriter::r11);
+			m_pjit->_EmitRegMem({ 0x89 }, true, regArg, JitWriter::rsp, disp);
+		}
+		_EmitArgMoves(ival);
+		if (ifnCallee < m_pctxt->m_vecimports.size())
+		{
+			// mov ecx, ifn		; so WasmToC knows the function
+			_LoadConst(JitWriter::rcx, ifnCallee);
+			static const uint8_t rgcodeCall[] = { 0xFF, 0x15 };
+			int32_t offset = m_pjit->RelAddrPfnVector(ifnCallee, 6);
+			m_pjit->SafePushCode(rgcodeCall);
+			m_pjit->SafePushCode(offset);
+		}
+		else
+		{
+			m_pjit->_EmitCallFn(ifnCallee);
+		}
+		_StoreDst(ival, JitWriter::rax);
+		break;
+	}
+
+	case Op::Jump:
+	{
+		uint32_t iblockTo = m_vecblock[instr.iblock].vecsucc[0];
+		_EmitMoves(instr.iblock, iblockTo);
+		iblockTo = _IblockTarget(iblockTo);
+		if (iblockTo != m_iblockNext)
+			_EmitJump(iblockTo, ccAlways);
+		break;
+	}
+
+	case Op::Branch:
+	{
+		uint8_t cc = _CcCondition(instr.vecopnd[0]);
+		uint32_t iblockTrue = _IblockTarget(m_vecblock[instr.iblock].vecsucc[0]);
+		uint32_t iblockFalse = _IblockTarget(m_vecblock[instr.iblock].vecsucc[1]);
+		if (iblockTrue == m_iblockNext)
+		{
+			_EmitJump(iblockFalse, cc ^ 1);
+		}
+		else
+		{
+			_EmitJump(iblockTrue, cc);
+			if (iblockFalse != m_iblockNext)
+				_EmitJump(iblockFalse, ccAlways);
+		}
+		break;
+	}
+
+	case Op::Return:
+	{
+		// mov rax, value
+		// leave				; takes the baseline's operand stack and locals too when we were entered at a loop
+		// ret
+		if (!instr.vecopnd.empty())
+			_LoadOpnd(JitWriter::rax, instr.vecopnd[0]);
+		static const uint8_t rgcodeRet[] = { 0xC9, 0xC3 };
+		m_pjit->SafePushCode(rgcodeRet);
+		break;
+	}
+
+	case Op::Unreachable:
+	{
+		// ud2
+		static const uint8_t rgcode[] = { 0x0F, 0x0B };
+		m_pjit->SafePushCode(rgcode);
+		break;
+	}
+
+	default:
+		Verify(false);
+	}
+}
@@ -0,0 +1,241 @@
+#pragma once
+#include "JitWriter.h"
+
+// Second tier compiler.  The function is translated into an SSA graph, optimized (constant folding, global value
+//	numbering, loop invariant code motion and dead code elimination) and register allocated with a linear scan over
+//	the whole function.  Only integer code is handled, anything else leaves the function on the baseline JIT.
+//
+//	The generated code keeps the baseline calling convention: the last arguments in registers and the others pushed in
+//	order by the caller, result in rax, rsi/rbx/rbp preserved and every other register clobbered.  The frame below
+//	the return address and the saved rbp holds the register arguments (pushed like the baseline does), the outgoing
+//	stack arguments of the biggest call and a slot for each value that doesn't get a register or is live across a call.
+class OptimizingCompiler
+{
+public:
+	// ibOsr is the bytecode offset of a loop to start at, the code is entered with rsp where the baseline code has it
+	//	at the loop head (its operand stack entries in memory, then its locals) instead of at the beginning
+	OptimizingCompiler(JitWriter *pjit, uint32_t ifn, uint32_t ibOsr = UINT32_MAX);
+
+	// Emits the function at the current end of the code, returns nullptr without emitting anything if the function
+	//	uses something this tier doesn't support
+	void *PvCompile();
+
+private:
+	typedef JitWriter::Reg Reg;
+	static const uint32_t ivalNone = UINT32_MAX;
+
+	enum class Op : uint8_t
+	{
+		Const,
+		Param,
+		Phi,
+		// pure operations, operands are vecopnd[0] and vecopnd[1]
+		Add,
+		Sub,
+		Mul,
+		And,
+		Or,
+		Xor,
+		Shl,
+		ShrS,
+		ShrU,
+		Rotl,
+		Rotr,
+		Clz,
+		Ctz,
+		Popcnt,
+		Eqz,
+		Compare,	// cc is the x86 condition code
+		Wrap,
+		ExtendS,
+		ExtendU,
+		Select,		// vecopnd[2] ? vecopnd[0] : vecopnd[1]
+		// may trap or have side effects
+		DivS,
+		DivU,
+		RemS,
+		RemU,
+		Load,		// [vecopnd[0] + imm]
+		Store,		// [vecopnd[0] + imm] = vecopnd[1]
+		GetGlobal,
+		SetGlobal,
+		Call,
+		// terminators
+		Jump,
+		Branch,		// vecsucc[0] if vecopnd[0] is nonzero else vecsucc[1]
+		Return,
+		Unreachable,
+	};
+
+	struct Instr
+	{
+		Op op;
+		bool f64 = false;		// width of the result (operands for Store, SetGlobal and Return)
+		uint8_t cc = 0;
+		uint8_t cbMem = 0;
+		bool fSignExtend = false;
+		uint32_t iblock = 0;
+		uint32_t ibBytecode = 0;
+		uint64_t imm = 0;		// constant, memory offset, global, function or parameter index
+		std::vector<uint32_t> vecopnd;
+		uint32_t ivalForward = ivalNone;	// this value was replaced by another
+		bool fDead = false;
+
+		// register allocation
+		uint32_t cuse = 0;
+		bool fFused = false;	// comparison emitted together with the branch or select that uses it
+		int32_t posStart = -1;
+		int32_t posEnd = -1;
+		int32_t loc = -1;		// register, or locSlot + frame slot
+	};
+	static const int32_t locSlot = 16;
+
+	struct Block
+	{
+		std::vector<uint32_t> vecphi;
+		std::vector<uint32_t> vecival;		// terminator last
+		std::vector<uint32_t> vecpred;
+		std::vector<uint32_t> vecsucc;
+		bool fLoopHeader = false;
+		bool fDead = false;
+
+		// SSA construction
+		bool fSealed = false;
+		std::vector<uint32_t> vecdef;		// current value of each variable in this block
+		std::vector<std::pair<uint32_t, uint32_t>> vecincomplete;	// (variable, phi) waiting for the block to be sealed
+
+		// analysis
+		uint32_t irpo = UINT32_MAX;
+		uint32_t idom = UINT32_MAX;
+		int32_t posStart = 0;
+		int32_t posEnd = 0;
+		std::vector<uint64_t> veclive;		// live in values
+		uint8_t *pbCode = nullptr;
+		std::vector<int32_t*> vecfixup;		// rel32 jumps waiting for this block's address
+	};
+
+	enum class FrameKind
+	{
+		Function,
+		Block,
+		Loop,
+		If,
+	};
+	struct Frame
+	{
+		FrameKind kind;
+		uint32_t iblockTarget;			// branch target, the loop header or the block after the end
+		uint32_t iblockElse = ivalNone;	// if without its else yet
+		uint32_t ivarResult = ivalNone;
+		size_t cstack;
+	};
+
+	// SSA construction
+	bool _FBuild();
+	bool _FIntegerType(value_type type, bool *pf64) const;
+	uint32_t _NewBlock();
+	void _EnterBlock(uint32_t iblock);
+	uint32_t _NewVar(bool f64);
+	uint32_t _Emit(Op op, bool f64, std::initializer_list<uint32_t> rgopnd, uint64_t imm = 0);
+	uint32_t _Emit(Op op, bool f64, std::vector<uint32_t> &&vecopnd, uint64_t imm = 0);
+	uint32_t _Const(bool f64, uint64_t c);
+	void _Terminate(Op op, std::vector<uint32_t> &&vecopnd, std::initializer_list<uint32_t> rgsucc);
+	void _BranchTo(const Frame &frame, uint32_t ivalCond);	// ivalNone for an unconditional branch
+	void _WriteVar(uint32_t ivar, uint32_t iblock, uint32_t ival);
+	uint32_t _DefVar(uint32_t ivar, uint32_t iblock) const;
+	uint32_t _ReadVar(uint32_t ivar, uint32_t iblock);
+	uint32_t _NewPhi(uint32_t iblock, uint32_t ivar);
+	uint32_t _AddPhiOperands(uint32_t ivar, uint32_t ivalPhi);
+	uint32_t _TryRemoveTrivialPhi(uint32_t ivalPhi);
+	void _Seal(uint32_t iblock);
+	uint32_t _Pop();
+
+	// Optimization
+	uint32_t _Resolve(uint32_t ival);
+	void _Forward(uint32_t ival, uint32_t ivalNew);
+	bool _F64(uint32_t ival) { return m_vecinstr[_Resolve(ival)].f64; }
+	bool _FConst(uint32_t ival, uint64_t *pc = nullptr);
+	static bool _FPure(Op op);
+	void _MakeConst(uint32_t ival, uint64_t c);
+	void _RemoveEdge(uint32_t iblockFrom, uint32_t iblockTo);
+	void _RemovePhiTrivia();
+	template<typename TU, typename TS>
+	static bool _FEvalBinary(Op op, TU a, TU b, TU *pr);	// false if the operation traps
+	bool _FFold(uint32_t ival);
+	void _FoldConstants();
+	void _RemoveUnreachable();
+	void _ComputeDominators();
+	bool _FDominates(uint32_t iblockA, uint32_t iblockB) const;
+	void _ValueNumber();
+	void _HoistInvariants();
+	void _EliminateDeadCode();
+	void _SplitCriticalEdges();
+	void _Compact();
+
+	// Register allocation
+	bool _FBuildIntervals();	// false if the function is too big to allocate
+	void _AllocateRegisters();
+	bool _FAllocated(uint32_t ival) const;
+
+	// Code generation
+	void _EmitCode();
+	void _EmitInstr(uint32_t ival);
+	void _EmitMoves(uint32_t iblockFrom, uint32_t iblockTo);
+	struct Move
+	{
+		int32_t locDst;
+		int32_t locSrc;		// -1 for a constant
+		uint64_t c;
+	};
+	void _EmitParallelMoves(std::vector<Move> &vecmove, Reg regPark);	// regPark breaks cycles
+	void _EmitArgMoves(uint32_t ival);	// the register arguments of a call
+	void _EmitParamMoves();		// the register arguments we were called with
+	void _EmitJump(uint32_t iblockTo, uint8_t cc);	// cc == ccAlways for an unconditional jump
+	void _EmitCompare(uint32_t ival);	// leaves the result in the flags, returns through m_ccLast
+	uint8_t _CcCondition(uint32_t ival);	// sets the flags from an i32 condition and returns the cc for "true"
+	bool _FForwarder(uint32_t iblock) const;	// the block would only be a jump
+	uint32_t _IblockTarget(uint32_t iblock) const;
+	bool _FReg(uint32_t ival) const { return m_vecinstr[ival].loc >= 0 && m_vecinstr[ival].loc < locSlot; }
+	int32_t _DispSlot(int32_t loc) const;
+	void _LoadConst(Reg reg, uint64_t c);
+	void _MoveLoc(int32_t locDst, int32_t locSrc);
+	void _LoadOpnd(Reg reg, uint32_t ival);
+	Reg _RegOpnd(uint32_t ival, Reg regScratch);
+	Reg _RegDst(uint32_t ival) const { return _FReg(ival) ? Reg(m_vecinstr[ival].loc) : JitWriter::r10; }
+	void _StoreDst(uint32_t ival, Reg reg);
+	// spl/bpl/sil/dil only exist with a REX prefix, which the emitters leave off unless a register needs it
+	static bool _FByteReg(Reg reg) { return reg < JitWriter::rsp || reg >= JitWriter::r8; }
+	void _EmitAlu(uint8_t opRm, uint8_t opext, bool f64, Reg reg, uint32_t ivalSrc);
+	bool _FPrepareAddress(uint32_t ivalAddr, uint64_t offset, int32_t *pdisp);	// true if the address is [rsi + r10 + disp]
+	void _EmitAddress(std::initializer_list<uint8_t> rgop, bool f64, uint8_t regOp, bool fIndex, int32_t disp);
+	static const uint8_t ccAlways = 0xFF;
+
+	JitWriter *m_pjit;
+	WasmContext *m_pctxt;
+	uint32_t m_ifn;
+	const FunctionCodeEntry *m_pfnc;
+	const FunctionTypeEntry *m_ptype;
+	uint32_t m_cparams = 0;
+	uint32_t m_ibOsr;
+	uint32_t m_clocalsIn = 0;	// frame slots holding values on entry, spill slots come after them
+	uint32_t m_cstackIn = 0;	// baseline operand stack entries below the locals when entered at a loop, slots after the locals
+	bool m_fOsr = false;
+
+	std::vector<Instr> m_vecinstr;
+	std::vector<Block> m_vecblock;
+	std::vector<uint32_t> m_veciblockLayout;	// emission order, roughly the order of the bytecode
+	std::vector<uint32_t> m_veciblockRpo;
+	std::vector<bool> m_vecf64Var;
+	std::vector<uint32_t> m_vecstack;
+	std::vector<Frame> m_vecframe;
+	uint32_t m_iblockCur = ivalNone;		// ivalNone while the bytecode is unreachable
+	uint32_t m_ibCur = 0;
+	std::map<std::pair<bool, uint64_t>, uint32_t> m_mapconst;
+
+	std::vector<int32_t> m_vecposCall;
+	uint32_t m_cslots = 0;
+	uint32_t m_cargsOut = 0;	// stack arguments of the biggest call, they are at the bottom of the frame
+	int32_t m_cbFrame = 0;		// what the prologue takes off rsp
+	uint8_t m_ccLast = 0;
+	uint32_t m_iblockNext = ivalNone;	// block emitted after the current one, jumps to it fall through
+};
@@ -5,6 +5,7 @@
 #include "Exceptions.h"
 #include "ExpressionService.h"
 #include "BuiltinFunctions.h"
+#include "os_memory.h"
 
 void WasmContext::load_fn_type(const uint8_t **prgbPayload, size_t *pcbData)
 {
@@ -301,7 +302,7 @@ void WasmContext::InitializeMemory()
 
 	if (fFound)
 	{
-		Verify(idxMem >= 0 && idxMem < m_vecmem_types.size(), "Invalid memory export");
+		Verify(idxMem >= 0 && size_t(idxMem) < m_vecmem_types.size(), "Invalid memory export");
 		m_vecmem.resize(m_vecmem_types[idxMem].initial_size * WASM_PAGE_SIZE);
 	}
 }
@@ -410,7 +411,6 @@ void WasmContext::LinkImports()
 	}
 }
 
-#include <Windows.h>	// we don't want other dependencies on this in earlier functions
 void WasmContext::LoadModule(FILE *pf)
 {
 	wasm_file_header header;
@@ -422,19 +422,22 @@ void WasmContext::LoadModule(FILE *pf)
 	while (load_section(pf));
 	Verify(feof(pf));
 
-	size_t cbExecPlane = 128 * 4096;
+	size_t cbExecPlane = cbExecPlaneReserve;
 
 	void *pvStartAddr = nullptr;
 #ifdef _DEBUG
 	pvStartAddr = (void*)0xb0000000000;	// Note we want execution to be at a random address in ship to make exploiting flaws harder, for debug its nice to always be the same
 #endif
-	uint8_t *rgexec = (uint8_t*)VirtualAlloc(pvStartAddr, cbExecPlane, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-	if (rgexec == nullptr && pvStartAddr != nullptr)
+	// Only reserve the address space here, the JitWriter commits it as it generates code.  Code is written through
+	//	a second view of the same memory so the executable view is never writable.
+	void *pvExec = nullptr, *pvWrite = nullptr;
+	bool fReserved = OsReserveDualMapped(pvStartAddr, cbExecPlane, &pvExec, &pvWrite);
+	if (!fReserved && pvStartAddr != nullptr)
 	{
-		rgexec = (uint8_t*)VirtualAlloc(nullptr, cbExecPlane, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		fReserved = OsReserveDualMapped(nullptr, cbExecPlane, &pvExec, &pvWrite);
 	}
-	memset(rgexec, 0xF4, cbExecPlane);	// fill with hlts (because 00 is effectively a NOP)
-	m_spjitwriter = std::make_unique<JitWriter>(this, rgexec, cbExecPlane, m_vecfn_entries.size(), m_vecglbls.size());
+	Verify(fReserved, "Failed to allocate the execution plane");
+	m_spjitwriter = std::make_unique<JitWriter>(this, (uint8_t*)pvExec, (uint8_t*)pvWrite, cbExecPlane, m_vecfn_entries.size(), m_vecglbls.size());
 	LinkImports();
 
 	for (auto &itr : m_vecfn_entries)
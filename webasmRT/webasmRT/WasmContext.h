@@ -6,8 +6,13 @@
 class WasmContext
 {
 	friend JitWriter;
+	friend class OptimizingCompiler;
 
 public:
+	WasmContext(const CompileOptions &opts = CompileOptions())
+		: m_opts(opts)
+	{}
+
 	ExpressionService::Variant CallFunction(const char *szName, ExpressionService::Variant *rgargs = nullptr, uint32_t cargs = 0);
 	void LoadModule(FILE *pfModule);
 
@@ -50,6 +55,7 @@ protected:
 	std::vector<FunctionCodeEntry::unique_pfne_ptr> m_vecfn_code;
 	std::vector<uint8_t> m_vecmem;
 
+	CompileOptions m_opts;
 	bool m_fStartFn = false;
 	uint32_t m_ifnStart = 0;
 
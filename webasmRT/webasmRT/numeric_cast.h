@@ -9,7 +9,8 @@ T_DST numeric_cast(T_SRC src)
 {
 	static_assert(!std::is_same<T_SRC, T_DST>::value, "Tautological cast");
 	T_DST dst = static_cast<T_DST>(src);
-	if (dst != src)
+	// Round trip to catch truncation, compare the signs to catch a negative value turning into a large unsigned one
+	if (static_cast<T_SRC>(dst) != src || (dst < T_DST()) != (src < T_SRC()))
 		throw 0;
 	return dst;
 }
\ No newline at end of file
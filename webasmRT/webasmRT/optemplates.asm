@@ -9,21 +9,20 @@ ExecutionControlBlock STRUCT
 	JitWriter dq ?
 
 	pfnEntry dq ?
-	operandStack dq ?
-	localsStack dq ?
-	cbHeap dq ?
+	rgargs dq ?
+	cargs dq ?
+	rgargsReg dq 8 dup (?)
 	memoryBase dq ?
-
-	cFnIndirect dq ?
-	rgfnIndirect dq ?
-	rgFnTypeIndicies dq ?
-	cFnTypeIndicies dq ?
-	rgFnPtrs dq ?
-	cFnPtrs dq ?
+	stackLimit dq ?
 
 	; Outputs and Temps
 	stackrestore dq ?
 	retvalue dq ?
+	retvalueFloat dq ?
+	dbgOpcode dq ?
+	trapAddress dq ?
+	trapKind dq ?
+	faultAddress dq ?
 ExecutionControlBlock ENDS
 
 CallCFn	MACRO fn
@@ -42,162 +41,174 @@ CallCFn	MACRO fn
 	pop r13
 ENDM
 
+SaveArgRegs MACRO
+	; the registers wasm to wasm calls pass arguments in, laid out like ExecutionControlBlock::rgargsReg
+	sub rsp, 64
+	mov [rsp], rax
+	mov [rsp + 8], r9
+	mov [rsp + 16], r10
+	mov [rsp + 24], r11
+	movq qword ptr [rsp + 32], xmm2
+	movq qword ptr [rsp + 40], xmm3
+	movq qword ptr [rsp + 48], xmm4
+	movq qword ptr [rsp + 56], xmm5
+ENDM
+
+RestoreArgRegs MACRO
+	mov rax, [rsp]
+	mov r9, [rsp + 8]
+	mov r10, [rsp + 16]
+	mov r11, [rsp + 24]
+	movq xmm2, qword ptr [rsp + 32]
+	movq xmm3, qword ptr [rsp + 40]
+	movq xmm4, qword ptr [rsp + 48]
+	movq xmm5, qword ptr [rsp + 56]
+	add rsp, 64
+ENDM
+
 CReentryFn PROTO
 GrowMemory PROTO
 
 
 ; REGISTERS:
-;	rax - top of param stack
-;	rdi - param stack - 1
+;	rax - integer return value and block results, xmm2 - float ones
+;	rax, r9, r10, r11, xmm2-xmm5 - the last arguments of a wasm call
+;	rsp - wasm frames: stack arguments (pushed in order by the caller), return address, saved rbp, locals, operand stack entries
 ;	rsi - memory base
-;	rbx	- parameter base
-;	rbp - pointer to the execution control block
-;	temps: rcx, rdx, r11
+;	rbp - frame pointer, every wasm function pushes it and points it at the saved value
+;	rbx - pointer to the execution control block
+;	rdi, r12-r15 - pinned locals (saved by the caller around wasm calls)
+;	xmm2-xmm7 - cached float operands, xmm8-xmm11 - pinned float locals
+;	temps: rcx, rdx, r8-r11, xmm0, xmm1
 
 ExternCallFnASM PROC pctl : ptr ExecutionControlBlock
+	push rbp
+	mov rbp, rsp	; the JIT frames chain onto ours
 	push rdi
 	push rsi
 	push rbx
-	push rbp
+	push r12
+	push r13
+	push r14
+	push r15
+	; xmm6-xmm15 are nonvolatile and the JIT uses xmm6-xmm11
+	sub rsp, 104
+	movdqu [rsp], xmm6
+	movdqu [rsp + 16], xmm7
+	movdqu [rsp + 32], xmm8
+	movdqu [rsp + 48], xmm9
+	movdqu [rsp + 64], xmm10
+	movdqu [rsp + 80], xmm11
 	
-	mov rdi, (ExecutionControlBlock PTR [rcx]).operandStack
 	mov rsi, (ExecutionControlBlock PTR [rcx]).memoryBase
-	mov rbx, (ExecutionControlBlock PTR [rcx]).localsStack
 	mov (ExecutionControlBlock PTR [rcx]).stackrestore, rsp
-	mov rbp, rcx
-	mov rax, (ExecutionControlBlock PTR [rcx]).pfnEntry
-	call rax
-	mov (ExecutionControlBlock PTR [rbp]).retvalue, rax
-	mov (ExecutionControlBlock PTR [rbp]).operandStack, rdi
-	mov (ExecutionControlBlock PTR [rbp]).localsStack, rbx
+	mov rbx, rcx
+	; push the arguments in order, the callee finds the last one right above its return address
+	mov rcx, (ExecutionControlBlock PTR [rbx]).cargs
+	mov rdx, (ExecutionControlBlock PTR [rbx]).rgargs
+	test rcx, rcx
+	jz LCallEntry
+LPushArg:
+	push qword ptr [rdx]
+	add rdx, 8
+	dec rcx
+	jnz LPushArg
+LCallEntry:
+	; the rest go in registers
+	mov rax, (ExecutionControlBlock PTR [rbx]).rgargsReg[0]
+	mov r9, (ExecutionControlBlock PTR [rbx]).rgargsReg[8]
+	mov r10, (ExecutionControlBlock PTR [rbx]).rgargsReg[16]
+	mov r11, (ExecutionControlBlock PTR [rbx]).rgargsReg[24]
+	movq xmm2, (ExecutionControlBlock PTR [rbx]).rgargsReg[32]
+	movq xmm3, (ExecutionControlBlock PTR [rbx]).rgargsReg[40]
+	movq xmm4, (ExecutionControlBlock PTR [rbx]).rgargsReg[48]
+	movq xmm5, (ExecutionControlBlock PTR [rbx]).rgargsReg[56]
+	call (ExecutionControlBlock PTR [rbx]).pfnEntry
+	mov rsp, (ExecutionControlBlock PTR [rbx]).stackrestore	; pops the arguments
+	mov (ExecutionControlBlock PTR [rbx]).retvalue, rax
+	movq (ExecutionControlBlock PTR [rbx]).retvalueFloat, xmm2
 
 	mov eax, 1
 LDone:
-	pop rbp
+	movdqu xmm6, [rsp]
+	movdqu xmm7, [rsp + 16]
+	movdqu xmm8, [rsp + 32]
+	movdqu xmm9, [rsp + 48]
+	movdqu xmm10, [rsp + 64]
+	movdqu xmm11, [rsp + 80]
+	add rsp, 104
+	pop r15
+	pop r14
+	pop r13
+	pop r12
 	pop rbx
 	pop rsi
 	pop rdi
+	pop rbp
 	ret
 LTrapRet::
 	xor eax, eax	; return 0 for failed execution
 	jmp LDone
 ExternCallFnASM ENDP
 
-BranchTable PROC
-	; jump to an argument in the table or default
-	;	note: this is a candidate for more optimization but for now we will always perform a jump table
-	;
-	;	rax - table index
-	;	rcx - table pointer
-	;	edx - temp
-	;
-	;	Table Format:
-	;		dword count
-	;		dword fReturnVal
-	;		--default_target--
-	;		qword distance (how many blocks we're jumping)
-	;		qword target_addr
-	;		--table_targets---
-	;		.... * count
-	
-	mov edx, eax		; backup the table index
-	mov rax, [rdi]		; store the block return value (or garbage)
-
-	cmp edx, [rcx]
-	jb LNotDefault
-	xor edx, edx
-	jmp LDefault
-
-LNotDefault:
-	;else use table
-	add edx, 1						; skip the default
-	shl edx, 4						; convert table offset to a byte offset
-LDefault:
-	; at this point rdx is a byte offset into the vector table
-	; Lets adjust the stack to deal with the blocks we're leaving
-	mov r11d, dword ptr [rcx+8+rdx]			; r11d = table[idx].distance
-	lea rsp, [rsp+r11*8]					; adjust the stack for the blocks
-	mov rax, [rdi-8]						; get the potential block return value
-	pop rdi									; Restore the param stack to the right location
-	; Put the top of the param stack in rax if we don't have a return value
-	mov r11d, dword ptr [rcx+4]
-	test r11d, r11d
-	jnz LHasRetValue
-	; Doesn't have a return value if we get here, so put the top param back in rax
-	sub rdi, 8
-	mov rax, [rdi]
-LHasRetValue:
-	; The universe should be setup correctly for the target block so we just need to jump
-	jmp [rcx+16+rdx]
-BranchTable ENDP
-
 Trap PROC
-	mov rsp, (ExecutionControlBlock PTR [rbp]).stackrestore
+	; we're always jumped to by a helper so the return address is in the JIT code that called it
+	mov rax, [rsp]
+	dec rax
+	mov (ExecutionControlBlock PTR [rbx]).trapAddress, rax
+	mov rsp, (ExecutionControlBlock PTR [rbx]).stackrestore
 	jmp LTrapRet
 Trap ENDP
 
 WasmToC PROC
 	; Translates a wasm function call into a C function call for internal use
 	; we expect the internal function # in rcx already
-	; we will put the parameter base address in rdx
+	; the argument registers are saved right below the return address and the stack arguments are above it, the
+	;	last one first.  We pass the address of the saved registers in rdx
 	; the normal JIT registers are preserved by the calling convention
 	
-	mov rdx, rbx	; put the parameter base address in rdx (second arg)
+	SaveArgRegs
+	mov rdx, rsp	; put the argument address in rdx (second arg)
 	mov r8, rsi
-	mov r9, rbp
-	; reserve space on stack
-
-	sub rsp, 32
-	call CReentryFn
-	add rsp, 32
+	mov r9, rbx
+	CallCFn CReentryFn
+	add rsp, 64
 	ret
 WasmToC ENDP
 
-CompileFn PROTO
-CallIndirectShim PROC
-	; ecx contains the function index
-	; eax contains the type
-	
-	; Convert the indirect index to the function index
-	; First Bounds Check
-	cmp rcx, (ExecutionControlBlock PTR [rbp]).cFnIndirect
-	jae LDoTrap
-	; Now do the conversion
-	mov rdx, (ExecutionControlBlock PTR [rbp]).rgFnIndirect
-	mov ecx, [rdx + rcx * 4]
+StackOverflowTrap PROC
+	; called from a function entry when rsp is below the control block's stackLimit
+	mov (ExecutionControlBlock PTR [rbx]).trapKind, 4	; TrapKind::StackOverflow
+	jmp Trap
+StackOverflowTrap ENDP
 
-	; Now bounds check the type index
-	mov rdx, (ExecutionControlBlock PTR [rbp]).rgFnTypeIndicies
-	cmp rcx, (ExecutionControlBlock PTR [rbp]).cFnTypeIndicies
-	jae LDoTrap
+IndirectCallTrap PROC
+	; called from a call_indirect site whose index is out of bounds or has the wrong signature
+	mov (ExecutionControlBlock PTR [rbx]).trapKind, 5	; TrapKind::IndirectCall
+	jmp Trap
+IndirectCallTrap ENDP
 
-	mov edx, [rdx + rcx*4]	; get the callee's type
-	cmp edx, eax			; check if its equal to the expected type
-	jne LDoTrap				; Trap if not				
+CompileFailedTrap PROC
+	; jumped to by LazyCallShim instead of the function it couldn't compile, [rsp] is the return address of the call
+	mov (ExecutionControlBlock PTR [rbx]).trapKind, 6	; TrapKind::CompileFailed
+	jmp Trap
+CompileFailedTrap ENDP
 
-	; Type is validated now lets do the function call
-	cmp rcx, (ExecutionControlBlock PTR [rbp]).cFnPtrs
-	jae LDoTrap
-	mov rdx, (ExecutionControlBlock PTR [rbp]).rgFnPtrs
-	mov rax, [rdx + rcx*8]
-	test rax, rax
-	jz LCompileFn
-	jmp rax
-	ud2
-
-LDoTrap:
-	jmp Trap	; this is just for a chance to break before going
-
-LCompileFn:
-	lea rax, [rdx + rcx*8]
-	push rax
-	mov edx, ecx	; second param is the function index
-	mov rcx, rbp	; first param the control block
-	CallCFn CompileFn
-	pop rax
-	jmp qword ptr [rax]
-	ud2
-CallIndirectShim ENDP
+FillIndirectCache PROTO
+IndirectCacheShim PROC
+	; ecx contains the table index, edx the expected type and r8 the call site whose cache is filled
+	;	Called with the arguments in their registers, ecx is needed again by the site
+	push rcx
+	SaveArgRegs
+	mov r9, r8		; fourth param the call site
+	mov r8d, edx	; third param the expected type
+	mov edx, ecx	; second param the table index
+	mov rcx, rbx	; first param the control block
+	CallCFn FillIndirectCache
+	RestoreArgRegs
+	pop rcx
+	ret
+IndirectCacheShim ENDP
 
 U64ToF32 PROC
 	test rax, rax
@@ -266,13 +277,70 @@ LSpecialCase:
 F64ToU64Trunc ENDP
 
 GrowMemoryOp PROC
-	mov rcx, rbp
+	mov rcx, rbx
 	mov rdx, rax
 	; Grow Memory eats an operand and returns an operand
 	CallCFn GrowMemory
 	ret
 GrowMemoryOp ENDP
 
+TierUp PROTO
+TierUpShim PROC
+	; ecx contains the function index
+	;	Called from function entries so every register the JIT might be using is preserved
+	push rcx
+	push rdx
+	push r8
+	SaveArgRegs
+	mov edx, ecx	; second param is the function index
+	mov rcx, rbx	; first param the control block
+	CallCFn TierUp
+	RestoreArgRegs
+	pop r8
+	pop rdx
+	pop rcx
+	ret
+TierUpShim ENDP
+
+OsrEntry PROTO
+OsrShim PROC
+	; ecx contains the function index, edx the bytecode offset of the loop
+	;	Returns the optimized entry for the loop in rcx (or 0), everything else is preserved
+	push rax
+	push rdx
+	push r8
+	push r9
+	push r10
+	push r11
+	mov r8d, edx	; third param is the loop offset
+	mov edx, ecx	; second param is the function index
+	mov rcx, rbx	; first param the control block
+	CallCFn OsrEntry
+	mov rcx, rax
+	pop r11
+	pop r10
+	pop r9
+	pop r8
+	pop rdx
+	pop rax
+	ret
+OsrShim ENDP
+
+LazyCompile PROTO
+LazyCallShim PROC
+	; ecx contains the function index, we were jumped to by its stub so [rsp] is the return address of the call
+	;	Compiles the function if it has no code yet, patches the call to go straight to it and continues there with
+	;	the argument registers intact
+	SaveArgRegs
+	mov r8, [rsp + 64]	; third param the return address
+	mov edx, ecx	; second param is the function index
+	mov rcx, rbx	; first param the control block
+	CallCFn LazyCompile
+	mov rcx, rax
+	RestoreArgRegs
+	jmp rcx
+LazyCallShim ENDP
+
 _TEXT ENDS
 
 END
\ No newline at end of file
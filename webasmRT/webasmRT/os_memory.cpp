@@ -0,0 +1,219 @@
+#include "stdafx.h"
+#include "os_memory.h"
+#include "Exceptions.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+
+static DWORD WinProtFromProtection(PageProtection prot)
+{
+	switch (prot)
+	{
+	case PageProtection::NoAccess:
+		return PAGE_NOACCESS;
+	case PageProtection::ReadOnly:
+		return PAGE_READONLY;
+	case PageProtection::ReadWrite:
+		return PAGE_READWRITE;
+	case PageProtection::ExecuteRead:
+		return PAGE_EXECUTE_READ;
+	}
+	Verify(false);
+	return PAGE_NOACCESS;
+}
+
+void *OsReserveMemory(void *pvHint, size_t cb, PageProtection prot)
+{
+	if (prot == PageProtection::NoAccess)
+		return VirtualAlloc(pvHint, cb, MEM_RESERVE, PAGE_NOACCESS);
+	return VirtualAlloc(pvHint, cb, MEM_COMMIT | MEM_RESERVE, WinProtFromProtection(prot));
+}
+
+void OsCommitMemory(void *pv, size_t cb)
+{
+	Verify(VirtualAlloc(pv, cb, MEM_COMMIT, PAGE_READWRITE) != nullptr);
+}
+
+void OsProtectMemory(void *pv, size_t cb, PageProtection prot)
+{
+	DWORD dwT;
+	Verify(VirtualProtect(pv, cb, WinProtFromProtection(prot), &dwT));
+}
+
+void OsReleaseMemory(void *pv, size_t cb)
+{
+	UNREFERENCED_PARAMETER(cb);
+	VirtualFree(pv, 0, MEM_RELEASE);
+}
+
+uint8_t *OsThreadStackLow()
+{
+	// The low limit includes the guard pages, stay a few pages above it so their own handling still has room
+	ULONG_PTR pLow, pHigh;
+	GetCurrentThreadStackLimits(&pLow, &pHigh);
+	return reinterpret_cast<uint8_t*>(pLow) + 4 * 4096;
+}
+
+bool OsReserveDualMapped(void *pvHintExec, size_t cb, void **ppvExec, void **ppvWrite)
+{
+	// SEC_RESERVE lets us commit the section piecemeal with VirtualAlloc just like a normal reservation
+	HANDLE hsection = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_EXECUTE_READWRITE | SEC_RESERVE, DWORD(uint64_t(cb) >> 32), DWORD(cb), nullptr);
+	if (hsection == nullptr)
+		return false;
+	void *pvExec = MapViewOfFileEx(hsection, FILE_MAP_READ | FILE_MAP_EXECUTE, 0, 0, cb, pvHintExec);
+	void *pvWrite = MapViewOfFileEx(hsection, FILE_MAP_WRITE, 0, 0, cb, nullptr);
+	CloseHandle(hsection);	// the views keep the section alive
+	if (pvExec == nullptr || pvWrite == nullptr)
+	{
+		if (pvExec != nullptr)
+			UnmapViewOfFile(pvExec);
+		if (pvWrite != nullptr)
+			UnmapViewOfFile(pvWrite);
+		return false;
+	}
+	*ppvExec = pvExec;
+	*ppvWrite = pvWrite;
+	return true;
+}
+
+void OsCommitDualMapped(void *pvExec, void *pvWrite, size_t cb, PageProtection protExec)
+{
+	Verify(VirtualAlloc(pvWrite, cb, MEM_COMMIT, PAGE_READWRITE) != nullptr);
+	Verify(VirtualAlloc(pvExec, cb, MEM_COMMIT, WinProtFromProtection(protExec)) != nullptr);
+}
+
+void OsReleaseDualMapped(void *pvExec, void *pvWrite, size_t cb)
+{
+	UNREFERENCED_PARAMETER(cb);
+	UnmapViewOfFile(pvExec);
+	UnmapViewOfFile(pvWrite);
+}
+
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+static int PosixProtFromProtection(PageProtection prot)
+{
+	switch (prot)
+	{
+	case PageProtection::NoAccess:
+		return PROT_NONE;
+	case PageProtection::ReadOnly:
+		return PROT_READ;
+	case PageProtection::ReadWrite:
+		return PROT_READ | PROT_WRITE;
+	case PageProtection::ExecuteRead:
+		return PROT_READ | PROT_EXEC;
+	}
+	Verify(false);
+	return PROT_NONE;
+}
+
+void *OsReserveMemory(void *pvHint, size_t cb, PageProtection prot)
+{
+	// Reservations are not charged against the commit limit until they are made accessible
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	if (prot == PageProtection::NoAccess)
+		flags |= MAP_NORESERVE;
+	void *pv = mmap(pvHint, cb, PosixProtFromProtection(prot), flags, -1, 0);
+	if (pv == MAP_FAILED)
+		return nullptr;
+	if (pvHint != nullptr && pv != pvHint)
+	{
+		// mmap treats the address as a hint, VirtualAlloc fails instead.  Match the Windows behavior so callers can retry
+		munmap(pv, cb);
+		return nullptr;
+	}
+	return pv;
+}
+
+void OsCommitMemory(void *pv, size_t cb)
+{
+	Verify(mprotect(pv, cb, PROT_READ | PROT_WRITE) == 0);
+}
+
+void OsProtectMemory(void *pv, size_t cb, PageProtection prot)
+{
+	Verify(mprotect(pv, cb, PosixProtFromProtection(prot)) == 0);
+}
+
+void OsReleaseMemory(void *pv, size_t cb)
+{
+	munmap(pv, cb);
+}
+
+uint8_t *OsThreadStackLow()
+{
+#ifdef __APPLE__
+	pthread_t thread = pthread_self();
+	return reinterpret_cast<uint8_t*>(pthread_get_stackaddr_np(thread)) - pthread_get_stacksize_np(thread);
+#else
+	// The main thread's stack grows on demand, glibc reports its size from the stack rlimit
+	pthread_attr_t attr;
+	void *pvStack = nullptr;
+	size_t cbStack = 0;
+	Verify(pthread_getattr_np(pthread_self(), &attr) == 0);
+	pthread_attr_getstack(&attr, &pvStack, &cbStack);
+	pthread_attr_destroy(&attr);
+	return reinterpret_cast<uint8_t*>(pvStack);
+#endif
+}
+
+static int FdAnonymousShared(size_t cb)
+{
+#ifdef __linux__
+	int fd = memfd_create("wasm-jit", MFD_CLOEXEC);
+#else
+	char szName[64];
+	snprintf(szName, sizeof(szName), "/wasm-jit-%d-%p", int(getpid()), (void*)&cb);
+	int fd = shm_open(szName, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd >= 0)
+		shm_unlink(szName);
+#endif
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, off_t(cb)) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+bool OsReserveDualMapped(void *pvHintExec, size_t cb, void **ppvExec, void **ppvWrite)
+{
+	int fd = FdAnonymousShared(cb);
+	if (fd < 0)
+		return false;
+	void *pvExec = mmap(pvHintExec, cb, PROT_NONE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+	void *pvWrite = mmap(nullptr, cb, PROT_NONE, MAP_SHARED | MAP_NORESERVE, fd, 0);
+	close(fd);	// the mappings keep the memory alive
+	bool fMismatch = (pvHintExec != nullptr && pvExec != MAP_FAILED && pvExec != pvHintExec);
+	if (pvExec == MAP_FAILED || pvWrite == MAP_FAILED || fMismatch)
+	{
+		if (pvExec != MAP_FAILED)
+			munmap(pvExec, cb);
+		if (pvWrite != MAP_FAILED)
+			munmap(pvWrite, cb);
+		return false;
+	}
+	*ppvExec = pvExec;
+	*ppvWrite = pvWrite;
+	return true;
+}
+
+void OsCommitDualMapped(void *pvExec, void *pvWrite, size_t cb, PageProtection protExec)
+{
+	Verify(mprotect(pvWrite, cb, PROT_READ | PROT_WRITE) == 0);
+	Verify(mprotect(pvExec, cb, PosixProtFromProtection(protExec)) == 0);
+}
+
+void OsReleaseDualMapped(void *pvExec, void *pvWrite, size_t cb)
+{
+	munmap(pvExec, cb);
+	munmap(pvWrite, cb);
+}
+#endif
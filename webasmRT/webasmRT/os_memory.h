@@ -0,0 +1,22 @@
+#pragma once
+
+// Thin wrapper over the platform virtual memory APIs (VirtualAlloc on Windows, mmap on POSIX)
+enum class PageProtection
+{
+	NoAccess,
+	ReadOnly,
+	ReadWrite,
+	ExecuteRead,
+};
+
+void *OsReserveMemory(void *pvHint, size_t cb, PageProtection prot);	// returns nullptr on failure
+void OsCommitMemory(void *pv, size_t cb);	// make reserved pages readable and writable
+void OsProtectMemory(void *pv, size_t cb, PageProtection prot);
+void OsReleaseMemory(void *pv, size_t cb);
+uint8_t *OsThreadStackLow();	// lowest usable address of the calling thread's stack
+
+// Two views of the same memory so code can be written through one and executed from the other without any page
+//	ever being writable and executable at once.  Both views start out reserved and inaccessible.
+bool OsReserveDualMapped(void *pvHintExec, size_t cb, void **ppvExec, void **ppvWrite);	// pvHintExec applies to the executable view
+void OsCommitDualMapped(void *pvExec, void *pvWrite, size_t cb, PageProtection protExec);	// the write view is always ReadWrite
+void OsReleaseDualMapped(void *pvExec, void *pvWrite, size_t cb);
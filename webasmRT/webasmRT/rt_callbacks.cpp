@@ -4,7 +4,12 @@
 #include "ExecutionControlBlock.h"
 #include "JitWriter.h"
 #include "WasmContext.h"
+#ifdef _WIN32
 #include <io.h>
+#else
+#include <unistd.h>
+#define _write write
+#endif
 
 bool FEqualProto(const BuiltinExport &builtinexport, const FunctionTypeEntry &fnt)
 {
@@ -33,7 +38,7 @@ bool FEqualProto(const BuiltinExport &builtinexport, const FunctionTypeEntry &fn
 	return (itrParamT == builtinexport.vecarg.end());
 }
 
-uint64_t wasm_close_fd(uint64_t *pvArgs, uint8_t *pvMemBase)
+uint64_t wasm_close_fd(uint64_t * /*pvArgs*/, uint8_t * /*pvMemBase*/)
 {
 	return 0;
 }
@@ -49,7 +54,7 @@ uint64_t wasm_write_fd(uint64_t *rgArgs, uint8_t *pvMemBase)
 }
 
 // long long wasm_llseek_fd(int fd, long long offset, int whence)
-uint64_t wasm_llseek_fd(uint64_t *pvArgs, uint8_t *pvMemBase)
+uint64_t wasm_llseek_fd(uint64_t * /*pvArgs*/, uint8_t * /*pvMemBase*/)
 {
 	return 0;
 }
@@ -62,7 +67,7 @@ BuiltinExport BuiltinMap[] = {
 
 int IBuiltinFromName(const std::string &strName)
 {
-	for (int ifn = 0; ifn < _countof(BuiltinMap); ++ifn)
+	for (int ifn = 0; ifn < int(_countof(BuiltinMap)); ++ifn)
 	{
 		if (strName == BuiltinMap[ifn].szName)
 			return ifn;
@@ -75,11 +80,26 @@ extern "C" uint64_t CReentryFn(int ifn, uint64_t *pvArgs, uint8_t *pvMemBase, Ex
 {
 	return pecb->pjitWriter->CReentryFn(ifn, pvArgs, pvMemBase, pecb);
 }
-uint64_t JitWriter::CReentryFn(int ifn, uint64_t *pvArgs, uint8_t *pvMemBase, ExecutionControlBlock *pecb)
+uint64_t JitWriter::CReentryFn(int ifn, uint64_t *pvArgs, uint8_t *pvMemBase, ExecutionControlBlock * /*pecb*/)
 {
-	Verify(ifn >= 0 && ifn < m_pctxt->m_vecimports.size());
+	Verify(ifn >= 0 && size_t(ifn) < m_pctxt->m_vecimports.size());
 	ifn = m_pctxt->m_vecimports[ifn];
-	Verify(ifn >= 0 && ifn < _countof(BuiltinMap));
-	BuiltinMap[ifn].pfn(pvArgs, pvMemBase);
+	Verify(ifn >= 0 && size_t(ifn) < _countof(BuiltinMap));
+	// WasmToC saved the argument registers at pvArgs (in the order of ExecutionControlBlock::rgargsReg), above them
+	//	are the return address and the stack arguments with the last one first
+	const BuiltinExport &builtin = BuiltinMap[ifn];
+	uint32_t cargs = numeric_cast<uint32_t>(builtin.vecarg.size());
+	uint32_t cargsStack = _CargsStack(cargs);
+	const uint64_t *pargStack = pvArgs + 2 * cargsReg + 1;
+	std::vector<uint64_t> vecarg(cargs);
+	for (uint32_t iarg = 0; iarg < cargsStack; ++iarg)
+		vecarg[iarg] = pargStack[cargsStack - 1 - iarg];
+	for (uint32_t iarg = cargsStack; iarg < cargs; ++iarg)
+	{
+		size_t iargSave;
+		_RegArg(builtin.vecarg.data(), cargs, iarg, &iargSave);
+		vecarg[iarg] = pvArgs[iargSave];
+	}
+	builtin.pfn(vecarg.data(), pvMemBase);
 	return 0;
 }
\ No newline at end of file
@@ -76,7 +76,7 @@ varint32 safe_read_buffer(const uint8_t **prgb, size_t *pcb)
 
 	/* sign bit of byte is second high order bit (0x40) */
 	if ((shift < 32) && (byteLast & 0x40))
-		ret |= (~0 << shift);		// sign extend
+		ret |= (~uint32_t(0) << shift);		// sign extend
 	return ret;
 }
 
@@ -100,7 +100,7 @@ varint64 safe_read_buffer(const uint8_t **prgb, size_t *pcb)
 
 	/* sign bit of byte is second high order bit (0x40) */
 	if ((shift < 64) && (byteLast & 0x40))
-		ret |= (~0 << shift);		// sign extend
+		ret |= (~uint64_t(0) << shift);		// sign extend
 	return ret;
 }
 
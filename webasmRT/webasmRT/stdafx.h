@@ -11,12 +11,29 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
 #include <tchar.h>
+#endif
 #include <inttypes.h>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <memory>
+#include <exception>
+#include <atomic>
+#include <mutex>
+#include <thread>
 #include <stack>
 #include <tuple>
+#include <map>
+#include <limits>
+
+#ifndef _MSC_VER
+// Shims for the MSVC-isms used throughout the project so the same sources build with GCC/Clang
+#define _countof(rg) (sizeof(rg) / sizeof(*(rg)))
+#define UNREFERENCED_PARAMETER(P) ((void)(P))
+#define _Out_
+#endif
 
 // TODO: reference additional headers your program requires here
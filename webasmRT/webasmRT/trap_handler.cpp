@@ -0,0 +1,213 @@
+#include "stdafx.h"
+#include "trap_handler.h"
+#include "Exceptions.h"
+#include "ExecutionControlBlock.h"
+
+extern "C" void Trap();
+
+// Live code ranges, the handler reads these so they are lock free.  A slot is in use when its start is set.
+static const size_t cjitrangeMax = 1024;
+static std::atomic<const uint8_t*> g_rgpbJitStart[cjitrangeMax];
+static std::atomic<const uint8_t*> g_rgpbJitEnd[cjitrangeMax];
+
+void RegisterJitCode(const void *pvStart, size_t cb)
+{
+	const uint8_t *pbStart = reinterpret_cast<const uint8_t*>(pvStart);
+	for (size_t irange = 0; irange < cjitrangeMax; ++irange)
+	{
+		const uint8_t *pbFree = nullptr;
+		if (g_rgpbJitEnd[irange].compare_exchange_strong(pbFree, pbStart + cb))
+		{
+			g_rgpbJitStart[irange] = pbStart;
+			return;
+		}
+	}
+	throw RuntimeException("Too many modules loaded");
+}
+
+void UnregisterJitCode(const void *pvStart)
+{
+	for (size_t irange = 0; irange < cjitrangeMax; ++irange)
+	{
+		if (g_rgpbJitStart[irange] == pvStart)
+		{
+			g_rgpbJitStart[irange] = nullptr;
+			g_rgpbJitEnd[irange] = nullptr;
+			return;
+		}
+	}
+}
+
+static bool FJitCode(const void *pv)
+{
+	const uint8_t *pb = reinterpret_cast<const uint8_t*>(pv);
+	for (size_t irange = 0; irange < cjitrangeMax; ++irange)
+	{
+		const uint8_t *pbStart = g_rgpbJitStart[irange];
+		if (pbStart != nullptr && pb >= pbStart && pb < g_rgpbJitEnd[irange])
+			return true;
+	}
+	return false;
+}
+
+// Point the thread at Trap as if the faulting instruction had called it, using the stack ExternCallFnASM saved
+//	since the JIT's own stack may be the reason we faulted.  rbx is always the control block inside JIT code.
+static void RedirectToTrap(uint64_t *prip, uint64_t *prsp, uint64_t rbx, TrapKind kind, void *pvFault)
+{
+	ExecutionControlBlock *pectl = reinterpret_cast<ExecutionControlBlock*>(rbx);
+	pectl->trapKind = uint64_t(kind);
+	pectl->faultAddress = pvFault;
+	uint64_t *pstack = reinterpret_cast<uint64_t*>(pectl->stackrestore) - 1;
+	*pstack = *prip + 1;	// Trap backs up one byte to land inside the faulting instruction
+	*prsp = reinterpret_cast<uint64_t>(pstack);
+	*prip = reinterpret_cast<uint64_t>(&Trap);
+}
+
+#ifdef _WIN32
+#include <Windows.h>
+
+static LONG CALLBACK TrapExceptionFilter(EXCEPTION_POINTERS *pexp)
+{
+	PCONTEXT pctxt = pexp->ContextRecord;
+	if (!FJitCode(reinterpret_cast<void*>(pctxt->Rip)))
+		return EXCEPTION_CONTINUE_SEARCH;
+
+	TrapKind kind;
+	void *pvFault = nullptr;
+	switch (pexp->ExceptionRecord->ExceptionCode)
+	{
+	case EXCEPTION_ACCESS_VIOLATION:
+		kind = TrapKind::MemoryOutOfBounds;
+		pvFault = reinterpret_cast<void*>(pexp->ExceptionRecord->ExceptionInformation[1]);
+		break;
+	case EXCEPTION_STACK_OVERFLOW:
+		kind = TrapKind::StackOverflow;
+		break;
+	case EXCEPTION_ILLEGAL_INSTRUCTION:
+		kind = TrapKind::Unreachable;
+		break;
+	case EXCEPTION_INT_DIVIDE_BY_ZERO:
+	case EXCEPTION_INT_OVERFLOW:
+		kind = TrapKind::IntegerDivide;
+		break;
+	default:
+		return EXCEPTION_CONTINUE_SEARCH;
+	}
+	RedirectToTrap(&pctxt->Rip, &pctxt->Rsp, pctxt->Rbx, kind, pvFault);
+	return EXCEPTION_CONTINUE_EXECUTION;
+}
+
+void InstallTrapHandler()
+{
+	static std::once_flag s_onceInstall;
+	std::call_once(s_onceInstall, []
+	{
+		Verify(AddVectoredExceptionHandler(1 /*first*/, TrapExceptionFilter) != nullptr);
+	});
+}
+
+#else
+#include <signal.h>
+#include <ucontext.h>
+
+static const int rgsigTrap[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE };
+static struct sigaction g_rgsaPrev[_countof(rgsigTrap)];
+
+static void ChainSignal(int sig, siginfo_t *psi, void *pvContext)
+{
+	for (size_t isig = 0; isig < _countof(rgsigTrap); ++isig)
+	{
+		if (rgsigTrap[isig] != sig)
+			continue;
+		const struct sigaction &saPrev = g_rgsaPrev[isig];
+		if (saPrev.sa_flags & SA_SIGINFO)
+		{
+			saPrev.sa_sigaction(sig, psi, pvContext);
+		}
+		else if (saPrev.sa_handler != SIG_DFL && saPrev.sa_handler != SIG_IGN)
+		{
+			saPrev.sa_handler(sig);
+		}
+		else
+		{
+			// Restore the default so the fault happens again when we return and takes the process down normally
+			signal(sig, SIG_DFL);
+		}
+		return;
+	}
+}
+
+static void TrapSignalHandler(int sig, siginfo_t *psi, void *pvContext)
+{
+	ucontext_t *puc = reinterpret_cast<ucontext_t*>(pvContext);
+	greg_t *rgreg = puc->uc_mcontext.gregs;
+	if (!FJitCode(reinterpret_cast<void*>(rgreg[REG_RIP])))
+	{
+		ChainSignal(sig, psi, pvContext);
+		return;
+	}
+
+	TrapKind kind;
+	switch (sig)
+	{
+	case SIGSEGV:
+	case SIGBUS:
+		kind = TrapKind::MemoryOutOfBounds;	// ExternCallFn reclassifies faults outside the heap
+		break;
+	case SIGILL:
+		kind = TrapKind::Unreachable;
+		break;
+	case SIGFPE:
+		kind = TrapKind::IntegerDivide;
+		break;
+	default:
+		kind = TrapKind::Unknown;
+	}
+	static_assert(sizeof(greg_t) == sizeof(uint64_t), "x86-64 only");
+	RedirectToTrap(reinterpret_cast<uint64_t*>(&rgreg[REG_RIP]), reinterpret_cast<uint64_t*>(&rgreg[REG_RSP]), uint64_t(rgreg[REG_RBX]), kind, psi->si_addr);
+}
+
+// Running out of native stack inside JIT code faults with no stack left to run the handler on
+struct AltSignalStack
+{
+	AltSignalStack()
+	{
+		stack_t ssCur;
+		if (sigaltstack(nullptr, &ssCur) == 0 && !(ssCur.ss_flags & SS_DISABLE))
+			return;	// someone else already provided one
+		m_spbStack = std::make_unique<uint8_t[]>(cbStack);
+		stack_t ss = {};
+		ss.ss_sp = m_spbStack.get();
+		ss.ss_size = cbStack;
+		if (sigaltstack(&ss, nullptr) != 0)
+			m_spbStack = nullptr;
+	}
+	~AltSignalStack()
+	{
+		if (m_spbStack == nullptr)
+			return;
+		stack_t ss = {};
+		ss.ss_flags = SS_DISABLE;
+		sigaltstack(&ss, nullptr);
+	}
+	static const size_t cbStack = 64 * 1024;
+	std::unique_ptr<uint8_t[]> m_spbStack;
+};
+
+void InstallTrapHandler()
+{
+	static std::once_flag s_onceInstall;
+	std::call_once(s_onceInstall, []
+	{
+		for (size_t isig = 0; isig < _countof(rgsigTrap); ++isig)
+		{
+			struct sigaction sa = {};
+			sa.sa_sigaction = TrapSignalHandler;
+			sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+			sigemptyset(&sa.sa_mask);
+			Verify(sigaction(rgsigTrap[isig], &sa, &g_rgsaPrev[isig]) == 0);
+		}
+	});
+	static thread_local AltSignalStack s_altstack;
+}
+#endif
@@ -0,0 +1,9 @@
+#pragma once
+
+// Turns hardware faults inside JIT code (bad memory accesses, ud2, integer divide errors) into wasm traps.  The
+//	handler resumes the faulting thread in the Trap helper which unwinds back out of ExternCallFnASM.
+void InstallTrapHandler();	// process wide on first call, also gives the calling thread an alternate signal stack
+
+// Only faults inside registered code ranges are treated as traps, everything else goes to the previous handler
+void RegisterJitCode(const void *pvStart, size_t cb);
+void UnregisterJitCode(const void *pvStart);
@@ -55,8 +55,8 @@ struct varintT
 		return *this;
 	}
 
-	template<typename T>
-	varintT &operator-=(T other)
+	template<typename TT>
+	varintT &operator-=(TT other)
 	{
 		val -= other;
 		return *this;
@@ -330,7 +330,7 @@ struct resizable_limits
 
 struct table_type
 {
-	elem_type elem_type;
+	::elem_type elem_type;
 	resizable_limits limits;
 };
 
@@ -2,7 +2,9 @@
 //
 
 #include "stdafx.h"
+#ifdef _WIN32
 #include <Windows.h>
+#endif
 #include <inttypes.h>
 #include "WasmContext.h"
 
@@ -22,7 +24,15 @@ int main(int argc, char *argv[])
 	ctxt.LoadModule(pf);
 	fclose(pf);
 	
-	ctxt.CallFunction("main");
+	try
+	{
+		ctxt.CallFunction("main");
+	}
+	catch (const TrapException &trap)
+	{
+		fprintf(stderr, "%s (trap kind %d)\n", trap.strErr.c_str(), int(trap.kind));
+		return EXIT_FAILURE;
+	}
 
     return EXIT_SUCCESS;
 }